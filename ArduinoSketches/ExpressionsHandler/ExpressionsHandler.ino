@@ -14,50 +14,392 @@ extern "C" double fabs(double x) {
 // Global variable for the target buffer size
 int targetBufferSize = 200;
 
+// Serial speed, also reported by the "id" command.
+const long serialBaud = 9600;
+
+// Version of the line protocol, reported by the "id" command.
+const int firmwareVersion = 1;
+
+#ifdef __AVR__
+const char* boardArchitecture = "avr";
+#elif defined(ESP32)
+const char* boardArchitecture = "esp32";
+#else
+const char* boardArchitecture = "other";
+#endif
+
+// Size of the UART receive buffer, reported by the "id" command as "rx".
+// Bytes arriving while it is full are lost, and it fills up while an
+// expression is evaluated, so the host keeps its unanswered requests within it.
+#if defined(SERIAL_RX_BUFFER_SIZE)
+const int serialRxBuffer = SERIAL_RX_BUFFER_SIZE;
+#elif defined(ESP32)
+const int serialRxBuffer = 256;
+#else
+const int serialRxBuffer = 64;
+#endif
+
+// Replies kept for the reliable protocol, reported by the "id" command as
+// "arq". A request the host sends again gets its kept reply instead of
+// being evaluated twice.
+const int arqWindow = 8;
+
+// What an expression evaluated to, enough to print its reply again.
+struct Result {
+  int error;  // Syntax error position, 0 if it compiled.
+  double value;
+};
+
+// The last replies sent for framed requests, by sequence number. A reply is
+// only reused for a frame with the same CRC, so the same sequence number and
+// expression: every host session numbers its requests from 0 again, and a
+// new one (or another client behind the same port) must not get an old reply.
+struct KeptReply {
+  long sequence;  // -1 while the slot is unused.
+  uint16_t crc;  // The request frame's CRC.
+  Result result;
+};
+KeptReply keptReplies[arqWindow];
+
+// Empties every slot.
+void forgetKeptReplies() {
+  for (int i = 0; i < arqWindow; i++) {
+    keptReplies[i].sequence = -1;
+  }
+}
+
+// Time spent in one step of answering requests, in micros().
+// The total wraps after about 71 minutes spent in that step.
+struct StepTime {
+  unsigned long total;
+  unsigned long longest;
+};
+
+// Counters reported by the "stats" command, since the board started.
+struct Counters {
+  unsigned long requests;  // Expressions answered, framed or not.
+  StepTime receive;  // Reading the line, including waiting for the rest of it.
+  StepTime compile;  // te_compile.
+  StepTime eval;  // te_eval.
+  StepTime print;  // Printing the reply.
+  unsigned long keptLookups;  // Framed requests looked up in keptReplies...
+  unsigned long keptHits;  // ...and answered from there.
+};
+Counters counters;
+
+// Adds the time since started to a step.
+void addTime(StepTime& step, unsigned long started) {
+  unsigned long elapsed = micros() - started;
+  step.total += elapsed;
+  if (elapsed > step.longest) {
+    step.longest = elapsed;
+  }
+}
+
+#ifdef __AVR__
+extern char __heap_start;
+extern char* __brkval;
+
+// Written over the free memory at startup, so the bytes never used by the
+// heap or the stack since can be counted.
+const uint8_t memoryPaint = 0xA5;
+
+// First byte above the heap.
+char* heapEnd() {
+  return __brkval != 0 ? __brkval : &__heap_start;
+}
+
+// Bytes between the heap and the stack right now.
+long freeMemory() {
+  char here;
+  return &here - heapEnd();
+}
+
+void paintFreeMemory() {
+  char here;
+  // Leaves the frames of this function and the ones it calls alone.
+  for (char* p = heapEnd(); p < &here - 16; p++) {
+    *p = memoryPaint;
+  }
+}
+
+// Bytes between the heap and the stack that still hold the paint: the least
+// free memory there has been since startup.
+long lowestFreeMemory() {
+  char here;
+  long count = 0;
+  for (char* p = heapEnd(); p < &here; p++) {
+    if ((uint8_t)*p == memoryPaint) {
+      count++;
+    }
+  }
+  return count;
+}
+#elif defined(ESP32)
+long freeMemory() {
+  return ESP.getFreeHeap();
+}
+
+void paintFreeMemory() {
+}
+
+long lowestFreeMemory() {
+  return ESP.getMinFreeHeap();
+}
+#else
+// Unknown on other boards.
+long freeMemory() {
+  return -1;
+}
+
+void paintFreeMemory() {
+}
+
+long lowestFreeMemory() {
+  return -1;
+}
+#endif
+
+// CRC-16/CCITT-FALSE, one byte at a time (same as BifrostArq::Crc16 on the host).
+uint16_t crc16Update(uint16_t crc, uint8_t c) {
+  crc ^= (uint16_t)c << 8;
+  for (int bit = 0; bit < 8; bit++) {
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+// Prints to Serial while keeping the CRC of everything printed, so a framed
+// reply doesn't need a buffer of its own.
+class CrcPrint : public Print {
+public:
+  uint16_t crc = 0xFFFF;
+
+  size_t write(uint8_t c) override {
+    crc = crc16Update(crc, c);
+    return Serial.write(c);
+  }
+  using Print::write;
+};
+
+// Value of count hex digits of text from start, or -1 if one isn't a hex digit.
+long hexValue(const String& text, int start, int count) {
+  long value = 0;
+  for (int i = start; i < start + count; i++) {
+    char c = text[i];
+    int digit;
+    if (c >= '0' && c <= '9') digit = c - '0';
+    else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+    else return -1;
+    value = value * 16 + digit;
+  }
+  return value;
+}
+
+// Prints a number as count lowercase hex digits, leading zeros included.
+void printHex(Print& out, uint16_t value, int count) {
+  for (int i = count - 1; i >= 0; i--) {
+    out.print("0123456789abcdef"[(value >> (4 * i)) & 0xF]);
+  }
+}
+
 void setup() {
-  Serial.begin(9600);  // Initialize serial communication at 9600 baud
+  Serial.begin(serialBaud);  // Initialize serial communication at 9600 baud
   while (!Serial) {
     ;  // Wait for serial port to connect (if needed)
   }
+
+  forgetKeptReplies();
+
+  paintFreeMemory();
+}
+
+// Evaluates an expression, with the variables the calculator offers.
+Result evaluate(const String& text) {
+  Result result;
+  result.value = 0;
+
+  // Dynamically allocate a buffer using the target buffer size.
+  char* expr = new char[targetBufferSize];
+  text.toCharArray(expr, targetBufferSize);
+
+  // Define the variables needed for TinyExpr.
+  const double pi_value = PI;
+  te_variable vars[] = { {"pi", &pi_value} };
+
+  // Compile the expression with the variables.
+  unsigned long started = micros();
+  te_expr* n = te_compile(expr, vars, 1, &result.error);
+  addTime(counters.compile, started);
+
+  if (n) {
+    // Evaluate the compiled expression.
+    started = micros();
+    result.value = te_eval(n);
+    addTime(counters.eval, started);
+    te_free(n);
+  }
+
+  counters.requests++;
+
+  // Free the dynamically allocated memory.
+  delete[] expr;
+  return result;
+}
+
+// Prints a result as the reply's text, without the line ending.
+void printResult(Print& out, const Result& result) {
+  if (result.error != 0) {
+    //The message contains "nan" since is the identifier for detecting the error message.
+    out.print("nanSyntax error at position: ");
+    out.print(result.error);
+  } else if (isinf(result.value)) {
+    // Check for infinity (e.g., division by zero)
+    out.print("inf");
+  } else {
+    out.print(result.value, 6);  // Print result with 6 decimal places
+  }
+}
+
+// Prints one step's time as "name=total,longest".
+void printStep(Print& out, const char* name, const StepTime& step) {
+  out.print(' ');
+  out.print(name);
+  out.print('=');
+  out.print(step.total);
+  out.print(',');
+  out.print(step.longest);
+}
+
+// Prints the counters, without the line ending:
+// "stats requests=12 receive=10950,1020 compile=5220,610 eval=2400,300 print=4100,420 kept=5,1 free=812 low=640"
+// Times are total and longest micros(); kept is framed requests looked up
+// and found among the kept replies; free and low are bytes (-1 if unknown).
+void printStats(Print& out) {
+  out.print("stats requests=");
+  out.print(counters.requests);
+  printStep(out, "receive", counters.receive);
+  printStep(out, "compile", counters.compile);
+  printStep(out, "eval", counters.eval);
+  printStep(out, "print", counters.print);
+  out.print(" kept=");
+  out.print(counters.keptLookups);
+  out.print(',');
+  out.print(counters.keptHits);
+  out.print(" free=");
+  out.print(freeMemory());
+  out.print(" low=");
+  out.print(lowestFreeMemory());
+}
+
+// Answers a framed request, "@" sequence number, space, expression, "*" CRC
+// (see BifrostArq.h on the host), with "$" sequence number, space, reply,
+// "*" CRC. A request that arrived damaged is answered with just "!" and its
+// number, if that could be read, so the host sends it again.
+void handleFrame(const String& input) {
+  int length = input.length();
+  long sequence = length >= 8 ? hexValue(input, 1, 2) : -1;
+  if (sequence < 0) {
+    return;
+  }
+
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < length - 5; i++) {
+    crc = crc16Update(crc, input[i]);
+  }
+  bool intact = input[length - 5] == '*' && hexValue(input, length - 4, 4) == crc
+                && (length == 8 || input[3] == ' ');
+
+  bool answered = false;  // With a result, whose printing is timed.
+  unsigned long started = 0;
+  CrcPrint framed;
+  String payload = intact && length > 8 ? input.substring(4, length - 5) : String();
+  if (!intact) {
+    framed.print('!');
+    printHex(framed, sequence, 2);
+  } else if (payload == "stats") {
+    framed.print('$');
+    printHex(framed, sequence, 2);
+    framed.print(' ');
+    printStats(framed);
+  } else {
+    // A request sent again because its reply was lost gets the same reply.
+    KeptReply& kept = keptReplies[sequence % arqWindow];
+    counters.keptLookups++;
+    if (kept.sequence != sequence || kept.crc != crc) {
+      kept.result = evaluate(payload);
+      kept.sequence = sequence;
+      kept.crc = crc;
+    } else {
+      counters.keptHits++;
+    }
+    answered = true;
+    started = micros();
+    framed.print('$');
+    printHex(framed, sequence, 2);
+    framed.print(' ');
+    printResult(framed, kept.result);
+  }
+
+  Serial.print('*');
+  printHex(Serial, framed.crc, 4);
+  Serial.println();
+  if (answered) {
+    addTime(counters.print, started);
+  }
 }
 
 void loop() {
   if (Serial.available()) {
     // Read a line from serial input
+    unsigned long started = micros();
     String input = Serial.readStringUntil('\n');
     input.trim();  // Remove any extra whitespace
+    addTime(counters.receive, started);
 
-    // Otherwise, treat the input as a mathematical expression.
-    // Dynamically allocate a buffer using the target buffer size.
-    char* expr = new char[targetBufferSize];
-    input.toCharArray(expr, targetBufferSize);
-
-    // Define the variables needed for TinyExpr.
-    const double pi_value = PI;
-    te_variable vars[] = { {"pi", &pi_value} };
-
-    // Compile the expression with the variables.
-    int err;
-    te_expr* n = te_compile(expr, vars, 1, &err);
-
-    if (!n) {
-      //The message contains "nan" since is the identifier for detecting the error message.
-      Serial.print("nanSyntax error at position: ");
-      Serial.println(err);
-    } else {
-      // Evaluate the compiled expression.
-      double result = te_eval(n);
-      te_free(n);
-
-      // Check for infinity (e.g., division by zero)
-      if (isinf(result)) {
-        Serial.println("inf");
-      } else {
-        Serial.println(result, 6);  // Print result with 6 decimal places
-      }
+    if (input.startsWith("@")) {
+      handleFrame(input);
+      return;
+    }
+
+    // The host's keepalive: answered at once, never framed and not counted
+    // as a request, so checking on an idle link changes nothing on the board.
+    if (input == "ping") {
+      Serial.println("pong");
+      return;
     }
 
-    // Free the dynamically allocated memory.
-    delete[] expr;
+    // "id" is not a valid expression, so it is free to identify the board:
+    // the host probes ports with it to find the calculator and its settings.
+    if (input == "id") {
+      Serial.print("bifrost ");
+      Serial.print(firmwareVersion);
+      Serial.print(" buffer=");
+      Serial.print(targetBufferSize);
+      Serial.print(" baud=");
+      Serial.print(serialBaud);
+      Serial.print(" arch=");
+      Serial.print(boardArchitecture);
+      Serial.print(" rx=");
+      Serial.print(serialRxBuffer);
+      Serial.print(" arq=");
+      Serial.println(arqWindow);
+      return;
+    }
+
+    // Not an expression either: what the board has spent its time on.
+    if (input == "stats") {
+      printStats(Serial);
+      Serial.println();
+      return;
+    }
+
+    // Otherwise, treat the input as a mathematical expression.
+    Result result = evaluate(input);
+    started = micros();
+    printResult(Serial, result);
+    Serial.println();
+    addTime(counters.print, started);
   }
 }
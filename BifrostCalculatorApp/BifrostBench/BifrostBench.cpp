@@ -0,0 +1,388 @@
+//BifrostBench.cpp
+//
+// bifrost_bench: drives an expression corpus through Bifrost and prints one
+// JSON object per configuration (requests/s, bytes/s, latency percentiles),
+// so throughput and tail latency regressions show up before a rollout.
+//
+// Usage:
+//   bifrost_bench [--port COM4 | --loopback] [--baud 9600,115200]
+//                 [--depth 1,4,16] [--batch 1,8] [--requests 1000]
+//                 [--corpus expressions.txt] [--host 1,2,4,8]
+//                 [--sweep "sin(x)*x"] [--arq] [--errors 10]
+//
+// --port drives a real board, or a virtual port pair (e.g. com0com) with a
+// simulator on the other end. --loopback (the default) uses the in-process
+// BoardEmulator, paced to each baud rate.
+// --host measures HostEvaluator instead of a link, once per thread count,
+// with its speedup over the first thread count listed.
+// --sweep evaluates one expression of x over --requests points, with the
+// scalar Evaluate loop and with Expression::EvaluateOver, and compares them.
+// --arq runs the link with the reliable protocol (see BifrostArq.h), and
+// --errors makes the loopback emulator damage that many lines per thousand
+// of the reliable protocol in each direction, to measure what recovering
+// from them costs.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+#include "Public/Bifrost.h"
+#include "Public/BifrostArq.h"
+#include "Public/BifrostPipeline.h"
+#include "Public/BoardEmulator.h"
+#include "Public/Expression.h"
+#include "Public/HostEvaluator.h"
+#include "Public/VectorMath.h"
+
+namespace {
+
+    // Used when no --corpus is given: a mix of short and long, cheap and expensive requests.
+    const char* const kDefaultCorpus[] = {
+        "1+2",
+        "3*4-5",
+        "sqrt(2)",
+        "sin(0.5)*cos(0.5)",
+        "2^10",
+        "(1+2)*(3+4)/5",
+        "log(1000)+ln(2)",
+        "atan2(1,2)*pi",
+        "fac(10)/ncr(10,3)",
+        "abs(-3.25)+floor(2.7)+ceil(2.2)",
+        "1/3+1/7+1/11+1/13",
+        "tanh(0.3)+sinh(0.2)+cosh(0.1)",
+    };
+
+    struct Options {
+        std::wstring port;  // Empty for the loopback emulator.
+        std::vector<unsigned long> bauds;
+        std::vector<unsigned long> depths;
+        std::vector<unsigned long> batches;
+        std::vector<unsigned long> hostThreads;  // Empty unless --host was given.
+        std::string sweep;  // Empty unless --sweep was given.
+        unsigned long requests;
+        std::string corpusPath;
+        bool reliable;  // --arq
+        unsigned long lineErrors;  // Per thousand, for the emulator.
+    };
+
+    /// <summary>
+    /// Parses a comma separated list of numbers such as "1,4,16".
+    /// </summary>
+    std::vector<unsigned long> ParseList(const char* text)
+    {
+        std::vector<unsigned long> values;
+        const char* p = text;
+        while (*p) {
+            char* end;
+            unsigned long value = std::strtoul(p, &end, 10);
+            if (end == p)
+                break;
+            values.push_back(value);
+            p = (*end == ',') ? end + 1 : end;
+        }
+        return values;
+    }
+
+    /// <summary>
+    /// Reads the command line. Returns false (after printing the usage) on bad input.
+    /// </summary>
+    bool ParseOptions(int argc, char* argv[], Options& options)
+    {
+        options.requests = 1000;
+        options.reliable = false;
+        options.lineErrors = 0;
+
+        for (int i = 1; i < argc; i++) {
+            const char* arg = argv[i];
+            const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+            if (std::strcmp(arg, "--loopback") == 0) {
+                options.port.clear();
+                continue;
+            }
+            if (std::strcmp(arg, "--arq") == 0) {
+                options.reliable = true;
+                continue;
+            }
+            if (!value) {
+                std::fprintf(stderr, "Missing value for %s\n", arg);
+                return false;
+            }
+
+            if (std::strcmp(arg, "--port") == 0) {
+                std::string port(value);
+                if (port.compare(0, 4, "\\\\.\\") != 0 && _strnicmp(port.c_str(), "shm:", 4) != 0)
+                    port = "\\\\.\\" + port;
+                options.port.assign(port.begin(), port.end());
+            }
+            else if (std::strcmp(arg, "--baud") == 0)
+                options.bauds = ParseList(value);
+            else if (std::strcmp(arg, "--depth") == 0)
+                options.depths = ParseList(value);
+            else if (std::strcmp(arg, "--batch") == 0)
+                options.batches = ParseList(value);
+            else if (std::strcmp(arg, "--requests") == 0)
+                options.requests = std::strtoul(value, NULL, 10);
+            else if (std::strcmp(arg, "--corpus") == 0)
+                options.corpusPath = value;
+            else if (std::strcmp(arg, "--host") == 0)
+                options.hostThreads = ParseList(value);
+            else if (std::strcmp(arg, "--sweep") == 0)
+                options.sweep = value;
+            else if (std::strcmp(arg, "--errors") == 0)
+                options.lineErrors = std::strtoul(value, NULL, 10);
+            else {
+                std::fprintf(stderr, "Unknown option %s\n", arg);
+                return false;
+            }
+            i++;
+        }
+
+        if (options.bauds.empty()) options.bauds.push_back(CBR_9600);
+        if (options.depths.empty()) options.depths.push_back(1);
+        if (options.batches.empty()) options.batches.push_back(1);
+        return options.requests > 0;
+    }
+
+    /// <summary>
+    /// Loads the corpus, one expression per line, skipping empty lines.
+    /// </summary>
+    bool LoadCorpus(const Options& options, std::vector<std::string>& corpus)
+    {
+        if (options.corpusPath.empty()) {
+            corpus.assign(kDefaultCorpus, kDefaultCorpus + sizeof(kDefaultCorpus) / sizeof(kDefaultCorpus[0]));
+            return true;
+        }
+
+        std::ifstream file(options.corpusPath.c_str());
+        if (!file)
+            return false;
+
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            if (!line.empty())
+                corpus.push_back(line);
+        }
+        return !corpus.empty();
+    }
+
+    /// <summary>
+    /// Runs one configuration and prints its results as a JSON line.
+    /// </summary>
+    void RunConfiguration(const Options& options, const std::vector<std::string>& corpus, const std::wstring& target, unsigned long baud, unsigned long depth, unsigned long batch)
+    {
+        Bifrost::Metrics().Reset();
+
+        Bifrost link;
+        unsigned long long errorReplies = 0;
+        unsigned long long completed = 0;
+        bool failed = !link.Open(target.c_str(), baud);
+        std::string identity;
+        if (!failed && options.reliable)
+            failed = !link.StartReliable();
+        else if (!failed)
+            link.Identify(identity);
+
+        unsigned long long started = BifrostMetrics::Now();
+        unsigned long long bytesSent = 0;
+        unsigned long long bytesReceived = 0;
+        unsigned long long retransmitted = 0;
+
+        // The board's counters around the run, when its firmware has them.
+        BifrostFirmwareStats boardBefore;
+        BifrostFirmwareStats boardAfter;
+        bool boardStats = !failed && link.ReadBoardStats(boardBefore);
+
+        if (!failed) {
+            BifrostPipeline pipeline(link, depth, batch);
+            pipeline.SetCompletion([&](unsigned long long, const std::string& reply) {
+                completed++;
+                if (reply.compare(0, 3, "nan") == 0)
+                    errorReplies++;
+            });
+
+            for (unsigned long i = 0; i < options.requests && !failed; i++)
+                failed = !pipeline.Submit(corpus[i % corpus.size()], i);
+            if (!failed)
+                failed = !pipeline.Drain();
+
+            bytesSent = pipeline.BytesSent();
+            bytesReceived = pipeline.BytesReceived();
+            if (link.Reliable() != NULL)
+                retransmitted = link.Reliable()->Retransmitted();
+            boardStats = boardStats && !failed && link.ReadBoardStats(boardAfter);
+            link.Close();
+        }
+
+        double seconds = BifrostMetrics::MicrosSince(started) / 1e6;
+        if (seconds <= 0) seconds = 1e-9;
+
+        BifrostPhaseSnapshot latency = Bifrost::Metrics().Snapshot(PhaseResponse);
+
+        // Mean time per request the board spent in each step, beside the round trip's percentiles.
+        char board[256] = "null";
+        if (boardStats) {
+            BifrostFirmwareStats run = boardAfter.Since(boardBefore);
+            double perRequest = run.requests > 0 ? 1.0 / run.requests : 0;
+            std::snprintf(board, sizeof(board),
+                "{\"requests\":%llu,\"receive_us\":%.1f,\"compile_us\":%.1f,\"eval_us\":%.1f,\"print_us\":%.1f,"
+                "\"kept_hit_rate\":%.4f,\"free_bytes\":%lld,\"lowest_free_bytes\":%lld}",
+                run.requests, run.receive.totalMicros * perRequest, run.compile.totalMicros * perRequest,
+                run.evaluate.totalMicros * perRequest, run.print.totalMicros * perRequest,
+                run.KeptHitRate(), run.freeMemory, run.lowestFreeMemory);
+        }
+
+        std::printf("{\"transport\":\"%s\",\"baud\":%lu,\"depth\":%lu,\"batch\":%lu,\"arq\":%s,"
+            "\"requests\":%llu,\"error_replies\":%llu,\"retransmitted\":%llu,\"failed\":%s,\"seconds\":%.6f,"
+            "\"requests_per_s\":%.2f,\"tx_bytes_per_s\":%.2f,\"rx_bytes_per_s\":%.2f,"
+            "\"p50_us\":%llu,\"p95_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu,\"board\":%s}\n",
+            options.port.empty() ? "loopback" : "port", baud, depth, batch, options.reliable ? "true" : "false",
+            completed, errorReplies, retransmitted, failed ? "true" : "false", seconds,
+            completed / seconds, bytesSent / seconds, bytesReceived / seconds,
+            latency.p50, latency.p95, latency.p99, latency.max, board);
+        std::fflush(stdout);
+    }
+
+    /// <summary>
+    /// Evaluates the requests on the host with each thread count and prints the results as JSON lines.
+    /// </summary>
+    void RunHost(const Options& options, const std::vector<std::string>& corpus)
+    {
+        std::vector<std::string> batch(options.requests);
+        for (unsigned long i = 0; i < options.requests; i++)
+            batch[i] = corpus[i % corpus.size()];
+        std::vector<HostResult> results(options.requests);
+
+        double baseline = 0;
+        for (size_t t = 0; t < options.hostThreads.size(); t++) {
+            HostEvaluator evaluator(options.hostThreads[t]);
+
+            unsigned long long started = BifrostMetrics::Now();
+            evaluator.Evaluate(batch.data(), batch.size(), results.data());
+            double seconds = BifrostMetrics::MicrosSince(started) / 1e6;
+            if (seconds <= 0) seconds = 1e-9;
+
+            unsigned long long errorReplies = 0;
+            for (size_t i = 0; i < results.size(); i++) {
+                if (results[i].errorPosition != 0)
+                    errorReplies++;
+            }
+
+            double rate = batch.size() / seconds;
+            if (t == 0)
+                baseline = rate;
+
+            std::printf("{\"transport\":\"host\",\"threads\":%u,\"requests\":%lu,\"error_replies\":%llu,"
+                "\"seconds\":%.6f,\"requests_per_s\":%.2f,\"speedup\":%.2f}\n",
+                evaluator.Threads(), options.requests, errorReplies, seconds, rate, rate / baseline);
+            std::fflush(stdout);
+        }
+    }
+
+    /// <summary>
+    /// Evaluates an expression of x over evenly spaced points, scalar and vectorized,
+    /// and prints the timings and the largest difference as a JSON line.
+    /// </summary>
+    /// <returns>False if the expression does not compile.</returns>
+    bool RunSweep(const Options& options)
+    {
+        Expression expression;
+        expression.SetVariable("x");
+        if (!expression.Compile(options.sweep))
+            return false;
+
+        const size_t points = options.requests;
+        std::vector<double> x(points);
+        for (size_t i = 0; i < points; i++)
+            x[i] = -100.0 + 200.0 * i / points;
+        std::vector<double> scalar(points);
+        std::vector<double> vectorized(points);
+
+        unsigned long long started = BifrostMetrics::Now();
+        for (size_t i = 0; i < points; i++) {
+            expression.SetVariable("x", x[i]);
+            scalar[i] = expression.Evaluate();
+        }
+        double scalarSeconds = BifrostMetrics::MicrosSince(started) / 1e6;
+
+        started = BifrostMetrics::Now();
+        expression.EvaluateOver("x", x.data(), points, vectorized.data());
+        double vectorSeconds = BifrostMetrics::MicrosSince(started) / 1e6;
+        if (vectorSeconds <= 0) vectorSeconds = 1e-9;
+
+        // Relative, since the vector math library may differ in the last bit.
+        double maxDifference = 0;
+        for (size_t i = 0; i < points; i++) {
+            if (std::isfinite(scalar[i]) && std::isfinite(vectorized[i]) && scalar[i] != vectorized[i]) {
+                double difference = std::fabs(scalar[i] - vectorized[i]) / std::fmax(std::fabs(scalar[i]), 1e-300);
+                if (difference > maxDifference)
+                    maxDifference = difference;
+            }
+        }
+
+        std::printf("{\"transport\":\"sweep\",\"expression\":\"%s\",\"points\":%llu,\"avx\":%s,"
+            "\"scalar_ns_per_point\":%.3f,\"vector_ns_per_point\":%.3f,\"speedup\":%.2f,\"max_relative_difference\":%.3g}\n",
+            options.sweep.c_str(), (unsigned long long)points, VectorMath::HasAvx() ? "true" : "false",
+            scalarSeconds * 1e9 / points, vectorSeconds * 1e9 / points, scalarSeconds / vectorSeconds, maxDifference);
+        std::fflush(stdout);
+        return true;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        std::fprintf(stderr, "Usage: bifrost_bench [--port COM4 | --loopback] [--baud 9600,115200] [--depth 1,4,16] [--batch 1,8] [--requests 1000] [--corpus file] [--host 1,2,4,8] [--sweep expression] [--arq] [--errors 10]\n");
+        return 2;
+    }
+
+    std::vector<std::string> corpus;
+    if (!LoadCorpus(options, corpus)) {
+        std::fprintf(stderr, "Could not read the corpus %s\n", options.corpusPath.c_str());
+        return 2;
+    }
+
+    if (!options.sweep.empty()) {
+        if (!RunSweep(options)) {
+            std::fprintf(stderr, "Could not compile %s\n", options.sweep.c_str());
+            return 2;
+        }
+        return 0;
+    }
+
+    if (!options.hostThreads.empty()) {
+        RunHost(options, corpus);
+        return 0;
+    }
+
+    for (size_t b = 0; b < options.bauds.size(); b++) {
+        const unsigned long baud = options.bauds[b];
+
+        // The emulator is restarted per baud rate, since that is what it paces to.
+        BoardEmulator emulator;
+        std::wstring target = options.port;
+        if (target.empty()) {
+            target = L"\\\\.\\pipe\\bifrost-bench-" + std::to_wstring(GetCurrentProcessId());
+            emulator.SetLineErrors(options.lineErrors);
+            if (!emulator.Start(target, baud)) {
+                std::fprintf(stderr, "Could not start the loopback emulator\n");
+                return 1;
+            }
+        }
+
+        for (size_t d = 0; d < options.depths.size(); d++) {
+            for (size_t n = 0; n < options.batches.size(); n++)
+                RunConfiguration(options, corpus, target, baud, options.depths[d], options.batches[n]);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,180 @@
+//BrokerMain.cpp
+//
+// bifrost_broker: owns the board's port and shares it with every local
+// program. Clients open the broker's pipe instead of the port (the form's
+// COM field, bifrost_cli --port, bifrost_bench --port all accept
+// \\.\pipe\bifrost) and speak the usual protocol: one expression line in,
+// one reply line out. Requests from all clients are merged into a single
+// pipelined, batched stream to the board and each reply is routed back to
+// the client that asked. Identical requests are sent once: requests for an
+// expression already in flight share its reply, and so do requests arriving
+// within --coalesce milliseconds of it (0 turns that off).
+// Interactive requests are sent before bulk ones (bifrost_cli asks for bulk)
+// and each class queues at most --queue requests before its clients are
+// held back; see BifrostBroker.h for the control lines clients can send.
+// --arq talks to the board with the reliable protocol (see BifrostArq.h)
+// if it speaks it; clients keep the plain one.
+//
+// Usage:
+//   bifrost_broker [--port COM4 | --loopback] [--baud 9600] [--pipe bifrost]
+//                  [--depth 8] [--batch 4] [--coalesce 10] [--queue 256] [--arq]
+//
+// Runs until Ctrl+C, printing the number of clients, requests received and
+// forwarded, board requests saved, requests past their deadline and queue
+// lengths to stderr every few seconds.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <windows.h>
+#include "Public/Bifrost.h"
+#include "Public/BifrostBroker.h"
+#include "Public/BoardEmulator.h"
+
+namespace {
+
+    // How often the status line is printed.
+    const DWORD kStatusIntervalMs = 5000;
+
+    struct Options {
+        std::wstring port;  // Empty for the loopback emulator.
+        std::wstring pipe;
+        unsigned long baud;
+        unsigned long depth;
+        unsigned long batch;
+        unsigned long coalesceMs;
+        unsigned long queue;
+        bool reliable;  // --arq
+    };
+
+    // Set by Ctrl+C (or the console closing).
+    HANDLE stopRequested = NULL;
+
+    /// <summary>
+    /// Reads the command line. Returns false (after printing the usage) on bad input.
+    /// </summary>
+    bool ParseOptions(int argc, char* argv[], Options& options)
+    {
+        options.pipe = L"\\\\.\\pipe\\bifrost";
+        options.baud = CBR_9600;
+        options.depth = 8;
+        options.batch = 4;
+        options.coalesceMs = 10;
+        options.queue = 256;
+        options.reliable = false;
+
+        for (int i = 1; i < argc; i++) {
+            const char* arg = argv[i];
+            const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+            if (std::strcmp(arg, "--loopback") == 0) {
+                options.port.clear();
+                continue;
+            }
+            if (std::strcmp(arg, "--arq") == 0) {
+                options.reliable = true;
+                continue;
+            }
+            if (!value) {
+                std::fprintf(stderr, "Missing value for %s\n", arg);
+                return false;
+            }
+
+            if (std::strcmp(arg, "--port") == 0) {
+                std::string port(value);
+                if (port.compare(0, 4, "\\\\.\\") != 0 && _strnicmp(port.c_str(), "shm:", 4) != 0)
+                    port = "\\\\.\\" + port;
+                options.port.assign(port.begin(), port.end());
+            }
+            else if (std::strcmp(arg, "--pipe") == 0) {
+                std::string pipe(value);
+                if (pipe.compare(0, 4, "\\\\.\\") != 0)
+                    pipe = "\\\\.\\pipe\\" + pipe;
+                options.pipe.assign(pipe.begin(), pipe.end());
+            }
+            else if (std::strcmp(arg, "--baud") == 0)
+                options.baud = std::strtoul(value, NULL, 10);
+            else if (std::strcmp(arg, "--depth") == 0)
+                options.depth = std::strtoul(value, NULL, 10);
+            else if (std::strcmp(arg, "--batch") == 0)
+                options.batch = std::strtoul(value, NULL, 10);
+            else if (std::strcmp(arg, "--coalesce") == 0)
+                options.coalesceMs = std::strtoul(value, NULL, 10);
+            else if (std::strcmp(arg, "--queue") == 0)
+                options.queue = std::strtoul(value, NULL, 10);
+            else {
+                std::fprintf(stderr, "Unknown option %s\n", arg);
+                return false;
+            }
+            i++;
+        }
+
+        return options.depth > 0 && options.batch > 0 && options.queue > 0;
+    }
+
+    /// <summary>
+    /// Console control handler: asks main to shut down cleanly.
+    /// </summary>
+    BOOL WINAPI OnConsoleControl(DWORD)
+    {
+        SetEvent(stopRequested);
+        return TRUE;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        std::fprintf(stderr, "Usage: bifrost_broker [--port COM4 | --loopback] [--baud 9600] [--pipe bifrost] [--depth 8] [--batch 4] [--coalesce 10] [--queue 256] [--arq]\n");
+        return 2;
+    }
+
+    BoardEmulator emulator;
+    std::wstring target = options.port;
+    if (target.empty()) {
+        target = L"\\\\.\\pipe\\bifrost-broker-" + std::to_wstring(GetCurrentProcessId());
+        if (!emulator.Start(target, options.baud)) {
+            std::fprintf(stderr, "Could not start the loopback emulator\n");
+            return 1;
+        }
+    }
+
+    Bifrost link;
+    if (!link.Open(target.c_str(), options.baud)) {
+        std::fprintf(stderr, "Could not open the port\n");
+        return 1;
+    }
+    if (options.reliable && !link.StartReliable())
+        std::fprintf(stderr, "The board doesn't speak the reliable protocol, using the plain one\n");
+    std::string identity;
+    if (link.Reliable() == NULL)
+        link.Identify(identity);
+
+    BifrostBroker broker;
+    broker.SetCoalesceWindow(options.coalesceMs);
+    broker.SetQueueCapacity(options.queue);
+    if (!broker.Start(link, options.pipe, options.depth, options.batch)) {
+        std::fprintf(stderr, "Could not create the pipe (is another broker running?)\n");
+        link.Close();
+        return 1;
+    }
+
+    stopRequested = CreateEventW(NULL, TRUE, FALSE, NULL);
+    SetConsoleCtrlHandler(OnConsoleControl, TRUE);
+    std::fprintf(stderr, "Serving %ls, Ctrl+C to stop\n", options.pipe.c_str());
+
+    while (WaitForSingleObject(stopRequested, kStatusIntervalMs) == WAIT_TIMEOUT) {
+        std::fprintf(stderr, "%u clients, %llu requests, %llu forwarded, %llu deduplicated, %llu coalesced, %llu late, queued %u/%u%s\n",
+            (unsigned int)broker.Clients(), broker.Requests(), broker.Forwarded(), broker.Deduplicated(), broker.Coalesced(), broker.Late(),
+            (unsigned int)broker.Queued(PriorityInteractive), (unsigned int)broker.Queued(PriorityBulk),
+            broker.LinkHealthy() ? "" : ", link failed");
+    }
+
+    broker.Stop();
+    link.Close();
+    CloseHandle(stopRequested);
+    return 0;
+}
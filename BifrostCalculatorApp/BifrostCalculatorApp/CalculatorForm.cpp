@@ -105,9 +105,6 @@ namespace BifrostCalculatorApp {
 	/// </summary>
 	System::Void CalculatorForm::SendButton_Click(System::Object^ sender, System::EventArgs^ e)
 	{
-		// Disabling the send button to prevent multiple clicks
-		this->SendButton->Enabled = false;
-
 		//System::Diagnostics::Debug::WriteLine("Sending expression to the microcontroller: " + this->GetCurrentExpression());
 
 		// Getting the text from the InputTextBox.
@@ -116,50 +113,159 @@ namespace BifrostCalculatorApp {
 		// Converting the managed string to a native std::string.
 		std::string expression = msclr::interop::marshal_as<std::string>(expressionManaged);
 
-		// Creating an instance of your Bifrost class.
-		Bifrost bridge;
+		// Checking the syntax on the host first, using the same grammar as the firmware,
+		// so a malformed expression never costs a serial round trip.
+		int syntaxErrorPosition = Expression::Validate(expression);
+		if (syntaxErrorPosition != 0) {
+
+			String^ msg = "SYNTAX ERROR: \nThe microcontroller couln't manage that expression. \nSyntax error at position: " + syntaxErrorPosition;
+			MessageBox::Show(msg, "Error", MessageBoxButtons::OK, MessageBoxIcon::Error);
+			return;
+		}
 
+		// Folding constants and dropping redundant characters, since every byte
+		// costs about 1 ms on the wire at 9600 baud.
+		size_t saved = 0;
+		std::string payload = Expression::Minify(expression, &saved);
+		this->CountBytesSaved(saved);
 
-		System::String^ managedCom = this->GetTargetCom();
-		std::wstring targetCom = msclr::interop::marshal_as<std::wstring>(managedCom);
+		PendingOperation^ operation = gcnew PendingOperation();
+		operation->Payload = gcnew String(payload.c_str());
 
-		// Opening the serial port.
-		if (!bridge.Open(targetCom.c_str(), this->GetTargetBaudrate()))
-		{
-			MessageBox::Show("Failed to open serial port.", "Error", MessageBoxButtons::OK, MessageBoxIcon::Error);
+		// Showing it in the history at once; the result is set on it when it comes.
+		operation->HistoryId = history->Add(msclr::interop::marshal_as<std::string>(this->GetCurrentExpression()));
+		this->ShowHistory(true);
+		pendingOperations->Add(operation);
 
-			this->SendButton->Enabled = true;
+		// The input is free for the next expression while this one is on its way.
+		this->InputTextBox->Text = "";
+		this->SetCaretPos(this->InputTextBox->Text->Length, true);
+
+		// While the search for the board holds the port, the operation waits
+		// for it to finish and then goes to whichever board it found.
+		if (this->discoveryWorker->IsBusy) {
+			heldOperations->Add(operation);
 			return;
 		}
+		this->SendOperation(operation);
+	}
 
-		// Writing the expression to the serial port.
-		if (!bridge.WriteData(expression + "\n"))
-		{
-			MessageBox::Show("Failed to write to serial port.", "Error", MessageBoxButtons::OK, MessageBoxIcon::Error);
-			bridge.Close();
 
-			this->SendButton->Enabled = true;
+	/// <summary>
+	/// Hands an operation to the session, waiting for its reply on a worker thread.
+	/// </summary>
+	System::Void CalculatorForm::SendOperation(PendingOperation^ operation)
+	{
+		// Waiting for the reply on a worker thread, so the window keeps repainting
+		// and answering clicks; the session sends queued requests in order.
+		this->StartSession();
+		operation->Sent = BifrostMetrics::Now();
+		BackgroundWorker^ requestWorker = gcnew BackgroundWorker();
+		requestWorker->DoWork += gcnew DoWorkEventHandler(this, &CalculatorForm::RequestWorker_DoWork);
+		requestWorker->RunWorkerCompleted += gcnew RunWorkerCompletedEventHandler(this, &CalculatorForm::RequestWorker_RunWorkerCompleted);
+		requestWorker->RunWorkerAsync(operation);
+	}
+
+
+	/// <summary>
+	/// Sends one expression through the session and waits for its reply.
+	/// </summary>
+	System::Void CalculatorForm::RequestWorker_DoWork(System::Object^ sender, System::ComponentModel::DoWorkEventArgs^ e)
+	{
+		// Long enough for the session to reopen the port after the board was
+		// reset or plugged back in, including the reset opening it causes.
+		const DWORD replyWaitMs = 5000;
+
+		PendingOperation^ operation = safe_cast<PendingOperation^>(e->Argument);
+		std::string payload = msclr::interop::marshal_as<std::string>(operation->Payload);
+
+		std::string response;
+		operation->Answered = session->Evaluate(payload, response, replyWaitMs);
+		operation->Reply = gcnew String(response.c_str());
+		e->Result = operation;
+	}
+
+
+	/// <summary>
+	/// Replaces the pending line in the history with the result, or removes it if none came.
+	/// </summary>
+	System::Void CalculatorForm::RequestWorker_RunWorkerCompleted(System::Object^ sender, System::ComponentModel::RunWorkerCompletedEventArgs^ e)
+	{
+		if (e->Error != nullptr)
+			return;
+
+		PendingOperation^ operation = safe_cast<PendingOperation^>(e->Result);
+		pendingOperations->Remove(operation);
+
+		// Nothing to remove if the history was cleared in the meantime.
+		if (operation->Cancelled) {
+			if (history->Remove(operation->HistoryId))
+				this->ShowHistory(true);
 			return;
 		}
 
-		std::string response = bridge.ReadData(200);
-		bridge.Close();
+		if (!operation->Answered) {
+			if (history->Remove(operation->HistoryId))
+				this->ShowHistory(true);
+
+			String^ msg = session->Connected() ? "The microcontroller didn't answer." : "The microcontroller isn't connected, still trying to reach it.";
+			MessageBox::Show(msg, "Error", MessageBoxButtons::OK, MessageBoxIcon::Error);
+			return;
+		}
 
 		// Converting the native response back to a managed string.
-		String^ responseManaged = gcnew String(response.c_str());
+		String^ responseManaged = operation->Reply;
 
 		//System::Diagnostics::Debug::WriteLine("Data recived from the microcontroller: " + responseManaged);
 
 		if (responseManaged->ToLower()->Contains("nan")) {
+			if (history->Remove(operation->HistoryId))
+				this->ShowHistory(true);
 
 			String^ msg = "SYNTAX ERROR: \nThe microcontroller couln't manage that expression. \n" + responseManaged->Replace("nan", "");
 			MessageBox::Show(msg, "Error", MessageBoxButtons::OK, MessageBoxIcon::Error);
-
-			this->SendButton->Enabled = true;
 			return;
 		}
 
-		String^ finalResponse = responseManaged->Trim();
+		unsigned long long parseStarted = BifrostMetrics::Now();
+
+		String^ finalResponse = FormatResult(responseManaged);
+
+		Bifrost::Metrics().RecordSince(PhaseParse, parseStarted);
+
+		this->LastResult = finalResponse;
+		this->CachePreview(operation->Payload, finalResponse);
+
+		// Completing the pending line where it is, so the list still displays
+		// the operations in the order they were sent.
+		if (history->SetResult(operation->HistoryId, msclr::interop::marshal_as<std::string>(finalResponse))) {
+			this->ShowHistory(false);
+
+			// Kept for the next run too.
+			const HistoryModel::Entry* entry = history->Get(operation->HistoryId);
+			FILETIME now;
+			GetSystemTimeAsFileTime(&now);
+
+			HistoryRecord record;
+			record.time = ((unsigned long long)now.dwHighDateTime << 32) | now.dwLowDateTime;
+			record.latencyMicros = (unsigned int)BifrostMetrics::MicrosSince(operation->Sent);
+			record.source = SourceBoard;
+			record.expression = entry->expression;
+			record.result = entry->result;
+			historyLog->Append(record);
+
+			// Searchable as soon as the search's thread has indexed it.
+			search->Wake();
+		}
+	}
+
+
+	/// <summary>
+	/// Formats a reply for display.
+	/// </summary>
+	String^ CalculatorForm::FormatResult(String^ reply)
+	{
+		String^ finalResponse = reply->Trim();
 
 		try {
 			// Try to convert the response to a double.
@@ -180,23 +286,177 @@ namespace BifrostCalculatorApp {
 			// If conversion fails, finalResponse remains unchanged.
 			// This handles cases like "ovf", "inf", or "nan".
 		}
+		return finalResponse;
+	}
 
-		this->LastResult = finalResponse;
 
-		// Construct a full operation string.
-		String^ fullOperation = this->GetCurrentExpression() + " = " + finalResponse;
+	/// <summary>
+	/// Shows the preview of the new input at once, and schedules the board's.
+	/// </summary>
+	System::Void CalculatorForm::InputTextBox_TextChanged(System::Object^ sender, System::EventArgs^ e)
+	{
+		// The board's preview of the old text is no use any more. If the
+		// session has not sent it yet it never will; if it has, its reply is
+		// dropped when it comes.
+		this->previewTimer->Stop();
+		previewPayload = nullptr;
+		if (previewPending != nullptr) {
+			session->Cancel(previewPending->Abandon);
+			previewPending = nullptr;
+		}
 
-		// Also add the operation to the ListBox for display at the top of the list, 
-		// so it displays the operations from bottom to top.
-		this->OperationsListBox->Items->Insert(0, fullOperation);
+		// Only well-formed input is previewed.
+		std::string expression = msclr::interop::marshal_as<std::string>(this->GetCurrentExpression()->Trim()->ToLower());
+		if (expression.empty() || Expression::Validate(expression) != 0) {
+			this->PreviewLabel->Text = "";
+			return;
+		}
 
-		//System::Diagnostics::Debug::WriteLine(this->OperationsListBox->Items->Count);
+		size_t saved = 0;
+		std::string payload = Expression::Minify(expression, &saved);
+		String^ payloadManaged = gcnew String(payload.c_str());
 
-		this->InputTextBox->Text = "";
+		String^ cached;
+		if (previewCache->TryGetValue(payloadManaged, cached)) {
+			this->PreviewLabel->Text = "= " + cached;
+			return;
+		}
 
-		this->SetCaretPos(this->InputTextBox->Text->Length, true);
+		// The host evaluates it the way the board would, without a round trip;
+		// shown as approximate until the board confirms it.
+		HostResult result = HostEvaluator::EvaluateLine(*previewExpression, payload.data(), payload.size(), *previewScratch);
+		char reply[64];
+		HostEvaluator::FormatReply(result, reply, sizeof(reply));
+		this->PreviewLabel->Text = L"\u2248 " + FormatResult(gcnew String(reply));
+
+		previewPayload = payloadManaged;
+		previewSaved = saved;
+		this->previewTimer->Start();
+	}
+
+
+	/// <summary>
+	/// Sends the input, stable since the timer started, to the board.
+	/// </summary>
+	System::Void CalculatorForm::PreviewTimer_Tick(System::Object^ sender, System::EventArgs^ e)
+	{
+		this->previewTimer->Stop();
+
+		// The search for the board may be holding the port; the host's preview stays.
+		if (previewPayload == nullptr || this->discoveryWorker->IsBusy)
+			return;
+		this->SendPreview();
+	}
+
+
+	/// <summary>
+	/// Sends previewPayload to the board, unless a preview is still in flight:
+	/// then it waits, and the latest input is sent when that one completes, so
+	/// typing quickly never queues one preview per pause.
+	/// </summary>
+	System::Void CalculatorForm::SendPreview()
+	{
+		if (previewInFlight != nullptr)
+			return;
+
+		PreviewRequest^ request = gcnew PreviewRequest();
+		request->Payload = previewPayload;
+		request->Abandon = new LONG(0);
+		previewPayload = nullptr;
+		this->CountBytesSaved(previewSaved);
+		previewPending = request;
+		previewInFlight = request;
+
+		this->StartSession();
+		BackgroundWorker^ previewWorker = gcnew BackgroundWorker();
+		previewWorker->DoWork += gcnew DoWorkEventHandler(this, &CalculatorForm::PreviewWorker_DoWork);
+		previewWorker->RunWorkerCompleted += gcnew RunWorkerCompletedEventHandler(this, &CalculatorForm::PreviewWorker_RunWorkerCompleted);
+		previewWorker->RunWorkerAsync(request);
+	}
+
+
+	/// <summary>
+	/// Sends the preview through the session and waits for its reply.
+	/// </summary>
+	System::Void CalculatorForm::PreviewWorker_DoWork(System::Object^ sender, System::ComponentModel::DoWorkEventArgs^ e)
+	{
+		// Shorter than a send's wait: the host's preview is already showing.
+		const DWORD previewWaitMs = 2000;
+
+		PreviewRequest^ request = safe_cast<PreviewRequest^>(e->Argument);
+		std::string payload = msclr::interop::marshal_as<std::string>(request->Payload);
+
+		std::string response;
+		request->Answered = session->Evaluate(payload, response, previewWaitMs, request->Abandon);
+		request->Reply = gcnew String(response.c_str());
+		e->Result = request;
+	}
+
+
+	/// <summary>
+	/// Replaces the host's preview with the board's result.
+	/// </summary>
+	System::Void CalculatorForm::PreviewWorker_RunWorkerCompleted(System::Object^ sender, System::ComponentModel::RunWorkerCompletedEventArgs^ e)
+	{
+		previewInFlight = nullptr;
+		if (e->Error != nullptr)
+			return;
+
+		PreviewRequest^ request = safe_cast<PreviewRequest^>(e->Result);
+		delete request->Abandon;
+		request->Abandon = NULL;
+
+		// Superseded by a newer input, which waited for this one if its timer
+		// has fired already.
+		if (request != previewPending) {
+			if (previewPayload != nullptr && !this->previewTimer->Enabled && !this->discoveryWorker->IsBusy)
+				this->SendPreview();
+			return;
+		}
+		previewPending = nullptr;
+
+		if (!request->Answered || request->Reply->ToLower()->Contains("nan"))
+			return;
+
+		String^ result = FormatResult(request->Reply);
+		this->CachePreview(request->Payload, result);
+		this->PreviewLabel->Text = "= " + result;
+	}
+
+
+	/// <summary>
+	/// Probes the cached board, or every port, for up to a few seconds.
+	/// </summary>
+	System::Void CalculatorForm::DiscoveryWorker_DoWork(System::Object^ sender, System::ComponentModel::DoWorkEventArgs^ e)
+	{
+		// Long enough for an Arduino to come out of the reset opening its port causes.
+		const DWORD discoveryDeadlineMs = 6000;
+
+		BifrostBoardInfo found;
+		if (!BifrostDiscovery::Find(discoveryDeadlineMs, found))
+			return;
+
+		e->Result = gcnew array<Object^>{ gcnew String(found.port.c_str()), (int)found.baudRate };
+	}
+
+
+	/// <summary>
+	/// Fills in the connection fields with the board that was found and
+	/// sends what was held meanwhile.
+	/// </summary>
+	System::Void CalculatorForm::DiscoveryWorker_RunWorkerCompleted(System::Object^ sender, System::ComponentModel::RunWorkerCompletedEventArgs^ e)
+	{
+		array<Object^>^ board = e->Error == nullptr ? dynamic_cast<array<Object^>^>(e->Result) : nullptr;
+
+		if (board != nullptr && this->ComTextBox->Text == discoveryCom && this->BaudRateTextBox->Text == discoveryBaudRate)
+			ShowBoard(safe_cast<String^>(board[0]), safe_cast<int>(board[1]));
 
-		this->SendButton->Enabled = true;
+		// The search no longer holds any port, so the session can open its own,
+		// and the operations sent meanwhile go out in the order they were made.
+		this->StartSession();
+		for each (PendingOperation^ operation in heldOperations)
+			this->SendOperation(operation);
+		heldOperations->Clear();
 	}
 
 
@@ -227,7 +487,15 @@ namespace BifrostCalculatorApp {
 	{
 		this->InputTextBox->Text = "";
 
-		this->OperationsListBox->Items->Clear();
+		// The search's thread reads the log, so it stops while both are emptied.
+		search->Stop();
+		history->Clear();
+		historyLog->Clear();
+		pastEntries = 0;
+		search->Clear();
+		search->Start(historyLog);
+		this->SearchTextBox->Text = "";
+		this->RunSearch();
 	}
 
 }
\ No newline at end of file
@@ -2,6 +2,13 @@
 
 #include <msclr/marshal_cppstd.h>
 #include "./Public/Bifrost.h"
+#include "./Public/BifrostDiscovery.h"
+#include "./Public/BifrostSession.h"
+#include "./Public/Expression.h"
+#include "./Public/HistoryLog.h"
+#include "./Public/HistoryModel.h"
+#include "./Public/HostEvaluator.h"
+#include "./Public/HistorySearch.h"
 
 namespace BifrostCalculatorApp {
 
@@ -12,6 +19,34 @@ namespace BifrostCalculatorApp {
 	using namespace System::Data;
 	using namespace System::Drawing;
 
+	/// <summary>
+	/// An expression on its way to the microcontroller. Its history entry
+	/// shows "expression = ..." until the result is set on it.
+	/// </summary>
+	public ref class PendingOperation
+	{
+	public:
+		unsigned long long HistoryId;  // Its entry in the history.
+		unsigned long long Sent;  // BifrostMetrics::Now() when it was handed to the session.
+		String^ Payload;  // The minified expression that is sent.
+		String^ Reply;  // The microcontroller's reply, set by the worker.
+		bool Answered;  // Whether the reply came.
+		bool Cancelled;  // Set when the user pressed Escape while it was waiting.
+	};
+
+	/// <summary>
+	/// The input, sent to the microcontroller for the live preview. Abandoned
+	/// as soon as the input changes again.
+	/// </summary>
+	public ref class PreviewRequest
+	{
+	public:
+		String^ Payload;  // The minified expression that is sent.
+		String^ Reply;  // The microcontroller's reply, set by the worker.
+		bool Answered;  // Whether the reply came.
+		volatile LONG* Abandon;  // Set through BifrostSession::Cancel when the input changed.
+	};
+
 	/// <summary>
 	/// CalculatorForm class for the Bifrost calculator application.
 	/// Handles UI interaction and communication with the microcontroller.
@@ -33,6 +68,11 @@ namespace BifrostCalculatorApp {
 	public:
 		String^ LastResult;
 
+	private:
+		// Bytes minifying has kept off the wire for the expressions sent so
+		// far, shown in the title bar.
+		unsigned long long bytesSaved;
+
 	public:
 		/// <summary>
 		/// Gets the target COM port from the UI input.
@@ -42,6 +82,19 @@ namespace BifrostCalculatorApp {
 			return this->ComTextBox->Text;
 		}
 
+	public:
+		/// <summary>
+		/// Gets the target port in the form Bifrost::Open takes it.
+		/// "COM10" and above can only be opened as "\\.\COM10", which works for any port.
+		/// </summary>
+		/// <returns>The port as a native string.</returns>
+		std::wstring GetTargetPort() {
+			String^ managedCom = this->GetTargetCom();
+			if (!managedCom->StartsWith("\\\\.\\") && !managedCom->StartsWith("shm:", StringComparison::OrdinalIgnoreCase))
+				managedCom = "\\\\.\\" + managedCom;
+			return msclr::interop::marshal_as<std::wstring>(managedCom);
+		}
+
 	public:
 		/// <summary>
 		/// Gets the target baud rate from the UI input.
@@ -58,6 +111,19 @@ namespace BifrostCalculatorApp {
 			}
 		}
 
+	public:
+		/// <summary>
+		/// Shows a port and baud rate in the connection fields.
+		/// </summary>
+		/// <param name="port">The port as Bifrost::Open takes it; "\\.\COM4" is shown as "COM4".</param>
+		/// <param name="baud">The baud rate.</param>
+		void ShowBoard(String^ port, int baud) {
+			if (port->StartsWith("\\\\.\\COM", StringComparison::OrdinalIgnoreCase))
+				port = port->Substring(4);
+			this->ComTextBox->Text = port;
+			this->BaudRateTextBox->Text = baud.ToString();
+		}
+
 	public:
 		/// <summary>
 		/// Gets the current caret position in the input textbox.
@@ -81,8 +147,58 @@ namespace BifrostCalculatorApp {
 			MathOperators = gcnew array<String^>{ "+", "-", "/", "*", "%", "^" };
 
 			LastResult = "";
+			bytesSaved = 0;
 
 			this->InputTextBox->HideSelection = false;
+
+			// Looking for the board in the background, so the form shows up at once.
+			discoveryWorker = gcnew BackgroundWorker();
+			discoveryWorker->DoWork += gcnew DoWorkEventHandler(this, &CalculatorForm::DiscoveryWorker_DoWork);
+			discoveryWorker->RunWorkerCompleted += gcnew RunWorkerCompletedEventHandler(this, &CalculatorForm::DiscoveryWorker_RunWorkerCompleted);
+
+			// Started once the search is over, since both need the port.
+			session = new BifrostSession();
+			pendingOperations = gcnew System::Collections::Generic::List<PendingOperation^>();
+			heldOperations = gcnew System::Collections::Generic::List<PendingOperation^>();
+
+			// The list only asks for the rows it shows, so neither adding to the
+			// history nor painting it slows down as it grows.
+			history = new HistoryModel();
+			historyLog = new HistoryLog();
+			historyLog->Open(HistoryLog::DefaultPath());
+			pastEntries = historyLog->Count();
+			historyBackBrush = gcnew SolidBrush(this->OperationsListView->BackColor);
+			historyTextBrush = gcnew SolidBrush(this->OperationsListView->ForeColor);
+			this->OperationsColumn->Width = this->OperationsListView->ClientSize.Width;
+
+			// The log is indexed for the search box on the search's own thread,
+			// so millions of records don't hold the window up.
+			search = new HistorySearch();
+			search->Start(historyLog);
+			searchMatches = new std::vector<size_t>();
+			searching = false;
+			searchedCount = 0;
+			restoringSelection = false;
+			searchTimer = gcnew System::Windows::Forms::Timer();
+			searchTimer->Interval = 250;
+			searchTimer->Tick += gcnew EventHandler(this, &CalculatorForm::SearchTimer_Tick);
+			this->ShowHistory(true);
+
+			// The result of the input is previewed as it is typed: from the host
+			// at once, and from the board once the input has stayed the same for
+			// the timer's interval, so typing doesn't flood the link.
+			previewExpression = new Expression();
+			previewScratch = new std::string();
+			previewSaved = 0;
+			previewCache = gcnew System::Collections::Generic::Dictionary<String^, String^>();
+			previewTimer = gcnew System::Windows::Forms::Timer();
+			previewTimer->Interval = 400;
+			previewTimer->Tick += gcnew EventHandler(this, &CalculatorForm::PreviewTimer_Tick);
+			this->InputTextBox->TextChanged += gcnew EventHandler(this, &CalculatorForm::InputTextBox_TextChanged);
+
+			// Escape cancels the requests still waiting, wherever the focus is.
+			this->KeyPreview = true;
+			this->KeyDown += gcnew KeyEventHandler(this, &CalculatorForm::CalculatorForm_KeyDown);
 		}
 
 	protected:
@@ -95,14 +211,206 @@ namespace BifrostCalculatorApp {
 			{
 				delete components;
 			}
+			delete session;
+			delete history;
+			delete search;  // First: its thread reads the log.
+			delete historyLog;
+			delete searchMatches;
+			delete searchTimer;
+			delete previewExpression;
+			delete previewScratch;
+			delete previewTimer;
+			delete historyBackBrush;
+			delete historyTextBrush;
 		}
 
 	private:
 		/// <summary>
-		/// Clears the input text box when the form loads.
+		/// Clears the input text box when the form loads, shows the board found
+		/// last time and starts checking it (or looking for another one).
 		/// </summary>
 		System::Void CalculatorForm_Load(System::Object^ sender, System::EventArgs^ e) {
 			this->InputTextBox->Text = "";
+
+			BifrostBoardInfo cached;
+			if (BifrostDiscovery::LoadCache(cached))
+				ShowBoard(gcnew String(cached.port.c_str()), (int)cached.baudRate);
+
+			discoveryCom = this->ComTextBox->Text;
+			discoveryBaudRate = this->BaudRateTextBox->Text;
+			discoveryWorker->RunWorkerAsync();
+		}
+
+	private:
+		/// <summary>
+		/// Finds the board, on a background thread.
+		/// </summary>
+		System::Void DiscoveryWorker_DoWork(System::Object^ sender, DoWorkEventArgs^ e);
+
+	private:
+		/// <summary>
+		/// Shows the board the background search found, unless the user has
+		/// changed the connection fields in the meantime, and starts the session
+		/// on it before sending the operations held while it ran.
+		/// </summary>
+		System::Void DiscoveryWorker_RunWorkerCompleted(System::Object^ sender, RunWorkerCompletedEventArgs^ e);
+
+	private:
+		BackgroundWorker^ discoveryWorker;
+		String^ discoveryCom;  // The connection fields when the search started.
+		String^ discoveryBaudRate;
+
+	private:
+		/// <summary>
+		/// Starts the session on the port and baud rate in the connection
+		/// fields, unless it already runs on them.
+		/// </summary>
+		void StartSession() {
+			std::wstring port = this->GetTargetPort();
+			DWORD baud = (DWORD)this->GetTargetBaudrate();
+			if (session->Port() != port || session->BaudRate() != baud)
+				session->Start(port, baud);
+		}
+
+	private:
+		// Keeps the link to the board open and checked between requests.
+		BifrostSession* session;
+
+		// Sent and not answered yet, oldest first.
+		System::Collections::Generic::List<PendingOperation^>^ pendingOperations;
+
+		// Those of pendingOperations made while the search for the board was
+		// running, sent once it is over.
+		System::Collections::Generic::List<PendingOperation^>^ heldOperations;
+
+		// This run's operations, newest first, shown at the top of OperationsListView.
+		HistoryModel* history;
+
+		// Every answered operation, kept across runs. The records earlier runs
+		// left (pastEntries of them) are shown below this run's, read from the
+		// log only as they scroll into view.
+		HistoryLog* historyLog;
+		size_t pastEntries;
+
+		// Made once rather than for every row painted.
+		SolidBrush^ historyBackBrush;
+		SolidBrush^ historyTextBrush;
+
+		// Finds answered operations as the search box is typed in. It has the
+		// log's records in log order; while the box isn't empty the list only
+		// shows searchMatches, the log positions of the newest matches.
+		HistorySearch* search;
+		std::vector<size_t>* searchMatches;
+		bool searching;
+		size_t searchedCount;  // search->Count() when searchMatches were found.
+		bool restoringSelection;  // Reselecting a row after a search, not a click.
+		System::Windows::Forms::Timer^ searchTimer;  // Runs while searching, for the records indexed since.
+
+		// The live preview. previewPayload is the input to send once the timer
+		// fires; previewPending the request for the current input, if any, and
+		// previewInFlight the one whose worker still runs, abandoned or not: at
+		// most one is sent at a time. previewCache holds the board's results by
+		// payload, from previews and sends alike.
+		Expression* previewExpression;
+		std::string* previewScratch;
+		System::Collections::Generic::Dictionary<String^, String^>^ previewCache;
+		System::Windows::Forms::Timer^ previewTimer;
+		String^ previewPayload;
+		size_t previewSaved;  // What minifying saved on previewPayload.
+		PreviewRequest^ previewPending;
+		PreviewRequest^ previewInFlight;
+
+	private:
+		/// <summary>
+		/// Starts the session if needed and sends an operation through it.
+		/// </summary>
+		System::Void SendOperation(PendingOperation^ operation);
+
+	private:
+		/// <summary>
+		/// Waits for one expression's reply on a background thread, so the
+		/// window keeps responding (and more expressions can be sent) meanwhile.
+		/// </summary>
+		System::Void RequestWorker_DoWork(System::Object^ sender, DoWorkEventArgs^ e);
+
+	private:
+		/// <summary>
+		/// Shows a reply in the history, back on the UI thread.
+		/// </summary>
+		System::Void RequestWorker_RunWorkerCompleted(System::Object^ sender, RunWorkerCompletedEventArgs^ e);
+
+	private:
+		/// <summary>
+		/// Previews the input's result on every edit, from the cache or the host,
+		/// abandoning the board preview of the text it replaced.
+		/// </summary>
+		System::Void InputTextBox_TextChanged(System::Object^ sender, System::EventArgs^ e);
+
+	private:
+		/// <summary>
+		/// Sends the input to the board once it has stayed the same for a moment.
+		/// </summary>
+		System::Void PreviewTimer_Tick(System::Object^ sender, System::EventArgs^ e);
+
+	private:
+		/// <summary>
+		/// Sends the pending input to the board, once no other preview is in flight.
+		/// </summary>
+		System::Void SendPreview();
+
+	private:
+		/// <summary>
+		/// Waits for the board's preview on a background thread.
+		/// </summary>
+		System::Void PreviewWorker_DoWork(System::Object^ sender, DoWorkEventArgs^ e);
+
+	private:
+		/// <summary>
+		/// Shows the board's preview, unless the input changed in the meantime.
+		/// </summary>
+		System::Void PreviewWorker_RunWorkerCompleted(System::Object^ sender, RunWorkerCompletedEventArgs^ e);
+
+	private:
+		/// <summary>
+		/// Remembers the board's result for a payload, for the preview.
+		/// </summary>
+		void CachePreview(String^ payload, String^ result) {
+			// Cleared when full; a result is only a round trip away.
+			const int previewCacheSize = 1024;
+
+			if (previewCache->Count >= previewCacheSize)
+				previewCache->Clear();
+			previewCache[payload] = result;
+		}
+
+	private:
+		/// <summary>
+		/// Formats a reply for display: whole numbers without decimals, others with six.
+		/// </summary>
+		String^ FormatResult(String^ reply);
+
+	private:
+		/// <summary>
+		/// Cancels every request still waiting when Escape is pressed.
+		/// </summary>
+		System::Void CalculatorForm_KeyDown(System::Object^ sender, KeyEventArgs^ e) {
+			if (e->KeyCode != Keys::Escape || pendingOperations->Count == 0)
+				return;
+
+			// Those still waiting for the search never reach the session.
+			for each (PendingOperation^ operation in heldOperations) {
+				pendingOperations->Remove(operation);
+				history->Remove(operation->HistoryId);
+			}
+			if (heldOperations->Count > 0) {
+				heldOperations->Clear();
+				this->ShowHistory(true);
+			}
+
+			for each (PendingOperation^ operation in pendingOperations)
+				operation->Cancelled = true;
+			session->Cancel();
+			e->Handled = true;
 		}
 
 	public:
@@ -129,58 +437,172 @@ namespace BifrostCalculatorApp {
 			return this->InputTextBox->Text;
 		}
 
-#pragma region OperationsListBox
-
 	private:
-		System::Void CalculatorForm::OperationsListBox_SelectedIndexChanged(System::Object^ sender, System::EventArgs^ e)
-		{
-			// Check if an item is selected.
-			if (this->OperationsListBox->SelectedItem == nullptr)
+		/// <summary>
+		/// Adds what minifying saved on a request sent to the board, and shows
+		/// the total in the title bar.
+		/// </summary>
+		void CountBytesSaved(size_t saved) {
+			if (saved == 0)
 				return;
+			bytesSaved += saved;
+			this->Text = L"Bifrost Calculator (" + bytesSaved.ToString() + L" bytes saved by minifying)";
+		}
 
-			// Get the full operation string.
-			String^ operation = this->OperationsListBox->SelectedItem->ToString();
+#pragma region OperationsListView
 
-			// Find the index of the "=" character.
-			int equalIndex = operation->IndexOf("=");
-			if (equalIndex != -1 && equalIndex < operation->Length - 1)
-			{
-				// Extract the substring after "=" and trim any whitespace.
-				String^ resultPart = operation->Substring(equalIndex + 1)->Trim();
+	private:
+		/// <summary>
+		/// Shows the history's current entries, after one was added, removed or given its result.
+		/// </summary>
+		/// <param name="rowsMoved">Whether entries were added or removed, so rows now show other entries.</param>
+		void ShowHistory(bool rowsMoved) {
+			if (rowsMoved) {
+				// The selected row would otherwise point at another entry.
+				this->OperationsListView->SelectedIndices->Clear();
+				this->OperationsListView->VirtualListSize = (int)(searching ? searchMatches->size() : history->Count() + pastEntries);
+			}
+			this->OperationsListView->Invalidate();
+		}
+
+	private:
+		/// <summary>
+		/// Gets the operation a row of OperationsListView shows.
+		/// </summary>
+		/// <param name="row">0 for the newest operation.</param>
+		/// <returns>False if the row is past the end or its record couldn't be read.</returns>
+		bool GetHistoryRow(int row, std::string& expression, std::string& result) {
+			HistoryRecord record;
+			if (searching) {
+				if ((size_t)row >= searchMatches->size() || !historyLog->Read((*searchMatches)[row], record))
+					return false;
+				expression.swap(record.expression);
+				result.swap(record.result);
+				return true;
+			}
 
-				// Update the InputTextBox with the result.
-				this->InputTextBox->SelectedText = resultPart;
+			size_t current = history->Count();
+			if ((size_t)row < current) {
+				const HistoryModel::Entry& entry = history->At((size_t)row);
+				expression = entry.expression;
+				result = entry.result;
+				return true;
 			}
+
+			if ((size_t)row - current >= pastEntries || !historyLog->Read(pastEntries - 1 - ((size_t)row - current), record))
+				return false;
+			expression.swap(record.expression);
+			result.swap(record.result);
+			return true;
 		}
 
 	private:
-		System::Void CalculatorForm::OperationsListBox_DrawItem(System::Object^ sender, System::Windows::Forms::DrawItemEventArgs^ e)
+		System::Void CalculatorForm::OperationsListView_RetrieveVirtualItem(System::Object^ sender, System::Windows::Forms::RetrieveVirtualItemEventArgs^ e)
 		{
-			// Ensure there is a valid index.
-			if (e->Index < 0)
+			// Only called for the rows being shown.
+			std::string expression, result;
+			if (!GetHistoryRow(e->ItemIndex, expression, result)) {
+				e->Item = gcnew ListViewItem("");
 				return;
+			}
+			e->Item = gcnew ListViewItem(gcnew String(HistoryModel::Text(expression, result).c_str()));
+		}
 
-			// Get the text of the item.
-			String^ itemText = this->OperationsListBox->Items[e->Index]->ToString();
+	private:
+		System::Void CalculatorForm::OperationsListView_SelectedIndexChanged(System::Object^ sender, System::EventArgs^ e)
+		{
+			// Check if an item is selected, by a click rather than a search.
+			if (restoringSelection || this->OperationsListView->SelectedIndices->Count == 0)
+				return;
 
-			// Draw the background (important for selection highlighting)
-			e->DrawBackground();
+			// Its result, empty while it is on its way.
+			std::string expression, result;
+			if (!GetHistoryRow(this->OperationsListView->SelectedIndices[0], expression, result) || result.empty())
+				return;
 
-			// Create a brush for the text.
-			Brush^ textBrush = gcnew SolidBrush(e->ForeColor);
+			// Update the InputTextBox with the result.
+			this->InputTextBox->SelectedText = gcnew String(result.c_str());
+		}
+
+	private:
+		System::Void CalculatorForm::OperationsListView_DrawItem(System::Object^ sender, System::Windows::Forms::DrawListViewItemEventArgs^ e)
+		{
+			// Draw the background, highlighted if the item is selected.
+			bool selected = e->Item->Selected;
+			e->Graphics->FillRectangle(selected ? SystemBrushes::Highlight : historyBackBrush, e->Bounds);
 
 			// Horizontal margin (5 pixels)
 			float offsetX = 5;
 			// Calculate vertical offset to center the text in the available item height.
-			float offsetY = (e->Bounds.Height - e->Font->Height) / 2;
+			float offsetY = (e->Bounds.Height - this->OperationsListView->Font->Height) / 2;
 
 			// Draw the string with the calculated offsets.
-			e->Graphics->DrawString(itemText, e->Font, textBrush, e->Bounds.X + offsetX, e->Bounds.Y + offsetY);
+			e->Graphics->DrawString(e->Item->Text, this->OperationsListView->Font, selected ? SystemBrushes::HighlightText : historyTextBrush,
+				e->Bounds.X + offsetX, e->Bounds.Y + offsetY);
 
-			// Draw focus rectangle if the item is selected.
+			// Draw focus rectangle if the item has the focus.
 			e->DrawFocusRectangle();
 		}
 
+	private:
+		/// <summary>
+		/// Shows the newest operations matching the search box, or the whole history if it is empty.
+		/// </summary>
+		void RunSearch() {
+			const size_t searchLimit = 1000;
+
+			String^ query = this->SearchTextBox->Text;
+			searching = query->Length > 0;
+			searchTimer->Enabled = searching;
+			searchedCount = search->Count();
+			if (searching)
+				search->Find(msclr::interop::marshal_as<std::string>(query), searchLimit, *searchMatches);
+			else
+				searchMatches->clear();
+			this->ShowHistory(true);
+		}
+
+	private:
+		System::Void CalculatorForm::SearchTextBox_TextChanged(System::Object^ sender, System::EventArgs^ e)
+		{
+			this->RunSearch();
+		}
+
+	private:
+		System::Void CalculatorForm::SearchTimer_Tick(System::Object^ sender, System::EventArgs^ e)
+		{
+			// Only the records indexed since the last run can add matches, and
+			// only those with every trigram of the query; most ticks stop here.
+			const size_t indexed = search->Count();
+			if (!searching || indexed == searchedCount)
+				return;
+			if (!search->MayMatchSince(msclr::interop::marshal_as<std::string>(this->SearchTextBox->Text), searchedCount)) {
+				searchedCount = indexed;
+				return;
+			}
+
+			// The new matches come first; the selected operation stays selected.
+			bool selected = this->OperationsListView->SelectedIndices->Count > 0
+				&& (size_t)this->OperationsListView->SelectedIndices[0] < searchMatches->size();
+			size_t selectedRecord = selected ? (*searchMatches)[this->OperationsListView->SelectedIndices[0]] : 0;
+			this->RunSearch();
+			for (size_t row = 0; selected && row < searchMatches->size(); row++) {
+				if ((*searchMatches)[row] == selectedRecord) {
+					restoringSelection = true;
+					this->OperationsListView->SelectedIndices->Add((int)row);
+					restoringSelection = false;
+					break;
+				}
+			}
+		}
+
+	private:
+		System::Void CalculatorForm::OperationsListView_Resize(System::Object^ sender, System::EventArgs^ e)
+		{
+			// The one column spans the whole list, so rows are drawn full width.
+			this->OperationsColumn->Width = this->OperationsListView->ClientSize.Width;
+		}
+
 
 #pragma endregion
 
@@ -233,10 +655,14 @@ namespace BifrostCalculatorApp {
 			this->DelButton->Click += gcnew System::EventHandler(this, &CalculatorForm::DelButton_Click);
 			this->AnsButton->Click += gcnew System::EventHandler(this, &CalculatorForm::CalculatorButton_Click);
 			this->ParenthesisButton->Click += gcnew System::EventHandler(this, &CalculatorForm::CalculatorButton_Click);
-			this->OperationsListBox->DrawItem += gcnew System::Windows::Forms::DrawItemEventHandler(this, &CalculatorForm::OperationsListBox_DrawItem);
-
-			this->OperationsListBox->SelectedIndexChanged +=
-				gcnew System::EventHandler(this, &CalculatorForm::OperationsListBox_SelectedIndexChanged);
+			this->OperationsListView->DrawItem += gcnew System::Windows::Forms::DrawListViewItemEventHandler(this, &CalculatorForm::OperationsListView_DrawItem);
+			this->OperationsListView->RetrieveVirtualItem +=
+				gcnew System::Windows::Forms::RetrieveVirtualItemEventHandler(this, &CalculatorForm::OperationsListView_RetrieveVirtualItem);
+			this->OperationsListView->Resize += gcnew System::EventHandler(this, &CalculatorForm::OperationsListView_Resize);
+
+			this->OperationsListView->SelectedIndexChanged +=
+				gcnew System::EventHandler(this, &CalculatorForm::OperationsListView_SelectedIndexChanged);
+			this->SearchTextBox->TextChanged += gcnew System::EventHandler(this, &CalculatorForm::SearchTextBox_TextChanged);
 		}
 
 #pragma endregion
@@ -320,7 +746,13 @@ namespace BifrostCalculatorApp {
 	private: System::Windows::Forms::Button^ AnsButton;
 	private: System::Windows::Forms::TextBox^ InputTextBox;
 	private: System::Windows::Forms::TableLayoutPanel^ tableLayoutPanel7;
-	private: System::Windows::Forms::ListBox^ OperationsListBox;
+	private: System::Windows::Forms::ListView^ OperationsListView;
+	private: System::Windows::Forms::ColumnHeader^ OperationsColumn;
+	private: System::Windows::Forms::ImageList^ OperationsRowHeight;
+	private: System::Windows::Forms::Panel^ SearchPanel;
+	private: System::Windows::Forms::Label^ SearchLabel;
+	private: System::Windows::Forms::TextBox^ SearchTextBox;
+	private: System::Windows::Forms::Label^ PreviewLabel;
 
 	private: System::Windows::Forms::Label^ AngleLabel;
 
@@ -353,6 +785,7 @@ namespace BifrostCalculatorApp {
 		/// </summary>
 		void InitializeComponent(void)
 		{
+			this->components = (gcnew System::ComponentModel::Container());
 			System::ComponentModel::ComponentResourceManager^ resources = (gcnew System::ComponentModel::ComponentResourceManager(CalculatorForm::typeid));
 			this->AppNameLabel = (gcnew System::Windows::Forms::Label());
 			this->AppSubLabel = (gcnew System::Windows::Forms::Label());
@@ -396,7 +829,13 @@ namespace BifrostCalculatorApp {
 			this->LnButton = (gcnew System::Windows::Forms::Button());
 			this->TextFieldPanel = (gcnew System::Windows::Forms::Panel());
 			this->AngleLabel = (gcnew System::Windows::Forms::Label());
-			this->OperationsListBox = (gcnew System::Windows::Forms::ListBox());
+			this->OperationsListView = (gcnew System::Windows::Forms::ListView());
+			this->OperationsColumn = (gcnew System::Windows::Forms::ColumnHeader());
+			this->OperationsRowHeight = (gcnew System::Windows::Forms::ImageList(this->components));
+			this->SearchPanel = (gcnew System::Windows::Forms::Panel());
+			this->SearchLabel = (gcnew System::Windows::Forms::Label());
+			this->SearchTextBox = (gcnew System::Windows::Forms::TextBox());
+			this->PreviewLabel = (gcnew System::Windows::Forms::Label());
 			this->tableLayoutPanel1 = (gcnew System::Windows::Forms::TableLayoutPanel());
 			this->AnsButton = (gcnew System::Windows::Forms::Button());
 			this->InputTextBox = (gcnew System::Windows::Forms::TextBox());
@@ -408,6 +847,7 @@ namespace BifrostCalculatorApp {
 			this->tableLayoutPanel6->SuspendLayout();
 			this->ButtonsContainer->SuspendLayout();
 			this->TextFieldPanel->SuspendLayout();
+			this->SearchPanel->SuspendLayout();
 			this->tableLayoutPanel1->SuspendLayout();
 			this->tableLayoutPanel7->SuspendLayout();
 			this->SuspendLayout();
@@ -1224,7 +1664,9 @@ namespace BifrostCalculatorApp {
 			this->TextFieldPanel->BackgroundImageLayout = System::Windows::Forms::ImageLayout::Stretch;
 			this->TextFieldPanel->BorderStyle = System::Windows::Forms::BorderStyle::Fixed3D;
 			this->TextFieldPanel->Controls->Add(this->AngleLabel);
-			this->TextFieldPanel->Controls->Add(this->OperationsListBox);
+			this->TextFieldPanel->Controls->Add(this->OperationsListView);
+			this->TextFieldPanel->Controls->Add(this->SearchPanel);
+			this->TextFieldPanel->Controls->Add(this->PreviewLabel);
 			this->TextFieldPanel->Controls->Add(this->tableLayoutPanel1);
 			this->TextFieldPanel->Dock = System::Windows::Forms::DockStyle::Fill;
 			this->TextFieldPanel->Location = System::Drawing::Point(3, 3);
@@ -1248,21 +1690,88 @@ namespace BifrostCalculatorApp {
 			this->AngleLabel->Text = L"⊾π";
 			this->AngleLabel->TextAlign = System::Drawing::ContentAlignment::MiddleCenter;
 			// 
-			// OperationsListBox
+			// OperationsListView
 			// 
-			this->OperationsListBox->BackColor = System::Drawing::SystemColors::InfoText;
-			this->OperationsListBox->BorderStyle = System::Windows::Forms::BorderStyle::None;
-			this->OperationsListBox->Dock = System::Windows::Forms::DockStyle::Fill;
-			this->OperationsListBox->DrawMode = System::Windows::Forms::DrawMode::OwnerDrawVariable;
-			this->OperationsListBox->Font = (gcnew System::Drawing::Font(L"Audiowide", 16, System::Drawing::FontStyle::Bold));
-			this->OperationsListBox->ForeColor = System::Drawing::Color::FromArgb(static_cast<System::Int32>(static_cast<System::Byte>(128)),
+			this->OperationsListView->BackColor = System::Drawing::SystemColors::InfoText;
+			this->OperationsListView->BorderStyle = System::Windows::Forms::BorderStyle::None;
+			this->OperationsListView->Columns->AddRange(gcnew cli::array< System::Windows::Forms::ColumnHeader^  >(1) { this->OperationsColumn });
+			this->OperationsListView->Dock = System::Windows::Forms::DockStyle::Fill;
+			this->OperationsListView->Font = (gcnew System::Drawing::Font(L"Audiowide", 16, System::Drawing::FontStyle::Bold));
+			this->OperationsListView->ForeColor = System::Drawing::Color::FromArgb(static_cast<System::Int32>(static_cast<System::Byte>(128)),
+				static_cast<System::Int32>(static_cast<System::Byte>(255)), static_cast<System::Int32>(static_cast<System::Byte>(128)));
+			this->OperationsListView->FullRowSelect = true;
+			this->OperationsListView->HeaderStyle = System::Windows::Forms::ColumnHeaderStyle::None;
+			this->OperationsListView->HideSelection = false;
+			this->OperationsListView->Location = System::Drawing::Point(0, 0);
+			this->OperationsListView->MultiSelect = false;
+			this->OperationsListView->Name = L"OperationsListView";
+			this->OperationsListView->OwnerDraw = true;
+			this->OperationsListView->Size = System::Drawing::Size(624, 228);
+			this->OperationsListView->SmallImageList = this->OperationsRowHeight;
+			this->OperationsListView->TabIndex = 5;
+			this->OperationsListView->UseCompatibleStateImageBehavior = false;
+			this->OperationsListView->View = System::Windows::Forms::View::Details;
+			this->OperationsListView->VirtualMode = true;
+			// 
+			// OperationsColumn
+			// 
+			this->OperationsColumn->Width = 624;
+			// 
+			// OperationsRowHeight
+			// 
+			this->OperationsRowHeight->ColorDepth = System::Windows::Forms::ColorDepth::Depth8Bit;
+			this->OperationsRowHeight->ImageSize = System::Drawing::Size(1, 30);
+			this->OperationsRowHeight->TransparentColor = System::Drawing::Color::Transparent;
+			// 
+			// SearchPanel
+			// 
+			this->SearchPanel->Controls->Add(this->SearchTextBox);
+			this->SearchPanel->Controls->Add(this->SearchLabel);
+			this->SearchPanel->Dock = System::Windows::Forms::DockStyle::Bottom;
+			this->SearchPanel->Location = System::Drawing::Point(0, 228);
+			this->SearchPanel->Name = L"SearchPanel";
+			this->SearchPanel->Size = System::Drawing::Size(624, 28);
+			this->SearchPanel->TabIndex = 6;
+			// 
+			// SearchLabel
+			// 
+			this->SearchLabel->Dock = System::Windows::Forms::DockStyle::Left;
+			this->SearchLabel->Font = (gcnew System::Drawing::Font(L"Audiowide", 8, System::Drawing::FontStyle::Bold));
+			this->SearchLabel->ForeColor = System::Drawing::Color::FromArgb(static_cast<System::Int32>(static_cast<System::Byte>(128)),
+				static_cast<System::Int32>(static_cast<System::Byte>(255)), static_cast<System::Int32>(static_cast<System::Byte>(128)));
+			this->SearchLabel->Location = System::Drawing::Point(0, 0);
+			this->SearchLabel->Name = L"SearchLabel";
+			this->SearchLabel->Size = System::Drawing::Size(70, 28);
+			this->SearchLabel->TabIndex = 1;
+			this->SearchLabel->Text = L"SEARCH:";
+			this->SearchLabel->TextAlign = System::Drawing::ContentAlignment::MiddleLeft;
+			// 
+			// SearchTextBox
+			// 
+			this->SearchTextBox->BackColor = System::Drawing::SystemColors::InfoText;
+			this->SearchTextBox->BorderStyle = System::Windows::Forms::BorderStyle::FixedSingle;
+			this->SearchTextBox->Dock = System::Windows::Forms::DockStyle::Fill;
+			this->SearchTextBox->Font = (gcnew System::Drawing::Font(L"Audiowide", 12));
+			this->SearchTextBox->ForeColor = System::Drawing::Color::FromArgb(static_cast<System::Int32>(static_cast<System::Byte>(128)),
+				static_cast<System::Int32>(static_cast<System::Byte>(255)), static_cast<System::Int32>(static_cast<System::Byte>(128)));
+			this->SearchTextBox->Location = System::Drawing::Point(70, 0);
+			this->SearchTextBox->MaxLength = 200;
+			this->SearchTextBox->Name = L"SearchTextBox";
+			this->SearchTextBox->Size = System::Drawing::Size(554, 28);
+			this->SearchTextBox->TabIndex = 0;
+			// 
+			// PreviewLabel
+			// 
+			this->PreviewLabel->BackColor = System::Drawing::SystemColors::InfoText;
+			this->PreviewLabel->Dock = System::Windows::Forms::DockStyle::Bottom;
+			this->PreviewLabel->Font = (gcnew System::Drawing::Font(L"Audiowide", 12));
+			this->PreviewLabel->ForeColor = System::Drawing::Color::FromArgb(static_cast<System::Int32>(static_cast<System::Byte>(128)),
 				static_cast<System::Int32>(static_cast<System::Byte>(255)), static_cast<System::Int32>(static_cast<System::Byte>(128)));
-			this->OperationsListBox->FormattingEnabled = true;
-			this->OperationsListBox->ItemHeight = 30;
-			this->OperationsListBox->Location = System::Drawing::Point(0, 0);
-			this->OperationsListBox->Name = L"OperationsListBox";
-			this->OperationsListBox->Size = System::Drawing::Size(624, 284);
-			this->OperationsListBox->TabIndex = 5;
+			this->PreviewLabel->Location = System::Drawing::Point(0, 256);
+			this->PreviewLabel->Name = L"PreviewLabel";
+			this->PreviewLabel->Size = System::Drawing::Size(624, 28);
+			this->PreviewLabel->TabIndex = 9;
+			this->PreviewLabel->TextAlign = System::Drawing::ContentAlignment::MiddleRight;
 			// 
 			// tableLayoutPanel1
 			// 
@@ -1370,6 +1879,8 @@ namespace BifrostCalculatorApp {
 			this->ButtonsContainer->ResumeLayout(false);
 			this->ButtonsContainer->PerformLayout();
 			this->TextFieldPanel->ResumeLayout(false);
+			this->SearchPanel->ResumeLayout(false);
+			this->SearchPanel->PerformLayout();
 			this->tableLayoutPanel1->ResumeLayout(false);
 			this->tableLayoutPanel1->PerformLayout();
 			this->tableLayoutPanel7->ResumeLayout(false);
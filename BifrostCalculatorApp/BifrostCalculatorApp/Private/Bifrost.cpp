@@ -1,10 +1,108 @@
 //Bifrost.cpp
 
+#include <algorithm>
 #include <iostream>
 #include <cstring> // For std::strlen
+#include <cstdlib>
+#include <cwchar>  // For _wcsnicmp
 
 #include <windows.h>
 #include "../public/Bifrost.h"
+#include "../public/BifrostArq.h"
+#include "../public/SharedRing.h"
+
+namespace {
+
+    // Longest reply the firmware sends ("nanSyntax error at position: 199\r\n"), with a margin.
+    const DWORD kLongestReply = 40;
+
+    // Time to answer assumed until the board has answered once: long enough
+    // for a board that resets when its port is opened to leave its bootloader.
+    const unsigned long long kInitialAnswerMicros = 2000000;
+
+    // Least time to answer allowed beyond the wire time, so a scheduling
+    // hiccup on the host isn't taken for a lost reply.
+    const unsigned long long kMinAnswerMicros = 10000;
+
+    // Longest a single ReadFile waits for the first byte before the read's
+    // deadline is checked again.
+    const DWORD kMaxReadSliceMs = 10;
+
+    // A read budget that never runs out.
+    const unsigned long long kNoBudget = ~0ULL;
+
+    // Times StartReliable asks the board for its identity.
+    const int kIdentifyAttempts = 3;
+
+    // Default coalescing: eight full-speed USB bulk packets, or a line that
+    // has waited a millisecond for company.
+    const size_t kDefaultFlushBytes = 8 * 64;
+    const unsigned long long kDefaultFlushDelayMicros = 1000;
+
+    /// <summary>
+    /// Gets how much of a read's budget is left, for a pipe read to wait.
+    /// </summary>
+    /// <param name="since">When the wait started.</param>
+    /// <param name="budget">How long it may last, in microseconds.</param>
+    /// <returns>The milliseconds left, rounded up; INFINITE for kNoBudget.</returns>
+    DWORD MillisLeft(unsigned long long since, unsigned long long budget)
+    {
+        if (budget == kNoBudget)
+            return INFINITE;
+        const unsigned long long elapsed = BifrostMetrics::MicrosSince(since);
+        if (elapsed >= budget)
+            return 0;
+        const unsigned long long left = (budget - elapsed + 999) / 1000;
+        return left < INFINITE ? (DWORD)left : INFINITE - 1;
+    }
+
+    /// <summary>
+    /// Reads a name=value number from the board's identity.
+    /// </summary>
+    /// <returns>The value, 0 if it isn't listed.</returns>
+    unsigned long IdentityValue(const std::string& identity, const char* name)
+    {
+        const std::string key = std::string(" ") + name + "=";
+        size_t at = identity.find(key);
+        return at != std::string::npos ? std::strtoul(identity.c_str() + at + key.size(), NULL, 10) : 0;
+    }
+
+    /// <summary>
+    /// Reads a name=first,second pair of numbers from the board's "stats" reply.
+    /// </summary>
+    /// <returns>False if it isn't listed.</returns>
+    bool StatsPair(const std::string& stats, const char* name, unsigned long long& first, unsigned long long& second)
+    {
+        const std::string key = std::string(" ") + name + "=";
+        size_t at = stats.find(key);
+        if (at == std::string::npos)
+            return false;
+
+        char* end;
+        first = std::strtoull(stats.c_str() + at + key.size(), &end, 10);
+        second = *end == ',' ? std::strtoull(end + 1, NULL, 10) : 0;
+        return true;
+    }
+
+    /// <summary>
+    /// Reads a name=value number that may be -1 from the board's "stats" reply.
+    /// </summary>
+    /// <returns>The value, -1 if it isn't listed.</returns>
+    long long StatsSigned(const std::string& stats, const char* name)
+    {
+        const std::string key = std::string(" ") + name + "=";
+        size_t at = stats.find(key);
+        return at != std::string::npos ? std::strtoll(stats.c_str() + at + key.size(), NULL, 10) : -1;
+    }
+
+    /// <summary>
+    /// Same characters Arduino's String::trim removes.
+    /// </summary>
+    bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+    }
+}
 
 /// <summary>
 /// Constructor for the Bifrost class. 
@@ -14,6 +112,37 @@ Bifrost::Bifrost()
 {
     // Initialize your member variables.
     hSerial = INVALID_HANDLE_VALUE;
+    isPipe = false;
+    ioEvent = NULL;
+    receivedStart = 0;
+    timeouts = { 0 };
+    readTimeoutMs = 0;
+    baudRate = 0;
+    receiveBuffer = 0;
+    reliableWindow = 0;
+    smoothedMicros = 0;
+    variationMicros = 0;
+    lastWriteBytes = 0;
+    lastLine = 0;
+    writeStarted = 0;
+    writeFinished = 0;
+    shared = NULL;
+    peer = NULL;
+    arq = NULL;
+    transmitSince = 0;
+    flushBytes = kDefaultFlushBytes;
+    flushDelayMicros = kDefaultFlushDelayMicros;
+    interrupt = CreateEventW(NULL, TRUE, FALSE, NULL);
+}
+
+/// <summary>
+/// Destructor. Closes the port.
+/// </summary>
+Bifrost::~Bifrost()
+{
+    Close();
+    if (interrupt != NULL)
+        CloseHandle(interrupt);
 }
 
 /// <summary>
@@ -24,11 +153,62 @@ Bifrost::Bifrost()
 /// <returns>True if the port was successfully opened, false otherwise.</returns>
 bool Bifrost::Open(LPCWSTR port, DWORD baudrate)
 {
-    hSerial = CreateFileW(port, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    unsigned long long openStarted = BifrostMetrics::Now();
+
+    const bool useShared = _wcsnicmp(port, L"shm:", 4) == 0;
+    if (useShared)
+        port += 4;
+
+    // Named pipes have no serial parameters or timeouts; they are read
+    // overlapped instead, so a read can give up (see ReadPort).
+    isPipe = _wcsnicmp(port, L"\\\\.\\pipe\\", 9) == 0;
+    const DWORD flags = isPipe ? FILE_FLAG_OVERLAPPED : FILE_ATTRIBUTE_NORMAL;
+
+    hSerial = CreateFileW(port, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, flags, NULL);
+
+    // A broker's pipe instances can all be taken for a moment while it
+    // creates the next one; waiting for it rather than failing.
+    for (int attempt = 0; hSerial == INVALID_HANDLE_VALUE && attempt < 5 && GetLastError() == ERROR_PIPE_BUSY; attempt++) {
+        if (!WaitNamedPipeW(port, 1000))
+            break;
+        hSerial = CreateFileW(port, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, flags, NULL);
+    }
+
     if (hSerial == INVALID_HANDLE_VALUE) {
         return false;
     }
 
+    if (interrupt != NULL)
+        ResetEvent(interrupt);
+    received.clear();
+    receivedStart = 0;
+    baudRate = 0;
+    receiveBuffer = 0;
+    reliableWindow = 0;
+    smoothedMicros = 0;
+    variationMicros = 0;
+    lastWriteBytes = 0;
+    lastLine = 0;
+
+    if (isPipe) {
+        timeouts = { 0 };
+        ioEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (ioEvent == NULL) {
+            Close();
+            return false;
+        }
+        if (useShared && !OpenShared()) {
+            Close();
+            return false;
+        }
+        Metrics().RecordSince(PhaseOpen, openStarted);
+        return true;
+    }
+    if (useShared) {
+        Close();
+        return false;
+    }
+
     // Setting up the serial port parameters...
 
     DCB dcbSerialParams = { 0 };
@@ -42,23 +222,40 @@ bool Bifrost::Open(LPCWSTR port, DWORD baudrate)
     dcbSerialParams.ByteSize = 8;
     dcbSerialParams.StopBits = ONESTOPBIT;
     dcbSerialParams.Parity = NOPARITY;
+
+    // No RTS/CTS or XON/XOFF: the boards' USB bridges don't wire RTS/CTS to
+    // the microcontroller, and the firmware can't send XOFF while it is busy
+    // evaluating. BifrostPipeline paces requests to the board's receive
+    // buffer instead. Set explicitly so another program's settings don't linger.
+    dcbSerialParams.fOutxCtsFlow = FALSE;
+    dcbSerialParams.fOutxDsrFlow = FALSE;
+    dcbSerialParams.fDsrSensitivity = FALSE;
+    dcbSerialParams.fOutX = FALSE;
+    dcbSerialParams.fInX = FALSE;
+    dcbSerialParams.fDtrControl = DTR_CONTROL_ENABLE;
+    dcbSerialParams.fRtsControl = RTS_CONTROL_ENABLE;
     if (!SetCommState(hSerial, &dcbSerialParams)) {
         Close();
         return false;
     }
 
-    // Set timeouts, etc.
-    COMMTIMEOUTS timeouts = { 0 };
-    timeouts.ReadIntervalTimeout = 50;
-    timeouts.ReadTotalTimeoutConstant = 50;
-    timeouts.ReadTotalTimeoutMultiplier = 10;
+    // A read returns as soon as any byte is there, or after a short slice
+    // with nothing. How long to keep waiting for a reply is decided by
+    // ReadLine and ReadData from ReplyTimeout(), not by the driver.
+    baudRate = baudrate;
+    const DWORD byteMs = (10000 + baudrate - 1) / baudrate;  // 8N1: 10 bits a byte.
+    timeouts = { 0 };
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant = std::min(4 * byteMs, kMaxReadSliceMs);
     timeouts.WriteTotalTimeoutConstant = 50;
-    timeouts.WriteTotalTimeoutMultiplier = 10;
+    timeouts.WriteTotalTimeoutMultiplier = 2 * byteMs;
     if (!SetCommTimeouts(hSerial, &timeouts)) {
         Close();
         return false;
     }
 
+    Metrics().RecordSince(PhaseOpen, openStarted);
     return true;
 }
 
@@ -67,10 +264,32 @@ bool Bifrost::Open(LPCWSTR port, DWORD baudrate)
 /// </summary>
 void Bifrost::Close()
 {
+    if (shared != NULL) {
+        delete shared;
+        shared = NULL;
+    }
+    if (peer != NULL) {
+        CloseHandle(peer);
+        peer = NULL;
+    }
+    unsent.clear();
+
+    if (arq != NULL) {
+        delete arq;
+        arq = NULL;
+    }
+    framed.clear();
+    ready.clear();
+    transmit.clear();
+
     if (hSerial != INVALID_HANDLE_VALUE) {
         CloseHandle(hSerial);
         hSerial = INVALID_HANDLE_VALUE;
     }
+    if (ioEvent != NULL) {
+        CloseHandle(ioEvent);
+        ioEvent = NULL;
+    }
 }
 
 /// <summary>
@@ -82,11 +301,123 @@ bool Bifrost::WriteData(const std::string& data) {
     if (hSerial == INVALID_HANDLE_VALUE)
         return false;
 
-    DWORD bytesWritten;
-    if (!WriteFile(hSerial, data.c_str(), data.size(), &bytesWritten, NULL)) {
+    // Behind what is queued, in the same write.
+    if (!transmit.empty()) {
+        transmit.append(data);
+        return Flush();
+    }
+    return Transmit(data);
+}
+
+/// <summary>
+/// Queues one request line for the next write.
+/// </summary>
+/// <param name="text">The request, without its newline.</param>
+/// <param name="length">Its length.</param>
+/// <returns>False if the port is closed or a write made to empty the queue failed.</returns>
+bool Bifrost::EnqueueLine(const char* text, size_t length) {
+    if (hSerial == INVALID_HANDLE_VALUE)
+        return false;
+
+    const unsigned long long now = BifrostMetrics::Now();
+    if (transmit.empty())
+        transmitSince = now;
+
+    transmit.append(text, length);
+    transmit.push_back('\n');
+
+    if (transmit.size() >= flushBytes || now - transmitSince >= flushDelayMicros)
+        return Flush();
+    return true;
+}
+
+/// <summary>
+/// Queues one request line for the next write.
+/// </summary>
+bool Bifrost::EnqueueLine(const std::string& text) {
+    return EnqueueLine(text.data(), text.size());
+}
+
+/// <summary>
+/// Writes every queued line with a single write.
+/// </summary>
+/// <returns>False if the write failed; the queued lines are dropped either way.</returns>
+bool Bifrost::Flush() {
+    if (transmit.empty())
+        return true;
+    if (hSerial == INVALID_HANDLE_VALUE)
+        return false;
+
+    // Cleared rather than swapped out, so its capacity is kept for the next lines.
+    bool written = Transmit(transmit);
+    transmit.clear();
+    return written;
+}
+
+/// <summary>
+/// Sets when EnqueueLine writes the queue on its own.
+/// </summary>
+/// <param name="bytes">Queued bytes that make it write (at least 1).</param>
+/// <param name="delayMicros">How long a queued line may wait for others, in microseconds.</param>
+void Bifrost::SetCoalescing(size_t bytes, unsigned long long delayMicros) {
+    flushBytes = bytes > 0 ? bytes : 1;
+    flushDelayMicros = delayMicros;
+}
+
+/// <summary>
+/// Writes data the way this link sends it.
+/// </summary>
+/// <param name="data">Request lines.</param>
+/// <returns>True if the write operation was successful, false otherwise.</returns>
+bool Bifrost::Transmit(const std::string& data) {
+    if (arq != NULL)
+        return WriteReliable(data);
+    return WriteRaw(data);
+}
+
+/// <summary>
+/// Writes data to the serial port, pipe or shared channel as is.
+/// </summary>
+/// <param name="data">The bytes to send.</param>
+/// <returns>True if the write operation was successful, false otherwise.</returns>
+bool Bifrost::WriteRaw(const std::string& data) {
+    writeStarted = BifrostMetrics::Now();
+    lastWriteBytes = data.size();
+
+    if (shared != NULL) {
+        // One slot per line; a line without its newline yet waits for the rest.
+        unsent.append(data);
+        size_t lineStart = 0;
+        size_t newline;
+        while ((newline = unsent.find('\n', lineStart)) != std::string::npos) {
+            size_t first = lineStart;
+            size_t last = newline;
+
+            // Trimmed as the firmware would before cutting it to a slot, which
+            // still holds more than the firmware keeps.
+            if (last - first > SharedRing::kSlotPayload) {
+                while (first < last && IsSpace(unsent[first]))
+                    first++;
+                while (last > first && IsSpace(unsent[last - 1]))
+                    last--;
+            }
+
+            if (!shared->Requests().Push(unsent.data() + first, last - first, INFINITE, peer)) {
+                unsent.clear();
+                writeStarted = 0;
+                return false;
+            }
+            lineStart = newline + 1;
+        }
+        unsent.erase(0, lineStart);
+    }
+    else if (!WritePort(data.data(), (DWORD)data.size())) {
+        writeStarted = 0;
         return false;
     }
 
+    writeFinished = BifrostMetrics::Now();
+    Metrics().RecordSince(PhaseWrite, writeStarted);
     return true;
 }
 
@@ -96,18 +427,646 @@ bool Bifrost::WriteData(const std::string& data) {
 /// <param name="numBytes">The maximum number of bytes to read.</param>
 /// <returns>A string containing the received data.</returns>
 std::string Bifrost::ReadData(DWORD numBytes) {
-    if (hSerial == INVALID_HANDLE_VALUE)
+    if (hSerial == INVALID_HANDLE_VALUE || numBytes == 0 || !Flush())
         return "";
 
+    unsigned long long readStarted = BifrostMetrics::Now();
+
+    // A whole reply arrives at once on the shared channel, and the reliable
+    // protocol only hands over whole replies.
+    if (shared != NULL || arq != NULL) {
+        std::string line;
+        if (!(shared != NULL ? ReadSharedLine(line, 0) : ReadReliableLine(line, 0)))
+            return "";
+        Metrics().RecordSince(PhaseFirstByte, writeFinished != 0 ? writeFinished : readStarted);
+        Metrics().RecordSince(PhaseResponse, writeStarted != 0 ? writeStarted : readStarted);
+        writeStarted = writeFinished = 0;
+        line += "\r\n";
+        return line.substr(0, numBytes);
+    }
+
     // Allocate a buffer to hold the incoming data.
     char* buffer = new char[numBytes + 1];
-    DWORD bytesRead;
-    if (!ReadFile(hSerial, buffer, numBytes, &bytesRead, NULL)) {
+
+    // A reply that was already waiting says nothing about how long the board takes.
+    const bool waited = BytesAvailable() == 0;
+    const unsigned long long budget = RawBudget(0, std::min(numBytes, kLongestReply));
+
+    // Waiting for the first byte on its own, so its arrival can be timed.
+    DWORD bytesRead = 0;
+    do {
+        if (!ReadPort(buffer, 1, MillisLeft(readStarted, budget), bytesRead)) {
+            delete[] buffer;
+            return "";
+        }
+    } while (bytesRead == 0 && BifrostMetrics::MicrosSince(readStarted) < budget);
+
+    if (bytesRead == 0) {
         delete[] buffer;
         return "";
     }
+
+    Metrics().RecordSince(PhaseFirstByte, writeFinished != 0 ? writeFinished : readStarted);
+
+    // Reading the rest of the response, which ends at its newline: there is
+    // no need to wait for the line to go quiet.
+    unsigned long long lastData = BifrostMetrics::Now();
+    bool complete = buffer[0] == '\n';
+    while (!complete && bytesRead < numBytes) {
+        DWORD moreBytesRead = 0;
+        if (!ReadPort(buffer + bytesRead, numBytes - bytesRead, MillisLeft(lastData, budget), moreBytesRead)) {
+            delete[] buffer;
+            return "";
+        }
+        if (moreBytesRead == 0) {
+            if (BifrostMetrics::MicrosSince(lastData) >= budget)
+                break;
+            continue;
+        }
+        complete = std::memchr(buffer + bytesRead, '\n', moreBytesRead) != NULL;
+        bytesRead += moreBytesRead;
+        lastData = BifrostMetrics::Now();
+    }
+
+    if (complete && waited)
+        RecordReply(writeFinished, bytesRead);
+    Metrics().RecordSince(PhaseResponse, writeStarted != 0 ? writeStarted : readStarted);
+    writeStarted = writeFinished = 0;
+
     buffer[bytesRead] = '\0';  // Null-terminate the C-string.
     std::string result(buffer);
     delete[] buffer;
     return result;
 }
+
+/// <summary>
+/// Reads one reply line from the serial port.
+/// </summary>
+/// <param name="line">Receives the line, without the trailing "\r\n".</param>
+/// <returns>True if a full line was read, false on failure or timeout.</returns>
+bool Bifrost::ReadLine(std::string& line) {
+    return ReadLine(line, 0);
+}
+
+/// <summary>
+/// Reads one reply line from the serial port, with its own timeout.
+/// </summary>
+/// <param name="line">Receives the line, without the trailing "\r\n".</param>
+/// <param name="timeoutMs">How long to wait for the reply, or 0 for ReplyTimeout().</param>
+/// <returns>True if a full line was read, false on failure or timeout.</returns>
+bool Bifrost::ReadLine(std::string& line, DWORD timeoutMs) {
+    if (hSerial == INVALID_HANDLE_VALUE || !Flush())
+        return false;
+    if (shared != NULL)
+        return ReadSharedLine(line, timeoutMs);
+    if (arq != NULL)
+        return ReadReliableLine(line, timeoutMs);
+
+    bool timedOut;
+    return ReadRawLine(line, RawBudget(timeoutMs, kLongestReply), timedOut);
+}
+
+/// <summary>
+/// Reads one line from the serial port or pipe.
+/// </summary>
+/// <param name="line">Receives the line, without the trailing "\r\n".</param>
+/// <param name="budget">How long to wait without any data coming in, in microseconds.</param>
+/// <param name="timedOut">Set when false is returned because nothing came in time.</param>
+/// <returns>True if a full line was read.</returns>
+bool Bifrost::ReadRawLine(std::string& line, unsigned long long budget, bool& timedOut) {
+    timedOut = false;
+
+    // The reply could be expected from when its request was written, or when
+    // the previous reply came in if that was later (the board answers one
+    // request at a time). A reply that was already waiting says nothing about
+    // how long the board takes, and neither does one to a request sent again.
+    const unsigned long long waitStarted = std::max(writeFinished, lastLine);
+    const bool waited = received.find('\n', receivedStart) == std::string::npos && BytesAvailable() == 0
+        && (arq == NULL || !arq->Retransmitting());
+
+    unsigned long long lastData = BifrostMetrics::Now();
+
+    for (;;) {
+        size_t newline = received.find('\n', receivedStart);
+        if (newline != std::string::npos) {
+            size_t end = newline;
+            if (end > receivedStart && received[end - 1] == '\r')
+                end--;
+            line.assign(received, receivedStart, end - receivedStart);
+
+            if (waited)
+                RecordReply(waitStarted, newline + 1 - receivedStart);
+            lastLine = BifrostMetrics::Now();
+
+            receivedStart = newline + 1;
+            if (receivedStart == received.size()) {
+                received.clear();
+                receivedStart = 0;
+            }
+            return true;
+        }
+
+        // Dropping what has already been returned before reading more.
+        if (receivedStart > 0) {
+            received.erase(0, receivedStart);
+            receivedStart = 0;
+        }
+
+        // Reading only what is already there, so a reply is returned as soon as
+        // its newline arrives instead of waiting for the interval timeout.
+        // With nothing buffered, a single byte is requested to wait for data;
+        // on a pipe for no longer than the budget, so a lost reply is still
+        // noticed (e.g. from an emulator told to lose some).
+        char chunk[256];
+        DWORD available = BytesAvailable();
+        DWORD toRead = available == 0 ? 1 : (available < sizeof(chunk) ? available : sizeof(chunk));
+
+        DWORD bytesRead = 0;
+        if (!ReadPort(chunk, toRead, MillisLeft(lastData, budget), bytesRead))
+            return false;
+
+        if (bytesRead == 0) {
+            if (BifrostMetrics::MicrosSince(lastData) >= budget) {
+                timedOut = true;
+                return false;
+            }
+            continue;
+        }
+
+        received.append(chunk, bytesRead);
+        lastData = BifrostMetrics::Now();
+    }
+}
+
+/// <summary>
+/// Reads from the serial port, or from the pipe with a bounded wait.
+/// </summary>
+/// <param name="buffer">Receives the bytes.</param>
+/// <param name="size">The most bytes to read.</param>
+/// <param name="waitMs">How long a pipe read waits for the first byte.</param>
+/// <param name="bytesRead">Receives the number of bytes read, 0 if none came in time.</param>
+/// <returns>False if the port or pipe failed.</returns>
+bool Bifrost::ReadPort(char* buffer, DWORD size, DWORD waitMs, DWORD& bytesRead) {
+    bytesRead = 0;
+    if (!isPipe)
+        return ReadFile(hSerial, buffer, size, &bytesRead, NULL) != FALSE;
+
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = ioEvent;
+    DWORD waited = WAIT_OBJECT_0;
+    if (!ReadFile(hSerial, buffer, size, NULL, &overlapped)) {
+        if (GetLastError() != ERROR_IO_PENDING)
+            return false;
+
+        // Given up on after waitMs, or failed by Interrupt; bytes that
+        // arrived meanwhile still count.
+        HANDLE events[2] = { ioEvent, interrupt };
+        waited = WaitForMultipleObjects(interrupt != NULL ? 2 : 1, events, FALSE, waitMs);
+        if (waited != WAIT_OBJECT_0)
+            CancelIoEx(hSerial, &overlapped);
+    }
+
+    if (!GetOverlappedResult(hSerial, &overlapped, &bytesRead, TRUE)) {
+        bytesRead = 0;
+        return GetLastError() == ERROR_OPERATION_ABORTED && waited != WAIT_OBJECT_0 + 1;
+    }
+    return true;
+}
+
+/// <summary>
+/// Writes to the serial port, or to the pipe and waits for the write to complete.
+/// </summary>
+/// <param name="data">The bytes.</param>
+/// <param name="size">Their number.</param>
+/// <returns>False if the write failed.</returns>
+bool Bifrost::WritePort(const char* data, DWORD size) {
+    DWORD bytesWritten = 0;
+    if (!isPipe)
+        return WriteFile(hSerial, data, size, &bytesWritten, NULL) != FALSE;
+
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = ioEvent;
+    if (!WriteFile(hSerial, data, size, NULL, &overlapped)) {
+        if (GetLastError() != ERROR_IO_PENDING)
+            return false;
+
+        // A broker that stopped reading leaves it pending until Interrupt.
+        HANDLE events[2] = { ioEvent, interrupt };
+        if (WaitForMultipleObjects(interrupt != NULL ? 2 : 1, events, FALSE, INFINITE) != WAIT_OBJECT_0) {
+            CancelIoEx(hSerial, &overlapped);
+            GetOverlappedResult(hSerial, &overlapped, &bytesWritten, TRUE);
+            return false;
+        }
+    }
+    return GetOverlappedResult(hSerial, &overlapped, &bytesWritten, TRUE) && bytesWritten == size;
+}
+
+/// <summary>
+/// Makes the pipe read or write in progress fail, and any started before the next Open.
+/// </summary>
+void Bifrost::Interrupt() {
+    if (interrupt != NULL)
+        SetEvent(interrupt);
+}
+
+/// <summary>
+/// Frames every complete line and writes them, making room in the window as needed.
+/// </summary>
+/// <param name="data">Requests, each ending with "\n"; a last one without it waits for the rest.</param>
+/// <returns>False if the link failed or gave up on a request.</returns>
+bool Bifrost::WriteReliable(const std::string& data) {
+    unsent.append(data);
+    framed.clear();
+
+    size_t lineStart = 0;
+    size_t newline;
+    while ((newline = unsent.find('\n', lineStart)) != std::string::npos) {
+        if (arq->Full()) {
+            // The frames gathered so far have to go out before waiting for replies.
+            if (!framed.empty() && !WriteRaw(framed)) {
+                unsent.clear();
+                return false;
+            }
+            framed.clear();
+
+            // Replies that came in are kept for ReadLine, which frees their slots.
+            std::string reply;
+            while (arq->Full()) {
+                if (arq->Deliver(reply))
+                    ready.push_back(reply);
+                else if (!Pump(ReadBudget(kLongestReply))) {
+                    unsent.clear();
+                    return false;
+                }
+            }
+        }
+
+        arq->Send(unsent.data() + lineStart, newline - lineStart, BifrostMetrics::Now(), framed);
+        lineStart = newline + 1;
+    }
+    unsent.erase(0, lineStart);
+
+    bool written = framed.empty() || WriteRaw(framed);
+    framed.clear();
+    return written;
+}
+
+/// <summary>
+/// Waits for the next reply, in request order, on the reliable protocol.
+/// </summary>
+/// <param name="line">Receives the reply, without its framing.</param>
+/// <param name="timeoutMs">Timeout before a request is sent again, or 0 for ReplyTimeout().</param>
+/// <returns>False if nothing is awaited, the link failed, or a request ran out of attempts.</returns>
+bool Bifrost::ReadReliableLine(std::string& line, DWORD timeoutMs) {
+    if (!ready.empty()) {
+        line.swap(ready.front());
+        ready.pop_front();
+        return true;
+    }
+
+    while (!arq->Deliver(line)) {
+        if (!arq->Waiting())
+            return false;
+        if (!Pump(timeoutMs != 0 ? 1000ULL * timeoutMs : ReadBudget(kLongestReply)))
+            return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Reads one line from the board, or sends again what has timed out, then
+/// writes whatever has to be sent again.
+/// </summary>
+/// <param name="timeoutMicros">The reply timeout.</param>
+/// <returns>False if the link failed or a request ran out of attempts.</returns>
+bool Bifrost::Pump(unsigned long long timeoutMicros) {
+    framed.clear();
+
+    bool going;
+    std::string line;
+    bool timedOut = true;
+    const unsigned long long left = arq->TimeLeft(BifrostMetrics::Now(), timeoutMicros);
+    if (left > 0 && ReadRawLine(line, left, timedOut))
+        going = arq->Receive(line, BifrostMetrics::Now(), framed);
+    else if (timedOut)
+        going = arq->Expire(BifrostMetrics::Now(), timeoutMicros, framed);
+    else
+        going = false;
+
+    bool written = going && (framed.empty() || WriteRaw(framed));
+    framed.clear();
+    return written;
+}
+
+/// <summary>
+/// Gets how long a read waits for a reply before giving up.
+/// </summary>
+/// <returns>The timeout in milliseconds.</returns>
+DWORD Bifrost::ReplyTimeout() const
+{
+    return (DWORD)((ReadBudget(kLongestReply) + 999) / 1000);
+}
+
+/// <summary>
+/// Replaces the adaptive reply timeout.
+/// </summary>
+/// <param name="milliseconds">The timeout, or 0 to go back to ReplyTimeout().</param>
+void Bifrost::SetReadTimeout(DWORD milliseconds)
+{
+    readTimeoutMs = milliseconds;
+}
+
+/// <summary>
+/// Asks the board for its identity and keeps what it says about its buffers.
+/// </summary>
+/// <param name="identity">Receives the answer.</param>
+/// <returns>False if no Bifrost firmware answered.</returns>
+bool Bifrost::Identify(std::string& identity)
+{
+    if (hSerial == INVALID_HANDLE_VALUE || arq != NULL)
+        return false;
+
+    // On a link that damages lines it may take a few tries.
+    for (int attempt = 0; attempt < kIdentifyAttempts; attempt++) {
+        if (!WriteData("id\n"))
+            return false;
+        if (!ReadLine(identity) || identity.compare(0, 8, "bifrost ") != 0)
+            continue;
+
+        receiveBuffer = IdentityValue(identity, "rx");
+        reliableWindow = IdentityValue(identity, "arq");
+        return true;
+    }
+    return false;
+}
+
+/// <summary>
+/// Gets the size of the board's receive buffer.
+/// </summary>
+/// <returns>Bytes, 0 if unknown.</returns>
+size_t Bifrost::ReceiveBuffer() const
+{
+    return receiveBuffer;
+}
+
+/// <summary>
+/// Gets the bytes a request takes on the wire.
+/// </summary>
+/// <param name="lineLength">Length of the request, without its newline.</param>
+/// <returns>Bytes including the newline and any framing.</returns>
+size_t Bifrost::WireLength(size_t lineLength) const
+{
+    // "@1f " before it and "*78f1" after it.
+    return lineLength + 1 + (arq != NULL ? 9 : 0);
+}
+
+/// <summary>
+/// Checks that the board answers, within a bounded time whatever the protocol.
+/// </summary>
+/// <param name="timeoutMs">The longest wait for the answer.</param>
+/// <returns>False if the link failed or nothing came back in time.</returns>
+bool Bifrost::Ping(DWORD timeoutMs)
+{
+    if (hSerial == INVALID_HANDLE_VALUE || !Flush() || !WriteRaw("ping\n"))
+        return false;
+
+    // A late reply to a frame sent earlier may come first; it is skipped.
+    const unsigned long long started = BifrostMetrics::Now();
+    const unsigned long long budget = 1000ULL * timeoutMs;
+    std::string line;
+    for (;;) {
+        const unsigned long long elapsed = BifrostMetrics::MicrosSince(started);
+        if (elapsed >= budget)
+            return false;
+
+        bool read;
+        if (shared != NULL) {
+            read = ReadSharedLine(line, (DWORD)((budget - elapsed + 999) / 1000));
+        }
+        else {
+            bool timedOut;
+            read = ReadRawLine(line, budget - elapsed, timedOut);
+        }
+        if (!read)
+            return false;
+        if (line.empty() || (line[0] != '$' && line[0] != '!'))
+            return true;
+    }
+}
+
+/// <summary>
+/// Switches to the reliable protocol if the board speaks it.
+/// </summary>
+/// <returns>True if requests are framed from now on.</returns>
+bool Bifrost::StartReliable()
+{
+    if (hSerial == INVALID_HANDLE_VALUE || shared != NULL)
+        return false;
+    if (arq != NULL)
+        return true;
+
+    std::string identity;
+    if (!Identify(identity) || reliableWindow == 0)
+        return false;
+
+    arq = new BifrostArq(reliableWindow);
+    return true;
+}
+
+/// <summary>
+/// Gets the reliable protocol's state, NULL without it.
+/// </summary>
+const BifrostArq* Bifrost::Reliable() const
+{
+    return arq;
+}
+
+/// <summary>
+/// Asks the board what it has spent its time on.
+/// </summary>
+/// <param name="stats">Receives the board's counters.</param>
+/// <returns>False if the link failed or the firmware doesn't know "stats".</returns>
+bool Bifrost::ReadBoardStats(BifrostFirmwareStats& stats)
+{
+    std::string line;
+    if (!WriteData("stats\n") || !ReadLine(line) || line.compare(0, 6, "stats ") != 0)
+        return false;
+
+    // Whatever an older firmware doesn't list stays 0.
+    stats = BifrostFirmwareStats();
+    unsigned long long unused;
+    if (!StatsPair(line, "requests", stats.requests, unused))
+        return false;
+    StatsPair(line, "receive", stats.receive.totalMicros, stats.receive.maxMicros);
+    StatsPair(line, "compile", stats.compile.totalMicros, stats.compile.maxMicros);
+    StatsPair(line, "eval", stats.evaluate.totalMicros, stats.evaluate.maxMicros);
+    StatsPair(line, "print", stats.print.totalMicros, stats.print.maxMicros);
+    StatsPair(line, "kept", stats.keptLookups, stats.keptHits);
+    stats.freeMemory = StatsSigned(line, "free");
+    stats.lowestFreeMemory = StatsSigned(line, "low");
+    return true;
+}
+
+/// <summary>
+/// Gets how long a read may wait for a reply of up to some bytes.
+/// </summary>
+/// <param name="numBytes">Longest reply expected, including its "\r\n".</param>
+/// <returns>The budget in microseconds.</returns>
+unsigned long long Bifrost::ReadBudget(DWORD numBytes) const
+{
+    if (readTimeoutMs != 0)
+        return 1000ULL * readTimeoutMs;
+
+    // RTO = SRTT + max(G, 4 * RTTVAR) as in RFC 6298, over the time beyond
+    // the wire time, which is added back for the bytes of this exchange.
+    const unsigned long long answer = smoothedMicros == 0 ? kInitialAnswerMicros
+        : smoothedMicros + std::max(kMinAnswerMicros, 4 * variationMicros);
+    return WireMicros(lastWriteBytes + numBytes) + answer;
+}
+
+/// <summary>
+/// Gets how long a read on the plain protocol may wait.
+/// </summary>
+/// <param name="timeoutMs">The timeout asked for, or 0 for the default.</param>
+/// <param name="numBytes">The longest reply expected.</param>
+/// <returns>Microseconds, or kNoBudget to wait for as long as it takes.</returns>
+unsigned long long Bifrost::RawBudget(DWORD timeoutMs, DWORD numBytes) const
+{
+    if (timeoutMs != 0)
+        return 1000ULL * timeoutMs;
+
+    // The other end of a pipe may be a broker with other clients' requests
+    // queued ahead of this one, so there only a timeout asked for ends the wait.
+    if (isPipe && readTimeoutMs == 0)
+        return kNoBudget;
+    return ReadBudget(numBytes);
+}
+
+/// <summary>
+/// Gets the time some bytes take on the wire.
+/// </summary>
+/// <param name="numBytes">How many bytes.</param>
+/// <returns>Microseconds at the port's baud rate, 0 for pipes.</returns>
+unsigned long long Bifrost::WireMicros(size_t numBytes) const
+{
+    if (baudRate == 0)
+        return 0;
+
+    // 8N1 framing: 10 bits on the wire per byte.
+    return numBytes * 10ULL * 1000000ULL / baudRate;
+}
+
+/// <summary>
+/// Updates the smoothed time to answer and its variation with one reply.
+/// </summary>
+/// <param name="waitStarted">BifrostMetrics::Now() when the reply could first be expected, 0 if unknown.</param>
+/// <param name="replyBytes">Length of the reply, including its "\r\n".</param>
+void Bifrost::RecordReply(unsigned long long waitStarted, size_t replyBytes)
+{
+    if (waitStarted == 0)
+        return;
+
+    // The time beyond what the reply's bytes needed on the wire, which is what
+    // varies with the board and the host. Never 0, which means "no sample yet".
+    const unsigned long long waited = BifrostMetrics::MicrosSince(waitStarted);
+    const unsigned long long wire = WireMicros(replyBytes);
+    const unsigned long long sample = waited > wire ? waited - wire : 1;
+
+    if (smoothedMicros == 0) {
+        smoothedMicros = sample;
+        variationMicros = sample / 2;
+        return;
+    }
+
+    // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, then SRTT = 7/8 SRTT + 1/8 R.
+    const unsigned long long deviation = smoothedMicros > sample ? smoothedMicros - sample : sample - smoothedMicros;
+    variationMicros = variationMicros - variationMicros / 4 + deviation / 4;
+    smoothedMicros = smoothedMicros - smoothedMicros / 8 + sample / 8;
+    if (smoothedMicros == 0)
+        smoothedMicros = 1;
+}
+
+/// <summary>
+/// Gets the number of bytes waiting in the driver's (or pipe's) input buffer.
+/// </summary>
+/// <returns>The number of bytes that can be read without blocking.</returns>
+DWORD Bifrost::BytesAvailable()
+{
+    if (isPipe) {
+        DWORD available = 0;
+        if (!PeekNamedPipe(hSerial, NULL, 0, NULL, &available, NULL))
+            return 0;
+        return available;
+    }
+
+    COMSTAT status = { 0 };
+    DWORD errors = 0;
+    if (!ClearCommError(hSerial, &errors, &status))
+        return 0;
+    return status.cbInQue;
+}
+
+/// <summary>
+/// Creates a shared-memory channel and asks the broker on the pipe to use it.
+/// </summary>
+/// <returns>True if the broker accepted; requests and replies then go through the channel.</returns>
+bool Bifrost::OpenShared()
+{
+    // Unique on the machine: the process id and a per-process counter.
+    static volatile LONG channels = 0;
+    const std::wstring name = L"bifrost-shm-" + std::to_wstring(GetCurrentProcessId()) + L"-" + std::to_wstring(InterlockedIncrement(&channels));
+
+    SharedChannel* channel = new SharedChannel();
+    if (!channel->Create(name)) {
+        delete channel;
+        return false;
+    }
+
+    // The name is plain ASCII.
+    std::string request = "#shm " + std::string(name.begin(), name.end()) + "\n";
+    std::string reply;
+    if (!WriteData(request) || !ReadLine(reply) || reply != "ok") {
+        delete channel;
+        return false;
+    }
+
+    // Waits on the channel end when the broker exits.
+    ULONG serverProcessId = 0;
+    if (GetNamedPipeServerProcessId(hSerial, &serverProcessId))
+        peer = OpenProcess(SYNCHRONIZE, FALSE, serverProcessId);
+
+    shared = channel;
+    return true;
+}
+
+/// <summary>
+/// Waits for the next reply on the shared channel.
+/// </summary>
+/// <param name="line">Receives the reply, without "\r\n".</param>
+/// <param name="timeoutMs">How long to wait, or 0 for as long as SetReadTimeout says (by default, as long as it takes).</param>
+/// <returns>False if the broker went away or nothing came in time.</returns>
+bool Bifrost::ReadSharedLine(std::string& line, DWORD timeoutMs)
+{
+    // As on the pipe, only a timeout asked for ends the wait (see RawBudget).
+    if (timeoutMs == 0)
+        timeoutMs = readTimeoutMs != 0 ? readTimeoutMs : INFINITE;
+
+    if (!shared->Replies().WaitForData(timeoutMs, peer))
+        return false;
+
+    const char* data;
+    size_t length;
+    shared->Replies().Front(data, length);
+    line.assign(data, length);
+    shared->Replies().Pop();
+    return true;
+}
+
+/// <summary>
+/// Gets the latency histograms shared by every Bifrost instance.
+/// </summary>
+/// <returns>The process-wide metrics.</returns>
+BifrostMetrics& Bifrost::Metrics()
+{
+    return BifrostMetrics::Global();
+}
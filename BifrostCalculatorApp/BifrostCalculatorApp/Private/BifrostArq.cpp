@@ -0,0 +1,338 @@
+//BifrostArq.cpp
+
+#include "../public/BifrostArq.h"
+
+namespace {
+
+    const char kHexDigits[] = "0123456789abcdef";
+
+    // Longest timeout doubling, so a long outage still gets probed every so often.
+    const unsigned kMaxBackoff = 6;
+
+    /// <summary>
+    /// Reads hex digits, either case.
+    /// </summary>
+    /// <returns>False if any of them isn't one.</returns>
+    bool ParseHex(const char* text, size_t digits, unsigned& value)
+    {
+        value = 0;
+        for (size_t i = 0; i < digits; i++) {
+            char c = text[i];
+            unsigned digit;
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                digit = c - 'A' + 10;
+            else
+                return false;
+            value = value * 16 + digit;
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Appends a number as lowercase hex digits, leading zeros included.
+    /// </summary>
+    void AppendHex(unsigned value, size_t digits, std::string& out)
+    {
+        for (size_t i = digits; i-- > 0;)
+            out.push_back(kHexDigits[(value >> (4 * i)) & 0xf]);
+    }
+}
+
+/// <summary>
+/// Computes the CRC-16/CCITT-FALSE of some bytes, the same way the firmware does.
+/// </summary>
+/// <param name="data">The bytes.</param>
+/// <param name="length">How many.</param>
+/// <param name="crc">The CRC so far, to continue it.</param>
+/// <returns>The CRC.</returns>
+unsigned short BifrostArq::Crc16(const char* data, size_t length, unsigned short crc)
+{
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (unsigned short)((unsigned char)data[i] << 8);
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (unsigned short)((crc << 1) ^ 0x1021) : (unsigned short)(crc << 1);
+    }
+    return crc;
+}
+
+/// <summary>
+/// Appends a frame, without line ending.
+/// </summary>
+/// <param name="kind">'@' for a request, '$' for a reply, '!' for a request to send again.</param>
+/// <param name="sequence">The sequence number.</param>
+/// <param name="payload">The expression or reply.</param>
+/// <param name="length">Length of the payload, 0 for none.</param>
+/// <param name="out">Receives the frame.</param>
+void BifrostArq::AppendFrame(char kind, unsigned sequence, const char* payload, size_t length, std::string& out)
+{
+    const size_t start = out.size();
+    out.push_back(kind);
+    AppendHex(sequence % kSequences, 2, out);
+    if (length > 0) {
+        out.push_back(' ');
+        out.append(payload, length);
+    }
+    unsigned short crc = Crc16(out.data() + start, out.size() - start);
+    out.push_back('*');
+    AppendHex(crc, 4, out);
+}
+
+/// <summary>
+/// Checks a received line and takes it apart.
+/// </summary>
+/// <param name="line">The line, without line ending.</param>
+/// <param name="length">Its length.</param>
+/// <param name="kind">Receives the frame's first character.</param>
+/// <param name="sequence">Receives the sequence number, unless the frame is unreadable.</param>
+/// <param name="payload">Receives where the payload starts, for intact frames.</param>
+/// <param name="payloadLength">Receives its length.</param>
+/// <returns>Whether the frame is intact, damaged or unreadable.</returns>
+BifrostArq::FrameStatus BifrostArq::ParseFrame(const char* line, size_t length, char& kind, unsigned& sequence, const char*& payload, size_t& payloadLength)
+{
+    // The shortest frame is "!1f*47ae".
+    if (length < 8 || (line[0] != '@' && line[0] != '$' && line[0] != '!'))
+        return FrameUnreadable;
+    kind = line[0];
+    if (!ParseHex(line + 1, 2, sequence))
+        return FrameUnreadable;
+
+    unsigned crc;
+    const size_t body = length - 5;
+    if (line[body] != '*' || !ParseHex(line + body + 1, 4, crc) || Crc16(line, body) != crc)
+        return FrameDamaged;
+
+    if (body == 3) {
+        payload = line + body;
+        payloadLength = 0;
+    }
+    else {
+        if (line[3] != ' ')
+            return FrameDamaged;
+        payload = line + 4;
+        payloadLength = body - 4;
+    }
+    return FrameIntact;
+}
+
+/// <summary>
+/// Constructor for the BifrostArq class.
+/// </summary>
+/// <param name="maxWindow">Requests out at once (1 to kMaxWindow).</param>
+BifrostArq::BifrostArq(size_t maxWindow)
+{
+    window = maxWindow < 1 ? 1 : (maxWindow > kMaxWindow ? kMaxWindow : maxWindow);
+    base = 0;
+    transmissions = 0;
+    lastReply = 0;
+    backoff = 0;
+    retransmitted = 0;
+    duplicates = 0;
+    damaged = 0;
+}
+
+/// <summary>
+/// Gets the number of requests out at once.
+/// </summary>
+size_t BifrostArq::Window() const
+{
+    return window;
+}
+
+/// <summary>
+/// Gets whether no more requests can be sent until a reply is delivered.
+/// </summary>
+bool BifrostArq::Full() const
+{
+    return frames.size() >= window;
+}
+
+/// <summary>
+/// Gets whether any request sent is still unanswered.
+/// </summary>
+bool BifrostArq::Waiting() const
+{
+    for (size_t i = 0; i < frames.size(); i++) {
+        if (!frames[i].answered)
+            return true;
+    }
+    return false;
+}
+
+/// <summary>
+/// Gets whether any unanswered request has been sent more than once.
+/// </summary>
+bool BifrostArq::Retransmitting() const
+{
+    for (size_t i = 0; i < frames.size(); i++) {
+        if (!frames[i].answered && frames[i].attempts > 1)
+            return true;
+    }
+    return false;
+}
+
+/// <summary>
+/// Frames one request and appends it to what is about to be written.
+/// </summary>
+/// <param name="line">The request, without its newline.</param>
+/// <param name="length">Its length.</param>
+/// <param name="now">BifrostMetrics::Now().</param>
+/// <param name="out">Receives the frame and its "\n".</param>
+void BifrostArq::Send(const char* line, size_t length, unsigned long long now, std::string& out)
+{
+    Frame frame;
+    AppendFrame('@', base + (unsigned)frames.size(), line, length, frame.request);
+    frame.request.push_back('\n');
+    frame.answered = false;
+    frame.attempts = 1;
+    frame.transmission = ++transmissions;
+
+    // The clock for the first reply starts with the first request out.
+    if (!Waiting())
+        lastReply = now;
+
+    out.append(frame.request);
+    frames.push_back(frame);
+}
+
+/// <summary>
+/// Handles one line received from the board.
+/// </summary>
+/// <param name="line">The line, without line ending.</param>
+/// <param name="now">BifrostMetrics::Now().</param>
+/// <param name="out">Receives the requests to send again.</param>
+/// <returns>False if a request ran out of attempts.</returns>
+bool BifrostArq::Receive(const std::string& line, unsigned long long now, std::string& out)
+{
+    char kind;
+    unsigned sequence;
+    const char* payload;
+    size_t payloadLength;
+    if (ParseFrame(line.data(), line.size(), kind, sequence, payload, payloadLength) != FrameIntact || kind == '@') {
+        damaged++;
+        return true;
+    }
+
+    const size_t index = (sequence - base) % kSequences;
+    if (index >= frames.size() || frames[index].answered) {
+        duplicates++;
+        return true;
+    }
+
+    // The board received this request damaged.
+    if (kind == '!')
+        return Resend(index, out);
+
+    Frame& frame = frames[index];
+    frame.reply.assign(payload, payloadLength);
+    frame.answered = true;
+    lastReply = now;
+    backoff = 0;
+
+    // Whatever was sent before this request and is still unanswered won't be.
+    for (size_t i = 0; i < frames.size(); i++) {
+        if (!frames[i].answered && frames[i].transmission < frame.transmission && !Resend(i, out))
+            return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Gets the time until Expire would send something again.
+/// </summary>
+/// <param name="now">BifrostMetrics::Now().</param>
+/// <param name="timeoutMicros">Bifrost's reply timeout.</param>
+/// <returns>Microseconds, 0 if due; timeoutMicros when nothing is unanswered.</returns>
+unsigned long long BifrostArq::TimeLeft(unsigned long long now, unsigned long long timeoutMicros) const
+{
+    if (!Waiting())
+        return timeoutMicros;
+
+    const unsigned long long deadline = lastReply + (timeoutMicros << backoff);
+    return deadline > now ? deadline - now : 0;
+}
+
+/// <summary>
+/// Sends the oldest unanswered request again once the timeout has passed.
+/// </summary>
+/// <param name="now">BifrostMetrics::Now().</param>
+/// <param name="timeoutMicros">Bifrost's reply timeout.</param>
+/// <param name="out">Receives the request to send again.</param>
+/// <returns>False if it ran out of attempts.</returns>
+bool BifrostArq::Expire(unsigned long long now, unsigned long long timeoutMicros, std::string& out)
+{
+    if (TimeLeft(now, timeoutMicros) > 0)
+        return true;
+
+    // Replies come back in the order the board received the requests, so
+    // the reply to this one shows which of the others were lost too.
+    for (size_t i = 0; i < frames.size(); i++) {
+        if (!frames[i].answered) {
+            if (backoff < kMaxBackoff)
+                backoff++;
+            lastReply = now;
+            return Resend(i, out);
+        }
+    }
+    return true;
+}
+
+/// <summary>
+/// Takes the next reply in request order.
+/// </summary>
+/// <param name="reply">Receives the reply's payload.</param>
+/// <returns>False if it hasn't arrived yet.</returns>
+bool BifrostArq::Deliver(std::string& reply)
+{
+    if (frames.empty() || !frames.front().answered)
+        return false;
+
+    reply.swap(frames.front().reply);
+    frames.pop_front();
+    base = (base + 1) % kSequences;
+    return true;
+}
+
+/// <summary>
+/// Gets the number of requests sent again.
+/// </summary>
+unsigned long long BifrostArq::Retransmitted() const
+{
+    return retransmitted;
+}
+
+/// <summary>
+/// Gets the number of replies dropped because their request was already answered.
+/// </summary>
+unsigned long long BifrostArq::Duplicates() const
+{
+    return duplicates;
+}
+
+/// <summary>
+/// Gets the number of received lines that were damaged or not frames.
+/// </summary>
+unsigned long long BifrostArq::Damaged() const
+{
+    return damaged;
+}
+
+/// <summary>
+/// Sends one request again.
+/// </summary>
+/// <returns>False if it has been sent kMaxAttempts times already.</returns>
+bool BifrostArq::Resend(size_t index, std::string& out)
+{
+    Frame& frame = frames[index];
+    if (frame.attempts >= kMaxAttempts)
+        return false;
+
+    frame.attempts++;
+    frame.transmission = ++transmissions;
+    out.append(frame.request);
+    retransmitted++;
+    return true;
+}
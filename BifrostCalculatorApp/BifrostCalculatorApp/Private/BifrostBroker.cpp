@@ -0,0 +1,855 @@
+//BifrostBroker.cpp
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <unordered_map>
+
+#include <windows.h>
+#include "../public/BifrostBroker.h"
+#include "../public/BifrostPipeline.h"
+#include "../public/SharedRing.h"
+
+namespace {
+
+    // Sent instead of a reply once the link has failed. It contains "nan" like
+    // every other error reply, so clients treat it as an error.
+    const char kLinkError[] = "nanLink error";
+
+    // Sent instead of a reply when the request's deadline can't be met.
+    const char kDeadlineError[] = "nanDeadline exceeded";
+
+    // Replies to the control lines.
+    const char kControlOk[] = "ok";
+    const char kControlError[] = "nanUnknown control line";
+
+    // Sent instead of a reply to a framed request (see BifrostArq.h). The
+    // board keeps replies by sequence number, which every client starts at
+    // 0, so clients' frames must not reach it through one link.
+    const char kFramingError[] = "nanFramed requests aren't forwarded";
+
+    // A client's keepalive, answered by the broker itself so that it is never
+    // queued behind the board's work.
+    const char kPing[] = "ping";
+    const char kPong[] = "pong";
+
+    // A client that doesn't read its replies for this long is disconnected,
+    // rather than holding up the replies of every other client.
+    const DWORD kWriteTimeoutMs = 5000;
+
+    /// <summary>
+    /// Same characters Arduino's String::trim removes.
+    /// </summary>
+    bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+    }
+
+    /// <summary>
+    /// Trims a request like the firmware does before evaluating it.
+    /// </summary>
+    void Trim(std::string& text)
+    {
+        size_t last = text.size();
+        while (last > 0 && IsSpace(text[last - 1]))
+            last--;
+        size_t first = 0;
+        while (first < last && IsSpace(text[first]))
+            first++;
+        text.erase(last);
+        text.erase(0, first);
+    }
+
+    /// <summary>
+    /// Removes the reliable window ("arq=8") from the board's answer to "id",
+    /// so a client's Bifrost::StartReliable keeps to the plain protocol.
+    /// </summary>
+    std::string ClientIdentity(const std::string& identity)
+    {
+        std::string answer(identity);
+        size_t field = answer.find(" arq=");
+        if (field != std::string::npos)
+            answer.erase(field, answer.find(' ', field + 1) - field);
+        return answer;
+    }
+
+    // Replies received in the last few milliseconds, by request text.
+    class RecentReplies {
+    public:
+        explicit RecentReplies(DWORD windowMs) : windowMicros(windowMs * 1000ULL) {}
+
+        void Add(const std::string& text, const std::string& reply)
+        {
+            if (windowMicros == 0)
+                return;
+            Entry& entry = replies[text];
+            entry.reply = reply;
+            entry.at = BifrostMetrics::Now();
+            expiry.push_back(std::make_pair(entry.at, text));
+        }
+
+        // The reply for text if it arrived within the window, or NULL.
+        const std::string* Find(const std::string& text) const
+        {
+            std::unordered_map<std::string, Entry>::const_iterator found = replies.find(text);
+            if (found == replies.end() || BifrostMetrics::MicrosSince(found->second.at) > windowMicros)
+                return NULL;
+            return &found->second.reply;
+        }
+
+        // Forgets the replies older than the window, oldest first.
+        void Expire()
+        {
+            while (!expiry.empty() && BifrostMetrics::MicrosSince(expiry.front().first) > windowMicros) {
+                std::unordered_map<std::string, Entry>::iterator found = replies.find(expiry.front().second);
+                // A later reply for the same text has its own expiry entry.
+                if (found != replies.end() && found->second.at == expiry.front().first)
+                    replies.erase(found);
+                expiry.pop_front();
+            }
+        }
+
+    private:
+        struct Entry {
+            std::string reply;
+            unsigned long long at;  // BifrostMetrics::Now() when the reply arrived.
+        };
+
+        unsigned long long windowMicros;
+        std::unordered_map<std::string, Entry> replies;
+        std::deque<std::pair<unsigned long long, std::string> > expiry;
+    };
+
+    /// <summary>
+    /// Waits for an overlapped operation on a pipe to finish. It is cancelled
+    /// if stop is signalled or the timeout elapses first.
+    /// </summary>
+    /// <param name="started">What the call that started the operation returned.</param>
+    /// <returns>True if the operation succeeded.</returns>
+    bool Complete(HANDLE pipe, OVERLAPPED& overlapped, BOOL started, HANDLE stop, DWORD timeoutMs, DWORD& bytes)
+    {
+        bytes = 0;
+        if (!started && GetLastError() != ERROR_IO_PENDING)
+            return false;
+
+        HANDLE events[2] = { overlapped.hEvent, stop };
+        if (WaitForMultipleObjects(2, events, FALSE, timeoutMs) != WAIT_OBJECT_0)
+            CancelIoEx(pipe, &overlapped);
+        return GetOverlappedResult(pipe, &overlapped, &bytes, TRUE) != FALSE;
+    }
+}
+
+/// <summary>
+/// Constructor for the BifrostBroker class.
+/// </summary>
+BifrostBroker::BifrostBroker()
+{
+    link = NULL;
+    depth = 8;
+    batchSize = 4;
+    coalesceWindowMs = 10;
+    acceptThread = NULL;
+    forwardThread = NULL;
+    listening = INVALID_HANDLE_VALUE;
+    stopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    stopping = 0;
+    linkFailed = 0;
+    requests = 0;
+    forwarded = 0;
+    deduplicated = 0;
+    coalesced = 0;
+    InitializeSRWLock(&lock);
+}
+
+/// <summary>
+/// Destructor. Stops the broker if still running.
+/// </summary>
+BifrostBroker::~BifrostBroker()
+{
+    Stop();
+    if (stopEvent != NULL)
+        CloseHandle(stopEvent);
+}
+
+/// <summary>
+/// Creates the pipe and starts accepting clients and forwarding their requests.
+/// </summary>
+/// <param name="boardLink">An open link to the board. It must outlive the broker.</param>
+/// <param name="name">Pipe to serve, e.g. L"\\\\.\\pipe\\bifrost".</param>
+/// <param name="maxDepth">Requests kept in flight on the link.</param>
+/// <param name="maxBatch">Requests written together.</param>
+/// <returns>True if the broker is running.</returns>
+bool BifrostBroker::Start(Bifrost& boardLink, const std::wstring& name, size_t maxDepth, size_t maxBatch)
+{
+    Stop();
+    if (stopEvent == NULL)
+        return false;
+
+    link = &boardLink;
+    pipeName = name;
+    depth = maxDepth;
+    batchSize = maxBatch;
+    stopping = 0;
+    linkFailed = 0;
+    requests = 0;
+    forwarded = 0;
+    deduplicated = 0;
+    coalesced = 0;
+    ResetEvent(stopEvent);
+    scheduler.Reopen();
+
+    // Creating the first instance here rather than on the thread, so a client
+    // can connect as soon as Start returns.
+    listening = CreateInstance();
+    if (listening == INVALID_HANDLE_VALUE)
+        return false;
+
+    forwardThread = CreateThread(NULL, 0, ForwardProc, this, 0, NULL);
+    acceptThread = forwardThread != NULL ? CreateThread(NULL, 0, AcceptProc, this, 0, NULL) : NULL;
+    if (acceptThread == NULL) {
+        Stop();
+        return false;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Sets how long a reply is reused for identical requests.
+/// </summary>
+/// <param name="milliseconds">The window, or 0 to only merge requests in flight together.</param>
+void BifrostBroker::SetCoalesceWindow(DWORD milliseconds)
+{
+    coalesceWindowMs = milliseconds;
+}
+
+/// <summary>
+/// Sets how many requests each priority class can queue.
+/// </summary>
+void BifrostBroker::SetQueueCapacity(size_t capacity)
+{
+    scheduler.SetCapacity(capacity);
+}
+
+/// <summary>
+/// Stops accepting, disconnects every client and stops the forwarding thread.
+/// </summary>
+void BifrostBroker::Stop()
+{
+    InterlockedExchange(&stopping, 1);
+    if (stopEvent != NULL)
+        SetEvent(stopEvent);
+
+    // Every wait on a client pipe (and on the next client) ends with stopEvent.
+    if (acceptThread != NULL) {
+        WaitForSingleObject(acceptThread, INFINITE);
+        CloseHandle(acceptThread);
+        acceptThread = NULL;
+    }
+    if (listening != INVALID_HANDLE_VALUE) {
+        CloseHandle(listening);
+        listening = INVALID_HANDLE_VALUE;
+    }
+
+    // Also wakes client threads held back by a full queue.
+    scheduler.Close();
+
+    // Client threads remove themselves from the list as they end.
+    for (;;) {
+        AcquireSRWLockShared(&lock);
+        bool none = clients.empty();
+        ReleaseSRWLockShared(&lock);
+        if (none)
+            break;
+        Sleep(1);
+    }
+
+    // The forwarding thread may be blocked reading the link.
+    if (forwardThread != NULL) {
+        while (WaitForSingleObject(forwardThread, 10) == WAIT_TIMEOUT)
+            CancelSynchronousIo(forwardThread);
+        CloseHandle(forwardThread);
+        forwardThread = NULL;
+    }
+
+    std::vector<ScheduledRequest> dropped;
+    scheduler.TakeAll(dropped);
+    for (size_t i = 0; i < dropped.size(); i++)
+        Release(static_cast<Client*>(dropped[i].context));
+}
+
+/// <summary>
+/// Gets the number of clients connected right now.
+/// </summary>
+size_t BifrostBroker::Clients()
+{
+    AcquireSRWLockShared(&lock);
+    size_t count = clients.size();
+    ReleaseSRWLockShared(&lock);
+    return count;
+}
+
+/// <summary>
+/// Tells whether the link to the board still works.
+/// </summary>
+bool BifrostBroker::LinkHealthy() const
+{
+    return linkFailed == 0;
+}
+
+/// <summary>
+/// Gets the number of requests received from clients so far.
+/// </summary>
+unsigned long long BifrostBroker::Requests() const
+{
+    return (unsigned long long)requests;
+}
+
+/// <summary>
+/// Gets the number of requests forwarded to the board so far.
+/// </summary>
+unsigned long long BifrostBroker::Forwarded() const
+{
+    return (unsigned long long)forwarded;
+}
+
+/// <summary>
+/// Gets the number of requests that waited for an identical request already in flight.
+/// </summary>
+unsigned long long BifrostBroker::Deduplicated() const
+{
+    return (unsigned long long)deduplicated;
+}
+
+/// <summary>
+/// Gets the number of requests answered with a reply from the coalescing window.
+/// </summary>
+unsigned long long BifrostBroker::Coalesced() const
+{
+    return (unsigned long long)coalesced;
+}
+
+/// <summary>
+/// Gets the number of requests answered with "nanDeadline exceeded".
+/// </summary>
+unsigned long long BifrostBroker::Late() const
+{
+    return scheduler.Late();
+}
+
+/// <summary>
+/// Gets the number of requests waiting for the link in a priority class.
+/// </summary>
+size_t BifrostBroker::Queued(BifrostPriority priority)
+{
+    return scheduler.Queued(priority);
+}
+
+/// <summary>
+/// Creates one more instance of the pipe, for the next client to connect to.
+/// </summary>
+/// <returns>The instance, or INVALID_HANDLE_VALUE.</returns>
+HANDLE BifrostBroker::CreateInstance()
+{
+    // Local clients only: the pipe is a stand-in for a port on this machine.
+    return CreateNamedPipeW(pipeName.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        PIPE_UNLIMITED_INSTANCES, 4096, 4096, 0, NULL);
+}
+
+/// <summary>
+/// Accept thread entry point.
+/// </summary>
+DWORD WINAPI BifrostBroker::AcceptProc(LPVOID parameter)
+{
+    static_cast<BifrostBroker*>(parameter)->Accept();
+    return 0;
+}
+
+/// <summary>
+/// Client thread entry point. Serves the client, then lets go of it.
+/// </summary>
+DWORD WINAPI BifrostBroker::ClientProc(LPVOID parameter)
+{
+    Client* client = static_cast<Client*>(parameter);
+    BifrostBroker* owner = client->owner;
+    owner->Serve(*client);
+
+    AcquireSRWLockExclusive(&owner->lock);
+    owner->clients.erase(std::find(owner->clients.begin(), owner->clients.end(), client));
+    ReleaseSRWLockExclusive(&owner->lock);
+
+    Release(client);
+    return 0;
+}
+
+/// <summary>
+/// Forwarding thread entry point.
+/// </summary>
+DWORD WINAPI BifrostBroker::ForwardProc(LPVOID parameter)
+{
+    static_cast<BifrostBroker*>(parameter)->Forward();
+    return 0;
+}
+
+/// <summary>
+/// Waits for clients and starts a thread for each of them.
+/// </summary>
+void BifrostBroker::Accept()
+{
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL)
+        return;
+
+    while (!stopping) {
+        if (listening == INVALID_HANDLE_VALUE) {
+            listening = CreateInstance();
+            if (listening == INVALID_HANDLE_VALUE) {
+                Sleep(100);
+                continue;
+            }
+        }
+
+        DWORD bytes;
+        BOOL started = ConnectNamedPipe(listening, &overlapped);
+        BOOL connected = (!started && GetLastError() == ERROR_PIPE_CONNECTED)
+            || Complete(listening, overlapped, started, stopEvent, INFINITE, bytes);
+        if (!connected) {
+            if (stopping)
+                break;
+            // The client gave up before it was accepted; starting over with a fresh instance.
+            CloseHandle(listening);
+            listening = INVALID_HANDLE_VALUE;
+            continue;
+        }
+
+        Client* client = new Client();
+        client->owner = this;
+        client->pipe = listening;
+        client->references = 1;
+        client->writeEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        client->priority = PriorityInteractive;
+        client->budgetMicros = 0;
+        client->sent = 0;
+        client->answered = 0;
+        client->shared = NULL;
+        client->sharedFrom = MAXLONG64;
+        listening = INVALID_HANDLE_VALUE;
+
+        // Started suspended so the handle is in the list before the thread can remove it.
+        client->thread = client->writeEvent != NULL ? CreateThread(NULL, 0, ClientProc, client, CREATE_SUSPENDED, NULL) : NULL;
+        if (client->thread == NULL) {
+            if (client->writeEvent != NULL)
+                CloseHandle(client->writeEvent);
+            CloseHandle(client->pipe);
+            delete client;
+            continue;
+        }
+
+        AcquireSRWLockExclusive(&lock);
+        clients.push_back(client);
+        ReleaseSRWLockExclusive(&lock);
+        ResumeThread(client->thread);
+    }
+
+    CloseHandle(overlapped.hEvent);
+}
+
+/// <summary>
+/// Reads request lines from one client until it disconnects: from its pipe,
+/// and from its shared-memory channel once it has asked for one.
+/// </summary>
+void BifrostBroker::Serve(Client& client)
+{
+    std::string pending;
+    char chunk[512];
+    bool reading = false;
+
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL)
+        return;
+
+    while (!stopping) {
+        // A read stays pending on the pipe even after the switch to shared
+        // memory: its completion is how a disconnect shows up.
+        if (!reading) {
+            if (!ReadFile(client.pipe, chunk, sizeof(chunk), NULL, &overlapped) && GetLastError() != ERROR_IO_PENDING)
+                break;
+            reading = true;
+        }
+
+        SharedRing* requests = client.shared != NULL ? &client.shared->Requests() : NULL;
+        if (requests != NULL) {
+            if (!ServeShared(client))
+                break;
+            // Something arrived since the ring was drained.
+            if (!requests->Arm())
+                continue;
+        }
+
+        HANDLE handles[3] = { overlapped.hEvent, stopEvent, requests != NULL ? requests->DataEvent() : NULL };
+        DWORD signalled = WaitForMultipleObjects(requests != NULL ? 3 : 2, handles, FALSE, INFINITE);
+        if (requests != NULL)
+            requests->Disarm();
+
+        if (signalled != WAIT_OBJECT_0)
+            continue;  // Stopping, or requests on the shared channel.
+
+        DWORD bytesRead = 0;
+        reading = false;
+        if (!GetOverlappedResult(client.pipe, &overlapped, &bytesRead, FALSE) || bytesRead == 0)
+            break;
+
+        pending.append(chunk, bytesRead);
+
+        size_t lineStart = 0;
+        size_t newline;
+        bool open = true;
+        while (open && (newline = pending.find('\n', lineStart)) != std::string::npos) {
+            open = Enqueue(client, pending.data() + lineStart, newline - lineStart);
+            lineStart = newline + 1;
+        }
+        if (!open)
+            break;
+        pending.erase(0, lineStart);
+    }
+
+    if (reading) {
+        DWORD bytesRead;
+        CancelIoEx(client.pipe, &overlapped);
+        GetOverlappedResult(client.pipe, &overlapped, &bytesRead, TRUE);
+    }
+    CloseHandle(overlapped.hEvent);
+}
+
+/// <summary>
+/// Queues every request waiting on a client's shared-memory channel.
+/// </summary>
+/// <returns>False if the broker is stopping.</returns>
+bool BifrostBroker::ServeShared(Client& client)
+{
+    SharedRing& requests = client.shared->Requests();
+
+    // Each line is read in place from the slot; Enqueue makes the only copy.
+    const char* text;
+    size_t length;
+    while (requests.Front(text, length)) {
+        bool open = Enqueue(client, text, length);
+        requests.Pop();
+        if (!open)
+            return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Queues one request for the forwarding thread, waiting while the client's
+/// priority class is full.
+/// </summary>
+/// <param name="client">The client the reply goes back to.</param>
+/// <param name="text">The request line, without its newline.</param>
+/// <param name="length">Length of the line.</param>
+/// <returns>False if the broker is stopping.</returns>
+bool BifrostBroker::Enqueue(Client& client, const char* text, size_t length)
+{
+    ScheduledRequest request;
+    request.context = &client;
+    request.sequence = client.sent;
+    request.text.assign(text, length);
+    request.answered = false;
+    request.budgetMicros = client.budgetMicros;
+
+    // Control lines are answered here but still queued, so that the reply
+    // comes after those of the requests sent before them.
+    BifrostPriority priority = client.priority;
+    size_t first = 0;
+    while (first < length && IsSpace(text[first]))
+        first++;
+    if (!request.text.empty() && request.text[0] == '#') {
+        request.text = Control(client, request.text, request.sequence) ? kControlOk : kControlError;
+        request.answered = true;
+        priority = PriorityInteractive;
+    }
+    else if (first < length && text[first] == '@') {
+        request.text = kFramingError;
+        request.answered = true;
+        priority = PriorityInteractive;
+    }
+    else {
+        std::string trimmed = request.text;
+        Trim(trimmed);
+        if (trimmed == kPing) {
+            request.text = kPong;
+            request.answered = true;
+            priority = PriorityInteractive;
+        }
+    }
+
+    // The reply may be written after the client's thread has ended.
+    InterlockedIncrement(&client.references);
+    if (!scheduler.Push(priority, request)) {
+        InterlockedDecrement(&client.references);
+        return false;
+    }
+    client.sent++;
+    return true;
+}
+
+/// <summary>
+/// Applies a control line ("#priority bulk", "#deadline 50", "#shm name") to a client.
+/// </summary>
+/// <param name="client">The client that sent it.</param>
+/// <param name="line">The control line.</param>
+/// <param name="sequence">The line's place among the client's requests.</param>
+/// <returns>False if the line isn't a known control line (or can't be applied).</returns>
+bool BifrostBroker::Control(Client& client, const std::string& line, unsigned long long sequence)
+{
+    if (line.compare(0, 10, "#priority ") == 0) {
+        std::string value = line.substr(10);
+        Trim(value);
+        if (value == "interactive")
+            client.priority = PriorityInteractive;
+        else if (value == "bulk")
+            client.priority = PriorityBulk;
+        else
+            return false;
+        return true;
+    }
+
+    if (line.compare(0, 10, "#deadline ") == 0) {
+        const char* value = line.c_str() + 10;
+        char* end;
+        unsigned long milliseconds = std::strtoul(value, &end, 10);
+        if (end == value)
+            return false;
+        client.budgetMicros = milliseconds * 1000ULL;
+        return true;
+    }
+
+    if (line.compare(0, 5, "#shm ") == 0 && client.shared == NULL) {
+        std::string name = line.substr(5);
+        Trim(name);
+        SharedChannel* channel = new SharedChannel();
+        if (name.empty() || !channel->Open(std::wstring(name.begin(), name.end()))) {
+            delete channel;
+            return false;
+        }
+
+        // The "ok" still goes over the pipe; every later reply goes to the channel.
+        client.shared = channel;
+        InterlockedExchange64(&client.sharedFrom, (LONG64)sequence + 1);
+        return true;
+    }
+
+    return false;
+}
+
+/// <summary>
+/// Feeds queued requests into the pipeline and routes the replies back,
+/// until the broker stops. Identical requests share one board request.
+/// </summary>
+void BifrostBroker::Forward()
+{
+    BifrostPipeline pipeline(*link, depth, batchSize);
+    RecentReplies recent(coalesceWindowMs);
+
+    // Board requests in flight, oldest first: the board answers in order.
+    // Elements stay put in a deque while others are added and removed at
+    // the ends, so inFlightByText can point at them.
+    std::deque<Pending> inFlight;
+    std::unordered_map<std::string, Pending*> inFlightByText;
+
+    // Average time between two replies while the board is busy, to tell how
+    // long a request sent now would wait for its reply.
+    unsigned long long replyMicros = 0;
+    unsigned long long lastReply = 0;
+
+    pipeline.SetCompletion([&](unsigned long long, const std::string& reply) {
+        if (lastReply != 0) {
+            unsigned long long sample = BifrostMetrics::MicrosSince(lastReply);
+            replyMicros = replyMicros == 0 ? sample : (7 * replyMicros + sample) / 8;
+        }
+        lastReply = inFlight.size() > 1 ? BifrostMetrics::Now() : 0;
+
+        // The reliable protocol ends here: clients are told the board has none.
+        Pending& pending = inFlight.front();
+        std::string identity;
+        const std::string& answer = pending.text == "id" ? (identity = ClientIdentity(reply)) : reply;
+        Answer(pending, answer);
+        inFlightByText.erase(pending.text);
+        recent.Add(pending.text, answer);
+        inFlight.pop_front();
+    });
+
+    ScheduledRequest request;
+    std::vector<ScheduledRequest> late;
+    unsigned long long id = 0;
+
+    while (!stopping) {
+        // Filling the free slots of the pipeline, most urgent first. Bulk
+        // requests leave the last slot free (unless there is only one), so an
+        // interactive request is sent as soon as it arrives. Only an idle
+        // broker blocks here.
+        for (;;) {
+            const size_t busy = inFlight.size();
+            if (busy >= depth && !linkFailed)
+                break;
+            BifrostPriority lowest = busy + 1 < depth || depth <= 1 || linkFailed ? PriorityBulk : PriorityInteractive;
+
+            late.clear();
+            bool taken = scheduler.Pop(request, lowest, (busy + 1) * replyMicros, late, busy == 0 ? INFINITE : 0);
+            InterlockedExchangeAdd64(&requests, (LONG64)late.size());
+            for (size_t i = 0; i < late.size(); i++) {
+                Client* client = static_cast<Client*>(late[i].context);
+                Deliver(*client, late[i].sequence, kDeadlineError);
+                Release(client);
+            }
+            if (!taken) {
+                if (late.empty() || stopping)
+                    break;
+                continue;
+            }
+
+            Client* client = static_cast<Client*>(request.context);
+            if (request.answered) {
+                Deliver(*client, request.sequence, request.text);
+                Release(client);
+                continue;
+            }
+
+            InterlockedIncrement64(&requests);
+            if (linkFailed) {
+                Deliver(*client, request.sequence, kLinkError);
+                Release(client);
+                continue;
+            }
+
+            Trim(request.text);
+            Waiter waiter = { client, request.sequence };
+
+            const std::string* reply = recent.Find(request.text);
+            if (reply != NULL) {
+                Deliver(*client, request.sequence, *reply);
+                Release(client);
+                InterlockedIncrement64(&coalesced);
+                continue;
+            }
+
+            std::unordered_map<std::string, Pending*>::iterator found = inFlightByText.find(request.text);
+            if (found != inFlightByText.end()) {
+                found->second->waiters.push_back(waiter);
+                InterlockedIncrement64(&deduplicated);
+                continue;
+            }
+
+            if (inFlight.empty())
+                lastReply = BifrostMetrics::Now();
+            inFlight.push_back(Pending());
+            Pending& pending = inFlight.back();
+            pending.text.swap(request.text);
+            pending.waiters.push_back(waiter);
+            inFlightByText[pending.text] = &pending;
+            InterlockedIncrement64(&forwarded);
+
+            // Never blocks: there is a free slot.
+            if (!pipeline.Submit(pending.text, id++))
+                InterlockedExchange(&linkFailed, 1);
+            if (linkFailed)
+                break;
+        }
+
+        // Nothing more can be sent: the batch is written now rather than when
+        // it fills up, and one reply is read before looking at the queues again.
+        if (!linkFailed && !inFlight.empty()) {
+            if (!pipeline.Flush() || !pipeline.ReceiveOne())
+                InterlockedExchange(&linkFailed, 1);
+        }
+
+        if (linkFailed) {
+            for (size_t i = 0; i < inFlight.size(); i++)
+                Answer(inFlight[i], kLinkError);
+            inFlight.clear();
+            inFlightByText.clear();
+        }
+    }
+
+    for (size_t i = 0; i < inFlight.size(); i++) {
+        for (size_t w = 0; w < inFlight[i].waiters.size(); w++)
+            Release(inFlight[i].waiters[w].client);
+    }
+}
+
+/// <summary>
+/// Writes a client's reply as soon as every earlier reply of that client has
+/// been written, holding it until then.
+/// </summary>
+/// <param name="client">The client.</param>
+/// <param name="sequence">Which of the client's requests this answers.</param>
+/// <param name="reply">The reply line, without "\r\n".</param>
+void BifrostBroker::Deliver(Client& client, unsigned long long sequence, const std::string& reply)
+{
+    if (sequence != client.answered) {
+        client.held[sequence] = reply;
+        return;
+    }
+
+    Reply(client, sequence, reply);
+    client.answered++;
+
+    std::map<unsigned long long, std::string>::iterator next;
+    while ((next = client.held.begin()) != client.held.end() && next->first == client.answered) {
+        Reply(client, next->first, next->second);
+        client.held.erase(next);
+        client.answered++;
+    }
+}
+
+/// <summary>
+/// Writes one reply line to a client. A client that has gone away (or stopped
+/// reading) is disconnected and otherwise ignored.
+/// </summary>
+void BifrostBroker::Reply(Client& client, unsigned long long sequence, const std::string& reply)
+{
+    if ((LONG64)sequence >= InterlockedCompareExchange64(&client.sharedFrom, 0, 0)) {
+        if (!client.shared->Replies().Push(reply.data(), reply.size(), kWriteTimeoutMs, client.owner->stopEvent))
+            DisconnectNamedPipe(client.pipe);
+        return;
+    }
+
+    std::string line = reply + "\r\n";
+
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = client.writeEvent;
+    DWORD bytesWritten;
+    BOOL started = WriteFile(client.pipe, line.c_str(), (DWORD)line.size(), NULL, &overlapped);
+    if (!Complete(client.pipe, overlapped, started, client.owner->stopEvent, kWriteTimeoutMs, bytesWritten))
+        DisconnectNamedPipe(client.pipe);  // Ends the client's read too.
+}
+
+/// <summary>
+/// Writes a reply to every client waiting for it and lets go of them.
+/// </summary>
+void BifrostBroker::Answer(Pending& pending, const std::string& reply)
+{
+    for (size_t i = 0; i < pending.waiters.size(); i++) {
+        Deliver(*pending.waiters[i].client, pending.waiters[i].sequence, reply);
+        Release(pending.waiters[i].client);
+    }
+    pending.waiters.clear();
+}
+
+/// <summary>
+/// Drops one reference to a client, closing its pipe after the last one.
+/// </summary>
+void BifrostBroker::Release(Client* client)
+{
+    if (InterlockedDecrement(&client->references) != 0)
+        return;
+
+    delete client->shared;
+    CloseHandle(client->pipe);
+    CloseHandle(client->writeEvent);
+    CloseHandle(client->thread);
+    delete client;
+}
@@ -0,0 +1,452 @@
+//BifrostDiscovery.cpp
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+
+#include <windows.h>
+#include "../public/BifrostDiscovery.h"
+#include "../public/Bifrost.h"
+
+namespace {
+
+    // How long one "id" waits for its answer before it is sent again.
+    const DWORD kProbeReplyMs = 300;
+
+    // Time given to each baud rate of a port. Opening the port resets many
+    // Arduinos, and their bootloader keeps the sketch from answering for
+    // up to two seconds.
+    const DWORD kBaudBudgetMs = 2500;
+
+    // The pipe bifrost_broker serves by default.
+    const wchar_t* const kBrokerPipe = L"\\\\.\\pipe\\bifrost";
+
+    // Where the cache lives under %LOCALAPPDATA%.
+    const wchar_t* const kCacheFolder = L"\\BifrostCalculator";
+    const wchar_t* const kCacheFile = L"\\board.txt";
+
+    // What every identity starts with.
+    const char kIdentityPrefix[] = "bifrost ";
+
+    // One Discover call, shared by its probing threads.
+    struct Search {
+        const std::vector<DWORD>* baudRates;
+        unsigned long long started;  // BifrostMetrics::Now() when it began.
+        DWORD deadlineMs;
+        volatile LONG stopping;  // Set when a board was found or the time is up.
+        volatile LONG running;  // Threads still probing; the last one sets done.
+        HANDLE done;
+        SRWLOCK lock;
+        bool found;  // Guarded by lock.
+        BifrostBoardInfo result;  // Guarded by lock.
+    };
+
+    // One port being probed.
+    struct PortProbe {
+        Search* search;
+        std::wstring port;
+        HANDLE thread;
+    };
+
+    /// <summary>
+    /// Tells whether a port is a pipe (possibly through shared memory), which has no baud rate.
+    /// </summary>
+    bool IsPipe(const std::wstring& port)
+    {
+        return _wcsnicmp(port.c_str(), L"\\\\.\\pipe\\", 9) == 0 || _wcsnicmp(port.c_str(), L"shm:", 4) == 0;
+    }
+
+    /// <summary>
+    /// Tells whether a line is the answer to "id".
+    /// </summary>
+    bool IsIdentity(const std::string& line)
+    {
+        return line.compare(0, sizeof(kIdentityPrefix) - 1, kIdentityPrefix) == 0;
+    }
+
+    /// <summary>
+    /// Sends "id" to a port until it answers, the time is up or stopping is set.
+    /// </summary>
+    /// <param name="stopping">Flag that ends the probe early, or NULL.</param>
+    bool ProbePort(const std::wstring& port, DWORD baudRate, DWORD timeoutMs, BifrostBoardInfo& info, const volatile LONG* stopping)
+    {
+        Bifrost link;
+        if (!link.Open(port.c_str(), baudRate))
+            return false;
+        link.SetReadTimeout(kProbeReplyMs);
+
+        const bool pipe = IsPipe(port);
+        const unsigned long long started = BifrostMetrics::Now();
+        const unsigned long long budget = 1000ULL * timeoutMs;
+        std::string line;
+        bool identified = false;
+
+        while (!identified && BifrostMetrics::MicrosSince(started) < budget && (stopping == NULL || !*stopping)) {
+            if (!link.WriteData("id\n"))
+                break;
+
+            // Whatever is at the end of a pipe answers every line, and a pipe
+            // read doesn't time out, so exactly one line is read there.
+            if (pipe) {
+                identified = link.ReadLine(line) && IsIdentity(line);
+                break;
+            }
+
+            // A serial port may also hold boot messages, noise at a wrong baud
+            // rate or answers to earlier attempts.
+            while (!identified && BifrostMetrics::MicrosSince(started) < budget && link.ReadLine(line))
+                identified = IsIdentity(line);
+        }
+        link.Close();
+
+        if (!identified)
+            return false;
+
+        info.port = port;
+        info.baudRate = baudRate;
+        info.identity = line;
+        return true;
+    }
+
+    /// <summary>
+    /// Thread entry point: probes one port at each baud rate until a board answers.
+    /// </summary>
+    DWORD WINAPI ProbeThread(LPVOID parameter)
+    {
+        PortProbe* probe = static_cast<PortProbe*>(parameter);
+        Search& search = *probe->search;
+
+        const size_t attempts = IsPipe(probe->port) ? 1 : search.baudRates->size();
+        for (size_t i = 0; i < attempts && !search.stopping; i++) {
+            const unsigned long long elapsedMs = BifrostMetrics::MicrosSince(search.started) / 1000;
+            if (elapsedMs >= search.deadlineMs)
+                break;
+            const DWORD remainingMs = search.deadlineMs - (DWORD)elapsedMs;
+
+            BifrostBoardInfo info;
+            if (ProbePort(probe->port, (*search.baudRates)[i], std::min(remainingMs, kBaudBudgetMs), info, &search.stopping)) {
+                AcquireSRWLockExclusive(&search.lock);
+                if (!search.found) {
+                    search.found = true;
+                    search.result = info;
+                }
+                ReleaseSRWLockExclusive(&search.lock);
+                SetEvent(search.done);
+                break;
+            }
+        }
+
+        if (InterlockedDecrement(&search.running) == 0)
+            SetEvent(search.done);
+        return 0;
+    }
+
+    /// <summary>
+    /// Gets the cache file's path, creating its folder when asked to.
+    /// </summary>
+    /// <returns>The path, or an empty string if %LOCALAPPDATA% isn't set.</returns>
+    std::wstring CachePath(bool createFolder)
+    {
+        wchar_t base[MAX_PATH];
+        DWORD length = GetEnvironmentVariableW(L"LOCALAPPDATA", base, MAX_PATH);
+        if (length == 0 || length >= MAX_PATH)
+            return std::wstring();
+
+        std::wstring folder = std::wstring(base, length) + kCacheFolder;
+        if (createFolder)
+            CreateDirectoryW(folder.c_str(), NULL);
+        return folder + kCacheFile;
+    }
+
+    /// <summary>
+    /// Converts text between UTF-8 and UTF-16.
+    /// </summary>
+    std::string Narrow(const std::wstring& text)
+    {
+        int length = WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), NULL, 0, NULL, NULL);
+        std::string narrow(length > 0 ? length : 0, '\0');
+        if (length > 0)
+            WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), &narrow[0], length, NULL, NULL);
+        return narrow;
+    }
+
+    std::wstring Widen(const std::string& text)
+    {
+        int length = MultiByteToWideChar(CP_UTF8, 0, text.c_str(), (int)text.size(), NULL, 0);
+        std::wstring wide(length > 0 ? length : 0, L'\0');
+        if (length > 0)
+            MultiByteToWideChar(CP_UTF8, 0, text.c_str(), (int)text.size(), &wide[0], length);
+        return wide;
+    }
+}
+
+/// <summary>
+/// Gets the protocol version the firmware reported.
+/// </summary>
+/// <returns>The version, or 0 if the identity doesn't have one.</returns>
+int BifrostBoardInfo::Firmware() const
+{
+    if (!IsIdentity(identity))
+        return 0;
+    return std::atoi(identity.c_str() + sizeof(kIdentityPrefix) - 1);
+}
+
+/// <summary>
+/// Tells whether the identity lists a capability.
+/// </summary>
+/// <param name="name">The capability, e.g. "arch".</param>
+bool BifrostBoardInfo::Has(const char* name) const
+{
+    const size_t nameLength = std::strlen(name);
+
+    // The words after "bifrost <version>".
+    size_t start = identity.find(' ', sizeof(kIdentityPrefix) - 1);
+    while (start != std::string::npos) {
+        start++;
+        size_t end = identity.find(' ', start);
+        size_t length = (end == std::string::npos ? identity.size() : end) - start;
+        if (length >= nameLength && identity.compare(start, nameLength, name) == 0
+            && (length == nameLength || identity[start + nameLength] == '='))
+            return true;
+        start = end;
+    }
+    return false;
+}
+
+/// <summary>
+/// Gets the value of a name=value capability.
+/// </summary>
+/// <param name="name">The capability, e.g. "baud".</param>
+/// <returns>The value, or an empty string if it isn't listed.</returns>
+std::string BifrostBoardInfo::Value(const char* name) const
+{
+    const std::string key = std::string(" ") + name + "=";
+    size_t start = identity.find(key, sizeof(kIdentityPrefix) - 2);
+    if (start == std::string::npos)
+        return std::string();
+    start += key.size();
+    size_t end = identity.find(' ', start);
+    return identity.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+
+/// <summary>
+/// Gets the baud rates Find tries, most likely first.
+/// </summary>
+std::vector<DWORD> BifrostDiscovery::DefaultBaudRates()
+{
+    // The firmware's own rate, then the usual faster ones.
+    const DWORD rates[] = { CBR_9600, CBR_115200, CBR_57600, CBR_38400, CBR_19200 };
+    return std::vector<DWORD>(rates, rates + sizeof(rates) / sizeof(rates[0]));
+}
+
+/// <summary>
+/// Lists the ports a board may be on.
+/// </summary>
+/// <returns>The broker's pipe if it is running, then COM1, COM2... as Bifrost::Open takes them.</returns>
+std::vector<std::wstring> BifrostDiscovery::CandidatePorts()
+{
+    std::vector<std::wstring> ports;
+
+    // A running broker owns the board's port, so its pipe is the way to the board.
+    if (WaitNamedPipeW(kBrokerPipe, 1) || GetLastError() == ERROR_SEM_TIMEOUT)
+        ports.push_back(kBrokerPipe);
+
+    // Every DOS device name, as a list of null-terminated strings.
+    std::vector<wchar_t> names(16384);
+    while (QueryDosDeviceW(NULL, names.data(), (DWORD)names.size()) == 0) {
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER || names.size() >= (1 << 22))
+            return ports;
+        names.resize(names.size() * 2);
+    }
+
+    std::vector<int> numbers;
+    for (const wchar_t* name = names.data(); *name != L'\0'; name += std::wcslen(name) + 1) {
+        if (_wcsnicmp(name, L"COM", 3) != 0 || name[3] == L'\0')
+            continue;
+        const wchar_t* digit = name + 3;
+        while (*digit >= L'0' && *digit <= L'9')
+            digit++;
+        if (*digit == L'\0')
+            numbers.push_back(std::wcstol(name + 3, NULL, 10));
+    }
+
+    std::sort(numbers.begin(), numbers.end());
+    for (size_t i = 0; i < numbers.size(); i++)
+        ports.push_back(L"\\\\.\\COM" + std::to_wstring(numbers[i]));
+    return ports;
+}
+
+/// <summary>
+/// Asks one port for the board's identity.
+/// </summary>
+/// <param name="port">The port, as Bifrost::Open takes it.</param>
+/// <param name="baudRate">Baud rate to open it at (ignored for pipes).</param>
+/// <param name="timeoutMs">How long to keep asking.</param>
+/// <param name="info">Receives the port, baud rate and identity.</param>
+/// <returns>True if a board answered.</returns>
+bool BifrostDiscovery::Probe(const std::wstring& port, DWORD baudRate, DWORD timeoutMs, BifrostBoardInfo& info)
+{
+    return ProbePort(port, baudRate, timeoutMs, info, NULL);
+}
+
+/// <summary>
+/// Probes every candidate port at once and returns the first board that answers.
+/// </summary>
+/// <param name="baudRates">Rates to try on each serial port, in order.</param>
+/// <param name="deadlineMs">How long the whole search may take.</param>
+/// <param name="found">Receives the board.</param>
+/// <returns>False if no board answered in time.</returns>
+bool BifrostDiscovery::Discover(const std::vector<DWORD>& baudRates, DWORD deadlineMs, BifrostBoardInfo& found)
+{
+    std::vector<std::wstring> ports = CandidatePorts();
+    if (ports.empty() || baudRates.empty())
+        return false;
+
+    Search search;
+    search.baudRates = &baudRates;
+    search.started = BifrostMetrics::Now();
+    search.deadlineMs = deadlineMs;
+    search.stopping = 0;
+    search.running = (LONG)ports.size();
+    search.done = CreateEventW(NULL, TRUE, FALSE, NULL);
+    InitializeSRWLock(&search.lock);
+    search.found = false;
+    if (search.done == NULL)
+        return false;
+
+    std::vector<PortProbe> probes(ports.size());
+    for (size_t i = 0; i < ports.size(); i++) {
+        probes[i].search = &search;
+        probes[i].port = ports[i];
+        probes[i].thread = CreateThread(NULL, 0, ProbeThread, &probes[i], 0, NULL);
+        if (probes[i].thread == NULL && InterlockedDecrement(&search.running) == 0)
+            SetEvent(search.done);
+    }
+
+    WaitForSingleObject(search.done, deadlineMs);
+    InterlockedExchange(&search.stopping, 1);
+
+    // The other probes may be blocked opening or reading their port.
+    for (size_t i = 0; i < probes.size(); i++) {
+        if (probes[i].thread == NULL)
+            continue;
+        while (WaitForSingleObject(probes[i].thread, 10) == WAIT_TIMEOUT)
+            CancelSynchronousIo(probes[i].thread);
+        CloseHandle(probes[i].thread);
+    }
+    CloseHandle(search.done);
+
+    if (search.found)
+        found = search.result;
+    return search.found;
+}
+
+/// <summary>
+/// Reads the board found last time from the cache.
+/// </summary>
+/// <param name="info">Receives the port, baud rate and identity.</param>
+/// <returns>False if there is no usable cache.</returns>
+bool BifrostDiscovery::LoadCache(BifrostBoardInfo& info)
+{
+    const std::wstring path = CachePath(false);
+    if (path.empty())
+        return false;
+
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    char buffer[1024];
+    DWORD bytesRead = 0;
+    BOOL read = ReadFile(file, buffer, sizeof(buffer), &bytesRead, NULL);
+    CloseHandle(file);
+    if (!read)
+        return false;
+
+    // One name=value per line: port, baud and identity.
+    BifrostBoardInfo cached;
+    cached.baudRate = 0;
+    std::string text(buffer, bytesRead);
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string line = text.substr(start, end - start);
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+
+        if (line.compare(0, 5, "port=") == 0)
+            cached.port = Widen(line.substr(5));
+        else if (line.compare(0, 5, "baud=") == 0)
+            cached.baudRate = std::strtoul(line.c_str() + 5, NULL, 10);
+        else if (line.compare(0, 9, "identity=") == 0)
+            cached.identity = line.substr(9);
+        start = end + 1;
+    }
+
+    if (cached.port.empty() || cached.baudRate == 0)
+        return false;
+    info = cached;
+    return true;
+}
+
+/// <summary>
+/// Remembers a board for the next launch.
+/// </summary>
+/// <returns>False if the cache couldn't be written.</returns>
+bool BifrostDiscovery::SaveCache(const BifrostBoardInfo& info)
+{
+    const std::wstring path = CachePath(true);
+    if (path.empty())
+        return false;
+
+    const std::string text = "port=" + Narrow(info.port) + "\nbaud=" + std::to_string(info.baudRate) + "\nidentity=" + info.identity + "\n";
+
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    DWORD bytesWritten = 0;
+    BOOL written = WriteFile(file, text.data(), (DWORD)text.size(), &bytesWritten, NULL);
+    CloseHandle(file);
+    return written && bytesWritten == text.size();
+}
+
+/// <summary>
+/// Finds the board: the cached one if it still answers, otherwise whichever
+/// candidate port answers first. Caches the result.
+/// </summary>
+/// <param name="deadlineMs">How long the whole search may take.</param>
+/// <param name="found">Receives the board.</param>
+/// <returns>False if no board answered in time.</returns>
+bool BifrostDiscovery::Find(DWORD deadlineMs, BifrostBoardInfo& found)
+{
+    const unsigned long long started = BifrostMetrics::Now();
+    std::vector<DWORD> baudRates = DefaultBaudRates();
+
+    BifrostBoardInfo cached;
+    if (LoadCache(cached)) {
+        if (Probe(cached.port, cached.baudRate, std::min(deadlineMs, kBaudBudgetMs), found)) {
+            if (found.identity != cached.identity)
+                SaveCache(found);
+            return true;
+        }
+
+        // The board may have moved to another port at the same rate.
+        std::vector<DWORD>::iterator rate = std::find(baudRates.begin(), baudRates.end(), cached.baudRate);
+        if (rate != baudRates.end())
+            baudRates.erase(rate);
+        baudRates.insert(baudRates.begin(), cached.baudRate);
+    }
+
+    const unsigned long long elapsedMs = BifrostMetrics::MicrosSince(started) / 1000;
+    if (elapsedMs >= deadlineMs)
+        return false;
+    if (!Discover(baudRates, deadlineMs - (DWORD)elapsedMs, found))
+        return false;
+
+    SaveCache(found);
+    return true;
+}
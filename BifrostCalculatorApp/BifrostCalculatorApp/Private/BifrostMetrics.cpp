@@ -0,0 +1,238 @@
+//BifrostMetrics.cpp
+
+#include <windows.h>
+#include "../public/BifrostMetrics.h"
+
+namespace {
+
+    // The performance counter frequency is fixed at boot, so it is read only once.
+    LONG64 QueryFrequency()
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        return frequency.QuadPart;
+    }
+
+    const LONG64 kFrequency = QueryFrequency();
+
+    BifrostMetrics globalMetrics;
+}
+
+/// <summary>
+/// Constructor for the LatencyHistogram class.
+/// Starts with every bucket empty.
+/// </summary>
+LatencyHistogram::LatencyHistogram()
+{
+    Reset();
+}
+
+/// <summary>
+/// Finds the bucket a duration falls into.
+/// </summary>
+/// <param name="micros">The duration in microseconds.</param>
+/// <returns>The bucket index, clamped to the last bucket.</returns>
+int LatencyHistogram::BucketIndex(unsigned long long micros)
+{
+    if (micros < kSubBuckets)
+        return (int)micros;
+
+    // Position of the most significant bit.
+    int msb = 0;
+    for (unsigned long long v = micros; v > 1; v >>= 1)
+        msb++;
+
+    if (msb >= kMagnitudes)
+        return kBucketCount - 1;
+
+    const int shift = msb - kSubBucketBits;
+    const int subBucket = (int)(micros >> shift) - kSubBuckets;
+    return (msb - kSubBucketBits + 1) * kSubBuckets + subBucket;
+}
+
+/// <summary>
+/// Gets the highest duration that maps to a bucket.
+/// </summary>
+/// <param name="index">The bucket index.</param>
+/// <returns>The bucket's upper bound in microseconds.</returns>
+unsigned long long LatencyHistogram::BucketUpperBound(int index)
+{
+    if (index < kSubBuckets)
+        return (unsigned long long)index;
+
+    const int msb = index / kSubBuckets - 1 + kSubBucketBits;
+    const int shift = msb - kSubBucketBits;
+    const unsigned long long lower = (unsigned long long)(kSubBuckets + index % kSubBuckets) << shift;
+    return lower + (1ULL << shift) - 1;
+}
+
+/// <summary>
+/// Adds one duration to the histogram.
+/// </summary>
+/// <param name="micros">The duration in microseconds.</param>
+void LatencyHistogram::Record(unsigned long long micros)
+{
+    InterlockedIncrement64(&buckets[BucketIndex(micros)]);
+    InterlockedIncrement64(&count);
+
+    LONG64 current = max;
+    while ((LONG64)micros > current) {
+        LONG64 previous = InterlockedCompareExchange64(&max, (LONG64)micros, current);
+        if (previous == current)
+            break;
+        current = previous;
+    }
+}
+
+/// <summary>
+/// Computes the p50/p95/p99/max of everything recorded so far.
+/// </summary>
+/// <returns>The snapshot. Percentiles are bucket upper bounds, capped at the max.</returns>
+BifrostPhaseSnapshot LatencyHistogram::Snapshot() const
+{
+    BifrostPhaseSnapshot snapshot = { 0 };
+
+    // Copying the buckets first so all percentiles come from the same data.
+    LONG64 copy[kBucketCount];
+    unsigned long long total = 0;
+    for (int i = 0; i < kBucketCount; i++) {
+        copy[i] = buckets[i];
+        total += copy[i];
+    }
+
+    snapshot.count = total;
+    snapshot.max = (unsigned long long)max;
+    if (total == 0)
+        return snapshot;
+
+    const double percentiles[3] = { 0.50, 0.95, 0.99 };
+    unsigned long long* targets[3] = { &snapshot.p50, &snapshot.p95, &snapshot.p99 };
+
+    for (int p = 0; p < 3; p++) {
+        unsigned long long rank = (unsigned long long)(percentiles[p] * total + 0.999999);
+        if (rank == 0) rank = 1;
+
+        unsigned long long seen = 0;
+        for (int i = 0; i < kBucketCount; i++) {
+            seen += copy[i];
+            if (seen >= rank) {
+                unsigned long long value = BucketUpperBound(i);
+                *targets[p] = value < snapshot.max ? value : snapshot.max;
+                break;
+            }
+        }
+    }
+
+    return snapshot;
+}
+
+/// <summary>
+/// Forgets everything recorded so far.
+/// </summary>
+void LatencyHistogram::Reset()
+{
+    for (int i = 0; i < kBucketCount; i++)
+        buckets[i] = 0;
+    count = 0;
+    max = 0;
+}
+
+/// <summary>
+/// Gets the metrics every Bifrost instance records into.
+/// </summary>
+BifrostMetrics& BifrostMetrics::Global()
+{
+    return globalMetrics;
+}
+
+/// <summary>
+/// Reads the monotonic clock.
+/// </summary>
+/// <returns>The current QueryPerformanceCounter value.</returns>
+unsigned long long BifrostMetrics::Now()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)now.QuadPart;
+}
+
+/// <summary>
+/// Converts the ticks elapsed since a Now() reading to microseconds.
+/// </summary>
+/// <param name="start">A value previously returned by Now().</param>
+/// <returns>The elapsed time in microseconds.</returns>
+unsigned long long BifrostMetrics::MicrosSince(unsigned long long start)
+{
+    unsigned long long elapsed = Now() - start;
+
+    // Splitting the division to avoid overflowing on long intervals.
+    unsigned long long seconds = elapsed / kFrequency;
+    unsigned long long remainder = elapsed % kFrequency;
+    return seconds * 1000000ULL + remainder * 1000000ULL / kFrequency;
+}
+
+/// <summary>
+/// Records a duration for a phase.
+/// </summary>
+void BifrostMetrics::Record(BifrostPhase phase, unsigned long long micros)
+{
+    histograms[phase].Record(micros);
+}
+
+/// <summary>
+/// Records the time elapsed since a Now() reading for a phase.
+/// </summary>
+void BifrostMetrics::RecordSince(BifrostPhase phase, unsigned long long start)
+{
+    histograms[phase].Record(MicrosSince(start));
+}
+
+/// <summary>
+/// Gets the percentiles and counts of one phase.
+/// </summary>
+BifrostPhaseSnapshot BifrostMetrics::Snapshot(BifrostPhase phase) const
+{
+    return histograms[phase].Snapshot();
+}
+
+/// <summary>
+/// Forgets everything recorded so far, in every phase.
+/// </summary>
+void BifrostMetrics::Reset()
+{
+    for (int i = 0; i < PhaseCount; i++)
+        histograms[i].Reset();
+}
+
+/// <summary>
+/// Gets what the board counted between an earlier snapshot and this one.
+/// </summary>
+/// <param name="earlier">A snapshot taken before, from the same board.</param>
+/// <returns>The differences; the longest times and memory are this snapshot's.</returns>
+BifrostFirmwareStats BifrostFirmwareStats::Since(const BifrostFirmwareStats& earlier) const
+{
+    BifrostFirmwareStats difference = *this;
+    difference.requests -= earlier.requests;
+    difference.receive.totalMicros -= earlier.receive.totalMicros;
+    difference.compile.totalMicros -= earlier.compile.totalMicros;
+    difference.evaluate.totalMicros -= earlier.evaluate.totalMicros;
+    difference.print.totalMicros -= earlier.print.totalMicros;
+    difference.keptLookups -= earlier.keptLookups;
+    difference.keptHits -= earlier.keptHits;
+
+    // The board's totals are 32 bits wide and wrap.
+    difference.receive.totalMicros &= 0xffffffffULL;
+    difference.compile.totalMicros &= 0xffffffffULL;
+    difference.evaluate.totalMicros &= 0xffffffffULL;
+    difference.print.totalMicros &= 0xffffffffULL;
+    return difference;
+}
+
+/// <summary>
+/// Gets the share of framed requests answered from the kept replies.
+/// </summary>
+/// <returns>Between 0 and 1, 0 without lookups.</returns>
+double BifrostFirmwareStats::KeptHitRate() const
+{
+    return keptLookups > 0 ? (double)keptHits / keptLookups : 0;
+}
@@ -0,0 +1,162 @@
+//BifrostPipeline.cpp
+
+#include "../public/BifrostPipeline.h"
+
+/// <summary>
+/// Constructor for the BifrostPipeline class.
+/// </summary>
+/// <param name="link">An open Bifrost link. It must outlive the pipeline.</param>
+/// <param name="maxDepth">Maximum number of unanswered requests (at least 1).</param>
+/// <param name="maxBatch">Number of requests written together (at least 1).</param>
+BifrostPipeline::BifrostPipeline(Bifrost& link, size_t maxDepth, size_t maxBatch)
+    : link(link)
+{
+    depth = maxDepth > 0 ? maxDepth : 1;
+    batchSize = maxBatch > 0 ? maxBatch : 1;
+    credit = link.ReceiveBuffer();
+    unansweredBytes = 0;
+    batched = 0;
+    batchBytes = 0;
+    bytesSent = 0;
+    bytesReceived = 0;
+}
+
+/// <summary>
+/// Sets the function that receives the replies.
+/// </summary>
+void BifrostPipeline::SetCompletion(const Completion& newCompletion)
+{
+    completion = newCompletion;
+}
+
+/// <summary>
+/// Sets how many bytes of unanswered requests the board can hold.
+/// </summary>
+/// <param name="bytes">The limit, or 0 for none.</param>
+void BifrostPipeline::SetCredit(size_t bytes)
+{
+    credit = bytes;
+}
+
+/// <summary>
+/// Queues one expression, writing and reading as needed to respect the depth, credit and batch size.
+/// </summary>
+/// <param name="expression">The expression, without a trailing newline.</param>
+/// <param name="length">Length of the expression.</param>
+/// <param name="id">Identifier handed back to the completion with the reply.</param>
+/// <returns>False if the link failed.</returns>
+bool BifrostPipeline::Submit(const char* expression, size_t length, unsigned long long id)
+{
+    // Making room first: the oldest replies have to be read before more can
+    // be sent, and before the board's receive buffer has room for this one.
+    const size_t wireLength = link.WireLength(length);
+    while (outstanding.size() >= depth || (credit != 0 && !outstanding.empty() && unansweredBytes + wireLength > credit)) {
+        if (batched > 0 && !Flush())
+            return false;
+        if (!ReceiveOne())
+            return false;
+    }
+
+    // Timed from here, since EnqueueLine may write the line itself.
+    const unsigned long long enqueued = BifrostMetrics::Now();
+    if (!link.EnqueueLine(expression, length))
+        return false;
+    batched++;
+    batchBytes += length + 1;
+
+    Request request = { id, enqueued, wireLength };
+    outstanding.push_back(request);
+    unansweredBytes += wireLength;
+
+    if (batched >= batchSize)
+        return Flush();
+    return true;
+}
+
+/// <summary>
+/// Queues one expression.
+/// </summary>
+bool BifrostPipeline::Submit(const std::string& expression, unsigned long long id)
+{
+    return Submit(expression.c_str(), expression.size(), id);
+}
+
+/// <summary>
+/// Writes anything still batched and waits for every outstanding reply.
+/// </summary>
+/// <returns>False if the link failed.</returns>
+bool BifrostPipeline::Drain()
+{
+    if (batched > 0 && !Flush())
+        return false;
+
+    while (!outstanding.empty()) {
+        if (!ReceiveOne())
+            return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Gets the number of requests submitted but not answered yet.
+/// </summary>
+size_t BifrostPipeline::Outstanding() const
+{
+    return outstanding.size();
+}
+
+/// <summary>
+/// Gets the number of bytes written to the link so far.
+/// </summary>
+unsigned long long BifrostPipeline::BytesSent() const
+{
+    return bytesSent;
+}
+
+/// <summary>
+/// Gets the number of bytes read from the link so far (including line endings).
+/// </summary>
+unsigned long long BifrostPipeline::BytesReceived() const
+{
+    return bytesReceived;
+}
+
+/// <summary>
+/// Writes every batched request with a single write.
+/// </summary>
+/// <returns>False if the write failed.</returns>
+bool BifrostPipeline::Flush()
+{
+    if (batched == 0)
+        return true;
+    if (!link.Flush())
+        return false;
+
+    bytesSent += batchBytes;
+    batchBytes = 0;
+    batched = 0;
+    return true;
+}
+
+/// <summary>
+/// Reads one reply and hands it to the completion of the oldest request.
+/// </summary>
+/// <returns>False if no reply could be read (or nothing was outstanding).</returns>
+bool BifrostPipeline::ReceiveOne()
+{
+    if (outstanding.empty())
+        return false;
+    if (!link.ReadLine(reply))
+        return false;
+
+    Request request = outstanding.front();
+    outstanding.pop_front();
+    unansweredBytes -= request.wireLength;
+
+    bytesReceived += reply.size() + 2;
+    Bifrost::Metrics().RecordSince(PhaseResponse, request.sentAt);
+
+    if (completion)
+        completion(request.id, reply);
+    return true;
+}
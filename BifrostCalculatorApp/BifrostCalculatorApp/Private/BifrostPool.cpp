@@ -0,0 +1,462 @@
+//BifrostPool.cpp
+
+#include <algorithm>
+#include <utility>
+
+#include "../public/BifrostPool.h"
+
+namespace {
+
+    // Time per request assumed for a board until it has answered once:
+    // about 20 bytes each way at 9600 baud.
+    const unsigned long long kInitialServiceMicros = 20000;
+
+    // Weight of the newest sample in the smoothed time per request, as a shift (1/8).
+    const int kServiceShift = 3;
+
+    /// <summary>
+    /// Orders requests by submission.
+    /// </summary>
+    template <typename T>
+    bool EarlierSequence(const T& a, const T& b)
+    {
+        return a.sequence < b.sequence;
+    }
+}
+
+/// <summary>
+/// Constructor for the BifrostPool class. The pool is unusable until Open.
+/// </summary>
+BifrostPool::BifrostPool()
+{
+    InitializeSRWLock(&lock);
+    InitializeSRWLock(&deliverLock);
+    InitializeConditionVariable(&workAvailable);
+    InitializeConditionVariable(&progress);
+    depth = 1;
+    submitted = 0;
+    delivered = 0;
+    retried = 0;
+    stolen = 0;
+    alive = 0;
+    stopping = false;
+    nextDelivery = 0;
+}
+
+/// <summary>
+/// Destructor. Stops the threads and closes the links.
+/// </summary>
+BifrostPool::~BifrostPool()
+{
+    Close();
+}
+
+/// <summary>
+/// Opens one link per port and starts a thread for each board.
+/// </summary>
+/// <param name="ports">The boards' ports, in any form Bifrost::Open accepts.</param>
+/// <param name="baudRate">Baud rate of every port.</param>
+/// <param name="maxDepth">Requests each board may have unanswered (at least 1).</param>
+/// <param name="batchSize">Requests written to a board together.</param>
+/// <param name="reliable">Whether boards that speak the reliable protocol use it.</param>
+/// <returns>True if at least one board is running.</returns>
+bool BifrostPool::Open(const std::vector<std::wstring>& ports, DWORD baudRate, size_t maxDepth, size_t batchSize, bool reliable)
+{
+    Close();
+
+    depth = maxDepth > 0 ? maxDepth : 1;
+    submitted = 0;
+    delivered = 0;
+    retried = 0;
+    stolen = 0;
+    stopping = false;
+    nextDelivery = 0;
+    reorder.assign(kWindow, Slot());
+    for (size_t i = 0; i < reorder.size(); i++)
+        reorder[i].ready = false;
+
+    // Boards that can't be opened are left out rather than failing the pool.
+    for (size_t i = 0; i < ports.size(); i++) {
+        Board* board = new Board();
+        board->owner = this;
+        board->port = ports[i];
+        board->pipeline = NULL;
+        board->thread = NULL;
+        board->outstanding = 0;
+        board->serviceMicros = 0;
+        board->lastReply = 0;
+        board->completed = 0;
+        board->alive = true;
+
+        if (!board->link.Open(ports[i].c_str(), baudRate)) {
+            delete board;
+            continue;
+        }
+        // Either way the board is asked for its receive buffer, which the
+        // pipeline then keeps its requests within.
+        std::string identity;
+        if (!reliable || !board->link.StartReliable())
+            board->link.Identify(identity);
+
+        board->pipeline = new BifrostPipeline(board->link, depth, batchSize);
+        board->pipeline->SetCompletion([board](unsigned long long, const std::string& reply) {
+            board->owner->OnReply(*board, reply);
+        });
+        boards.push_back(board);
+    }
+
+    alive = boards.size();
+    for (size_t i = 0; i < boards.size(); i++) {
+        boards[i]->thread = CreateThread(NULL, 0, ThreadProc, boards[i], 0, NULL);
+        if (boards[i]->thread == NULL) {
+            boards[i]->alive = false;
+            alive--;
+        }
+    }
+    return alive > 0;
+}
+
+/// <summary>
+/// Stops every board's thread and closes its link.
+/// </summary>
+void BifrostPool::Close()
+{
+    AcquireSRWLockExclusive(&lock);
+    stopping = true;
+    alive = 0;
+    ReleaseSRWLockExclusive(&lock);
+    WakeAllConditionVariable(&workAvailable);
+    WakeAllConditionVariable(&progress);
+
+    for (size_t i = 0; i < boards.size(); i++) {
+        Board* board = boards[i];
+
+        // The thread may be blocked reading its link.
+        if (board->thread != NULL) {
+            while (WaitForSingleObject(board->thread, 10) == WAIT_TIMEOUT)
+                CancelSynchronousIo(board->thread);
+            CloseHandle(board->thread);
+        }
+        delete board->pipeline;
+        board->link.Close();
+        delete board;
+    }
+    boards.clear();
+}
+
+/// <summary>
+/// Sets the function that receives the replies.
+/// </summary>
+void BifrostPool::SetCompletion(const Completion& newCompletion)
+{
+    AcquireSRWLockExclusive(&deliverLock);
+    completion = newCompletion;
+    ReleaseSRWLockExclusive(&deliverLock);
+}
+
+/// <summary>
+/// Queues one expression for the board expected to answer it first.
+/// </summary>
+/// <param name="expression">The expression, without a trailing newline.</param>
+/// <param name="id">Identifier handed back to the completion with the reply.</param>
+/// <returns>False if every board has failed.</returns>
+bool BifrostPool::Submit(const std::string& expression, unsigned long long id)
+{
+    AcquireSRWLockExclusive(&lock);
+    while (alive > 0 && submitted - delivered >= kWindow)
+        SleepConditionVariableSRW(&progress, &lock, INFINITE, 0);
+    if (alive == 0) {
+        ReleaseSRWLockExclusive(&lock);
+        return false;
+    }
+
+    Work work;
+    work.sequence = submitted++;
+    work.id = id;
+    work.text = expression;
+    work.submitted = 0;
+    LeastLoaded()->queued.push_back(std::move(work));
+    ReleaseSRWLockExclusive(&lock);
+
+    // Every idle board is woken, not just the chosen one, so any of them can steal it.
+    WakeAllConditionVariable(&workAvailable);
+    return true;
+}
+
+/// <summary>
+/// Waits until every submitted request has been handed to the completion.
+/// </summary>
+/// <returns>False if every board failed with requests left.</returns>
+bool BifrostPool::Drain()
+{
+    AcquireSRWLockExclusive(&lock);
+    while (alive > 0 && delivered < submitted)
+        SleepConditionVariableSRW(&progress, &lock, INFINITE, 0);
+    const bool done = delivered == submitted;
+    ReleaseSRWLockExclusive(&lock);
+    return done;
+}
+
+/// <summary>
+/// Gets the number of boards that were opened.
+/// </summary>
+size_t BifrostPool::Boards() const
+{
+    return boards.size();
+}
+
+/// <summary>
+/// Gets what the pool knows about one board.
+/// </summary>
+/// <param name="index">0 to Boards() - 1.</param>
+BifrostBoardStats BifrostPool::BoardStats(size_t index)
+{
+    BifrostBoardStats stats;
+    AcquireSRWLockShared(&lock);
+    const Board& board = *boards[index];
+    stats.port = board.port;
+    stats.alive = board.alive;
+    stats.completed = board.completed;
+    stats.serviceMicros = board.serviceMicros;
+    stats.queued = board.queued.size();
+    stats.outstanding = board.outstanding;
+    ReleaseSRWLockShared(&lock);
+    return stats;
+}
+
+/// <summary>
+/// Gets the number of requests sent again after their board failed.
+/// </summary>
+unsigned long long BifrostPool::Retried() const
+{
+    return retried;
+}
+
+/// <summary>
+/// Gets the number of requests a board took from another board's queue.
+/// </summary>
+unsigned long long BifrostPool::Stolen() const
+{
+    return stolen;
+}
+
+/// <summary>
+/// Thread entry point.
+/// </summary>
+DWORD WINAPI BifrostPool::ThreadProc(LPVOID parameter)
+{
+    Board* board = static_cast<Board*>(parameter);
+    board->owner->Run(*board);
+    return 0;
+}
+
+/// <summary>
+/// Keeps one board's pipeline full: sends requests while it has room and
+/// reads replies otherwise, until Close or the link fails.
+/// </summary>
+void BifrostPool::Run(Board& board)
+{
+    for (;;) {
+        Work work;
+        bool taken = false;
+
+        AcquireSRWLockExclusive(&lock);
+        while (!stopping) {
+            if (board.outstanding < depth && Take(board, work)) {
+                board.outstanding++;
+                taken = true;
+                break;
+            }
+            if (board.outstanding > 0)
+                break;
+            SleepConditionVariableSRW(&workAvailable, &lock, INFINITE, 0);
+        }
+        const bool stop = stopping;
+        ReleaseSRWLockExclusive(&lock);
+        if (stop)
+            return;
+
+        // The pipeline has room, so Submit only writes (it reads nothing and
+        // calls no completion), and the work can be referenced in place.
+        bool succeeded;
+        if (taken) {
+            work.submitted = BifrostMetrics::Now();
+            board.inFlight.push_back(std::move(work));
+            const Work& sent = board.inFlight.back();
+            succeeded = board.pipeline->Submit(sent.text, sent.sequence);
+        }
+        else
+            succeeded = board.pipeline->Flush() && board.pipeline->ReceiveOne();
+
+        if (!succeeded) {
+            Fail(board);
+            return;
+        }
+    }
+}
+
+/// <summary>
+/// Picks the next request for a board: its own oldest, or else the newest
+/// one from the board whose queue would take longest to get through, if
+/// this board would answer it sooner. Called with lock held.
+/// </summary>
+/// <returns>False if there is nothing worth taking.</returns>
+bool BifrostPool::Take(Board& board, Work& work)
+{
+    if (!board.queued.empty()) {
+        work = std::move(board.queued.front());
+        board.queued.pop_front();
+        return true;
+    }
+
+    Board* victim = NULL;
+    unsigned long long longest = 0;
+    for (size_t i = 0; i < boards.size(); i++) {
+        if (boards[i] == &board || boards[i]->queued.empty())
+            continue;
+        unsigned long long backlog = Backlog(*boards[i], 0);
+        if (backlog > longest) {
+            longest = backlog;
+            victim = boards[i];
+        }
+    }
+    if (victim == NULL || Backlog(board, 1) >= longest)
+        return false;
+
+    work = std::move(victim->queued.back());
+    victim->queued.pop_back();
+    stolen++;
+    return true;
+}
+
+/// <summary>
+/// Pipeline completion: pairs the reply with the board's oldest request,
+/// updates the board's time per request and delivers the reply.
+/// </summary>
+void BifrostPool::OnReply(Board& board, const std::string& reply)
+{
+    Work work = std::move(board.inFlight.front());
+    board.inFlight.pop_front();
+
+    // While the pipeline is busy a reply follows the previous one, so the
+    // time per request is measured from whichever came later.
+    const unsigned long long since = std::max(work.submitted, board.lastReply);
+    const unsigned long long sample = BifrostMetrics::MicrosSince(since);
+    board.lastReply = BifrostMetrics::Now();
+
+    AcquireSRWLockExclusive(&lock);
+    board.outstanding--;
+    board.completed++;
+    if (board.serviceMicros == 0)
+        board.serviceMicros = sample;
+    else
+        board.serviceMicros = board.serviceMicros - (board.serviceMicros >> kServiceShift) + (sample >> kServiceShift);
+    ReleaseSRWLockExclusive(&lock);
+
+    Deliver(work.sequence, work.id, reply);
+}
+
+/// <summary>
+/// Stores a reply in the reorder buffer and hands every reply that is now
+/// next in submission order to the completion.
+/// </summary>
+void BifrostPool::Deliver(unsigned long long sequence, unsigned long long id, const std::string& reply)
+{
+    AcquireSRWLockExclusive(&deliverLock);
+    Slot& slot = reorder[sequence % kWindow];
+    if (sequence >= nextDelivery && !slot.ready) {
+        slot.ready = true;
+        slot.id = id;
+        slot.reply = reply;
+    }
+
+    const unsigned long long before = nextDelivery;
+    for (;;) {
+        Slot& next = reorder[nextDelivery % kWindow];
+        if (!next.ready)
+            break;
+        if (completion)
+            completion(next.id, next.reply);
+        next.ready = false;
+        nextDelivery++;
+    }
+    const unsigned long long after = nextDelivery;
+    ReleaseSRWLockExclusive(&deliverLock);
+
+    if (after == before)
+        return;
+
+    AcquireSRWLockExclusive(&lock);
+    if (after > delivered)
+        delivered = after;
+    ReleaseSRWLockExclusive(&lock);
+    WakeAllConditionVariable(&progress);
+}
+
+/// <summary>
+/// Takes a board whose link failed out of the pool and hands every request
+/// it had not answered to the least loaded board left.
+/// </summary>
+void BifrostPool::Fail(Board& board)
+{
+    std::vector<Work> orphaned;
+    for (size_t i = 0; i < board.inFlight.size(); i++)
+        orphaned.push_back(std::move(board.inFlight[i]));
+    board.inFlight.clear();
+
+    AcquireSRWLockExclusive(&lock);
+    if (board.alive) {
+        board.alive = false;
+        if (alive > 0)
+            alive--;
+    }
+    for (size_t i = 0; i < board.queued.size(); i++)
+        orphaned.push_back(std::move(board.queued[i]));
+    board.queued.clear();
+    board.outstanding = 0;
+
+    // Oldest first at the front of the queue, so they are sent again before
+    // anything newer; the other boards steal from its back as usual.
+    Board* heir = stopping ? NULL : LeastLoaded();
+    if (heir != NULL) {
+        std::sort(orphaned.begin(), orphaned.end(), EarlierSequence<Work>);
+        for (size_t i = orphaned.size(); i > 0; i--)
+            heir->queued.push_front(std::move(orphaned[i - 1]));
+        retried += orphaned.size();
+    }
+    ReleaseSRWLockExclusive(&lock);
+
+    WakeAllConditionVariable(&workAvailable);
+    WakeAllConditionVariable(&progress);
+}
+
+/// <summary>
+/// Finds the live board expected to answer a new request first. Called with lock held.
+/// </summary>
+/// <returns>The board, or NULL if none is alive.</returns>
+BifrostPool::Board* BifrostPool::LeastLoaded()
+{
+    Board* best = NULL;
+    unsigned long long shortest = 0;
+    for (size_t i = 0; i < boards.size(); i++) {
+        if (!boards[i]->alive)
+            continue;
+        unsigned long long backlog = Backlog(*boards[i], 1);
+        if (best == NULL || backlog < shortest) {
+            shortest = backlog;
+            best = boards[i];
+        }
+    }
+    return best;
+}
+
+/// <summary>
+/// Estimates how long a board needs to answer everything it has, plus extra
+/// more requests. Called with lock held.
+/// </summary>
+/// <returns>The estimate in microseconds.</returns>
+unsigned long long BifrostPool::Backlog(const Board& board, size_t extra) const
+{
+    const unsigned long long service = board.serviceMicros > 0 ? board.serviceMicros : kInitialServiceMicros;
+    return (board.queued.size() + board.outstanding + extra) * service;
+}
@@ -0,0 +1,172 @@
+//BifrostScheduler.cpp
+
+#include <utility>
+
+#include "../public/BifrostScheduler.h"
+#include "../public/BifrostMetrics.h"
+
+/// <summary>
+/// Constructor for the BifrostScheduler class.
+/// </summary>
+/// <param name="maxQueued">Requests each priority class can hold before Push blocks.</param>
+BifrostScheduler::BifrostScheduler(size_t maxQueued)
+{
+    InitializeSRWLock(&lock);
+    InitializeConditionVariable(&available);
+    InitializeConditionVariable(&space);
+    capacity = maxQueued > 0 ? maxQueued : 1;
+    closed = false;
+    late = 0;
+}
+
+/// <summary>
+/// Changes how many requests each priority class can hold.
+/// </summary>
+void BifrostScheduler::SetCapacity(size_t maxQueued)
+{
+    AcquireSRWLockExclusive(&lock);
+    capacity = maxQueued > 0 ? maxQueued : 1;
+    ReleaseSRWLockExclusive(&lock);
+    WakeAllConditionVariable(&space);
+}
+
+/// <summary>
+/// Queues a request, waiting while its priority class is full.
+/// </summary>
+/// <param name="priority">The class to queue it in.</param>
+/// <param name="request">The request. Its text is moved into the queue.</param>
+/// <returns>False if the scheduler was closed before the request could be queued.</returns>
+bool BifrostScheduler::Push(BifrostPriority priority, ScheduledRequest& request)
+{
+    request.arrived = BifrostMetrics::Now();
+
+    AcquireSRWLockExclusive(&lock);
+    std::deque<ScheduledRequest>& queue = queues[priority];
+    while (!closed && queue.size() >= capacity)
+        SleepConditionVariableSRW(&space, &lock, INFINITE, 0);
+    if (closed) {
+        ReleaseSRWLockExclusive(&lock);
+        return false;
+    }
+    queue.push_back(std::move(request));
+    ReleaseSRWLockExclusive(&lock);
+
+    WakeConditionVariable(&available);
+    return true;
+}
+
+/// <summary>
+/// Takes the most urgent request that can still meet its deadline.
+/// </summary>
+/// <param name="request">Receives the request.</param>
+/// <param name="lowest">The least urgent class that may be served.</param>
+/// <param name="expectedMicros">How long a request taken now will wait for its reply.</param>
+/// <param name="lateRequests">Receives the requests that can't meet their deadline any more.</param>
+/// <param name="waitMs">How long to wait for a request (INFINITE to wait until one comes or Close).</param>
+/// <returns>True if a request was taken.</returns>
+bool BifrostScheduler::Pop(ScheduledRequest& request, BifrostPriority lowest, unsigned long long expectedMicros,
+    std::vector<ScheduledRequest>& lateRequests, DWORD waitMs)
+{
+    const size_t lateBefore = lateRequests.size();
+    bool taken = false;
+
+    AcquireSRWLockExclusive(&lock);
+    for (;;) {
+        // Only the head of each queue is checked: requests behind it are
+        // looked at when they get there, still before reaching the link.
+        for (int p = 0; p <= lowest && !taken; p++) {
+            std::deque<ScheduledRequest>& queue = queues[p];
+            while (!queue.empty() && IsLate(queue.front(), expectedMicros)) {
+                lateRequests.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            if (!queue.empty()) {
+                request = std::move(queue.front());
+                queue.pop_front();
+                taken = true;
+            }
+        }
+
+        if (taken || closed || lateRequests.size() > lateBefore || waitMs == 0)
+            break;
+        if (!SleepConditionVariableSRW(&available, &lock, waitMs, 0))
+            break;  // Timed out.
+    }
+    ReleaseSRWLockExclusive(&lock);
+
+    if (lateRequests.size() > lateBefore)
+        InterlockedExchangeAdd64(&late, (LONG64)(lateRequests.size() - lateBefore));
+    if (taken || lateRequests.size() > lateBefore)
+        WakeAllConditionVariable(&space);
+    return taken;
+}
+
+/// <summary>
+/// Wakes every waiting producer and consumer and refuses new requests.
+/// </summary>
+void BifrostScheduler::Close()
+{
+    AcquireSRWLockExclusive(&lock);
+    closed = true;
+    ReleaseSRWLockExclusive(&lock);
+    WakeAllConditionVariable(&available);
+    WakeAllConditionVariable(&space);
+}
+
+/// <summary>
+/// Accepts requests again after Close.
+/// </summary>
+void BifrostScheduler::Reopen()
+{
+    AcquireSRWLockExclusive(&lock);
+    closed = false;
+    late = 0;
+    ReleaseSRWLockExclusive(&lock);
+}
+
+/// <summary>
+/// Empties every queue.
+/// </summary>
+/// <param name="remaining">Receives the requests that were queued, most urgent class first.</param>
+void BifrostScheduler::TakeAll(std::vector<ScheduledRequest>& remaining)
+{
+    AcquireSRWLockExclusive(&lock);
+    for (int p = 0; p < PriorityCount; p++) {
+        for (size_t i = 0; i < queues[p].size(); i++)
+            remaining.push_back(std::move(queues[p][i]));
+        queues[p].clear();
+    }
+    ReleaseSRWLockExclusive(&lock);
+    WakeAllConditionVariable(&space);
+}
+
+/// <summary>
+/// Gets the number of requests waiting in a priority class.
+/// </summary>
+size_t BifrostScheduler::Queued(BifrostPriority priority)
+{
+    AcquireSRWLockShared(&lock);
+    size_t count = queues[priority].size();
+    ReleaseSRWLockShared(&lock);
+    return count;
+}
+
+/// <summary>
+/// Gets the number of requests handed back because they couldn't meet their deadline.
+/// </summary>
+unsigned long long BifrostScheduler::Late() const
+{
+    return (unsigned long long)late;
+}
+
+/// <summary>
+/// Tells whether a request's reply would come after its deadline.
+/// </summary>
+/// <param name="request">The request.</param>
+/// <param name="expectedMicros">How long it would still wait for its reply if taken now.</param>
+bool BifrostScheduler::IsLate(const ScheduledRequest& request, unsigned long long expectedMicros)
+{
+    if (request.budgetMicros == 0 || request.answered)
+        return false;
+    return BifrostMetrics::MicrosSince(request.arrived) + expectedMicros > request.budgetMicros;
+}
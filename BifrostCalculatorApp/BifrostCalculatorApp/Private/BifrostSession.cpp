@@ -0,0 +1,417 @@
+//BifrostSession.cpp
+
+#include "../public/BifrostSession.h"
+#include "../public/BifrostPipeline.h"
+
+namespace {
+
+    // Wait before opening a failed link again, doubling up to the longest,
+    // so an unplugged board doesn't keep the thread opening ports.
+    const DWORD kRetryMinMs = 250;
+    const DWORD kRetryMaxMs = 4000;
+
+    // Requests in flight at once when several were queued while the link was down.
+    const size_t kReplayDepth = 8;
+}
+
+/// <summary>
+/// Constructor for the BifrostSession class. Nothing runs until Start.
+/// </summary>
+BifrostSession::BifrostSession()
+{
+    InitializeSRWLock(&lock);
+    InitializeConditionVariable(&work);
+    InitializeConditionVariable(&answered);
+    baudRate = CBR_9600;
+    reliable = false;
+    thread = NULL;
+    stopping = false;
+    cancels = 0;
+    waiters = 0;
+    connected = 0;
+    reconnects = 0;
+}
+
+/// <summary>
+/// Destructor. Stops the thread and closes the link.
+/// </summary>
+BifrostSession::~BifrostSession()
+{
+    Stop();
+}
+
+/// <summary>
+/// Starts the thread that opens the link and keeps it alive.
+/// </summary>
+/// <param name="portName">The port, in any form Bifrost::Open accepts.</param>
+/// <param name="baud">Its baud rate.</param>
+/// <param name="useReliable">Whether a board that speaks it uses the reliable protocol.</param>
+/// <returns>False if the thread could not be started.</returns>
+bool BifrostSession::Start(const std::wstring& portName, DWORD baud, bool useReliable)
+{
+    Stop();
+
+    port = portName;
+    baudRate = baud;
+    reliable = useReliable;
+
+    AcquireSRWLockExclusive(&lock);
+    stopping = false;
+    identity.clear();
+    ReleaseSRWLockExclusive(&lock);
+    InterlockedExchange64(&reconnects, 0);
+
+    thread = CreateThread(NULL, 0, ThreadProc, this, 0, NULL);
+    return thread != NULL;
+}
+
+/// <summary>
+/// Ends the thread and fails every request still waiting.
+/// </summary>
+void BifrostSession::Stop()
+{
+    AcquireSRWLockExclusive(&lock);
+    stopping = true;
+    ReleaseSRWLockExclusive(&lock);
+    WakeAllConditionVariable(&work);
+
+    // The thread may be blocked reading or writing the link.
+    if (thread != NULL) {
+        while (WaitForSingleObject(thread, 10) == WAIT_TIMEOUT) {
+            CancelSynchronousIo(thread);
+            link.Interrupt();
+        }
+        CloseHandle(thread);
+        thread = NULL;
+    }
+
+    // Whatever the thread was sending went back to the queue when it failed.
+    AcquireSRWLockExclusive(&lock);
+    while (!queue.empty()) {
+        Finish(queue.front(), false);
+        queue.pop_front();
+    }
+    WakeAllConditionVariable(&answered);
+
+    // So the session can be destroyed as soon as this returns.
+    while (waiters > 0)
+        SleepConditionVariableSRW(&answered, &lock, INFINITE, 0);
+    ReleaseSRWLockExclusive(&lock);
+}
+
+/// <summary>
+/// Sends one expression through the session and waits for its reply.
+/// </summary>
+/// <param name="expression">The expression, without its newline.</param>
+/// <param name="reply">Receives the reply line.</param>
+/// <param name="timeoutMs">How long to wait, including for the link to come back.</param>
+/// <param name="abandon">A flag for Cancel(abandon) to give up on this call with, or NULL.</param>
+/// <returns>False if no reply came in time, on Cancel, or if the session was stopped.</returns>
+bool BifrostSession::Evaluate(const std::string& expression, std::string& reply, DWORD timeoutMs, const volatile LONG* abandon)
+{
+    Request* request = new Request();
+    request->expression = expression;
+    request->taken = false;
+    request->done = false;
+    request->succeeded = false;
+    request->abandoned = false;
+
+    const ULONGLONG deadline = GetTickCount64() + timeoutMs;
+
+    AcquireSRWLockExclusive(&lock);
+    if (stopping || thread == NULL) {
+        ReleaseSRWLockExclusive(&lock);
+        delete request;
+        return false;
+    }
+    queue.push_back(request);
+    waiters++;
+    WakeConditionVariable(&work);
+
+    const unsigned long long cancelsBefore = cancels;
+    while (!request->done && cancels == cancelsBefore && (abandon == NULL || *abandon == 0)) {
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline)
+            break;
+        SleepConditionVariableSRW(&answered, &lock, (DWORD)(deadline - now), 0);
+    }
+
+    bool succeeded = request->done && request->succeeded;
+    if (succeeded)
+        reply.swap(request->reply);
+
+    if (request->done) {
+        delete request;
+    }
+    else if (!request->taken) {
+        for (size_t i = 0; i < queue.size(); i++) {
+            if (queue[i] == request) {
+                queue.erase(queue.begin() + i);
+                break;
+            }
+        }
+        delete request;
+    }
+    else {
+        // The thread is sending it and deletes it once it is answered.
+        request->abandoned = true;
+    }
+    waiters--;
+    const bool leaving = stopping;
+    ReleaseSRWLockExclusive(&lock);
+
+    // Stop waits on the same variable for the last caller to leave.
+    if (leaving)
+        WakeAllConditionVariable(&answered);
+    return succeeded;
+}
+
+/// <summary>
+/// Makes the Evaluate calls waiting now give up.
+/// </summary>
+void BifrostSession::Cancel()
+{
+    AcquireSRWLockExclusive(&lock);
+    cancels++;
+    ReleaseSRWLockExclusive(&lock);
+    WakeAllConditionVariable(&answered);
+}
+
+/// <summary>
+/// Makes the Evaluate calls given a flag give up.
+/// </summary>
+/// <param name="abandon">The flag they were given.</param>
+void BifrostSession::Cancel(volatile LONG* abandon)
+{
+    // Set under the lock, so a caller can't check it just before and then sleep through the wake.
+    AcquireSRWLockExclusive(&lock);
+    *abandon = 1;
+    ReleaseSRWLockExclusive(&lock);
+    WakeAllConditionVariable(&answered);
+}
+
+/// <summary>
+/// Gets whether the link is open and the board is answering.
+/// </summary>
+bool BifrostSession::Connected() const
+{
+    return connected != 0;
+}
+
+/// <summary>
+/// Gets the port given to Start.
+/// </summary>
+std::wstring BifrostSession::Port() const
+{
+    return port;
+}
+
+/// <summary>
+/// Gets the baud rate given to Start.
+/// </summary>
+DWORD BifrostSession::BaudRate() const
+{
+    return baudRate;
+}
+
+/// <summary>
+/// Gets the board's answer to "id" in the last handshake.
+/// </summary>
+/// <returns>The identity, empty before the first handshake.</returns>
+std::string BifrostSession::Identity()
+{
+    AcquireSRWLockShared(&lock);
+    std::string copy = identity;
+    ReleaseSRWLockShared(&lock);
+    return copy;
+}
+
+/// <summary>
+/// Gets the number of times the link was opened again after failing.
+/// </summary>
+unsigned long long BifrostSession::Reconnects() const
+{
+    return (unsigned long long)reconnects;
+}
+
+/// <summary>
+/// Thread entry point.
+/// </summary>
+DWORD WINAPI BifrostSession::ThreadProc(LPVOID parameter)
+{
+    static_cast<BifrostSession*>(parameter)->Run();
+    return 0;
+}
+
+/// <summary>
+/// Opens the link, sends what is queued and pings while idle, opening the
+/// link again whenever it fails, until Stop.
+/// </summary>
+void BifrostSession::Run()
+{
+    bool open = false;
+    bool lost = false;  // The link failed at least once.
+    DWORD retryMs = kRetryMinMs;
+
+    for (;;) {
+        if (!open) {
+            AcquireSRWLockShared(&lock);
+            bool stop = stopping;
+            ReleaseSRWLockShared(&lock);
+            if (stop)
+                break;
+
+            if (Connect()) {
+                open = true;
+                retryMs = kRetryMinMs;
+                InterlockedExchange(&connected, 1);
+                if (lost)
+                    InterlockedIncrement64(&reconnects);
+                continue;
+            }
+
+            // A request being queued tries again at once.
+            AcquireSRWLockExclusive(&lock);
+            if (!stopping)
+                SleepConditionVariableSRW(&work, &lock, retryMs, 0);
+            ReleaseSRWLockExclusive(&lock);
+            retryMs = retryMs * 2 < kRetryMaxMs ? retryMs * 2 : kRetryMaxMs;
+            continue;
+        }
+
+        AcquireSRWLockExclusive(&lock);
+        if (queue.empty() && !stopping)
+            SleepConditionVariableSRW(&work, &lock, kPingIntervalMs, 0);
+        bool stop = stopping;
+        bool idle = queue.empty();
+        ReleaseSRWLockExclusive(&lock);
+        if (stop)
+            break;
+
+        // Woken with nothing to send: the link has been idle for the interval.
+        bool alive = idle ? Ping() : Send();
+        if (!alive) {
+            InterlockedExchange(&connected, 0);
+            link.Close();
+            open = false;
+            lost = true;
+        }
+    }
+
+    InterlockedExchange(&connected, 0);
+    link.Close();
+}
+
+/// <summary>
+/// Opens the link and asks the board who it is.
+/// </summary>
+/// <returns>False if the port couldn't be opened or no board answered.</returns>
+bool BifrostSession::Connect()
+{
+    if (!link.Open(port.c_str(), baudRate))
+        return false;
+
+    // Also tells the pipeline how much the board's receive buffer holds.
+    std::string answer;
+    if (!link.Identify(answer)) {
+        link.Close();
+        return false;
+    }
+    if (reliable)
+        link.StartReliable();
+
+    AcquireSRWLockExclusive(&lock);
+    identity.swap(answer);
+    ReleaseSRWLockExclusive(&lock);
+    return true;
+}
+
+/// <summary>
+/// Checks that the board still answers.
+/// </summary>
+/// <returns>False if the link failed or nothing came back in time.</returns>
+bool BifrostSession::Ping()
+{
+    // Never framed, so never sent again: the timeout holds on the reliable
+    // protocol, and on a broker's pipe or shared channel, where a hung
+    // broker is noticed too.
+    return link.Ping(kPingTimeoutMs);
+}
+
+/// <summary>
+/// Sends the queued requests, and those queued meanwhile, and hands out their replies.
+/// </summary>
+/// <returns>False if the link failed.</returns>
+bool BifrostSession::Send()
+{
+    std::deque<Request*> batch;  // Taken from the queue, oldest first.
+    size_t unanswered = 0;  // First request without a reply.
+
+    BifrostPipeline pipeline(link, kReplayDepth, 1);
+    pipeline.SetCompletion([&](unsigned long long id, const std::string& reply) {
+        AcquireSRWLockExclusive(&lock);
+        batch[(size_t)id]->reply = reply;
+        Finish(batch[(size_t)id], true);
+        ReleaseSRWLockExclusive(&lock);
+        WakeAllConditionVariable(&answered);
+        unanswered = (size_t)id + 1;
+    });
+
+    bool succeeded = true;
+    while (succeeded) {
+        // Room first, so a request is only taken from the queue once it can
+        // be written at once: until then a cancelled Evaluate still drops it.
+        if (pipeline.Outstanding() >= kReplayDepth) {
+            succeeded = pipeline.ReceiveOne();
+            continue;
+        }
+
+        Request* request = NULL;
+        AcquireSRWLockExclusive(&lock);
+        if (!queue.empty() && !stopping) {
+            request = queue.front();
+            queue.pop_front();
+            request->taken = true;
+        }
+        ReleaseSRWLockExclusive(&lock);
+        if (request == NULL)
+            break;
+
+        batch.push_back(request);
+        succeeded = pipeline.Submit(request->expression, batch.size() - 1);
+    }
+    if (succeeded)
+        succeeded = pipeline.Drain();
+
+    if (!succeeded) {
+        // Sent again, in the same order, ahead of anything queued since.
+        AcquireSRWLockExclusive(&lock);
+        for (size_t i = batch.size(); i-- > unanswered;) {
+            if (batch[i]->abandoned) {
+                delete batch[i];
+            }
+            else {
+                batch[i]->taken = false;
+                queue.push_front(batch[i]);
+            }
+        }
+        ReleaseSRWLockExclusive(&lock);
+    }
+    batch.clear();
+    return succeeded;
+}
+
+/// <summary>
+/// Hands a request's outcome over, or deletes it if it was abandoned.
+/// </summary>
+/// <param name="request">The request.</param>
+/// <param name="succeeded">Whether its reply has been set.</param>
+void BifrostSession::Finish(Request* request, bool succeeded)
+{
+    if (request->abandoned) {
+        delete request;
+        return;
+    }
+    request->done = true;
+    request->succeeded = succeeded;
+}
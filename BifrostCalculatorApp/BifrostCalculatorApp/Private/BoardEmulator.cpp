@@ -0,0 +1,347 @@
+//BoardEmulator.cpp
+
+#include <cstdio>
+
+#include <windows.h>
+#include "../public/BoardEmulator.h"
+#include "../public/BifrostArq.h"
+#include "../public/BifrostMetrics.h"
+#include "../public/HostEvaluator.h"
+
+namespace {
+
+    // Same as firmwareVersion and targetBufferSize in ExpressionsHandler.ino.
+    const int kFirmwareVersion = 1;
+    const int kTargetBufferSize = 200;
+    const int kArqWindow = 8;
+
+    // Reported like an AVR's, so the host paces to it as it would to a board.
+    const int kReceiveBuffer = 64;
+}
+
+/// <summary>
+/// Constructor for the BoardEmulator class.
+/// </summary>
+BoardEmulator::BoardEmulator()
+{
+    thread = NULL;
+    pipe = INVALID_HANDLE_VALUE;
+    stopping = 0;
+    baudRate = 0;
+    origin = 0;
+    lineErrors = 0;
+    noise = 0x9e3779b97f4a7c15ULL;
+    stats = BifrostFirmwareStats();
+}
+
+/// <summary>
+/// Destructor. Stops serving if still running.
+/// </summary>
+BoardEmulator::~BoardEmulator()
+{
+    Stop();
+}
+
+/// <summary>
+/// Creates the pipe and starts answering requests on a background thread.
+/// </summary>
+/// <param name="pipeName">Pipe to serve, e.g. L"\\\\.\\pipe\\bifrost-loopback".</param>
+/// <param name="baud">Baud rate to emulate, or 0 to answer as fast as possible.</param>
+/// <returns>True if the emulator is running.</returns>
+bool BoardEmulator::Start(const std::wstring& pipeName, DWORD baud)
+{
+    Stop();
+
+    // Creating the pipe here rather than on the thread, so a client can
+    // connect as soon as Start returns.
+    pipe = CreateNamedPipeW(pipeName.c_str(), PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 4096, 4096, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE)
+        return false;
+
+    baudRate = baud;
+    origin = BifrostMetrics::Now();
+    stopping = 0;
+    thread = CreateThread(NULL, 0, ThreadProc, this, 0, NULL);
+    if (thread == NULL) {
+        CloseHandle(pipe);
+        pipe = INVALID_HANDLE_VALUE;
+        return false;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Stops the background thread and closes the pipe.
+/// </summary>
+void BoardEmulator::Stop()
+{
+    if (thread != NULL) {
+        InterlockedExchange(&stopping, 1);
+
+        // The thread is blocked in ConnectNamedPipe or ReadFile most of the time.
+        while (WaitForSingleObject(thread, 10) == WAIT_TIMEOUT)
+            CancelSynchronousIo(thread);
+
+        CloseHandle(thread);
+        thread = NULL;
+    }
+
+    if (pipe != INVALID_HANDLE_VALUE) {
+        CloseHandle(pipe);
+        pipe = INVALID_HANDLE_VALUE;
+    }
+}
+
+/// <summary>
+/// Makes the emulator damage some of the framed lines it receives and sends.
+/// </summary>
+/// <param name="perThousand">Lines damaged per thousand in each direction, 0 for none.</param>
+void BoardEmulator::SetLineErrors(unsigned perThousand)
+{
+    lineErrors = perThousand;
+}
+
+/// <summary>
+/// Builds the reply ExpressionsHandler.ino sends for one received line.
+/// </summary>
+/// <param name="line">The received line, without its newline.</param>
+/// <returns>The reply, including the "\r\n" Serial.println adds.</returns>
+std::string BoardEmulator::Respond(const std::string& line)
+{
+    // The "id" command, checked on the trimmed line like the firmware does.
+    size_t first = line.find_first_not_of(" \t\r\n\v\f");
+    size_t last = line.find_last_not_of(" \t\r\n\v\f");
+    if (first != std::string::npos && line.compare(first, last - first + 1, "id") == 0) {
+        char identity[96];
+        int length = std::snprintf(identity, sizeof(identity), "bifrost %d buffer=%d baud=%lu arch=host rx=%d arq=%d\r\n",
+            kFirmwareVersion, kTargetBufferSize, (unsigned long)baudRate, kReceiveBuffer, kArqWindow);
+        return std::string(identity, length > 0 ? (size_t)length : 0);
+    }
+    if (first != std::string::npos && line.compare(first, last - first + 1, "ping") == 0)
+        return "pong\r\n";
+    if (first != std::string::npos && line.compare(first, last - first + 1, "stats") == 0)
+        return FormatStats() + "\r\n";
+    if (first != std::string::npos && line[first] == '@')
+        return RespondFrame(line.substr(first, last - first + 1));
+
+    return Evaluate(line.data(), line.size()) + "\r\n";
+}
+
+/// <summary>
+/// Answers a framed request with the framed reply, or asks for it again if it arrived damaged.
+/// </summary>
+/// <param name="frame">The trimmed request.</param>
+/// <returns>The reply with "\r\n", or nothing if not even the sequence number could be read.</returns>
+std::string BoardEmulator::RespondFrame(const std::string& frame)
+{
+    char kind;
+    unsigned sequence;
+    const char* payload;
+    size_t payloadLength;
+    BifrostArq::FrameStatus status = BifrostArq::ParseFrame(frame.data(), frame.size(), kind, sequence, payload, payloadLength);
+
+    std::string reply;
+    if (status == BifrostArq::FrameUnreadable)
+        return reply;
+
+    if (status == BifrostArq::FrameDamaged) {
+        BifrostArq::AppendFrame('!', sequence, NULL, 0, reply);
+    }
+    else if (std::string(payload, payloadLength) == "stats") {
+        std::string text = FormatStats();
+        BifrostArq::AppendFrame('$', sequence, text.data(), text.size(), reply);
+    }
+    else {
+        // A request sent again because its reply was lost gets the same
+        // reply; the CRC tells it from another request with the same number.
+        const unsigned short crc = BifrostArq::Crc16(frame.data(), frame.size() - 5);
+        KeptReply& kept = keptReplies[sequence % kArqWindow];
+        stats.keptLookups++;
+        if (kept.sequence != (int)sequence || kept.crc != crc) {
+            kept.reply = Evaluate(payload, payloadLength);
+            kept.sequence = (int)sequence;
+            kept.crc = crc;
+        }
+        else {
+            stats.keptHits++;
+        }
+        BifrostArq::AppendFrame('$', sequence, kept.reply.data(), kept.reply.size(), reply);
+    }
+    reply += "\r\n";
+    return reply;
+}
+
+/// <summary>
+/// Evaluates one expression the way the firmware does, timing it like the firmware's counters.
+/// </summary>
+/// <param name="text">The expression as received.</param>
+/// <param name="length">Its length.</param>
+/// <returns>The reply, without "\r\n".</returns>
+std::string BoardEmulator::Evaluate(const char* text, size_t length)
+{
+    unsigned long long started = BifrostMetrics::Now();
+    HostResult result = HostEvaluator::EvaluateLine(expression, text, length, input);
+    unsigned long long evaluated = BifrostMetrics::MicrosSince(started);
+
+    started = BifrostMetrics::Now();
+    char buffer[64];
+    std::string reply(buffer, HostEvaluator::FormatReply(result, buffer, sizeof(buffer)));
+    unsigned long long printed = BifrostMetrics::MicrosSince(started);
+
+    stats.requests++;
+    stats.evaluate.totalMicros += evaluated;
+    stats.evaluate.maxMicros = evaluated > stats.evaluate.maxMicros ? evaluated : stats.evaluate.maxMicros;
+    stats.print.totalMicros += printed;
+    stats.print.maxMicros = printed > stats.print.maxMicros ? printed : stats.print.maxMicros;
+    return reply;
+}
+
+/// <summary>
+/// Formats the counters the way the firmware's printStats does.
+/// </summary>
+/// <returns>The reply to "stats", without "\r\n"; memory is reported as unknown.</returns>
+std::string BoardEmulator::FormatStats() const
+{
+    // The board's counters are unsigned long, 32 bits wide.
+    char text[192];
+    int length = std::snprintf(text, sizeof(text),
+        "stats requests=%lu receive=%lu,%lu compile=%lu,%lu eval=%lu,%lu print=%lu,%lu kept=%lu,%lu free=-1 low=-1",
+        (unsigned long)stats.requests,
+        (unsigned long)stats.receive.totalMicros, (unsigned long)stats.receive.maxMicros,
+        (unsigned long)stats.compile.totalMicros, (unsigned long)stats.compile.maxMicros,
+        (unsigned long)stats.evaluate.totalMicros, (unsigned long)stats.evaluate.maxMicros,
+        (unsigned long)stats.print.totalMicros, (unsigned long)stats.print.maxMicros,
+        (unsigned long)stats.keptLookups, (unsigned long)stats.keptHits);
+    return std::string(text, length > 0 ? (size_t)length : 0);
+}
+
+/// <summary>
+/// Flips a bit in, or drops a byte from, about lineErrors lines in a thousand.
+/// </summary>
+/// <param name="line">The line, damaged in place.</param>
+void BoardEmulator::Damage(std::string& line)
+{
+    if (lineErrors == 0 || line.empty())
+        return;
+
+    // xorshift64: cheap, and the same sequence on every run.
+    noise ^= noise << 13;
+    noise ^= noise >> 7;
+    noise ^= noise << 17;
+    if (noise % 1000 >= lineErrors)
+        return;
+
+    size_t at = (size_t)((noise >> 10) % line.size());
+    if ((noise >> 40) & 1)
+        line.erase(at, 1);
+    else
+        line[at] ^= (char)(1 << ((noise >> 20) % 7));
+}
+
+/// <summary>
+/// Thread entry point.
+/// </summary>
+DWORD WINAPI BoardEmulator::ThreadProc(LPVOID parameter)
+{
+    static_cast<BoardEmulator*>(parameter)->Run();
+    return 0;
+}
+
+/// <summary>
+/// Accepts one client at a time, like a COM port only one process can open.
+/// </summary>
+void BoardEmulator::Run()
+{
+    while (!stopping) {
+        BOOL connected = ConnectNamedPipe(pipe, NULL) ? TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
+        if (!connected) {
+            if (stopping)
+                break;
+            Sleep(1);
+            continue;
+        }
+
+        Serve();
+        DisconnectNamedPipe(pipe);
+    }
+}
+
+/// <summary>
+/// Answers requests from the connected client until it disconnects.
+/// </summary>
+void BoardEmulator::Serve()
+{
+    std::string pending;
+    unsigned long long receiveBusyUntil = 0;
+    unsigned long long transmitBusyUntil = 0;
+
+    KeptReply unused = { -1, 0, std::string() };
+    keptReplies.assign(kArqWindow, unused);
+    stats = BifrostFirmwareStats();
+
+    while (!stopping) {
+        char chunk[512];
+        DWORD bytesRead = 0;
+        if (!ReadFile(pipe, chunk, sizeof(chunk), &bytesRead, NULL) || bytesRead == 0)
+            return;
+
+        pending.append(chunk, bytesRead);
+
+        size_t lineStart = 0;
+        size_t newline;
+        while ((newline = pending.find('\n', lineStart)) != std::string::npos) {
+            Pace(receiveBusyUntil, newline - lineStart + 1);
+
+            std::string request = pending.substr(lineStart, newline - lineStart);
+            lineStart = newline + 1;
+
+            const bool framed = !request.empty() && request[0] == '@';
+            if (framed)
+                Damage(request);
+
+            std::string reply = Respond(request);
+            if (reply.empty())
+                continue;
+            if (framed)
+                Damage(reply);
+
+            Pace(transmitBusyUntil, reply.size());
+
+            DWORD bytesWritten = 0;
+            if (!WriteFile(pipe, reply.c_str(), (DWORD)reply.size(), &bytesWritten, NULL))
+                return;
+        }
+        pending.erase(0, lineStart);
+    }
+}
+
+/// <summary>
+/// Waits as long as a UART at the emulated baud rate needs to move some bytes.
+/// </summary>
+/// <param name="busyUntil">When that direction of the line becomes free, in microseconds since Start; updated.</param>
+/// <param name="bytes">How many bytes go over the line.</param>
+void BoardEmulator::Pace(unsigned long long& busyUntil, size_t bytes)
+{
+    if (baudRate == 0)
+        return;
+
+    unsigned long long now = BifrostMetrics::MicrosSince(origin);
+
+    // 8N1 framing: 10 bits on the wire per byte.
+    if (busyUntil < now)
+        busyUntil = now;
+    busyUntil += bytes * 10ULL * 1000000ULL / baudRate;
+
+    // Sleeping for the bulk of the wait and spinning for the last millisecond,
+    // since Sleep is far coarser than a byte time at high baud rates.
+    for (;;) {
+        now = BifrostMetrics::MicrosSince(origin);
+        if (now >= busyUntil)
+            break;
+        if (busyUntil - now > 2000)
+            Sleep((DWORD)((busyUntil - now) / 1000 - 1));
+        else
+            YieldProcessor();
+    }
+}
@@ -0,0 +1,893 @@
+//Expression.cpp
+
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#include "../public/Expression.h"
+#include "../public/VectorMath.h"
+
+namespace {
+
+    // Same value the firmware binds to the "pi" variable (Arduino's PI).
+    const double kPi = 3.1415926535897932384626433832795;
+
+    const double kNaN = std::numeric_limits<double>::quiet_NaN();
+    const double kInfinity = std::numeric_limits<double>::infinity();
+
+    // Inputs per block in EvaluateOver: every node's block (2 KB) stays in L1.
+    const size_t kBlockSize = 256;
+
+    // The AVR's double is a 32-bit float, so a value is only folded when the
+    // board holds it exactly too (subnormals aside, which it may not keep).
+    bool ExactInFloat(double value)
+    {
+        if (!std::isfinite(value) || std::fabs(value) > std::numeric_limits<float>::max())
+            return false;
+        if (value != 0.0 && std::fabs(value) < std::numeric_limits<float>::min())
+            return false;
+        return (double)(float)value == value;
+    }
+
+    // Ports of TinyExpr's combinatorics helpers, including their overflow rules.
+    double Factorial(double a)
+    {
+        if (a < 0.0)
+            return kNaN;
+        if (a > UINT_MAX)
+            return kInfinity;
+        unsigned int ua = (unsigned int)(a);
+        unsigned long int result = 1, i;
+        for (i = 1; i <= ua; i++) {
+            if (i > ULONG_MAX / result)
+                return kInfinity;
+            result *= i;
+        }
+        return (double)result;
+    }
+
+    double Combinations(double n, double r)
+    {
+        if (n < 0.0 || r < 0.0 || n < r) return kNaN;
+        if (n > UINT_MAX || r > UINT_MAX) return kInfinity;
+        unsigned long int un = (unsigned int)(n), ur = (unsigned int)(r), i;
+        unsigned long int result = 1;
+        if (ur > un / 2) ur = un - ur;
+        for (i = 1; i <= ur; i++) {
+            if (result > ULONG_MAX / (un - ur + i))
+                return kInfinity;
+            result *= un - ur + i;
+            result /= i;
+        }
+        return (double)result;
+    }
+
+    double Permutations(double n, double r)
+    {
+        return Combinations(n, r) * Factorial(r);
+    }
+}
+
+/// <summary>
+/// Constructor for the Expression class.
+/// Registers the variables the firmware passes to te_compile.
+/// </summary>
+Expression::Expression()
+{
+    root = -1;
+    start = next = NULL;
+    tokenType = TokenNull;
+    tokenValue = 0.0;
+    tokenVariable = -1;
+    tokenOperation = OpAdd;
+    tokenArity = 0;
+
+    variableNames.push_back("pi");
+    variableValues.push_back(kPi);
+}
+
+// Must stay in alphabetical order, like TinyExpr's own table.
+// The firmware is built without TE_NAT_LOG, so "log" is base 10.
+const Expression::Builtin Expression::builtins[] = {
+    { "abs",   OpAbs,   1 },
+    { "acos",  OpAcos,  1 },
+    { "asin",  OpAsin,  1 },
+    { "atan",  OpAtan,  1 },
+    { "atan2", OpAtan2, 2 },
+    { "ceil",  OpCeil,  1 },
+    { "cos",   OpCos,   1 },
+    { "cosh",  OpCosh,  1 },
+    { "e",     OpE,     0 },
+    { "exp",   OpExp,   1 },
+    { "fac",   OpFac,   1 },
+    { "floor", OpFloor, 1 },
+    { "ln",    OpLn,    1 },
+    { "log",   OpLog,   1 },
+    { "log10", OpLog10, 1 },
+    { "ncr",   OpNcr,   2 },
+    { "npr",   OpNpr,   2 },
+    { "pi",    OpPi,    0 },
+    { "pow",   OpPow2,  2 },
+    { "sin",   OpSin,   1 },
+    { "sinh",  OpSinh,  1 },
+    { "sqrt",  OpSqrt,  1 },
+    { "tan",   OpTan,   1 },
+    { "tanh",  OpTanh,  1 },
+};
+
+const int Expression::builtinCount = sizeof(Expression::builtins) / sizeof(Expression::builtins[0]);
+
+/// <summary>
+/// Looks up a builtin function by name, the same way TinyExpr's find_builtin does.
+/// </summary>
+/// <param name="name">Start of the identifier (not null-terminated).</param>
+/// <param name="length">Length of the identifier.</param>
+/// <returns>The builtin entry, or NULL if the name is unknown.</returns>
+const Expression::Builtin* Expression::FindBuiltin(const char* name, size_t length)
+{
+    int imin = 0;
+    int imax = builtinCount - 1;
+
+    // Binary search.
+    while (imax >= imin) {
+        const int i = imin + ((imax - imin) / 2);
+        int c = std::strncmp(name, builtins[i].name, length);
+        if (!c) c = '\0' - builtins[i].name[length];
+        if (c == 0)
+            return builtins + i;
+        else if (c > 0)
+            imin = i + 1;
+        else
+            imax = i - 1;
+    }
+
+    return NULL;
+}
+
+/// <summary>
+/// Looks up the builtin function that implements an operation.
+/// </summary>
+/// <param name="operation">The operation to look for.</param>
+/// <returns>The builtin entry, or NULL for infix operators.</returns>
+const Expression::Builtin* Expression::FindBuiltin(Operation operation)
+{
+    for (int i = 0; i < builtinCount; i++) {
+        if (builtins[i].operation == operation)
+            return builtins + i;
+    }
+    return NULL;
+}
+
+/// <summary>
+/// Prints a number in the shortest form that reads back to the same value.
+/// </summary>
+/// <param name="value">A finite value.</param>
+/// <returns>The shortest decimal or exponent notation, e.g. ".5" or "1e-7".</returns>
+std::string Expression::FormatConstant(double value)
+{
+    char buffer[40];
+
+    // Finding the smallest precision that still round-trips.
+    int precision = 1;
+    for (; precision < 17; precision++) {
+        std::snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        if (std::strtod(buffer, NULL) == value)
+            break;
+    }
+
+    // Candidates: general, exponent and (for whole numbers) plain notation.
+    std::string candidates[3];
+    std::snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+    candidates[0] = buffer;
+    std::snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+    candidates[1] = buffer;
+    if (value == std::floor(value) && std::fabs(value) < 1e17) {
+        std::snprintf(buffer, sizeof(buffer), "%.0f", value);
+        candidates[2] = buffer;
+    }
+
+    std::string best;
+    for (int i = 0; i < 3; i++) {
+        std::string text = candidates[i];
+        if (text.empty())
+            continue;
+
+        // "1e+07" -> "1e7", "1e-07" -> "1e-7".
+        size_t exponent = text.find('e');
+        if (exponent != std::string::npos) {
+            size_t digits = exponent + 1;
+            if (text[digits] == '+')
+                text.erase(digits, 1);
+            else if (text[digits] == '-')
+                digits++;
+            while (digits + 1 < text.size() && text[digits] == '0')
+                text.erase(digits, 1);
+        }
+
+        // "0.5" -> ".5", "-0.5" -> "-.5".
+        size_t zero = (text[0] == '-') ? 1 : 0;
+        if (text.compare(zero, 2, "0.") == 0)
+            text.erase(zero, 1);
+
+        if (best.empty() || text.size() < best.size())
+            best = text;
+    }
+
+    return best;
+}
+
+/// <summary>
+/// Applies an operation to already evaluated arguments.
+/// </summary>
+/// <param name="operation">The operation to apply.</param>
+/// <param name="a">First argument (ignored by constants).</param>
+/// <param name="b">Second argument (ignored by unary operations).</param>
+/// <returns>The result, following the firmware's math library semantics.</returns>
+double Expression::Apply(Operation operation, double a, double b)
+{
+    switch (operation) {
+    case OpAdd:    return a + b;
+    case OpSub:    return a - b;
+    case OpMul:    return a * b;
+    case OpDiv:    return a / b;
+    case OpPow:    return std::pow(a, b);
+    case OpMod:    return std::fmod(a, b);
+    case OpNegate: return -a;
+    case OpComma:  return b;
+    case OpAbs:    return std::fabs(a);
+    case OpAcos:   return std::acos(a);
+    case OpAsin:   return std::asin(a);
+    case OpAtan:   return std::atan(a);
+    case OpAtan2:  return std::atan2(a, b);
+    case OpCeil:   return std::ceil(a);
+    case OpCos:    return std::cos(a);
+    case OpCosh:   return std::cosh(a);
+    case OpE:      return 2.71828182845904523536;
+    case OpExp:    return std::exp(a);
+    case OpFac:    return Factorial(a);
+    case OpFloor:  return std::floor(a);
+    case OpLn:     return std::log(a);
+    case OpLog:    return std::log10(a);
+    case OpLog10:  return std::log10(a);
+    case OpNcr:    return Combinations(a, b);
+    case OpNpr:    return Permutations(a, b);
+    case OpPi:     return 3.14159265358979323846;
+    case OpPow2:   return std::pow(a, b);
+    case OpSin:    return std::sin(a);
+    case OpSinh:   return std::sinh(a);
+    case OpSqrt:   return std::sqrt(a);
+    case OpTan:    return std::tan(a);
+    case OpTanh:   return std::tanh(a);
+    }
+    return kNaN;
+}
+
+/// <summary>
+/// Reads the next token, mirroring TinyExpr's next_token.
+/// </summary>
+void Expression::NextToken()
+{
+    tokenType = TokenNull;
+
+    do {
+        if (!*next) {
+            tokenType = TokenEnd;
+            return;
+        }
+
+        const unsigned char c = (unsigned char)next[0];
+
+        if ((c >= '0' && c <= '9') || c == '.') {
+            // The AVR strtod only understands decimal notation, so a hex
+            // prefix must stop after the leading zero like it does on the board.
+            if (c == '0' && (next[1] == 'x' || next[1] == 'X')) {
+                tokenValue = 0.0;
+                next++;
+            }
+            else {
+                char* end;
+                tokenValue = std::strtod(next, &end);
+                next = end;
+            }
+            tokenType = TokenNumber;
+        }
+        else if (std::isalpha(c)) {
+            // Look for a variable or builtin function call.
+            const char* identifier = next;
+            while (std::isalpha((unsigned char)next[0]) || std::isdigit((unsigned char)next[0]) || next[0] == '_')
+                next++;
+            const size_t length = next - identifier;
+
+            tokenType = TokenError;
+            for (size_t i = 0; i < variableNames.size(); i++) {
+                if (variableNames[i].size() == length && std::strncmp(identifier, variableNames[i].c_str(), length) == 0) {
+                    tokenType = TokenVariable;
+                    tokenVariable = (int)i;
+                    break;
+                }
+            }
+
+            if (tokenType == TokenError) {
+                const Builtin* builtin = FindBuiltin(identifier, length);
+                if (builtin) {
+                    tokenType = TokenFunction;
+                    tokenOperation = builtin->operation;
+                    tokenArity = builtin->arity;
+                }
+            }
+        }
+        else {
+            // Look for an operator or special character.
+            switch (next++[0]) {
+            case '+': tokenType = TokenInfix; tokenOperation = OpAdd; break;
+            case '-': tokenType = TokenInfix; tokenOperation = OpSub; break;
+            case '*': tokenType = TokenInfix; tokenOperation = OpMul; break;
+            case '/': tokenType = TokenInfix; tokenOperation = OpDiv; break;
+            case '^': tokenType = TokenInfix; tokenOperation = OpPow; break;
+            case '%': tokenType = TokenInfix; tokenOperation = OpMod; break;
+            case '(': tokenType = TokenOpen; break;
+            case ')': tokenType = TokenClose; break;
+            case ',': tokenType = TokenSeparator; break;
+            case ' ': case '\t': case '\n': case '\r': break;
+            default: tokenType = TokenError; break;
+            }
+        }
+    } while (tokenType == TokenNull);
+}
+
+/// <summary>
+/// Appends a node to the arena.
+/// </summary>
+/// <returns>The index of the new node.</returns>
+int Expression::AddNode(NodeType type, Operation operation, int first, int second)
+{
+    Node node;
+    node.type = type;
+    node.operation = operation;
+    node.value = 0.0;
+    node.variable = -1;
+    node.arguments[0] = first;
+    node.arguments[1] = second;
+    nodes.push_back(node);
+    return (int)nodes.size() - 1;
+}
+
+/// <summary>
+/// &lt;list&gt; = &lt;expr&gt; {"," &lt;expr&gt;}
+/// </summary>
+int Expression::ParseList()
+{
+    int ret = ParseExpr();
+
+    while (tokenType == TokenSeparator) {
+        NextToken();
+        int e = ParseExpr();
+        ret = AddNode(NodeCall, OpComma, ret, e);
+    }
+
+    return ret;
+}
+
+/// <summary>
+/// &lt;expr&gt; = &lt;term&gt; {("+" | "-") &lt;term&gt;}
+/// </summary>
+int Expression::ParseExpr()
+{
+    int ret = ParseTerm();
+
+    while (tokenType == TokenInfix && (tokenOperation == OpAdd || tokenOperation == OpSub)) {
+        Operation operation = tokenOperation;
+        NextToken();
+        int t = ParseTerm();
+        ret = AddNode(NodeCall, operation, ret, t);
+    }
+
+    return ret;
+}
+
+/// <summary>
+/// &lt;term&gt; = &lt;factor&gt; {("*" | "/" | "%") &lt;factor&gt;}
+/// </summary>
+int Expression::ParseTerm()
+{
+    int ret = ParseFactor();
+
+    while (tokenType == TokenInfix && (tokenOperation == OpMul || tokenOperation == OpDiv || tokenOperation == OpMod)) {
+        Operation operation = tokenOperation;
+        NextToken();
+        int f = ParseFactor();
+        ret = AddNode(NodeCall, operation, ret, f);
+    }
+
+    return ret;
+}
+
+/// <summary>
+/// &lt;factor&gt; = &lt;power&gt; {"^" &lt;power&gt;}
+/// The firmware is built without TE_POW_FROM_RIGHT, so "^" is left associative.
+/// </summary>
+int Expression::ParseFactor()
+{
+    int ret = ParsePower();
+
+    while (tokenType == TokenInfix && tokenOperation == OpPow) {
+        NextToken();
+        int p = ParsePower();
+        ret = AddNode(NodeCall, OpPow, ret, p);
+    }
+
+    return ret;
+}
+
+/// <summary>
+/// &lt;power&gt; = {("-" | "+")} &lt;base&gt;
+/// </summary>
+int Expression::ParsePower()
+{
+    int sign = 1;
+    while (tokenType == TokenInfix && (tokenOperation == OpAdd || tokenOperation == OpSub)) {
+        if (tokenOperation == OpSub) sign = -sign;
+        NextToken();
+    }
+
+    int ret = ParseBase();
+    if (sign == -1)
+        ret = AddNode(NodeCall, OpNegate, ret);
+
+    return ret;
+}
+
+/// <summary>
+/// &lt;base&gt; = &lt;constant&gt; | &lt;variable&gt; | &lt;function-0&gt; {"(" ")"} | &lt;function-1&gt; &lt;power&gt;
+///            | &lt;function-X&gt; "(" &lt;expr&gt; {"," &lt;expr&gt;} ")" | "(" &lt;list&gt; ")"
+/// </summary>
+int Expression::ParseBase()
+{
+    int ret;
+
+    switch (tokenType) {
+    case TokenNumber:
+        ret = AddNode(NodeConstant, OpAdd);
+        nodes[ret].value = tokenValue;
+        NextToken();
+        break;
+
+    case TokenVariable:
+        ret = AddNode(NodeVariable, OpAdd);
+        nodes[ret].variable = tokenVariable;
+        NextToken();
+        break;
+
+    case TokenFunction:
+        if (tokenArity == 0) {
+            ret = AddNode(NodeCall, tokenOperation);
+            NextToken();
+            if (tokenType == TokenOpen) {
+                NextToken();
+                if (tokenType != TokenClose)
+                    tokenType = TokenError;
+                else
+                    NextToken();
+            }
+        }
+        else if (tokenArity == 1) {
+            ret = AddNode(NodeCall, tokenOperation);
+            NextToken();
+            int argument = ParsePower();
+            nodes[ret].arguments[0] = argument;
+        }
+        else {
+            const int arity = tokenArity;
+            ret = AddNode(NodeCall, tokenOperation);
+            NextToken();
+
+            if (tokenType != TokenOpen) {
+                tokenType = TokenError;
+            }
+            else {
+                int i;
+                for (i = 0; i < arity; i++) {
+                    NextToken();
+                    int argument = ParseExpr();
+                    nodes[ret].arguments[i] = argument;
+
+                    if (tokenType != TokenSeparator)
+                        break;
+                }
+                if (tokenType != TokenClose || i != arity - 1)
+                    tokenType = TokenError;
+                else
+                    NextToken();
+            }
+        }
+        break;
+
+    case TokenOpen:
+        NextToken();
+        ret = ParseList();
+
+        if (tokenType != TokenClose)
+            tokenType = TokenError;
+        else
+            NextToken();
+        break;
+
+    default:
+        ret = AddNode(NodeConstant, OpAdd);
+        nodes[ret].value = kNaN;
+        tokenType = TokenError;
+        break;
+    }
+
+    return ret;
+}
+
+/// <summary>
+/// Compiles an expression with the firmware's grammar.
+/// </summary>
+/// <param name="text">The expression, as it would be sent to the board.</param>
+/// <param name="errorPosition">Receives 0 on success or the 1-based error position.</param>
+/// <returns>True if the expression is well formed, false otherwise.</returns>
+bool Expression::Compile(const std::string& text, int* errorPosition)
+{
+    nodes.clear();
+    root = -1;
+    start = next = text.c_str();
+
+    NextToken();
+    int parsed = ParseList();
+
+    if (tokenType != TokenEnd) {
+        if (errorPosition) {
+            *errorPosition = (int)(next - start);
+            if (*errorPosition == 0) *errorPosition = 1;
+        }
+        nodes.clear();
+        return false;
+    }
+
+    root = parsed;
+    if (errorPosition) *errorPosition = 0;
+    return true;
+}
+
+/// <summary>
+/// Evaluates one node of the arena recursively.
+/// </summary>
+double Expression::EvaluateNode(int index) const
+{
+    const Node& node = nodes[index];
+
+    switch (node.type) {
+    case NodeConstant:
+        return node.value;
+    case NodeVariable:
+        return variableValues[node.variable];
+    case NodeCall:
+        {
+            double a = node.arguments[0] >= 0 ? EvaluateNode(node.arguments[0]) : 0.0;
+            double b = node.arguments[1] >= 0 ? EvaluateNode(node.arguments[1]) : 0.0;
+            return Apply(node.operation, a, b);
+        }
+    }
+    return kNaN;
+}
+
+/// <summary>
+/// Evaluates the last successfully compiled expression.
+/// </summary>
+/// <returns>The result, or NaN if nothing has been compiled.</returns>
+double Expression::Evaluate() const
+{
+    if (root < 0)
+        return kNaN;
+    return EvaluateNode(root);
+}
+
+/// <summary>
+/// Defines a variable for the following compilations, or updates its value.
+/// </summary>
+/// <param name="name">The variable name, e.g. "x".</param>
+/// <param name="value">The value Evaluate uses for it.</param>
+void Expression::SetVariable(const std::string& name, double value)
+{
+    for (size_t i = 0; i < variableNames.size(); i++) {
+        if (variableNames[i] == name) {
+            variableValues[i] = value;
+            return;
+        }
+    }
+    variableNames.push_back(name);
+    variableValues.push_back(value);
+}
+
+/// <summary>
+/// Lists the nodes reachable from one node, every node after its arguments.
+/// </summary>
+void Expression::OrderNodes(int index, std::vector<int>& order) const
+{
+    const Node& node = nodes[index];
+    if (node.type == NodeCall) {
+        for (int i = 0; i < 2 && node.arguments[i] >= 0; i++)
+            OrderNodes(node.arguments[i], order);
+    }
+    order.push_back(index);
+}
+
+/// <summary>
+/// Applies an operation to whole arrays of arguments.
+/// </summary>
+/// <param name="operation">The operation to apply.</param>
+/// <param name="a">First arguments.</param>
+/// <param name="b">Second arguments (NULL for unary operations).</param>
+/// <param name="out">Receives the results.</param>
+/// <param name="count">Number of elements.</param>
+void Expression::ApplyOver(Operation operation, const double* a, const double* b, double* out, size_t count)
+{
+    switch (operation) {
+    case OpAdd:    VectorMath::Add(a, b, out, count); return;
+    case OpSub:    VectorMath::Subtract(a, b, out, count); return;
+    case OpMul:    VectorMath::Multiply(a, b, out, count); return;
+    case OpDiv:    VectorMath::Divide(a, b, out, count); return;
+    case OpNegate: VectorMath::Negate(a, out, count); return;
+    case OpAbs:    VectorMath::Abs(a, out, count); return;
+    case OpSqrt:   VectorMath::Sqrt(a, out, count); return;
+    case OpSin:    VectorMath::Sin(a, out, count); return;
+    case OpCos:    VectorMath::Cos(a, out, count); return;
+    case OpExp:    VectorMath::Exp(a, out, count); return;
+    case OpLn:     VectorMath::Ln(a, out, count); return;
+    case OpLog:    VectorMath::Log10(a, out, count); return;
+    case OpLog10:  VectorMath::Log10(a, out, count); return;
+    default:
+        break;
+    }
+
+    // Everything else runs one element at a time through the scalar code.
+    for (size_t i = 0; i < count; i++)
+        out[i] = Apply(operation, a[i], b ? b[i] : 0.0);
+}
+
+/// <summary>
+/// Evaluates the last compiled expression over an array of inputs.
+/// </summary>
+/// <param name="variable">The variable bound to each input, e.g. "x".</param>
+/// <param name="x">The inputs.</param>
+/// <param name="count">Number of inputs.</param>
+/// <param name="out">Receives one result per input (may be x).</param>
+/// <returns>False if nothing is compiled or the variable is not defined.</returns>
+bool Expression::EvaluateOver(const std::string& variable, const double* x, size_t count, double* out) const
+{
+    if (root < 0)
+        return false;
+
+    int bound = -1;
+    for (size_t i = 0; i < variableNames.size(); i++) {
+        if (variableNames[i] == variable)
+            bound = (int)i;
+    }
+    if (bound < 0)
+        return false;
+
+    std::vector<int> order;
+    OrderNodes(root, order);
+
+    // Every node reads its arguments through source: the inputs themselves
+    // for the variable, or a block of lanes (one per node in order).
+    std::vector<double> lanes(order.size() * kBlockSize);
+    std::vector<const double*> source(nodes.size(), (const double*)NULL);
+    std::vector<char> varying(nodes.size(), 0);
+
+    // Subtrees that don't depend on the variable are evaluated once, up front.
+    for (size_t k = 0; k < order.size(); k++) {
+        const int index = order[k];
+        const Node& node = nodes[index];
+
+        if (node.type == NodeVariable)
+            varying[index] = node.variable == bound;
+        else if (node.type == NodeCall) {
+            for (int i = 0; i < 2 && node.arguments[i] >= 0; i++)
+                varying[index] = varying[index] || varying[node.arguments[i]];
+        }
+
+        if (!varying[index]) {
+            double* block = &lanes[k * kBlockSize];
+            const double value = EvaluateNode(index);
+            for (size_t i = 0; i < kBlockSize; i++)
+                block[i] = value;
+            source[index] = block;
+        }
+    }
+
+    for (size_t first = 0; first < count; first += kBlockSize) {
+        const size_t blockCount = (count - first < kBlockSize) ? count - first : kBlockSize;
+
+        for (size_t k = 0; k < order.size(); k++) {
+            const int index = order[k];
+            const Node& node = nodes[index];
+            if (!varying[index])
+                continue;
+
+            if (node.type == NodeVariable) {
+                source[index] = x + first;
+                continue;
+            }
+
+            const double* a = source[node.arguments[0]];
+            const double* b = node.arguments[1] >= 0 ? source[node.arguments[1]] : NULL;
+            if (node.operation == OpComma) {
+                source[index] = b;
+                continue;
+            }
+
+            // The root writes straight into out. Every other node has been
+            // evaluated by then, so this is safe even when out is x.
+            double* block = (index == root) ? out + first : &lanes[k * kBlockSize];
+            ApplyOver(node.operation, a, b, block, blockCount);
+            source[index] = block;
+        }
+
+        if (source[root] != out + first)
+            std::memmove(out + first, source[root], blockCount * sizeof(double));
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Checks whether an expression is well formed for the firmware.
+/// </summary>
+/// <param name="text">The expression to check.</param>
+/// <returns>0 if it compiles, otherwise the error position te_compile would report.</returns>
+int Expression::Validate(const std::string& text)
+{
+    Expression expression;
+    int errorPosition = 0;
+    expression.Compile(text, &errorPosition);
+    return errorPosition;
+}
+
+/// <summary>
+/// Emits the shortest text for one node of the arena, folding it into a
+/// constant when every argument is constant and the value prints shorter.
+/// </summary>
+/// <param name="index">Index of the node to emit.</param>
+/// <returns>The emitted text and how tightly it binds.</returns>
+Expression::Emitted Expression::EmitNode(int index) const
+{
+    const Node& node = nodes[index];
+    Emitted emitted;
+    emitted.constant = false;
+    emitted.value = 0.0;
+
+    if (node.type == NodeConstant) {
+        emitted.text = FormatConstant(node.value);
+        emitted.level = (emitted.text[0] == '-') ? LevelPower : LevelBase;
+        emitted.constant = true;
+        emitted.value = node.value;
+        return emitted;
+    }
+
+    if (node.type == NodeVariable) {
+        emitted.text = variableNames[node.variable];
+        emitted.level = LevelBase;
+        return emitted;
+    }
+
+    Emitted arguments[2];
+    arguments[0].value = arguments[1].value = 0.0;
+    int arity = 0;
+    bool constant = true;
+    for (int i = 0; i < 2 && node.arguments[i] >= 0; i++) {
+        arguments[i] = EmitNode(node.arguments[i]);
+        constant = constant && arguments[i].constant;
+        arity++;
+    }
+
+    // Wraps an argument in parentheses when it binds looser than the grammar allows there.
+    auto wrap = [](const Emitted& argument, Level required) -> std::string {
+        if (argument.level >= required)
+            return argument.text;
+        return "(" + argument.text + ")";
+    };
+
+    const Builtin* builtin = FindBuiltin(node.operation);
+    if (node.operation == OpNegate) {
+        // The grammar folds repeated signs, so "--a" still reads back as a.
+        emitted.text = "-" + wrap(arguments[0], LevelPower);
+        emitted.level = LevelPower;
+    }
+    else if (!builtin) {
+        Level level;
+        char symbol;
+        switch (node.operation) {
+        case OpComma: level = LevelList;   symbol = ','; break;
+        case OpAdd:   level = LevelExpr;   symbol = '+'; break;
+        case OpSub:   level = LevelExpr;   symbol = '-'; break;
+        case OpMul:   level = LevelTerm;   symbol = '*'; break;
+        case OpDiv:   level = LevelTerm;   symbol = '/'; break;
+        case OpMod:   level = LevelTerm;   symbol = '%'; break;
+        default:      level = LevelFactor; symbol = '^'; break;
+        }
+
+        // Every infix operator is left associative.
+        emitted.text = wrap(arguments[0], level) + symbol + wrap(arguments[1], (Level)(level + 1));
+        emitted.level = level;
+    }
+    else if (arity == 0) {
+        emitted.text = builtin->name;
+        emitted.level = LevelBase;
+    }
+    else if (arity == 1) {
+        // One-argument functions take a <power>, so "sin 2" and "sin-2" need no parentheses.
+        std::string argument = wrap(arguments[0], LevelPower);
+        const unsigned char first = (unsigned char)argument[0];
+        if (std::isalnum(first) || first == '_')
+            emitted.text = std::string(builtin->name) + " " + argument;
+        else
+            emitted.text = builtin->name + argument;
+        emitted.level = LevelBase;
+    }
+    else {
+        emitted.text = std::string(builtin->name) + "(" + wrap(arguments[0], LevelExpr) + "," + wrap(arguments[1], LevelExpr) + ")";
+        emitted.level = LevelBase;
+    }
+
+    // Every builtin is pure, so a call on constants is a constant itself. It is
+    // folded only when its operands and result are exact in float: then the
+    // board, rounding each step to float, arrives at the same value.
+    for (int i = 0; i < arity; i++)
+        constant = constant && ExactInFloat(arguments[i].value);
+    if (constant) {
+        double value = Apply(node.operation, arguments[0].value, arguments[1].value);
+        if (ExactInFloat(value)) {
+            std::string folded = FormatConstant(value);
+            if (folded.size() < emitted.text.size()) {
+                emitted.text = folded;
+                emitted.level = (folded[0] == '-') ? LevelPower : LevelBase;
+            }
+            emitted.constant = true;
+            emitted.value = value;
+        }
+    }
+
+    return emitted;
+}
+
+/// <summary>
+/// Re-emits the last compiled expression as the shortest equivalent text.
+/// </summary>
+/// <returns>The minified expression, or an empty string if nothing has been compiled.</returns>
+std::string Expression::Minify() const
+{
+    if (root < 0)
+        return "";
+    return EmitNode(root).text;
+}
+
+/// <summary>
+/// Compiles an expression and re-emits it as the shortest equivalent text.
+/// </summary>
+/// <param name="text">The expression to minify.</param>
+/// <param name="bytesSaved">Receives how many bytes the minified text saves.</param>
+/// <returns>The minified text, or the original one if it does not compile.</returns>
+std::string Expression::Minify(const std::string& text, size_t* bytesSaved)
+{
+    if (bytesSaved) *bytesSaved = 0;
+
+    Expression expression;
+    if (!expression.Compile(text))
+        return text;
+
+    std::string minified = expression.Minify();
+
+    // Never send something the board would read differently than the original.
+    if (minified.size() >= text.size() || Validate(minified) != 0)
+        return text;
+
+    if (bytesSaved) *bytesSaved = text.size() - minified.size();
+    return minified;
+}
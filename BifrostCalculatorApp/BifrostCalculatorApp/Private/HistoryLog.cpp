@@ -0,0 +1,475 @@
+//HistoryLog.cpp
+
+#include <cstring>
+
+#include <windows.h>
+#include "../public/HistoryLog.h"
+
+namespace {
+
+    // Where the log lives under %LOCALAPPDATA%, next to the board cache.
+    const wchar_t* const kLogFolder = L"\\BifrostCalculator";
+    const wchar_t* const kLogFile = L"\\history.log";
+    const wchar_t* const kIndexSuffix = L".idx";
+
+    // What the log starts with, so another file is never taken for one.
+    const char kMagic[8] = { 'B', 'F', 'H', 'L', 'O', 'G', '1', '\n' };
+
+    // Longest expression or result a record can hold. Anything longer is
+    // the length field of a record that was cut short.
+    const unsigned int kMaxText = 1 << 20;
+
+    // What each record starts with, followed by the expression and the
+    // result (not terminated).
+    struct RecordHeader {
+        unsigned long long time;
+        unsigned int latencyMicros;
+        unsigned int source;
+        unsigned int expressionLength;
+        unsigned int resultLength;
+        unsigned int checksum;  // RecordChecksum of the record.
+        unsigned int reserved;  // 0; keeps the header free of padding.
+    };
+
+    // CRC-32 (polynomial 0xedb88320) of every value of a nibble.
+    const unsigned int kCrcNibbles[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    /// <summary>
+    /// Computes the CRC-32 of some bytes, a nibble at a time.
+    /// </summary>
+    /// <param name="crc">The CRC so far, to continue it.</param>
+    unsigned int Crc32(const void* data, size_t length, unsigned int crc = 0)
+    {
+        const unsigned char* bytes = (const unsigned char*)data;
+        crc = ~crc;
+        for (size_t i = 0; i < length; i++) {
+            crc = (crc >> 4) ^ kCrcNibbles[(crc ^ bytes[i]) & 0xf];
+            crc = (crc >> 4) ^ kCrcNibbles[(crc ^ (bytes[i] >> 4)) & 0xf];
+        }
+        return ~crc;
+    }
+
+    /// <summary>
+    /// Computes a record's checksum: the CRC-32 of its header, with the
+    /// checksum field 0, and its text. A record of zeros doesn't pass.
+    /// </summary>
+    /// <param name="text">The expression and the result, one after the other.</param>
+    unsigned int RecordChecksum(const RecordHeader& header, const char* text)
+    {
+        RecordHeader summed = header;
+        summed.checksum = 0;
+        unsigned int crc = Crc32(&summed, sizeof(summed));
+        return Crc32(text, (size_t)header.expressionLength + header.resultLength, crc);
+    }
+
+    /// <summary>
+    /// Reads bytes at an offset of a file.
+    /// </summary>
+    /// <returns>False unless all of them could be read.</returns>
+    bool ReadAt(HANDLE file, unsigned long long offset, void* data, DWORD length)
+    {
+        OVERLAPPED at = {};
+        at.Offset = (DWORD)offset;
+        at.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD read = 0;
+        return ReadFile(file, data, length, &read, &at) && read == length;
+    }
+
+    /// <summary>
+    /// Writes bytes at an offset of a file.
+    /// </summary>
+    /// <returns>False unless all of them were written.</returns>
+    bool WriteAt(HANDLE file, unsigned long long offset, const void* data, DWORD length)
+    {
+        OVERLAPPED at = {};
+        at.Offset = (DWORD)offset;
+        at.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD written = 0;
+        return WriteFile(file, data, length, &written, &at) && written == length;
+    }
+
+    /// <summary>
+    /// Cuts a file to a size.
+    /// </summary>
+    bool Truncate(HANDLE file, unsigned long long size)
+    {
+        LARGE_INTEGER position;
+        position.QuadPart = (LONGLONG)size;
+        return SetFilePointerEx(file, position, NULL, FILE_BEGIN) && SetEndOfFile(file);
+    }
+
+    /// <summary>
+    /// Gets the size of a file, 0 if it can't be read.
+    /// </summary>
+    unsigned long long SizeOf(HANDLE file)
+    {
+        LARGE_INTEGER size;
+        return GetFileSizeEx(file, &size) ? (unsigned long long)size.QuadPart : 0;
+    }
+
+    /// <summary>
+    /// Checks that a record's header is whole and its text fits in the log.
+    /// </summary>
+    /// <returns>The offset just past the record, or 0 if it is cut short.</returns>
+    unsigned long long RecordEnd(const RecordHeader& header, unsigned long long offset, unsigned long long logSize)
+    {
+        if (header.expressionLength > kMaxText || header.resultLength > kMaxText)
+            return 0;
+        unsigned long long end = offset + sizeof(RecordHeader) + header.expressionLength + header.resultLength;
+        return end <= logSize ? end : 0;
+    }
+
+    /// <summary>
+    /// Reads a record from the log file and checks it is whole: that it fits
+    /// and its checksum matches, so neither a torn write nor a tail the disk
+    /// filled with zeros passes.
+    /// </summary>
+    /// <param name="text">Receives the expression and the result, one after the other.</param>
+    /// <returns>The offset just past the record, or 0 if it isn't whole.</returns>
+    unsigned long long ReadWhole(HANDLE log, unsigned long long offset, unsigned long long logSize, RecordHeader& header, std::string& text)
+    {
+        if (offset + sizeof(header) > logSize || !ReadAt(log, offset, &header, sizeof(header)))
+            return 0;
+        unsigned long long end = RecordEnd(header, offset, logSize);
+        if (end == 0)
+            return 0;
+        text.assign((size_t)header.expressionLength + header.resultLength, '\0');
+        if (!text.empty() && !ReadAt(log, offset + sizeof(header), &text[0], (DWORD)text.size()))
+            return 0;
+        return RecordChecksum(header, text.data()) == header.checksum ? end : 0;
+    }
+}
+
+/// <summary>
+/// Constructor for the HistoryLog class. Nothing is open until Open.
+/// </summary>
+HistoryLog::HistoryLog()
+{
+    log = INVALID_HANDLE_VALUE;
+    index = INVALID_HANDLE_VALUE;
+    logMapping = NULL;
+    indexMapping = NULL;
+    logView = NULL;
+    indexView = NULL;
+    mappedLogSize = 0;
+    mappedCount = 0;
+    logSize = 0;
+    InitializeSRWLock(&lock);
+}
+
+/// <summary>
+/// Destructor. Closes the files if still open.
+/// </summary>
+HistoryLog::~HistoryLog()
+{
+    Close();
+}
+
+/// <summary>
+/// Gets the log's usual path.
+/// </summary>
+/// <returns>The path, or an empty string if %LOCALAPPDATA% isn't set.</returns>
+std::wstring HistoryLog::DefaultPath()
+{
+    wchar_t base[MAX_PATH];
+    DWORD length = GetEnvironmentVariableW(L"LOCALAPPDATA", base, MAX_PATH);
+    if (length == 0 || length >= MAX_PATH)
+        return std::wstring();
+
+    std::wstring folder = std::wstring(base, length) + kLogFolder;
+    CreateDirectoryW(folder.c_str(), NULL);
+    return folder + kLogFile;
+}
+
+/// <summary>
+/// Opens the log and its index and maps them.
+/// </summary>
+/// <param name="path">The log file; the index is the same path with ".idx" appended.</param>
+/// <returns>False if either file couldn't be opened, or the log isn't one.</returns>
+bool HistoryLog::Open(const std::wstring& path)
+{
+    Close();
+    if (path.empty())
+        return false;
+
+    // Other programs may read it, but only this one writes it.
+    log = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    index = CreateFileW((path + kIndexSuffix).c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (log == INVALID_HANDLE_VALUE || index == INVALID_HANDLE_VALUE || !Recover() || !Map()) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Unmaps and closes both files.
+/// </summary>
+void HistoryLog::Close()
+{
+    Unmap();
+    if (log != INVALID_HANDLE_VALUE) {
+        CloseHandle(log);
+        log = INVALID_HANDLE_VALUE;
+    }
+    if (index != INVALID_HANDLE_VALUE) {
+        CloseHandle(index);
+        index = INVALID_HANDLE_VALUE;
+    }
+    appended.clear();
+    logSize = 0;
+}
+
+/// <summary>
+/// Gets the number of records in the log.
+/// </summary>
+size_t HistoryLog::Count() const
+{
+    AcquireSRWLockShared(&lock);
+    size_t count = mappedCount + appended.size();
+    ReleaseSRWLockShared(&lock);
+    return count;
+}
+
+/// <summary>
+/// Reads one record.
+/// </summary>
+/// <param name="position">0 for the oldest record, up to Count() - 1 for the newest.</param>
+/// <param name="record">Receives the record.</param>
+/// <returns>False if there is no such record or it couldn't be read.</returns>
+bool HistoryLog::Read(size_t position, HistoryRecord& record) const
+{
+    AcquireSRWLockShared(&lock);
+    bool read = ReadRecord(position, record);
+    ReleaseSRWLockShared(&lock);
+    return read;
+}
+
+/// <summary>
+/// Reads one record, the lock being held.
+/// </summary>
+bool HistoryLog::ReadRecord(size_t position, HistoryRecord& record) const
+{
+    if (position >= mappedCount + appended.size())
+        return false;
+
+    const unsigned long long offset = Offset(position);
+    RecordHeader header;
+
+    if (position < mappedCount) {
+        // Only the pages of this record are read from disk.
+        if (offset + sizeof(header) > mappedLogSize)
+            return false;
+        std::memcpy(&header, logView + offset, sizeof(header));
+        if (RecordEnd(header, offset, mappedLogSize) == 0)
+            return false;
+
+        const char* text = logView + offset + sizeof(header);
+        if (RecordChecksum(header, text) != header.checksum)
+            return false;
+        record.expression.assign(text, header.expressionLength);
+        record.result.assign(text + header.expressionLength, header.resultLength);
+    }
+    else {
+        std::string text;
+        if (ReadWhole(log, offset, logSize, header, text) == 0)
+            return false;
+        record.expression.assign(text, 0, header.expressionLength);
+        record.result.assign(text, header.expressionLength, std::string::npos);
+    }
+
+    record.time = header.time;
+    record.latencyMicros = header.latencyMicros;
+    record.source = (HistorySource)header.source;
+    return true;
+}
+
+/// <summary>
+/// Appends a record.
+/// </summary>
+/// <param name="record">The record; text longer than 1 MB is cut.</param>
+/// <returns>False if the log isn't open or couldn't be written.</returns>
+bool HistoryLog::Append(const HistoryRecord& record)
+{
+    AcquireSRWLockExclusive(&lock);
+    bool appendedOne = AppendRecord(record);
+    ReleaseSRWLockExclusive(&lock);
+    return appendedOne;
+}
+
+/// <summary>
+/// Appends a record, the lock being held.
+/// </summary>
+bool HistoryLog::AppendRecord(const HistoryRecord& record)
+{
+    if (log == INVALID_HANDLE_VALUE)
+        return false;
+
+    RecordHeader header;
+    header.time = record.time;
+    header.latencyMicros = record.latencyMicros;
+    header.source = (unsigned int)record.source;
+    header.expressionLength = (unsigned int)(record.expression.size() < kMaxText ? record.expression.size() : kMaxText);
+    header.resultLength = (unsigned int)(record.result.size() < kMaxText ? record.result.size() : kMaxText);
+    header.reserved = 0;
+    header.checksum = 0;
+
+    // One write, so the record is either whole or cut short, never interleaved.
+    std::string bytes(sizeof(header) + header.expressionLength + header.resultLength, '\0');
+    std::memcpy(&bytes[0], &header, sizeof(header));
+    std::memcpy(&bytes[sizeof(header)], record.expression.data(), header.expressionLength);
+    std::memcpy(&bytes[sizeof(header) + header.expressionLength], record.result.data(), header.resultLength);
+    header.checksum = RecordChecksum(header, bytes.data() + sizeof(header));
+    std::memcpy(&bytes[0], &header, sizeof(header));
+
+    // The log first: a record the index misses is indexed again by Open,
+    // while an offset to a record that isn't there would have to be dropped.
+    const unsigned long long offset = logSize;
+    if (!WriteAt(log, offset, bytes.data(), (DWORD)bytes.size()))
+        return false;
+    if (!WriteAt(index, (unsigned long long)(mappedCount + appended.size()) * sizeof(offset), &offset, sizeof(offset)))
+        return false;
+
+    logSize += bytes.size();
+    appended.push_back(offset);
+    return true;
+}
+
+/// <summary>
+/// Deletes every record.
+/// </summary>
+/// <returns>False if the log isn't open or couldn't be emptied.</returns>
+bool HistoryLog::Clear()
+{
+    if (log == INVALID_HANDLE_VALUE)
+        return false;
+
+    // Mapped files can't be cut.
+    AcquireSRWLockExclusive(&lock);
+    Unmap();
+    appended.clear();
+    bool cleared = Truncate(index, 0) && Truncate(log, sizeof(kMagic));
+    if (cleared)
+        logSize = sizeof(kMagic);
+    ReleaseSRWLockExclusive(&lock);
+    return cleared;
+}
+
+/// <summary>
+/// Brings the index in line with the log after a write was cut short.
+/// </summary>
+/// <returns>False if the log isn't a history log or couldn't be repaired.</returns>
+bool HistoryLog::Recover()
+{
+    logSize = SizeOf(log);
+    if (logSize == 0) {
+        if (!WriteAt(log, 0, kMagic, sizeof(kMagic)) || !Truncate(index, 0))
+            return false;
+        logSize = sizeof(kMagic);
+        return true;
+    }
+
+    char magic[sizeof(kMagic)];
+    if (logSize < sizeof(kMagic) || !ReadAt(log, 0, magic, sizeof(magic)) || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0)
+        return false;
+
+    // Offsets at the end of the index whose records aren't whole in the log.
+    // The log is written first, so this takes a disk that lost writes, or
+    // one that grew the file but left zeros where the records should be.
+    unsigned long long count = SizeOf(index) / sizeof(unsigned long long);
+    unsigned long long end = sizeof(kMagic);
+    RecordHeader header;
+    std::string text;
+    while (count > 0) {
+        unsigned long long offset;
+        if (ReadAt(index, (count - 1) * sizeof(offset), &offset, sizeof(offset)) && offset >= sizeof(kMagic)
+            && (end = ReadWhole(log, offset, logSize, header, text)) != 0)
+            break;
+        end = sizeof(kMagic);
+        count--;
+    }
+    if (!Truncate(index, count * sizeof(unsigned long long)))
+        return false;
+
+    // Records written to the log whose offsets never made it to the index,
+    // up to the first one that isn't whole: nothing after it is trusted.
+    while (end < logSize) {
+        unsigned long long next = ReadWhole(log, end, logSize, header, text);
+        if (next == 0)
+            break;
+        if (!WriteAt(index, count * sizeof(end), &end, sizeof(end)))
+            return false;
+        count++;
+        end = next;
+    }
+
+    // Whatever is left is a record cut short, or zeros.
+    if (end < logSize) {
+        if (!Truncate(log, end))
+            return false;
+        logSize = end;
+    }
+    return true;
+}
+
+/// <summary>
+/// Maps the log and the index as they are now.
+/// </summary>
+/// <returns>False if either couldn't be mapped.</returns>
+bool HistoryLog::Map()
+{
+    unsigned long long indexSize = SizeOf(index);
+    if (indexSize == 0)
+        return true;
+
+    // Mapping the current size lets the files keep growing past the views.
+    logMapping = CreateFileMappingW(log, NULL, PAGE_READONLY, 0, 0, NULL);
+    indexMapping = CreateFileMappingW(index, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (logMapping == NULL || indexMapping == NULL)
+        return false;
+
+    logView = (const char*)MapViewOfFile(logMapping, FILE_MAP_READ, 0, 0, 0);
+    indexView = (const unsigned long long*)MapViewOfFile(indexMapping, FILE_MAP_READ, 0, 0, 0);
+    if (logView == NULL || indexView == NULL)
+        return false;
+
+    mappedLogSize = logSize;
+    mappedCount = (size_t)(indexSize / sizeof(unsigned long long));
+    return true;
+}
+
+/// <summary>
+/// Unmaps the views. The records in them are no longer counted.
+/// </summary>
+void HistoryLog::Unmap()
+{
+    if (logView != NULL) {
+        UnmapViewOfFile(logView);
+        logView = NULL;
+    }
+    if (indexView != NULL) {
+        UnmapViewOfFile(indexView);
+        indexView = NULL;
+    }
+    if (logMapping != NULL) {
+        CloseHandle(logMapping);
+        logMapping = NULL;
+    }
+    if (indexMapping != NULL) {
+        CloseHandle(indexMapping);
+        indexMapping = NULL;
+    }
+    mappedLogSize = 0;
+    mappedCount = 0;
+}
+
+/// <summary>
+/// Gets where a record starts in the log.
+/// </summary>
+unsigned long long HistoryLog::Offset(size_t position) const
+{
+    return position < mappedCount ? indexView[position] : appended[position - mappedCount];
+}
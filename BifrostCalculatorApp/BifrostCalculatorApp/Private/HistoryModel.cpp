@@ -0,0 +1,159 @@
+//HistoryModel.cpp
+
+#include "../public/HistoryModel.h"
+
+#include <utility>
+
+/// <summary>
+/// Constructor for the HistoryModel class. Starts empty.
+/// </summary>
+/// <param name="maxEntries">Entries kept before the oldest are dropped (at least 1).</param>
+HistoryModel::HistoryModel(size_t maxEntries)
+{
+    capacity = maxEntries > 0 ? maxEntries : 1;
+    oldest = 0;
+    count = 0;
+    nextId = 1;
+}
+
+/// <summary>
+/// Adds an operation as the newest entry.
+/// </summary>
+/// <param name="expression">The expression as typed.</param>
+/// <returns>The entry's id, for SetResult or Remove.</returns>
+unsigned long long HistoryModel::Add(const std::string& expression)
+{
+    // The buffer only grows until it is full; after that the newest entry
+    // takes the oldest one's slot, and its strings' storage with it.
+    if (ring.size() < capacity && count == ring.size()) {
+        ring.push_back(Entry());
+        count++;
+    }
+    else if (count < capacity) {
+        count++;
+    }
+    else {
+        oldest = (oldest + 1) % capacity;
+    }
+
+    Entry& entry = ring[Slot(count - 1)];
+    entry.id = nextId++;
+    entry.expression = expression;
+    entry.result.clear();
+    return entry.id;
+}
+
+/// <summary>
+/// Sets the result of an entry added earlier.
+/// </summary>
+/// <param name="id">The id Add returned.</param>
+/// <param name="result">The result, as shown after " = ".</param>
+/// <returns>False if the entry has been dropped or removed.</returns>
+bool HistoryModel::SetResult(unsigned long long id, const std::string& result)
+{
+    size_t index = Find(id);
+    if (index == count)
+        return false;
+
+    ring[Slot(index)].result = result;
+    return true;
+}
+
+/// <summary>
+/// Gets an entry by id.
+/// </summary>
+/// <param name="id">The id Add returned.</param>
+/// <returns>The entry, or NULL if it has been dropped or removed.</returns>
+const HistoryModel::Entry* HistoryModel::Get(unsigned long long id) const
+{
+    size_t index = Find(id);
+    return index == count ? NULL : &ring[Slot(index)];
+}
+
+/// <summary>
+/// Removes an entry.
+/// </summary>
+/// <param name="id">The id Add returned.</param>
+/// <returns>False if the entry has been dropped or removed already.</returns>
+bool HistoryModel::Remove(unsigned long long id)
+{
+    size_t index = Find(id);
+    if (index == count)
+        return false;
+
+    for (size_t i = index; i + 1 < count; i++)
+        std::swap(ring[Slot(i)], ring[Slot(i + 1)]);
+    count--;
+    return true;
+}
+
+/// <summary>
+/// Forgets every entry.
+/// </summary>
+void HistoryModel::Clear()
+{
+    oldest = 0;
+    count = 0;
+}
+
+/// <summary>
+/// Gets the number of entries kept.
+/// </summary>
+size_t HistoryModel::Count() const
+{
+    return count;
+}
+
+/// <summary>
+/// Gets the number of entries kept before the oldest are dropped.
+/// </summary>
+size_t HistoryModel::Capacity() const
+{
+    return capacity;
+}
+
+/// <summary>
+/// Gets an entry by its row in the list.
+/// </summary>
+/// <param name="row">0 for the newest entry, up to Count() - 1 for the oldest.</param>
+const HistoryModel::Entry& HistoryModel::At(size_t row) const
+{
+    return ring[Slot(count - 1 - row)];
+}
+
+/// <summary>
+/// Formats an operation the way the list shows it.
+/// </summary>
+/// <returns>"expression = result", with "..." while there is no result yet.</returns>
+std::string HistoryModel::Text(const std::string& expression, const std::string& result)
+{
+    return expression + " = " + (result.empty() ? std::string("...") : result);
+}
+
+/// <summary>
+/// Gets the slot of the index-th oldest entry.
+/// </summary>
+size_t HistoryModel::Slot(size_t index) const
+{
+    size_t slot = oldest + index;
+    return slot < ring.size() ? slot : slot - ring.size();
+}
+
+/// <summary>
+/// Looks an entry up by id. Ids only grow from the oldest entry to the
+/// newest, so a binary search finds it.
+/// </summary>
+/// <returns>Its index from the oldest, or Count() if it isn't kept.</returns>
+size_t HistoryModel::Find(unsigned long long id) const
+{
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (ring[Slot(middle)].id < id)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < count && ring[Slot(low)].id == id ? low : count;
+}
@@ -0,0 +1,357 @@
+//HistorySearch.cpp
+
+#include <algorithm>
+#include <cctype>
+
+#include "../public/HistorySearch.h"
+
+namespace {
+
+    // Keys of the queries shorter than a trigram: a character, or 256 plus a pair of them.
+    const size_t kShortKeys = 256 + 65536;
+
+    /// <summary>
+    /// Lowercases a character, the way every text and query is compared.
+    /// </summary>
+    char Lower(char c)
+    {
+        return (char)std::tolower((unsigned char)c);
+    }
+
+    /// <summary>
+    /// Gets a record's text as the list shows it, lowercased.
+    /// </summary>
+    std::string LowerText(const std::string& expression, const std::string& result)
+    {
+        std::string text = expression + " = " + result;
+        for (size_t i = 0; i < text.size(); i++)
+            text[i] = Lower(text[i]);
+        return text;
+    }
+
+    /// <summary>
+    /// Packs three characters into a trigram key.
+    /// </summary>
+    unsigned int Trigram(const char* text)
+    {
+        return ((unsigned int)(unsigned char)text[0] << 16) | ((unsigned int)(unsigned char)text[1] << 8) | (unsigned char)text[2];
+    }
+
+    /// <summary>
+    /// Gets the key of a one- or two-character text.
+    /// </summary>
+    size_t ShortKey(const char* text, size_t length)
+    {
+        if (length == 1)
+            return (unsigned char)text[0];
+        return 256 + (((size_t)(unsigned char)text[0] << 8) | (unsigned char)text[1]);
+    }
+
+    /// <summary>
+    /// Gets the mask bit of a lowercased character. Digits and letters get
+    /// a bit each; other characters share the rest, which only lets a few
+    /// more records through to the text check.
+    /// </summary>
+    unsigned long long MaskBit(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return 1ULL << (c - '0');
+        if (c >= 'a' && c <= 'z')
+            return 1ULL << (10 + c - 'a');
+        return 1ULL << (36 + (unsigned char)c % 28);
+    }
+
+    /// <summary>
+    /// Moves an end down a sorted list past the records newer than one.
+    /// Gallops, so a long list is crossed in a few steps.
+    /// </summary>
+    /// <param name="list">Record numbers, ascending.</param>
+    /// <param name="end">Only list[0..end) is looked at.</param>
+    /// <returns>The new end: list[0..end) holds the records up to record.</returns>
+    size_t SkipAbove(const std::vector<unsigned int>& list, size_t end, unsigned int record)
+    {
+        size_t step = 1;
+        size_t low = end;
+        while (low > 0 && list[low - 1] > record) {
+            end = low - 1;
+            low = low > step ? low - step : 0;
+            step *= 2;
+        }
+        // list[low - 1] <= record (or low is 0), list[end] > record: the boundary is in between.
+        return std::upper_bound(list.begin() + low, list.begin() + end, record) - list.begin();
+    }
+}
+
+/// <summary>
+/// Constructor for the HistorySearch class. Starts empty, with no thread.
+/// </summary>
+HistorySearch::HistorySearch()
+{
+    log = NULL;
+    thread = NULL;
+    more = CreateEventW(NULL, FALSE, FALSE, NULL);
+    stopping = 0;
+    InitializeSRWLock(&lock);
+    firstSeen.assign(kShortKeys, 0);
+    lastSeen.assign(kShortKeys, 0);
+}
+
+/// <summary>
+/// Destructor. Stops the thread if it is running.
+/// </summary>
+HistorySearch::~HistorySearch()
+{
+    Stop();
+    if (more != NULL)
+        CloseHandle(more);
+}
+
+/// <summary>
+/// Starts indexing a log on a background thread, from the first record not indexed yet.
+/// </summary>
+/// <param name="historyLog">The log; it must stay open until Stop.</param>
+/// <returns>False if the thread couldn't be started.</returns>
+bool HistorySearch::Start(const HistoryLog* historyLog)
+{
+    Stop();
+    if (more == NULL)
+        return false;
+
+    log = historyLog;
+    stopping = 0;
+    thread = CreateThread(NULL, 0, ThreadProc, this, 0, NULL);
+    return thread != NULL;
+}
+
+/// <summary>
+/// Stops the background thread.
+/// </summary>
+void HistorySearch::Stop()
+{
+    if (thread == NULL)
+        return;
+
+    // It only ever waits on more, and checks stopping between records.
+    InterlockedExchange(&stopping, 1);
+    SetEvent(more);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    thread = NULL;
+}
+
+/// <summary>
+/// Wakes the thread to index the records appended to the log.
+/// </summary>
+void HistorySearch::Wake()
+{
+    if (more != NULL)
+        SetEvent(more);
+}
+
+DWORD WINAPI HistorySearch::ThreadProc(LPVOID parameter)
+{
+    ((HistorySearch*)parameter)->Run();
+    return 0;
+}
+
+/// <summary>
+/// Indexes the log's records one at a time, then waits until more are appended.
+/// </summary>
+void HistorySearch::Run()
+{
+    HistoryRecord record;
+    while (!stopping) {
+        // Only this thread adds, so Count can't move under it.
+        const size_t next = Count();
+        if (next >= log->Count()) {
+            WaitForSingleObject(more, INFINITE);
+            continue;
+        }
+
+        // Even a record that can't be read takes its number, so the numbers stay log positions.
+        if (!log->Read(next, record)) {
+            record.expression.clear();
+            record.result.clear();
+        }
+        Add(record.expression, record.result);
+    }
+}
+
+/// <summary>
+/// Indexes a record.
+/// </summary>
+/// <param name="expression">The expression as typed.</param>
+/// <param name="result">Its result.</param>
+void HistorySearch::Add(const std::string& expression, const std::string& result)
+{
+    // Worked out before taking the lock, so a Find waits as little as possible.
+    const std::string text = LowerText(expression, result);
+    unsigned long long mask = 0;
+    for (size_t i = 0; i < text.size(); i++)
+        mask |= MaskBit(text[i]);
+
+    AcquireSRWLockExclusive(&lock);
+    const unsigned int record = (unsigned int)masks.size();
+    for (size_t i = 0; i < text.size(); i++) {
+        for (size_t length = 1; length <= 2 && i + length <= text.size(); length++) {
+            const size_t key = ShortKey(&text[i], length);
+            if (firstSeen[key] == 0)
+                firstSeen[key] = record + 1;
+            lastSeen[key] = record + 1;
+        }
+    }
+
+    // A trigram that occurs twice in the text lists the record once.
+    for (size_t i = 0; i + 3 <= text.size(); i++) {
+        std::vector<unsigned int>& list = postings[Trigram(&text[i])];
+        if (list.empty() || list.back() != record)
+            list.push_back(record);
+    }
+
+    masks.push_back(mask);
+    ReleaseSRWLockExclusive(&lock);
+}
+
+/// <summary>
+/// Gets the number of records indexed.
+/// </summary>
+size_t HistorySearch::Count() const
+{
+    AcquireSRWLockShared(&lock);
+    size_t count = masks.size();
+    ReleaseSRWLockShared(&lock);
+    return count;
+}
+
+/// <summary>
+/// Finds the newest records that contain a query.
+/// </summary>
+/// <param name="query">The text to look for, in any case.</param>
+/// <param name="limit">The most matches wanted.</param>
+/// <param name="matches">Receives the matching records' numbers, newest first.</param>
+/// <returns>The number of matches.</returns>
+size_t HistorySearch::Find(const std::string& query, size_t limit, std::vector<size_t>& matches) const
+{
+    AcquireSRWLockShared(&lock);
+    size_t found = FindRecords(query, limit, matches);
+    ReleaseSRWLockShared(&lock);
+    return found;
+}
+
+/// <summary>
+/// Finds the newest records that contain a query, the lock being held.
+/// </summary>
+size_t HistorySearch::FindRecords(const std::string& query, size_t limit, std::vector<size_t>& matches) const
+{
+    matches.clear();
+    if (query.empty() || limit == 0)
+        return 0;
+
+    std::string lowered(query);
+    unsigned long long mask = 0;
+    for (size_t i = 0; i < lowered.size(); i++) {
+        lowered[i] = Lower(lowered[i]);
+        mask |= MaskBit(lowered[i]);
+    }
+
+    if (lowered.size() < 3) {
+        // Only the records between the first and the last that have it.
+        const size_t key = ShortKey(lowered.data(), lowered.size());
+        if (lastSeen[key] == 0)
+            return 0;
+        const size_t oldest = firstSeen[key] - 1;
+        for (size_t record = lastSeen[key]; record-- > oldest && matches.size() < limit;) {
+            if ((masks[record] & mask) == mask && Contains(record, lowered))
+                matches.push_back(record);
+        }
+        return matches.size();
+    }
+
+    // The lists of the query's trigrams, shortest first. A trigram no
+    // record has means nothing matches.
+    std::vector<const std::vector<unsigned int>*> lists;
+    for (size_t i = 0; i + 3 <= lowered.size(); i++) {
+        std::unordered_map<unsigned int, std::vector<unsigned int> >::const_iterator found = postings.find(Trigram(&lowered[i]));
+        if (found == postings.end())
+            return 0;
+        if (std::find(lists.begin(), lists.end(), &found->second) == lists.end())
+            lists.push_back(&found->second);
+    }
+    std::sort(lists.begin(), lists.end(), [](const std::vector<unsigned int>* a, const std::vector<unsigned int>* b) {
+        return a->size() < b->size();
+    });
+
+    // Newest first through the shortest list, each other list being walked
+    // down alongside it, so no list is read more than once. Having every
+    // trigram doesn't mean having them in a row, so the text has the last word.
+    const std::vector<unsigned int>& shortest = *lists[0];
+    std::vector<size_t> ends(lists.size());
+    for (size_t j = 0; j < lists.size(); j++)
+        ends[j] = lists[j]->size();
+
+    for (size_t i = shortest.size(); i-- > 0 && matches.size() < limit;) {
+        const unsigned int record = shortest[i];
+        bool candidate = true;
+        for (size_t j = 1; j < lists.size() && candidate; j++) {
+            ends[j] = SkipAbove(*lists[j], ends[j], record);
+            candidate = ends[j] > 0 && (*lists[j])[ends[j] - 1] == record;
+        }
+        if (candidate && Contains(record, lowered))
+            matches.push_back(record);
+    }
+    return matches.size();
+}
+
+/// <summary>
+/// Checks whether records indexed since a Find could match its query.
+/// Only looks at the newest record of each key the query has.
+/// </summary>
+/// <param name="query">The text looked for, in any case.</param>
+/// <param name="from">The Count() the Find saw.</param>
+/// <returns>False if none of the records numbered from on can contain query.</returns>
+bool HistorySearch::MayMatchSince(const std::string& query, size_t from) const
+{
+    if (query.empty())
+        return false;
+
+    std::string lowered(query);
+    for (size_t i = 0; i < lowered.size(); i++)
+        lowered[i] = Lower(lowered[i]);
+
+    AcquireSRWLockShared(&lock);
+    bool may = true;
+    if (lowered.size() < 3)
+        may = lastSeen[ShortKey(lowered.data(), lowered.size())] > from;
+    for (size_t i = 0; i + 3 <= lowered.size() && may; i++) {
+        std::unordered_map<unsigned int, std::vector<unsigned int> >::const_iterator found = postings.find(Trigram(&lowered[i]));
+        may = found != postings.end() && found->second.back() >= from;
+    }
+    ReleaseSRWLockShared(&lock);
+    return may;
+}
+
+/// <summary>
+/// Forgets every record.
+/// </summary>
+void HistorySearch::Clear()
+{
+    AcquireSRWLockExclusive(&lock);
+    postings.clear();
+    firstSeen.assign(kShortKeys, 0);
+    lastSeen.assign(kShortKeys, 0);
+    masks.clear();
+    ReleaseSRWLockExclusive(&lock);
+}
+
+/// <summary>
+/// Checks whether a record's text contains a query, reading it from the log.
+/// </summary>
+/// <param name="query">The query, lowercased.</param>
+bool HistorySearch::Contains(size_t record, const std::string& query) const
+{
+    HistoryRecord read;
+    if (log == NULL || !log->Read(record, read))
+        return false;
+    const std::string text = LowerText(read.expression, read.result);
+    return text.find(query) != std::string::npos;
+}
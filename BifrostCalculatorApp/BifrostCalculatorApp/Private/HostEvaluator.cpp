@@ -0,0 +1,258 @@
+//HostEvaluator.cpp
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+#include <windows.h>
+#include "../public/HostEvaluator.h"
+
+namespace {
+
+    // Expressions per chunk: enough to make the interlocked increment that
+    // claims a chunk negligible, few enough to balance uneven expressions.
+    const size_t kChunkSize = 64;
+
+    // Same as targetBufferSize in ExpressionsHandler.ino (one byte is the terminator).
+    const size_t kTargetBufferSize = 200;
+
+    // Largest magnitude Arduino's Print::printFloat prints before giving up with "ovf".
+    const double kPrintFloatLimit = 4294967040.0;
+
+    /// <summary>
+    /// Same characters Arduino's String::trim removes.
+    /// </summary>
+    bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+    }
+}
+
+/// <summary>
+/// Constructor for the HostEvaluator class. Starts the worker threads.
+/// </summary>
+/// <param name="threadCount">Threads to use, including the caller (0 for one per logical processor).</param>
+HostEvaluator::HostEvaluator(unsigned int threadCount)
+{
+    InitializeSRWLock(&lock);
+    InitializeConditionVariable(&wake);
+    InitializeConditionVariable(&done);
+    generation = 0;
+    busy = 0;
+    stopping = false;
+    expressions = NULL;
+    results = NULL;
+    count = 0;
+
+    if (threadCount == 0) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        threadCount = info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+    }
+
+    ranges.resize(threadCount);
+    for (unsigned int i = 0; i < threadCount; i++) {
+        Worker* worker = new Worker();
+        worker->owner = this;
+        worker->index = i;
+        worker->thread = NULL;
+        workers.push_back(worker);
+    }
+
+    // Worker 0 belongs to the thread that calls Evaluate. If a thread can't
+    // be started, its range is simply stolen by the others.
+    for (unsigned int i = 1; i < threadCount; i++)
+        workers[i]->thread = CreateThread(NULL, 0, ThreadProc, workers[i], 0, NULL);
+}
+
+/// <summary>
+/// Destructor. Stops and joins the worker threads.
+/// </summary>
+HostEvaluator::~HostEvaluator()
+{
+    AcquireSRWLockExclusive(&lock);
+    stopping = true;
+    ReleaseSRWLockExclusive(&lock);
+    WakeAllConditionVariable(&wake);
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        if (workers[i]->thread != NULL) {
+            WaitForSingleObject(workers[i]->thread, INFINITE);
+            CloseHandle(workers[i]->thread);
+        }
+        delete workers[i];
+    }
+}
+
+/// <summary>
+/// Gets the number of threads a batch is spread over, including the caller.
+/// </summary>
+unsigned int HostEvaluator::Threads() const
+{
+    return (unsigned int)workers.size();
+}
+
+/// <summary>
+/// Evaluates a batch of expressions on every thread.
+/// </summary>
+/// <param name="batch">The expressions, as they would be sent to the board.</param>
+/// <param name="batchCount">How many expressions there are.</param>
+/// <param name="batchResults">Receives one result per expression, in the same order.</param>
+void HostEvaluator::Evaluate(const std::string* batch, size_t batchCount, HostResult* batchResults)
+{
+    if (batchCount == 0)
+        return;
+
+    // Dealing the chunks out evenly; stealing evens out whatever is left.
+    const LONG64 chunks = (LONG64)((batchCount + kChunkSize - 1) / kChunkSize);
+    const LONG64 participants = (LONG64)workers.size();
+
+    AcquireSRWLockExclusive(&lock);
+    expressions = batch;
+    results = batchResults;
+    count = batchCount;
+    for (LONG64 i = 0; i < participants; i++) {
+        ranges[(size_t)i].next = chunks * i / participants;
+        ranges[(size_t)i].end = chunks * (i + 1) / participants;
+    }
+    busy = 0;
+    for (size_t i = 1; i < workers.size(); i++) {
+        if (workers[i]->thread != NULL)
+            busy++;
+    }
+    generation++;
+    ReleaseSRWLockExclusive(&lock);
+    WakeAllConditionVariable(&wake);
+
+    Work(*workers[0]);
+
+    AcquireSRWLockExclusive(&lock);
+    while (busy > 0)
+        SleepConditionVariableSRW(&done, &lock, INFINITE, 0);
+    expressions = NULL;
+    results = NULL;
+    count = 0;
+    ReleaseSRWLockExclusive(&lock);
+}
+
+/// <summary>
+/// Evaluates one line the way the firmware's loop does.
+/// </summary>
+/// <param name="expression">The compile arena to use.</param>
+/// <param name="line">The received line, without its newline.</param>
+/// <param name="length">Length of the line.</param>
+/// <param name="scratch">Receives the text actually compiled.</param>
+/// <returns>The value, or NaN and the error position on a syntax error.</returns>
+HostResult HostEvaluator::EvaluateLine(Expression& expression, const char* line, size_t length, std::string& scratch)
+{
+    // input.trim(), then toCharArray into the fixed size buffer.
+    size_t first = 0;
+    while (first < length && IsSpace(line[first]))
+        first++;
+    while (length > first && IsSpace(line[length - 1]))
+        length--;
+    if (length - first > kTargetBufferSize - 1)
+        length = first + kTargetBufferSize - 1;
+    scratch.assign(line + first, length - first);
+
+    HostResult result;
+    if (!expression.Compile(scratch, &result.errorPosition)) {
+        result.value = std::numeric_limits<double>::quiet_NaN();
+        return result;
+    }
+
+    result.value = expression.Evaluate();
+    return result;
+}
+
+/// <summary>
+/// Formats a result the way the firmware prints it.
+/// </summary>
+/// <param name="result">The result to format.</param>
+/// <param name="buffer">Receives the text, null-terminated.</param>
+/// <param name="size">Size of buffer.</param>
+/// <returns>The length of the text.</returns>
+size_t HostEvaluator::FormatReply(const HostResult& result, char* buffer, size_t size)
+{
+    int length;
+
+    // Serial.println(result, 6), including printFloat's special cases.
+    if (result.errorPosition != 0)
+        length = std::snprintf(buffer, size, "nanSyntax error at position: %d", result.errorPosition);
+    else if (std::isinf(result.value))
+        length = std::snprintf(buffer, size, "inf");
+    else if (std::isnan(result.value))
+        length = std::snprintf(buffer, size, "nan");
+    else if (result.value > kPrintFloatLimit || result.value < -kPrintFloatLimit)
+        length = std::snprintf(buffer, size, "ovf");
+    else
+        length = std::snprintf(buffer, size, "%.6f", result.value);
+
+    if (length < 0)
+        return 0;
+    return (size_t)length < size ? (size_t)length : size - 1;
+}
+
+/// <summary>
+/// Thread entry point.
+/// </summary>
+DWORD WINAPI HostEvaluator::ThreadProc(LPVOID parameter)
+{
+    Worker* worker = static_cast<Worker*>(parameter);
+    worker->owner->Run(*worker);
+    return 0;
+}
+
+/// <summary>
+/// Waits for batches and works on each of them until shutdown.
+/// </summary>
+void HostEvaluator::Run(Worker& worker)
+{
+    unsigned long long seen = 0;
+
+    for (;;) {
+        AcquireSRWLockExclusive(&lock);
+        while (!stopping && generation == seen)
+            SleepConditionVariableSRW(&wake, &lock, INFINITE, 0);
+        if (stopping) {
+            ReleaseSRWLockExclusive(&lock);
+            return;
+        }
+        seen = generation;
+        ReleaseSRWLockExclusive(&lock);
+
+        Work(worker);
+
+        AcquireSRWLockExclusive(&lock);
+        bool last = --busy == 0;
+        ReleaseSRWLockExclusive(&lock);
+        if (last)
+            WakeAllConditionVariable(&done);
+    }
+}
+
+/// <summary>
+/// Claims and evaluates chunks: first from the worker's own range, then
+/// from every other range until none has any left.
+/// </summary>
+void HostEvaluator::Work(Worker& worker)
+{
+    const size_t participants = ranges.size();
+
+    for (size_t r = 0; r < participants; r++) {
+        Range& range = ranges[(worker.index + r) % participants];
+
+        for (;;) {
+            // Claiming past the end is harmless: next is reset for every batch.
+            LONG64 chunk = InterlockedIncrement64(&range.next) - 1;
+            if (chunk >= range.end)
+                break;
+
+            size_t first = (size_t)chunk * kChunkSize;
+            size_t last = first + kChunkSize < count ? first + kChunkSize : count;
+            for (size_t i = first; i < last; i++)
+                results[i] = EvaluateLine(worker.expression, expressions[i].data(), expressions[i].size(), worker.input);
+        }
+    }
+}
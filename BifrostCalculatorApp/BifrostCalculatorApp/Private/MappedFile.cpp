@@ -0,0 +1,335 @@
+//MappedFile.cpp
+
+#include <cstring>
+
+#include <windows.h>
+#include "../public/MappedFile.h"
+
+namespace {
+
+    // Size of the mapped window. A multiple of the 64 KB allocation
+    // granularity, so window offsets are always valid view offsets.
+    const size_t kWindowSize = 64 * 1024 * 1024;
+
+    /// <summary>
+    /// Gets the granularity view offsets have to be aligned to.
+    /// </summary>
+    unsigned long long AllocationGranularity()
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwAllocationGranularity;
+    }
+}
+
+/// <summary>
+/// Constructor for the MappedFileReader class.
+/// </summary>
+MappedFileReader::MappedFileReader()
+{
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+    view = NULL;
+    viewOffset = 0;
+    viewSize = 0;
+    fileSize = 0;
+    position = 0;
+}
+
+/// <summary>
+/// Destructor. Closes the file if still open.
+/// </summary>
+MappedFileReader::~MappedFileReader()
+{
+    Close();
+}
+
+/// <summary>
+/// Opens a file for reading through a mapping.
+/// </summary>
+/// <param name="path">The file to read.</param>
+/// <returns>True if the file was opened (an empty file is fine).</returns>
+bool MappedFileReader::Open(LPCWSTR path)
+{
+    Close();
+
+    file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        Close();
+        return false;
+    }
+    fileSize = (unsigned long long)size.QuadPart;
+
+    // An empty file can't be mapped, but has no lines either.
+    if (fileSize == 0)
+        return true;
+
+    mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Unmaps and closes the file.
+/// </summary>
+void MappedFileReader::Close()
+{
+    if (view != NULL) {
+        UnmapViewOfFile(view);
+        view = NULL;
+    }
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+        mapping = NULL;
+    }
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+    viewOffset = 0;
+    viewSize = 0;
+    fileSize = 0;
+    position = 0;
+}
+
+/// <summary>
+/// Gets the next line of the file.
+/// </summary>
+/// <param name="text">Receives the start of the line, inside the mapping.</param>
+/// <param name="length">Receives the length of the line, without its line ending.</param>
+/// <returns>False at the end of the file or if the file could not be mapped.</returns>
+bool MappedFileReader::Next(const char*& text, size_t& length)
+{
+    while (position < fileSize) {
+        const unsigned long long viewEnd = viewOffset + viewSize;
+
+        if (view != NULL && position >= viewOffset && position < viewEnd) {
+            const char* start = view + (position - viewOffset);
+            const char* end = view + viewSize;
+            const char* newline = static_cast<const char*>(std::memchr(start, '\n', end - start));
+
+            // The last line of the file doesn't need a newline.
+            if (newline == NULL && viewEnd == fileSize)
+                newline = end;
+
+            if (newline != NULL) {
+                text = start;
+                length = newline - start;
+                position += length + (newline != end ? 1 : 0);
+                if (length > 0 && text[length - 1] == '\r')
+                    length--;
+                return true;
+            }
+        }
+
+        // The line runs past the window: moving the window to the line, and
+        // doubling it if the line alone is longer than the window was.
+        unsigned long long needed = kWindowSize;
+        if (view != NULL && position >= viewOffset && viewEnd - position >= kWindowSize / 2)
+            needed = 2 * (viewEnd - position);
+        if (!MapWindow(position, needed))
+            return false;
+    }
+    return false;
+}
+
+/// <summary>
+/// Gets the size of the file in bytes.
+/// </summary>
+unsigned long long MappedFileReader::Size() const
+{
+    return fileSize;
+}
+
+/// <summary>
+/// Gets the file offset of the next line.
+/// </summary>
+unsigned long long MappedFileReader::Position() const
+{
+    return position;
+}
+
+/// <summary>
+/// Maps a window of the file covering a range.
+/// </summary>
+/// <param name="offset">First byte the window must cover.</param>
+/// <param name="length">Number of bytes from offset it must cover (less at the end of the file).</param>
+/// <returns>True if the window was mapped.</returns>
+bool MappedFileReader::MapWindow(unsigned long long offset, unsigned long long length)
+{
+    if (view != NULL) {
+        UnmapViewOfFile(view);
+        view = NULL;
+    }
+
+    static const unsigned long long granularity = AllocationGranularity();
+    unsigned long long start = offset - offset % granularity;
+    unsigned long long end = offset + length;
+    if (end > fileSize)
+        end = fileSize;
+
+    // Views have to fit in a size_t, which only matters for 32-bit builds.
+    if (end - start > (size_t)-1 / 2)
+        return false;
+
+    view = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(start >> 32), (DWORD)start, (SIZE_T)(end - start)));
+    if (view == NULL)
+        return false;
+
+    viewOffset = start;
+    viewSize = (size_t)(end - start);
+    return true;
+}
+
+/// <summary>
+/// Constructor for the MappedFileWriter class.
+/// </summary>
+MappedFileWriter::MappedFileWriter()
+{
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+    view = NULL;
+    viewOffset = 0;
+    used = 0;
+    reserved = 0;
+}
+
+/// <summary>
+/// Destructor. Closes the file if still open.
+/// </summary>
+MappedFileWriter::~MappedFileWriter()
+{
+    Close();
+}
+
+/// <summary>
+/// Creates a file to be written through a mapping.
+/// </summary>
+/// <param name="path">The file to create. An existing file is truncated.</param>
+/// <param name="sizeHint">Expected size, preallocated up front (0 to grow as needed).</param>
+/// <returns>True if the file was created and its first window mapped.</returns>
+bool MappedFileWriter::Create(LPCWSTR path, unsigned long long sizeHint)
+{
+    Close();
+
+    file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    reserved = sizeHint;
+    if (!MapWindow(0)) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Appends bytes to the file.
+/// </summary>
+/// <param name="data">The bytes to write.</param>
+/// <param name="length">How many bytes to write.</param>
+/// <returns>False if the next window could not be mapped.</returns>
+bool MappedFileWriter::Append(const char* data, size_t length)
+{
+    if (view == NULL)
+        return false;
+
+    while (length > 0) {
+        if (used == kWindowSize && !MapWindow(viewOffset + kWindowSize))
+            return false;
+
+        size_t chunk = kWindowSize - used;
+        if (chunk > length)
+            chunk = length;
+
+        std::memcpy(view + used, data, chunk);
+        used += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+/// <summary>
+/// Unmaps the file and cuts it to the number of bytes written.
+/// </summary>
+/// <returns>False if the file could not be trimmed.</returns>
+bool MappedFileWriter::Close()
+{
+    if (file == INVALID_HANDLE_VALUE)
+        return true;
+
+    unsigned long long length = Written();
+
+    if (view != NULL) {
+        UnmapViewOfFile(view);
+        view = NULL;
+    }
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+        mapping = NULL;
+    }
+
+    // The mapping grew the file a whole window (or sizeHint) at a time.
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)length;
+    bool trimmed = SetFilePointerEx(file, end, NULL, FILE_BEGIN) && SetEndOfFile(file);
+
+    CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+    viewOffset = 0;
+    used = 0;
+    reserved = 0;
+    return trimmed;
+}
+
+/// <summary>
+/// Gets the number of bytes appended so far.
+/// </summary>
+unsigned long long MappedFileWriter::Written() const
+{
+    return viewOffset + used;
+}
+
+/// <summary>
+/// Maps the window starting at an offset, growing the file to hold it.
+/// </summary>
+/// <param name="offset">Start of the window, a multiple of the window size.</param>
+/// <returns>True if the window was mapped.</returns>
+bool MappedFileWriter::MapWindow(unsigned long long offset)
+{
+    if (view != NULL) {
+        UnmapViewOfFile(view);
+        view = NULL;
+    }
+
+    // A mapping can't be larger than the file it was created with, so a new
+    // one (which extends the file) is needed whenever the window passes its end.
+    unsigned long long end = offset + kWindowSize;
+    if (mapping == NULL || end > reserved) {
+        if (mapping != NULL)
+            CloseHandle(mapping);
+        if (end > reserved)
+            reserved = end;
+
+        mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, (DWORD)(reserved >> 32), (DWORD)reserved, NULL);
+        if (mapping == NULL)
+            return false;
+    }
+
+    view = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)offset, kWindowSize));
+    if (view == NULL)
+        return false;
+
+    viewOffset = offset;
+    used = 0;
+    return true;
+}
@@ -0,0 +1,300 @@
+//SharedRing.cpp
+
+#include <cstring>
+
+#include <windows.h>
+#include "../public/SharedRing.h"
+
+namespace {
+
+    // Suffixes of the four events of a channel.
+    const wchar_t* const kEventSuffixes[4] = { L"-request", L"-request-space", L"-reply", L"-reply-space" };
+
+    /// <summary>
+    /// Waits for an event, giving up when cancel is set or the timeout elapses.
+    /// </summary>
+    /// <returns>True if the event was signalled.</returns>
+    bool WaitEvent(HANDLE event, HANDLE cancel, DWORD timeoutMs)
+    {
+        HANDLE handles[2] = { event, cancel };
+        return WaitForMultipleObjects(cancel != NULL ? 2 : 1, handles, FALSE, timeoutMs) == WAIT_OBJECT_0;
+    }
+}
+
+/// <summary>
+/// Constructor for the SharedRing class. The ring is unusable until Attach.
+/// </summary>
+SharedRing::SharedRing()
+{
+    control = NULL;
+    slots = NULL;
+    dataEvent = NULL;
+    spaceEvent = NULL;
+}
+
+/// <summary>
+/// Gets the number of bytes of shared memory one ring needs.
+/// </summary>
+size_t SharedRing::MemorySize()
+{
+    return sizeof(Control) + kSlotSize * kSlotCount;
+}
+
+/// <summary>
+/// Lays the ring over shared memory.
+/// </summary>
+/// <param name="memory">MemorySize() bytes in a mapping both sides see, zeroed when created.</param>
+/// <param name="data">Event the producer signals for a waiting consumer.</param>
+/// <param name="space">Event the consumer signals for a waiting producer.</param>
+void SharedRing::Attach(void* memory, HANDLE data, HANDLE space)
+{
+    control = static_cast<Control*>(memory);
+    slots = static_cast<char*>(memory) + sizeof(Control);
+    dataEvent = data;
+    spaceEvent = space;
+}
+
+/// <summary>
+/// Copies a line into the next free slot and publishes it.
+/// </summary>
+/// <param name="data">The line, without its newline.</param>
+/// <param name="length">Length of the line; anything past kSlotPayload is cut.</param>
+/// <param name="timeoutMs">How long to wait for a free slot.</param>
+/// <param name="cancel">Event that ends the wait early, or NULL.</param>
+/// <returns>False if no slot became free in time.</returns>
+bool SharedRing::Push(const char* data, size_t length, DWORD timeoutMs, HANDLE cancel)
+{
+    while (Full()) {
+        // Saying we are about to sleep, then checking again, so a slot freed
+        // in between is not missed.
+        InterlockedExchange(&control->producerWaiting, 1);
+        bool full = Full();
+        if (full && !WaitEvent(spaceEvent, cancel, timeoutMs)) {
+            InterlockedExchange(&control->producerWaiting, 0);
+            return false;
+        }
+        InterlockedExchange(&control->producerWaiting, 0);
+    }
+
+    if (length > kSlotPayload)
+        length = kSlotPayload;
+
+    const LONG tail = control->tail;
+    char* slot = slots + (size_t)((ULONG)tail % kSlotCount) * kSlotSize;
+    std::memcpy(slot + sizeof(LONG), data, length);
+    *reinterpret_cast<LONG*>(slot) = (LONG)length;
+
+    // The interlocked write orders the slot before the new tail, and the
+    // waiting flag is read after it.
+    InterlockedExchange(&control->tail, tail + 1);
+    if (control->consumerWaiting)
+        SetEvent(dataEvent);
+    return true;
+}
+
+/// <summary>
+/// Gets the oldest line without copying it or waiting.
+/// </summary>
+/// <param name="data">Receives a pointer into the slot, valid until Pop.</param>
+/// <param name="length">Receives the length of the line.</param>
+/// <returns>False if the ring is empty.</returns>
+bool SharedRing::Front(const char*& data, size_t& length)
+{
+    if (Empty())
+        return false;
+
+    const char* slot = slots + (size_t)((ULONG)control->head % kSlotCount) * kSlotSize;
+    LONG stored = *reinterpret_cast<const LONG*>(slot);
+    length = stored >= 0 && (size_t)stored <= kSlotPayload ? (size_t)stored : 0;
+    data = slot + sizeof(LONG);
+    return true;
+}
+
+/// <summary>
+/// Frees the oldest slot for the producer.
+/// </summary>
+void SharedRing::Pop()
+{
+    InterlockedExchange(&control->head, control->head + 1);
+    if (control->producerWaiting)
+        SetEvent(spaceEvent);
+}
+
+/// <summary>
+/// Waits until there is a line to read.
+/// </summary>
+/// <param name="timeoutMs">How long to wait.</param>
+/// <param name="cancel">Event that ends the wait early, or NULL.</param>
+/// <returns>True if a line is there.</returns>
+bool SharedRing::WaitForData(DWORD timeoutMs, HANDLE cancel)
+{
+    while (Arm()) {
+        bool signalled = WaitEvent(dataEvent, cancel, timeoutMs);
+        Disarm();
+        if (!signalled)
+            return !Empty();
+    }
+    return true;
+}
+
+/// <summary>
+/// Tells the producer the consumer is about to wait for DataEvent().
+/// </summary>
+/// <returns>False if a line is already there, in which case there is nothing to wait for.</returns>
+bool SharedRing::Arm()
+{
+    InterlockedExchange(&control->consumerWaiting, 1);
+    if (!Empty()) {
+        InterlockedExchange(&control->consumerWaiting, 0);
+        return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Ends a wait started with Arm.
+/// </summary>
+void SharedRing::Disarm()
+{
+    InterlockedExchange(&control->consumerWaiting, 0);
+}
+
+/// <summary>
+/// Gets the event the producer signals for an armed consumer.
+/// </summary>
+HANDLE SharedRing::DataEvent() const
+{
+    return dataEvent;
+}
+
+/// <summary>
+/// Tells whether every published line has been read.
+/// </summary>
+bool SharedRing::Empty()
+{
+    // The interlocked read orders the slot contents after the tail.
+    return InterlockedCompareExchange(&control->tail, 0, 0) == control->head;
+}
+
+/// <summary>
+/// Tells whether every slot holds a line not read yet.
+/// </summary>
+bool SharedRing::Full()
+{
+    return (ULONG)(control->tail - InterlockedCompareExchange(&control->head, 0, 0)) >= (ULONG)kSlotCount;
+}
+
+/// <summary>
+/// Constructor for the SharedChannel class.
+/// </summary>
+SharedChannel::SharedChannel()
+{
+    mapping = NULL;
+    view = NULL;
+    for (int i = 0; i < 4; i++)
+        events[i] = NULL;
+}
+
+/// <summary>
+/// Destructor. Unmaps the channel.
+/// </summary>
+SharedChannel::~SharedChannel()
+{
+    Close();
+}
+
+/// <summary>
+/// Creates the mapping and events of a new channel.
+/// </summary>
+/// <param name="name">Channel name, unique on the machine (e.g. with the process id in it).</param>
+/// <returns>True if the channel is ready.</returns>
+bool SharedChannel::Create(const std::wstring& name)
+{
+    return Attach(true, name);
+}
+
+/// <summary>
+/// Opens a channel the other side created.
+/// </summary>
+/// <param name="name">The name the channel was created under.</param>
+/// <returns>True if the channel is ready.</returns>
+bool SharedChannel::Open(const std::wstring& name)
+{
+    return Attach(false, name);
+}
+
+/// <summary>
+/// Unmaps the channel and closes its events.
+/// </summary>
+void SharedChannel::Close()
+{
+    if (view != NULL) {
+        UnmapViewOfFile(view);
+        view = NULL;
+    }
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+        mapping = NULL;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (events[i] != NULL) {
+            CloseHandle(events[i]);
+            events[i] = NULL;
+        }
+    }
+}
+
+/// <summary>
+/// Gets the ring of requests, from the client to the broker.
+/// </summary>
+SharedRing& SharedChannel::Requests()
+{
+    return requests;
+}
+
+/// <summary>
+/// Gets the ring of replies, from the broker to the client.
+/// </summary>
+SharedRing& SharedChannel::Replies()
+{
+    return replies;
+}
+
+/// <summary>
+/// Creates or opens the mapping and events and lays the two rings over them.
+/// </summary>
+bool SharedChannel::Attach(bool create, const std::wstring& name)
+{
+    Close();
+
+    const std::wstring base = L"Local\\" + name;
+    const DWORD size = (DWORD)(2 * SharedRing::MemorySize());
+
+    // A new mapping backed by the paging file starts out zeroed.
+    mapping = create ? CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, base.c_str())
+                     : OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, base.c_str());
+    if (mapping == NULL || (create && GetLastError() == ERROR_ALREADY_EXISTS)) {
+        Close();
+        return false;
+    }
+
+    view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (view == NULL) {
+        Close();
+        return false;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        const std::wstring eventName = base + kEventSuffixes[i];
+        events[i] = create ? CreateEventW(NULL, FALSE, FALSE, eventName.c_str())
+                           : OpenEventW(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, eventName.c_str());
+        if (events[i] == NULL) {
+            Close();
+            return false;
+        }
+    }
+
+    requests.Attach(view, events[0], events[1]);
+    replies.Attach(static_cast<char*>(view) + SharedRing::MemorySize(), events[2], events[3]);
+    return true;
+}
@@ -0,0 +1,302 @@
+//VectorMath.cpp
+
+#include <cmath>
+
+#include "../public/VectorMath.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#define BIFROST_VECTOR_X86
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+// The SVML intrinsics (_mm256_sin_pd and friends) ship with Visual Studio 2019 and later.
+#if defined(BIFROST_VECTOR_X86) && defined(_MSC_VER) && _MSC_VER >= 1920
+#define BIFROST_VECTOR_SVML
+#endif
+
+// Intrinsics can't be compiled to MSIL, so the kernels stay native in the /clr app.
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace {
+
+#ifdef BIFROST_VECTOR_X86
+    /// <summary>
+    /// Checks that the processor has AVX and that the OS saves the YMM registers.
+    /// </summary>
+    bool DetectAvx()
+    {
+        int info[4];
+        __cpuid(info, 1);
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool avx = (info[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx)
+            return false;
+        return (_xgetbv(0) & 6) == 6;
+    }
+#endif
+
+    // Each operation has a 4-lane AVX, a 2-lane SSE2 and a scalar form.
+
+    struct AddOp {
+#ifdef BIFROST_VECTOR_X86
+        static __m256d Avx(__m256d a, __m256d b) { return _mm256_add_pd(a, b); }
+        static __m128d Sse(__m128d a, __m128d b) { return _mm_add_pd(a, b); }
+#endif
+        static double Scalar(double a, double b) { return a + b; }
+    };
+
+    struct SubtractOp {
+#ifdef BIFROST_VECTOR_X86
+        static __m256d Avx(__m256d a, __m256d b) { return _mm256_sub_pd(a, b); }
+        static __m128d Sse(__m128d a, __m128d b) { return _mm_sub_pd(a, b); }
+#endif
+        static double Scalar(double a, double b) { return a - b; }
+    };
+
+    struct MultiplyOp {
+#ifdef BIFROST_VECTOR_X86
+        static __m256d Avx(__m256d a, __m256d b) { return _mm256_mul_pd(a, b); }
+        static __m128d Sse(__m128d a, __m128d b) { return _mm_mul_pd(a, b); }
+#endif
+        static double Scalar(double a, double b) { return a * b; }
+    };
+
+    struct DivideOp {
+#ifdef BIFROST_VECTOR_X86
+        static __m256d Avx(__m256d a, __m256d b) { return _mm256_div_pd(a, b); }
+        static __m128d Sse(__m128d a, __m128d b) { return _mm_div_pd(a, b); }
+#endif
+        static double Scalar(double a, double b) { return a / b; }
+    };
+
+    struct NegateOp {
+#ifdef BIFROST_VECTOR_X86
+        static __m256d Avx(__m256d a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+        static __m128d Sse(__m128d a) { return _mm_xor_pd(a, _mm_set1_pd(-0.0)); }
+#endif
+        static double Scalar(double a) { return -a; }
+    };
+
+    struct AbsOp {
+#ifdef BIFROST_VECTOR_X86
+        static __m256d Avx(__m256d a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+        static __m128d Sse(__m128d a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+#endif
+        static double Scalar(double a) { return std::fabs(a); }
+    };
+
+    struct SqrtOp {
+#ifdef BIFROST_VECTOR_X86
+        static __m256d Avx(__m256d a) { return _mm256_sqrt_pd(a); }
+        static __m128d Sse(__m128d a) { return _mm_sqrt_pd(a); }
+#endif
+        static double Scalar(double a) { return std::sqrt(a); }
+    };
+
+    struct SinOp {
+#ifdef BIFROST_VECTOR_SVML
+        static __m256d Avx(__m256d a) { return _mm256_sin_pd(a); }
+        static __m128d Sse(__m128d a) { return _mm_sin_pd(a); }
+#endif
+        static double Scalar(double a) { return std::sin(a); }
+    };
+
+    struct CosOp {
+#ifdef BIFROST_VECTOR_SVML
+        static __m256d Avx(__m256d a) { return _mm256_cos_pd(a); }
+        static __m128d Sse(__m128d a) { return _mm_cos_pd(a); }
+#endif
+        static double Scalar(double a) { return std::cos(a); }
+    };
+
+    struct ExpOp {
+#ifdef BIFROST_VECTOR_SVML
+        static __m256d Avx(__m256d a) { return _mm256_exp_pd(a); }
+        static __m128d Sse(__m128d a) { return _mm_exp_pd(a); }
+#endif
+        static double Scalar(double a) { return std::exp(a); }
+    };
+
+    struct LnOp {
+#ifdef BIFROST_VECTOR_SVML
+        static __m256d Avx(__m256d a) { return _mm256_log_pd(a); }
+        static __m128d Sse(__m128d a) { return _mm_log_pd(a); }
+#endif
+        static double Scalar(double a) { return std::log(a); }
+    };
+
+    struct Log10Op {
+#ifdef BIFROST_VECTOR_SVML
+        static __m256d Avx(__m256d a) { return _mm256_log10_pd(a); }
+        static __m128d Sse(__m128d a) { return _mm_log10_pd(a); }
+#endif
+        static double Scalar(double a) { return std::log10(a); }
+    };
+
+    template <class Op>
+    void Binary(const double* a, const double* b, double* out, size_t count)
+    {
+        size_t i = 0;
+#ifdef BIFROST_VECTOR_X86
+        if (VectorMath::HasAvx()) {
+            for (; i + 4 <= count; i += 4)
+                _mm256_storeu_pd(out + i, Op::Avx(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+            // Avoiding the AVX to SSE transition penalty in the loops below.
+            _mm256_zeroupper();
+        }
+        for (; i + 2 <= count; i += 2)
+            _mm_storeu_pd(out + i, Op::Sse(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+#endif
+        for (; i < count; i++)
+            out[i] = Op::Scalar(a[i], b[i]);
+    }
+
+    template <class Op>
+    void Unary(const double* a, double* out, size_t count)
+    {
+        size_t i = 0;
+#ifdef BIFROST_VECTOR_X86
+        if (VectorMath::HasAvx()) {
+            for (; i + 4 <= count; i += 4)
+                _mm256_storeu_pd(out + i, Op::Avx(_mm256_loadu_pd(a + i)));
+            _mm256_zeroupper();
+        }
+        for (; i + 2 <= count; i += 2)
+            _mm_storeu_pd(out + i, Op::Sse(_mm_loadu_pd(a + i)));
+#endif
+        for (; i < count; i++)
+            out[i] = Op::Scalar(a[i]);
+    }
+
+    // For the library functions when there is no vector math library.
+    template <class Op>
+    void UnaryLibrary(const double* a, double* out, size_t count)
+    {
+#ifdef BIFROST_VECTOR_SVML
+        Unary<Op>(a, out, count);
+#else
+        for (size_t i = 0; i < count; i++)
+            out[i] = Op::Scalar(a[i]);
+#endif
+    }
+}
+
+/// <summary>
+/// out[i] = a[i] + b[i]
+/// </summary>
+void VectorMath::Add(const double* a, const double* b, double* out, size_t count)
+{
+    Binary<AddOp>(a, b, out, count);
+}
+
+/// <summary>
+/// out[i] = a[i] - b[i]
+/// </summary>
+void VectorMath::Subtract(const double* a, const double* b, double* out, size_t count)
+{
+    Binary<SubtractOp>(a, b, out, count);
+}
+
+/// <summary>
+/// out[i] = a[i] * b[i]
+/// </summary>
+void VectorMath::Multiply(const double* a, const double* b, double* out, size_t count)
+{
+    Binary<MultiplyOp>(a, b, out, count);
+}
+
+/// <summary>
+/// out[i] = a[i] / b[i]
+/// </summary>
+void VectorMath::Divide(const double* a, const double* b, double* out, size_t count)
+{
+    Binary<DivideOp>(a, b, out, count);
+}
+
+/// <summary>
+/// out[i] = -a[i]
+/// </summary>
+void VectorMath::Negate(const double* a, double* out, size_t count)
+{
+    Unary<NegateOp>(a, out, count);
+}
+
+/// <summary>
+/// out[i] = fabs(a[i])
+/// </summary>
+void VectorMath::Abs(const double* a, double* out, size_t count)
+{
+    Unary<AbsOp>(a, out, count);
+}
+
+/// <summary>
+/// out[i] = sqrt(a[i])
+/// </summary>
+void VectorMath::Sqrt(const double* a, double* out, size_t count)
+{
+    Unary<SqrtOp>(a, out, count);
+}
+
+/// <summary>
+/// out[i] = sin(a[i])
+/// </summary>
+void VectorMath::Sin(const double* a, double* out, size_t count)
+{
+    UnaryLibrary<SinOp>(a, out, count);
+}
+
+/// <summary>
+/// out[i] = cos(a[i])
+/// </summary>
+void VectorMath::Cos(const double* a, double* out, size_t count)
+{
+    UnaryLibrary<CosOp>(a, out, count);
+}
+
+/// <summary>
+/// out[i] = exp(a[i])
+/// </summary>
+void VectorMath::Exp(const double* a, double* out, size_t count)
+{
+    UnaryLibrary<ExpOp>(a, out, count);
+}
+
+/// <summary>
+/// out[i] = log(a[i]), the natural logarithm.
+/// </summary>
+void VectorMath::Ln(const double* a, double* out, size_t count)
+{
+    UnaryLibrary<LnOp>(a, out, count);
+}
+
+/// <summary>
+/// out[i] = log10(a[i])
+/// </summary>
+void VectorMath::Log10(const double* a, double* out, size_t count)
+{
+    UnaryLibrary<Log10Op>(a, out, count);
+}
+
+/// <summary>
+/// Checks (once) whether the AVX kernels can be used.
+/// </summary>
+/// <returns>True if the processor and the OS support AVX.</returns>
+bool VectorMath::HasAvx()
+{
+#ifdef BIFROST_VECTOR_X86
+    // 0: not checked yet, 1: no AVX, 2: AVX. Racing first calls just check twice.
+    static volatile long state = 0;
+    if (state == 0)
+        state = DetectAvx() ? 2 : 1;
+    return state == 2;
+#else
+    return false;
+#endif
+}
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
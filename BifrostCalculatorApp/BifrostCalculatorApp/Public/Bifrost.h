@@ -1,26 +1,214 @@
+#pragma once
+
 #include <windows.h>
 #include <string>
 
+#include <deque>
+
+#include "BifrostMetrics.h"
+
+class BifrostArq;
+class SharedChannel;
+
 class Bifrost {
 public:
     Bifrost();
+    ~Bifrost();
 
     // Opens the serial port. 
     // portName should be something like L"\\\\.\\COM4" (recommended format for Windows).
+    // A named pipe (L"\\\\.\\pipe\\...") is accepted too, e.g. the in-process
+    // BoardEmulator; it speaks the same line protocol but has no serial settings.
+    // "shm:" before a broker's pipe name (L"shm:\\\\.\\pipe\\bifrost") connects
+    // through the pipe, then moves requests and replies to a shared-memory
+    // channel (see SharedRing.h), which saves a system call per line.
     // The baudRate defaults to CBR_9600.
     bool Open(LPCWSTR portName, DWORD baudRate = CBR_9600);
 
     // Closes the serial port if it is open.
     void Close();
 
-    // Writes data to the serial port.
+    // Writes data to the serial port, after anything queued by EnqueueLine.
     // Returns true if the write is successful.
     bool WriteData(const std::string &data);
 
-    // Reads up to numBytes from the serial port.
-    // Returns the data read as a std::string.
+    // Queues one request line (without its newline) for the next write,
+    // copying it straight into the transmit buffer. The buffer goes out in
+    // one write once it holds the coalescing size, when a line is queued
+    // after the first one has waited the coalescing delay, on Flush(), and
+    // before any read. A USB-serial adapter then gets a few full bulk
+    // transfers instead of one small packet per request.
+    // Returns false if a write it made failed.
+    bool EnqueueLine(const char* text, size_t length);
+    bool EnqueueLine(const std::string& text);
+
+    // Writes everything EnqueueLine queued.
+    bool Flush();
+
+    // Sets when EnqueueLine writes without waiting for Flush: once flushBytes
+    // are queued, or once the oldest queued line has waited delayMicros
+    // (checked when the next one is queued; 0 writes every line at once).
+    void SetCoalescing(size_t flushBytes, unsigned long long delayMicros);
+
+    // Reads up to numBytes from the serial port, stopping early at the end
+    // of the reply line. Returns the data read as a std::string.
     std::string ReadData(DWORD numBytes);
 
+    // Reads one reply line (without the trailing "\r\n") into line.
+    // Bytes received after the newline are kept for the next call, which lets
+    // several requests be in flight at once. Don't mix with ReadData().
+    // Returns false if the port failed or no full line arrived in time.
+    bool ReadLine(std::string& line);
+
+    // Same, but waits timeoutMs instead of ReplyTimeout() for this one reply
+    // (e.g. for a request the board is known to take longer over). Pipes and
+    // the shared channel, which otherwise wait as long as it takes, keep to it too.
+    bool ReadLine(std::string& line, DWORD timeoutMs);
+
+    // Makes a pipe read or write in progress on another thread fail, and any
+    // started after it until the next Open. Unlike everything else here, safe
+    // to call while another thread uses the link. (CancelSynchronousIo does
+    // the same for a serial port.)
+    void Interrupt();
+
+    // How long a read on a serial port waits for a reply (or for the rest of
+    // one) before giving up, in milliseconds. It adapts to the link, the way
+    // TCP computes its retransmission timeout: the time the request just
+    // written and the longest reply take on the wire at the port's baud
+    // rate, plus the smoothed time the board has been taking to answer and
+    // four times its variation. Until the board has answered once it allows
+    // for the reset many Arduinos do when their port is opened.
+    DWORD ReplyTimeout() const;
+
+    // Replaces ReplyTimeout() for every read until set back to 0, e.g. to
+    // give up on a port quickly while probing it.
+    void SetReadTimeout(DWORD milliseconds);
+
+    // Asks the board who it is with "id" (a few times, since the question
+    // goes out unprotected) and keeps what the answer says about its receive
+    // buffer ("rx=64") and reliable window ("arq=8"). The answer looks like
+    // "bifrost 1 buffer=200 baud=9600 arch=avr rx=64 arq=8".
+    // Returns false if no Bifrost firmware answered, or on the reliable protocol.
+    bool Identify(std::string& identity);
+
+    // Bytes the board's UART receive buffer holds, as Identify learned; 0 if
+    // unknown. Bytes that arrive while it is full (the board is evaluating,
+    // not reading) are lost, so BifrostPipeline keeps the bytes of unanswered
+    // requests within it.
+    size_t ReceiveBuffer() const;
+
+    // Bytes a request of lineLength characters takes on the wire, with its
+    // newline and, on the reliable protocol, its framing.
+    size_t WireLength(size_t lineLength) const;
+
+    // Checks that the board (or the broker) still answers: sends "ping"
+    // unframed, even on the reliable protocol, and waits at most timeoutMs in
+    // all for the answer. The firmware answers "pong" without counting it;
+    // an older one answers with an error, which shows it is there just as
+    // well. Not to be called while requests are unanswered.
+    bool Ping(DWORD timeoutMs);
+
+    // Switches to the reliable protocol (see BifrostArq.h) if the board
+    // speaks it: asks with Identify and looks for "arq=N" in the reply. From then
+    // on requests are framed with a sequence number and a CRC, damaged or
+    // lost ones are sent again, and ReadLine and ReadData return the replies
+    // without their framing, in order. Lets a link run at baud rates where
+    // bytes get dropped. Returns false, keeping the plain protocol, if the
+    // board doesn't speak it (or on the shared channel).
+    bool StartReliable();
+
+    // The reliable protocol's window and counters, NULL without it.
+    const BifrostArq* Reliable() const;
+
+    // Asks the board for its own counters with "stats": requests answered,
+    // time spent receiving, compiling, evaluating and printing, kept reply
+    // hits, and free memory. Works on the reliable protocol too. Not to be
+    // called while pipelined requests are unanswered.
+    // Returns false if the firmware doesn't answer it.
+    bool ReadBoardStats(BifrostFirmwareStats& stats);
+
+    // Latency histograms (open, write, first byte, response, parse) shared by
+    // every Bifrost instance in the process.
+    static BifrostMetrics& Metrics();
+
 private:
+    // Number of bytes waiting to be read, without blocking.
+    DWORD BytesAvailable();
+
+    // Writes data as it is sent on this link: framed on the reliable protocol, as is otherwise.
+    bool Transmit(const std::string& data);
+
+    // Writes to the port or pipe as is.
+    bool WriteRaw(const std::string& data);
+
+    // Reads up to size bytes: what is there, or else the first to come.
+    // A port waits as long as its timeouts say; a pipe is read overlapped and
+    // waits up to waitMs. bytesRead is 0 if nothing came in time.
+    bool ReadPort(char* buffer, DWORD size, DWORD waitMs, DWORD& bytesRead);
+
+    // Writes all of data to the port, or to the pipe overlapped.
+    bool WritePort(const char* data, DWORD size);
+
+    // Reads one line from the port or pipe, giving up after budget
+    // microseconds without data; timedOut tells that from a failed port.
+    bool ReadRawLine(std::string& line, unsigned long long budget, bool& timedOut);
+
+    // Frames every complete line of data and writes them, reading replies
+    // while the window is full.
+    bool WriteReliable(const std::string& data);
+
+    // Waits for the next reply in order on the reliable protocol.
+    bool ReadReliableLine(std::string& line, DWORD timeoutMs);
+
+    // Reads one line from the board, or resends what timed out, then writes
+    // what has to be sent again. False if the link failed or gave up.
+    bool Pump(unsigned long long timeoutMicros);
+
+    // How long a read of a reply of up to numBytes may wait, in microseconds.
+    unsigned long long ReadBudget(DWORD numBytes) const;
+
+    // The same on the plain protocol, or timeoutMs if not 0. Without either
+    // timeout, a pipe read waits for as long as it takes.
+    unsigned long long RawBudget(DWORD timeoutMs, DWORD numBytes) const;
+
+    // Time numBytes take on the wire at the port's baud rate, in microseconds.
+    unsigned long long WireMicros(size_t numBytes) const;
+
+    // Adds a reply's wait to the round trip estimate. waitStarted is when the
+    // reply could first have been expected; replyBytes includes the "\r\n".
+    void RecordReply(unsigned long long waitStarted, size_t replyBytes);
+
+    // Asks the broker at the other end of the pipe to switch to shared memory.
+    bool OpenShared();
+
+    // Waits for the next reply on the shared channel, for timeoutMs if not 0.
+    bool ReadSharedLine(std::string& line, DWORD timeoutMs);
+
     HANDLE hSerial;  // Handle for the serial port.
+    bool isPipe;  // True if the handle is a named pipe rather than a COM port.
+    HANDLE ioEvent;  // Set when an overlapped read or write on the pipe completes; NULL for ports.
+    HANDLE interrupt;  // Set by Interrupt, reset by Open.
+    std::string received;  // Bytes read by ReadLine() but not returned yet.
+    size_t receivedStart;  // Start of the unread part of received.
+    COMMTIMEOUTS timeouts;  // Timeouts applied to the port in Open().
+    DWORD readTimeoutMs;  // Set by SetReadTimeout, 0 for the default.
+    DWORD baudRate;  // The port's baud rate, 0 for pipes.
+    size_t receiveBuffer;  // The board's, from Identify; 0 if unknown.
+    size_t reliableWindow;  // The board's "arq", from Identify; 0 if it has none.
+    unsigned long long smoothedMicros;  // Smoothed time to answer beyond the wire time (SRTT), 0 before the first reply.
+    unsigned long long variationMicros;  // Its smoothed mean deviation (RTTVAR).
+    size_t lastWriteBytes;  // Size of the last write, which may still be on the wire.
+    unsigned long long lastLine;  // When ReadLine last returned a line (0 if never).
+    unsigned long long writeStarted;  // When the last write started (0 if none).
+    unsigned long long writeFinished;  // When the last write finished (0 if none).
+    SharedChannel* shared;  // The shared-memory channel, or NULL.
+    HANDLE peer;  // The broker's process while shared is open, to notice it exiting.
+    std::string unsent;  // Written without a newline yet, on the shared channel or the reliable protocol.
+    BifrostArq* arq;  // The reliable protocol, or NULL.
+    std::string framed;  // Frames waiting to be written, reused.
+    std::deque<std::string> ready;  // Replies taken to make room in the window, not read yet.
+    std::string transmit;  // Lines queued by EnqueueLine, not written yet.
+    unsigned long long transmitSince;  // When the oldest of them was queued.
+    size_t flushBytes;  // Set by SetCoalescing.
+    unsigned long long flushDelayMicros;
 };
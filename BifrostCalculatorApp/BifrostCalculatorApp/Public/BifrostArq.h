@@ -0,0 +1,118 @@
+#pragma once
+
+#include <deque>
+#include <string>
+
+// The reliable protocol, for links fast enough to drop or damage bytes.
+// Every request is framed with a sequence number and a CRC:
+//     @1f 3*(2+4)*78f1
+// "@", the number as two hex digits, a space, the expression, "*" and the
+// CRC-16/CCITT-FALSE of everything before that last "*" as four hex digits.
+// The board answers with the same number after "$" ("$1f 18.000000*9eab"),
+// or with "!" and the number ("!1f*47ae") when a request arrived damaged.
+//
+// BifrostArq is the host's side of it, a selective-repeat sliding window:
+// up to Window() requests are out at once, replies are delivered in order
+// whatever order they are received in, and only the requests that went
+// missing are sent again. The board answers in the order it receives, so a
+// reply to a request sent after one still unanswered means that one (or its
+// reply) was lost, and it is sent again right away. A request whose reply
+// doesn't come within the timeout is sent again too, with the timeout
+// doubling each time. The board keeps its last replies by number, so a
+// request sent twice is answered twice with the same reply but evaluated
+// once, and the host drops the second one.
+//
+// The class only keeps the state: Bifrost does the reading and writing.
+class BifrostArq {
+public:
+    // Sequence numbers are two hex digits, so the window must stay under half of them.
+    static const unsigned kSequences = 256;
+    static const size_t kMaxWindow = 64;
+
+    // Transmissions of one request before the link is given up on.
+    static const int kMaxAttempts = 8;
+
+    enum FrameStatus {
+        FrameIntact,
+        FrameDamaged,  // The CRC doesn't match, but the sequence number could be read.
+        FrameUnreadable,  // Not a frame, or not even its sequence number could be read.
+    };
+
+    // CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xffff).
+    static unsigned short Crc16(const char* data, size_t length, unsigned short crc = 0xffff);
+
+    // Appends a frame (without line ending) to out: kind, sequence number,
+    // and the payload after a space unless it is empty.
+    static void AppendFrame(char kind, unsigned sequence, const char* payload, size_t length, std::string& out);
+
+    // Checks a received line (without line ending). For intact frames the
+    // payload is the part between the space and the CRC.
+    static FrameStatus ParseFrame(const char* line, size_t length, char& kind, unsigned& sequence, const char*& payload, size_t& payloadLength);
+
+    // window: requests out at once, at most kMaxWindow (the board says how
+    // many it keeps replies for in its "id" reply, as "arq=8").
+    explicit BifrostArq(size_t window);
+
+    size_t Window() const;
+
+    // Whether Window() requests are waiting for their replies (or for the
+    // ones before them to be delivered).
+    bool Full() const;
+
+    // Whether any request sent is still unanswered.
+    bool Waiting() const;
+
+    // Whether any unanswered request has been sent more than once. Replies
+    // are then not timed, since it isn't known which copy they answer.
+    bool Retransmitting() const;
+
+    // Frames one request line (without its newline) and appends it, with
+    // "\n", to out. Not to be called while Full().
+    void Send(const char* line, size_t length, unsigned long long now, std::string& out);
+
+    // Handles one line received from the board. Requests it shows to be
+    // lost are appended to out to be sent again.
+    // Returns false if one of them has run out of attempts.
+    bool Receive(const std::string& line, unsigned long long now, std::string& out);
+
+    // Microseconds until Expire would send something again, given the
+    // current timeout; 0 if it is due.
+    unsigned long long TimeLeft(unsigned long long now, unsigned long long timeoutMicros) const;
+
+    // Sends the oldest unanswered request again if nothing has come back
+    // for the timeout (doubled for each time in a row this happened).
+    // Returns false if it has run out of attempts.
+    bool Expire(unsigned long long now, unsigned long long timeoutMicros, std::string& out);
+
+    // The next reply in request order, if it has arrived.
+    bool Deliver(std::string& reply);
+
+    // Requests sent again, replies dropped as duplicates, and lines that
+    // were damaged or not frames at all.
+    unsigned long long Retransmitted() const;
+    unsigned long long Duplicates() const;
+    unsigned long long Damaged() const;
+
+private:
+    struct Frame {
+        std::string request;  // The framed request, with "\n".
+        std::string reply;  // The reply's payload, once answered.
+        bool answered;
+        int attempts;
+        unsigned long long transmission;  // Order of the last transmission among all of them.
+    };
+
+    // Sends frames[index] again.
+    bool Resend(size_t index, std::string& out);
+
+    size_t window;
+    std::deque<Frame> frames;  // Sent and not delivered, oldest first.
+    unsigned base;  // Sequence number of frames.front().
+    unsigned long long transmissions;
+    unsigned long long lastReply;  // Now() when the last intact reply came in.
+    unsigned backoff;  // Timeouts in a row; each doubles the next one.
+
+    unsigned long long retransmitted;
+    unsigned long long duplicates;
+    unsigned long long damaged;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <windows.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Bifrost.h"
+#include "BifrostScheduler.h"
+
+class SharedChannel;
+
+// Shares one board between many local clients. The broker owns the link and
+// serves a named pipe (e.g. L"\\\\.\\pipe\\bifrost") that speaks the board's
+// own protocol: a client opens the pipe with Bifrost::Open as if it were the
+// port, writes expression lines and reads one reply line per request.
+// Requests from every client are merged into a single BifrostPipeline, so
+// the link stays full even when each client only has one request in flight;
+// each reply is routed back to the client that sent it, in the order that
+// client sent its requests.
+// Requests go through a BifrostScheduler: interactive ones (the default) are
+// sent before bulk ones, and bulk requests never take the last free slot of
+// the pipeline, so a click waits for at most depth - 1 bulk replies however
+// large the batch job. A client changes its class and deadline with control
+// lines, each answered with "ok":
+//   #priority interactive|bulk
+//   #deadline <milliseconds>   (0 for none)
+//   #shm <name>                (see below)
+// A request that can't be answered before its client's deadline is answered
+// with "nanDeadline exceeded" without being sent.
+// A client on the same machine can move its traffic off the pipe: it creates
+// a SharedChannel and sends "#shm <name>"; after the "ok", requests and
+// replies go through the channel's rings (Bifrost::Open does this for port
+// names starting with "shm:"). The pipe stays open to tell when it leaves.
+// The reliable protocol (see BifrostArq.h) only runs between the broker and
+// the board: framed requests from clients are answered with an error, and
+// the board's answer to "id" reaches them without its "arq" window, so a
+// client's StartReliable keeps to the plain protocol.
+// Identical requests are only sent once: a request for an expression already
+// on its way to the board waits for that reply, and one answered less than
+// the coalescing window ago is answered with the same reply straight away.
+class BifrostBroker {
+public:
+    BifrostBroker();
+    ~BifrostBroker();
+
+    // Starts accepting clients on pipeName and forwarding their requests over
+    // link, which must be open and must outlive the broker. depth and
+    // batchSize are handed to the BifrostPipeline.
+    // Returns false if the pipe could not be created.
+    bool Start(Bifrost& link, const std::wstring& pipeName, size_t depth = 8, size_t batchSize = 4);
+
+    // How long a reply is reused for identical requests (0 to only merge
+    // requests that are in flight together). Takes effect on the next Start.
+    void SetCoalesceWindow(DWORD milliseconds);
+
+    // Requests each priority class can queue before the clients sending
+    // them are held back.
+    void SetQueueCapacity(size_t capacity);
+
+    // Disconnects every client and stops forwarding. Requests still queued
+    // are dropped.
+    void Stop();
+
+    // Clients connected right now.
+    size_t Clients();
+
+    // False once the link has failed; every request is then answered with
+    // an error reply instead of being forwarded.
+    bool LinkHealthy() const;
+
+    // Requests received from clients so far.
+    unsigned long long Requests() const;
+
+    // Requests forwarded to the board so far.
+    unsigned long long Forwarded() const;
+
+    // Requests answered without a board request of their own: attached to an
+    // identical request in flight, or answered from the coalescing window.
+    unsigned long long Deduplicated() const;
+    unsigned long long Coalesced() const;
+
+    // Requests answered with "nanDeadline exceeded" so far.
+    unsigned long long Late() const;
+
+    // Requests waiting for the link in a priority class right now.
+    size_t Queued(BifrostPriority priority);
+
+private:
+    // Client pipes are opened for overlapped I/O: replies are written by the
+    // forwarding thread while the client's own thread is blocked reading, and
+    // on a synchronous handle the two calls would wait for each other.
+    struct Client {
+        BifrostBroker* owner;
+        HANDLE pipe;
+        HANDLE thread;
+        HANDLE writeEvent;  // For the forwarding thread's writes.
+        volatile LONG references;  // One for the client's thread, one per request not answered yet.
+
+        // Used by the client's thread only.
+        BifrostPriority priority;
+        unsigned long long budgetMicros;  // Deadline of each request, 0 for none.
+        unsigned long long sent;  // Requests read so far; numbers the next one.
+        SharedChannel* shared;  // Set once by "#shm", then read by both threads.
+        volatile LONG64 sharedFrom;  // First reply that goes through shared (MAXLONG64 before "#shm").
+
+        // Used by the forwarding thread only. Replies can be ready out of
+        // order (different classes, coalesced replies), so they are held
+        // until every earlier request of the client has been answered.
+        unsigned long long answered;  // Sequence number of the next reply to write.
+        std::map<unsigned long long, std::string> held;
+    };
+
+    // A client request waiting for the board's reply.
+    struct Waiter {
+        Client* client;
+        unsigned long long sequence;
+    };
+
+    // One request sent to the board and every client waiting for its reply.
+    struct Pending {
+        std::string text;  // Trimmed like the firmware does, so " 1+2" and "1+2" match.
+        std::vector<Waiter> waiters;
+    };
+
+    static DWORD WINAPI AcceptProc(LPVOID parameter);
+    static DWORD WINAPI ClientProc(LPVOID parameter);
+    static DWORD WINAPI ForwardProc(LPVOID parameter);
+    void Accept();
+    void Serve(Client& client);
+    void Forward();
+
+    HANDLE CreateInstance();
+    bool Enqueue(Client& client, const char* text, size_t length);
+    bool ServeShared(Client& client);
+    static bool Control(Client& client, const std::string& line, unsigned long long sequence);
+
+    static void Deliver(Client& client, unsigned long long sequence, const std::string& reply);
+    static void Reply(Client& client, unsigned long long sequence, const std::string& reply);
+    static void Answer(Pending& pending, const std::string& reply);
+    static void Release(Client* client);
+
+    Bifrost* link;
+    std::wstring pipeName;
+    size_t depth;
+    size_t batchSize;
+    DWORD coalesceWindowMs;
+
+    HANDLE acceptThread;
+    HANDLE forwardThread;
+    HANDLE listening;  // The pipe instance waiting for the next client.
+    HANDLE stopEvent;  // Set by Stop; ends every wait on a client pipe.
+    volatile LONG stopping;
+    volatile LONG linkFailed;
+    volatile LONG64 requests;
+    volatile LONG64 forwarded;
+    volatile LONG64 deduplicated;
+    volatile LONG64 coalesced;
+
+    BifrostScheduler scheduler;  // Requests not yet handed to the pipeline.
+
+    SRWLOCK lock;  // Guards clients.
+    std::vector<Client*> clients;  // Connected clients, whose threads Stop has to end.
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+// A board that answered the "id" command.
+struct BifrostBoardInfo {
+    std::wstring port;  // As Bifrost::Open takes it, e.g. L"\\\\.\\COM4".
+    DWORD baudRate;
+    std::string identity;  // The reply, e.g. "bifrost 1 buffer=200 baud=9600 arch=avr rx=64 arq=8".
+
+    // Protocol version of the firmware (the number after "bifrost"), 0 if unknown.
+    int Firmware() const;
+
+    // Whether the identity lists a capability, on its own or as name=value.
+    bool Has(const char* name) const;
+
+    // The value of a name=value capability, empty if it isn't listed.
+    std::string Value(const char* name) const;
+};
+
+// Finds the board without the user typing its port and baud rate.
+// Every candidate port is probed at once, each on its own thread: the probe
+// opens the port, sends "id" until the firmware answers or the time is up,
+// and tries the next baud rate if nothing sensible came back. The first
+// board to answer wins and the other probes are cancelled. What was found is
+// cached under %LOCALAPPDATA%, so the next launch checks that port first.
+class BifrostDiscovery {
+public:
+    // Baud rates tried by Find, most likely first.
+    static std::vector<DWORD> DefaultBaudRates();
+
+    // The broker's pipe when one is running, then every COM port on the machine.
+    static std::vector<std::wstring> CandidatePorts();
+
+    // Asks one port for its identity, for up to timeoutMs.
+    static bool Probe(const std::wstring& port, DWORD baudRate, DWORD timeoutMs, BifrostBoardInfo& info);
+
+    // Probes every candidate port concurrently at each baud rate in turn.
+    // Returns within about deadlineMs, false if no board answered.
+    static bool Discover(const std::vector<DWORD>& baudRates, DWORD deadlineMs, BifrostBoardInfo& found);
+
+    // The board found last time, without checking it is still there.
+    static bool LoadCache(BifrostBoardInfo& info);
+    static bool SaveCache(const BifrostBoardInfo& info);
+
+    // Probes the cached board, and if it no longer answers, discovers one
+    // with DefaultBaudRates(). Whatever answers is cached.
+    static bool Find(DWORD deadlineMs, BifrostBoardInfo& found);
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <windows.h>
+
+// Phases of a request timed by Bifrost.
+enum BifrostPhase {
+    PhaseOpen,       // Opening and configuring the port.
+    PhaseWrite,      // WriteFile of the request.
+    PhaseFirstByte,  // End of the write until the first response byte arrives.
+    PhaseResponse,   // Start of the write until the whole response has been read.
+    PhaseParse,      // Parsing the response (recorded by the caller).
+    PhaseCount
+};
+
+// Summary of one phase. Durations are in microseconds.
+struct BifrostPhaseSnapshot {
+    unsigned long long count;
+    unsigned long long p50;
+    unsigned long long p95;
+    unsigned long long p99;
+    unsigned long long max;
+};
+
+// Time the board spent in one step of answering requests, in its micros().
+struct BifrostFirmwareStep {
+    unsigned long long totalMicros;  // Wraps on the board after about 71 minutes.
+    unsigned long long maxMicros;  // Longest single request since the board started.
+};
+
+// The board's own counters, as its "stats" command reports them (see
+// Bifrost::ReadBoardStats). Set beside the host's histograms over the same
+// requests, they tell the board's share of the round trip from the wire's
+// and the host's.
+struct BifrostFirmwareStats {
+    unsigned long long requests;  // Expressions answered.
+    BifrostFirmwareStep receive;  // Reading request lines, including waiting for their last bytes.
+    BifrostFirmwareStep compile;  // te_compile.
+    BifrostFirmwareStep evaluate;  // te_eval.
+    BifrostFirmwareStep print;  // Printing replies.
+    unsigned long long keptLookups;  // Framed requests looked up among the kept replies,
+    unsigned long long keptHits;  // and those answered from there (sent again by the host).
+    long long freeMemory;  // Bytes free now, -1 if the board can't tell.
+    long long lowestFreeMemory;  // Fewest bytes free since the board started, -1 if unknown.
+
+    // What was counted between an earlier snapshot and this one. The
+    // longest times and memory are this snapshot's, since the board keeps
+    // only those since it started.
+    BifrostFirmwareStats Since(const BifrostFirmwareStats& earlier) const;
+
+    // keptHits / keptLookups, 0 without lookups.
+    double KeptHitRate() const;
+};
+
+// Lock-free log-linear (HDR style) histogram of durations in microseconds.
+// Each power of two is split into 16 sub-buckets, so any recorded value is
+// reported within ~6% of its real value. Recording is a couple of interlocked
+// increments, which is cheap enough to leave on all the time.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    // Adds one duration to the histogram. Safe to call from any thread.
+    void Record(unsigned long long micros);
+
+    // Computes the percentiles of everything recorded so far.
+    BifrostPhaseSnapshot Snapshot() const;
+
+    // Forgets everything recorded so far.
+    void Reset();
+
+private:
+    static const int kSubBucketBits = 4;
+    static const int kSubBuckets = 1 << kSubBucketBits;
+    static const int kMagnitudes = 40;  // Up to 2^40 us (~12 days).
+    static const int kBucketCount = (kMagnitudes - kSubBucketBits + 1) * kSubBuckets;
+
+    static int BucketIndex(unsigned long long micros);
+    static unsigned long long BucketUpperBound(int index);
+
+    volatile LONG64 buckets[kBucketCount];
+    volatile LONG64 count;
+    volatile LONG64 max;
+};
+
+// Process-wide latency metrics, one histogram per phase.
+class BifrostMetrics {
+public:
+    // The metrics every Bifrost instance records into.
+    static BifrostMetrics& Global();
+
+    // Reads the monotonic clock (QueryPerformanceCounter ticks).
+    static unsigned long long Now();
+
+    // Converts the ticks elapsed since a Now() reading to microseconds.
+    static unsigned long long MicrosSince(unsigned long long start);
+
+    // Records a duration for a phase.
+    void Record(BifrostPhase phase, unsigned long long micros);
+
+    // Records the time elapsed since a Now() reading for a phase.
+    void RecordSince(BifrostPhase phase, unsigned long long start);
+
+    // Percentiles and counts of one phase.
+    BifrostPhaseSnapshot Snapshot(BifrostPhase phase) const;
+
+    // Forgets everything recorded so far.
+    void Reset();
+
+private:
+    LatencyHistogram histograms[PhaseCount];
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <string>
+
+#include "Bifrost.h"
+
+// Keeps several requests in flight on one open Bifrost link.
+// The firmware answers strictly in order, one line per request, so replies
+// are matched to requests first-in first-out. Requests can also be batched:
+// they are queued in the link's transmit buffer (Bifrost::EnqueueLine) and
+// batchSize of them are written together. Besides depth, the bytes of
+// unanswered requests are kept within the board's receive buffer, so
+// requests never arrive faster than the board can hold them while it
+// evaluates (the firmware reads the next request only once it has answered
+// the last one, and a UART drops what doesn't fit).
+class BifrostPipeline {
+public:
+    // Called once per request, in submission order, with its reply line.
+    typedef std::function<void(unsigned long long id, const std::string& reply)> Completion;
+
+    // depth: maximum number of requests sent (or queued) but not answered yet.
+    // batchSize: number of requests gathered before they are written.
+    BifrostPipeline(Bifrost& link, size_t depth = 8, size_t batchSize = 1);
+
+    // Sets the function that receives the replies.
+    void SetCompletion(const Completion& completion);
+
+    // Bytes of unanswered requests to stay within; 0 for no limit. Starts as
+    // the link's ReceiveBuffer(). A request is always sent when nothing is
+    // unanswered, however long.
+    void SetCredit(size_t bytes);
+
+    // Queues one expression (without its newline) under a caller chosen id.
+    // Blocks reading replies while depth requests are outstanding.
+    // Returns false if the link failed; the pipeline is then unusable.
+    bool Submit(const char* expression, size_t length, unsigned long long id);
+    bool Submit(const std::string& expression, unsigned long long id);
+
+    // Writes anything still batched and waits for every outstanding reply.
+    bool Drain();
+
+    // Number of requests submitted but not answered yet.
+    size_t Outstanding() const;
+
+    // Bytes written to and read from the link so far.
+    unsigned long long BytesSent() const;
+    unsigned long long BytesReceived() const;
+
+    // Writes the requests batched so far, even if fewer than batchSize.
+    bool Flush();
+
+    // Waits for the oldest outstanding reply and hands it to the completion.
+    // Lets a caller that also waits for new requests (such as a broker)
+    // read one reply at a time instead of draining everything.
+    bool ReceiveOne();
+
+private:
+    struct Request {
+        unsigned long long id;
+        unsigned long long sentAt;  // BifrostMetrics::Now() when handed to the link.
+        size_t wireLength;  // Bytes it takes on the wire.
+    };
+
+    Bifrost& link;
+    size_t depth;
+    size_t batchSize;
+    size_t credit;  // 0 for no limit.
+    size_t unansweredBytes;  // Sum of wireLength over outstanding.
+
+    size_t batched;  // Requests queued on the link but not written yet.
+    size_t batchBytes;  // Their size, newlines included.
+    std::deque<Request> outstanding;
+    std::string reply;  // Reused for every reply line.
+    Completion completion;
+
+    unsigned long long bytesSent;
+    unsigned long long bytesReceived;
+};
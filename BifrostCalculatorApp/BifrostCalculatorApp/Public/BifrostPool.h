@@ -0,0 +1,129 @@
+#pragma once
+
+#include <windows.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "Bifrost.h"
+#include "BifrostPipeline.h"
+
+// What a pool knows about one of its boards.
+struct BifrostBoardStats {
+    std::wstring port;
+    bool alive;  // False once its link failed; its work went to the other boards.
+    unsigned long long completed;  // Replies received from it.
+    unsigned long long serviceMicros;  // Smoothed time it takes per request.
+    size_t queued;  // Requests waiting for it.
+    size_t outstanding;  // Requests sent to it and not answered yet.
+};
+
+// Spreads requests over several boards, each on its own link and thread.
+// A request goes to the board expected to answer it first, judging by the
+// requests already waiting for each board and the time each one has been
+// taking per request. A board with nothing left to do takes requests still
+// waiting for a slower one. Replies are handed to the completion in
+// submission order whichever board answers first, and when a board's link
+// fails the requests it had not answered are sent again on the others.
+class BifrostPool {
+public:
+    typedef BifrostPipeline::Completion Completion;
+
+    // Requests that can be submitted but not delivered yet; Submit blocks
+    // beyond that. A caller that keeps something per request for the
+    // completion needs kWindow + 1 slots for it (see BifrostPipeline).
+    static const size_t kWindow = 4096;
+
+    BifrostPool();
+    ~BifrostPool();
+
+    // Opens every port and starts one thread per board that opened, each
+    // pipelining depth requests in batches of batchSize. With reliable, the
+    // boards that speak it use the reliable protocol (Bifrost::StartReliable).
+    // Returns false if none of them could be opened.
+    bool Open(const std::vector<std::wstring>& ports, DWORD baudRate, size_t depth = 8, size_t batchSize = 1, bool reliable = false);
+
+    // Stops the threads and closes every link. Undelivered requests are dropped.
+    void Close();
+
+    // Sets the function that receives the replies. It is called from the
+    // boards' threads, one call at a time, in submission order.
+    void SetCompletion(const Completion& completion);
+
+    // Queues one expression (without its newline) under a caller chosen id.
+    // Blocks while kWindow requests are undelivered.
+    // Returns false once every board has failed.
+    bool Submit(const std::string& expression, unsigned long long id);
+
+    // Waits until every submitted request has been delivered.
+    // Returns false if every board failed first.
+    bool Drain();
+
+    size_t Boards() const;
+    BifrostBoardStats BoardStats(size_t index);
+
+    // Requests sent again after their board failed.
+    unsigned long long Retried() const;
+
+    // Requests taken by a board from another board's queue.
+    unsigned long long Stolen() const;
+
+private:
+    struct Work {
+        unsigned long long sequence;  // Submission order, for the reorder buffer.
+        unsigned long long id;  // The caller's.
+        std::string text;
+        unsigned long long submitted;  // BifrostMetrics::Now() when handed to the pipeline.
+    };
+
+    struct Board {
+        BifrostPool* owner;
+        std::wstring port;
+        Bifrost link;
+        BifrostPipeline* pipeline;
+        HANDLE thread;
+        std::deque<Work> queued;  // Waiting for this board; guarded by lock.
+        std::deque<Work> inFlight;  // In the pipeline, oldest first; only touched by the board's thread.
+        size_t outstanding;  // inFlight.size(), readable under lock.
+        unsigned long long serviceMicros;  // Guarded by lock.
+        unsigned long long lastReply;  // BifrostMetrics::Now() of the last reply.
+        unsigned long long completed;  // Guarded by lock.
+        bool alive;  // Guarded by lock.
+    };
+
+    // One submitted request waiting for (or holding) its reply.
+    struct Slot {
+        bool ready;
+        unsigned long long id;
+        std::string reply;
+    };
+
+    static DWORD WINAPI ThreadProc(LPVOID parameter);
+    void Run(Board& board);
+    bool Take(Board& board, Work& work);
+    void OnReply(Board& board, const std::string& reply);
+    void Deliver(unsigned long long sequence, unsigned long long id, const std::string& reply);
+    void Fail(Board& board);
+    Board* LeastLoaded();
+    unsigned long long Backlog(const Board& board, size_t extra) const;
+
+    std::vector<Board*> boards;
+    size_t depth;
+
+    SRWLOCK lock;
+    CONDITION_VARIABLE workAvailable;  // Signalled when work is queued (or on Close).
+    CONDITION_VARIABLE progress;  // Signalled when requests are delivered or boards fail.
+    unsigned long long submitted;
+    unsigned long long delivered;
+    unsigned long long retried;
+    unsigned long long stolen;
+    size_t alive;
+    bool stopping;
+
+    // The reorder buffer: slot sequence % kWindow. deliverLock keeps the
+    // completion calls in order and one at a time.
+    SRWLOCK deliverLock;
+    std::vector<Slot> reorder;
+    unsigned long long nextDelivery;
+    Completion completion;
+};
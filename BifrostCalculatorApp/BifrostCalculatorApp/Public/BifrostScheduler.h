@@ -0,0 +1,76 @@
+#pragma once
+
+#include <windows.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Priority classes, most urgent first.
+enum BifrostPriority {
+    PriorityInteractive,  // Someone is waiting for the answer (e.g. a click in the form).
+    PriorityBulk,         // Batch jobs such as bifrost_cli; only served when nothing interactive waits.
+    PriorityCount
+};
+
+// One request waiting for the link.
+struct ScheduledRequest {
+    void* context;  // The submitter's, handed back untouched (e.g. who to reply to).
+    unsigned long long sequence;  // The submitter's too.
+    std::string text;  // The request line, or the reply itself when answered is set.
+    bool answered;  // Already answered (e.g. a control line); only queued to keep the reply in order.
+    unsigned long long arrived;  // BifrostMetrics::Now() when it was pushed.
+    unsigned long long budgetMicros;  // Time allowed from arrival to reply, 0 for no deadline.
+};
+
+// Bounded queues in front of one link, one per priority class.
+// Producers block in Push while their class is full, so a bulk job is held
+// back (and, through its pipe, its writer) instead of the queue growing
+// without limit. The link's consumer pops interactive requests before bulk
+// ones, and requests that can no longer be answered before their deadline
+// are handed back as late without ever reaching the link.
+class BifrostScheduler {
+public:
+    // capacity: requests each class can hold before Push blocks.
+    explicit BifrostScheduler(size_t capacity = 256);
+
+    // Changes the capacity of every class.
+    void SetCapacity(size_t capacity);
+
+    // Queues a request (its text is moved out). Blocks while the class is full.
+    // Returns false, without queueing, once Close has been called.
+    bool Push(BifrostPriority priority, ScheduledRequest& request);
+
+    // Takes the most urgent request, from classes up to lowest only.
+    // expectedMicros is how long a request taken now will wait for its reply;
+    // requests whose deadline is sooner than that are moved to late instead.
+    // Waits up to waitMs for a request. Returns false if none was taken
+    // (timed out, closed, or only late requests were found).
+    bool Pop(ScheduledRequest& request, BifrostPriority lowest, unsigned long long expectedMicros,
+        std::vector<ScheduledRequest>& late, DWORD waitMs);
+
+    // Wakes every waiting producer and consumer; Push fails from then on.
+    void Close();
+
+    // Accepts requests again after Close.
+    void Reopen();
+
+    // Moves every queued request to remaining (e.g. to release them after Close).
+    void TakeAll(std::vector<ScheduledRequest>& remaining);
+
+    // Requests waiting in a class right now.
+    size_t Queued(BifrostPriority priority);
+
+    // Requests handed back as late so far.
+    unsigned long long Late() const;
+
+private:
+    static bool IsLate(const ScheduledRequest& request, unsigned long long expectedMicros);
+
+    SRWLOCK lock;
+    CONDITION_VARIABLE available;  // Signalled when a request is pushed (or on Close).
+    CONDITION_VARIABLE space;  // Signalled when a request is popped (or on Close).
+    std::deque<ScheduledRequest> queues[PriorityCount];
+    size_t capacity;
+    bool closed;
+    volatile LONG64 late;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <windows.h>
+#include <deque>
+#include <string>
+
+#include "Bifrost.h"
+
+// Keeps one link to the board open for as long as the app runs, instead of
+// opening the port for every request. A thread of its own owns the link: it
+// opens it and asks the board for its identity (the handshake), sends the
+// requests handed to Evaluate, and while nothing is being sent it pings the
+// board (Bifrost::Ping) every kPingIntervalMs. A link whose reads or writes fail,
+// or whose ping goes unanswered, is closed and opened again in the
+// background, handshake included, so an unplugged or reset board is noticed
+// within about kPingIntervalMs plus the ping's timeout rather than by the
+// next request. Requests made meanwhile wait in the queue and are sent once
+// the board is back; those lost with the old link are sent again (an
+// expression gives the same result however often it is evaluated).
+class BifrostSession {
+public:
+    // Idle time between pings, and how long a ping waits for its answer.
+    static const DWORD kPingIntervalMs = 2000;
+    static const DWORD kPingTimeoutMs = 500;
+
+    BifrostSession();
+    ~BifrostSession();
+
+    // Starts the session's thread on a port (in any form Bifrost::Open
+    // accepts) and returns without waiting for the port to open. A session
+    // already running is stopped first, its queued requests failing.
+    // reliable: whether a board that speaks it uses the reliable protocol.
+    // Returns false if the thread could not be started.
+    bool Start(const std::wstring& port, DWORD baudRate, bool reliable = false);
+
+    // Closes the link and ends the thread; Evaluate calls waiting fail, and
+    // have returned by the time Stop does.
+    void Stop();
+
+    // Sends one expression (without its newline) and waits for its reply,
+    // for up to timeoutMs including any wait for the link to come back.
+    // Safe to call from several threads at once; the requests are sent in
+    // the order the calls were made.
+    // abandon, if not NULL, lets Cancel(abandon) give up on this call alone.
+    // Returns false on timeout, on Cancel, if the session isn't running or is stopped.
+    bool Evaluate(const std::string& expression, std::string& reply, DWORD timeoutMs, const volatile LONG* abandon = NULL);
+
+    // Makes every Evaluate call waiting right now return false. Requests not
+    // sent yet are dropped; the replies to those already sent are still read,
+    // and thrown away, so the link stays in step with the board.
+    void Cancel();
+
+    // Sets *abandon and makes the Evaluate calls given it return false, the
+    // same way Cancel() does for all of them.
+    void Cancel(volatile LONG* abandon);
+
+    // Whether the link is open and the board answered its last ping or request.
+    bool Connected() const;
+
+    // The port and baud rate given to Start.
+    std::wstring Port() const;
+    DWORD BaudRate() const;
+
+    // The board's answer to "id" in the last handshake, empty if none yet.
+    std::string Identity();
+
+    // Times the link was opened again after it failed.
+    unsigned long long Reconnects() const;
+
+private:
+    // One Evaluate call. Owned by the queue until the thread takes it, then
+    // by the thread until it is answered; whoever holds it last deletes it.
+    struct Request {
+        std::string expression;
+        std::string reply;
+        bool taken;  // Being sent by the thread.
+        bool done;  // Answered, or failed by Stop.
+        bool succeeded;
+        bool abandoned;  // Evaluate gave up waiting.
+    };
+
+    static DWORD WINAPI ThreadProc(LPVOID parameter);
+    void Run();
+
+    // Opens the link and does the handshake. False if the board didn't answer.
+    bool Connect();
+
+    // Pings the board, waiting at most kPingTimeoutMs for the answer.
+    bool Ping();
+
+    // Sends the queued requests, taking each from the queue only when the
+    // pipeline has room to write it, so a request whose Evaluate gives up
+    // before then is never sent. Those left unanswered when the link fails
+    // go back to the front of the queue.
+    bool Send();
+
+    // Hands a request's outcome to the Evaluate call waiting for it, or
+    // deletes it if nobody waits any more. Called with lock held.
+    void Finish(Request* request, bool succeeded);
+
+    std::wstring port;
+    DWORD baudRate;
+    bool reliable;
+
+    Bifrost link;  // Used by the thread only, but for Stop's Interrupt.
+    HANDLE thread;
+
+    SRWLOCK lock;  // Guards everything below.
+    CONDITION_VARIABLE work;  // A request was queued, or Stop was called.
+    CONDITION_VARIABLE answered;  // A request was answered or failed.
+    std::deque<Request*> queue;  // Waiting to be sent, oldest first.
+    std::string identity;
+    bool stopping;
+    unsigned long long cancels;  // Incremented by Cancel.
+    size_t waiters;  // Evaluate calls in progress, which Stop waits for.
+
+    volatile LONG connected;
+    volatile LONG64 reconnects;
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#include "BifrostMetrics.h"
+#include "Expression.h"
+
+// In-process stand-in for the microcontroller, served on a named pipe.
+// It runs the same loop as ExpressionsHandler.ino (one line in, one line out)
+// on the host Expression engine, so Bifrost can be exercised and benchmarked
+// without a board: open the pipe name with Bifrost::Open as if it were a port.
+class BoardEmulator {
+public:
+    BoardEmulator();
+    ~BoardEmulator();
+
+    // Starts serving on a pipe name such as L"\\\\.\\pipe\\bifrost-loopback".
+    // A non-zero baudRate paces both directions like a UART at that rate would.
+    // Returns false if the pipe could not be created.
+    bool Start(const std::wstring& pipeName, DWORD baudRate = 0);
+
+    // Stops serving and closes the pipe.
+    void Stop();
+
+    // Damages about perThousand framed lines in every thousand, in each
+    // direction (a flipped bit or a lost byte), like a link pushed past what
+    // it carries cleanly, to exercise the reliable protocol. Plain lines are
+    // left alone: a plain reply lost on a pipe would be waited for forever.
+    // Set before Start.
+    void SetLineErrors(unsigned perThousand);
+
+    // Builds the reply the firmware sends for one received line (with "\r\n").
+    std::string Respond(const std::string& line);
+
+private:
+    // A reply kept for the reliable protocol, like the firmware's keptReplies.
+    struct KeptReply {
+        int sequence;  // -1 while unused.
+        unsigned short crc;  // The request frame's CRC.
+        std::string reply;
+    };
+
+    static DWORD WINAPI ThreadProc(LPVOID parameter);
+    void Run();
+    void Serve();
+
+    // Answers a framed request (see BifrostArq.h), the way handleFrame does.
+    std::string RespondFrame(const std::string& frame);
+
+    // Evaluates an expression and formats its reply (without "\r\n"),
+    // counting it in stats.
+    std::string Evaluate(const char* text, size_t length);
+
+    // The reply to "stats", without "\r\n", in the firmware's format.
+    std::string FormatStats() const;
+
+    // Damages a line now and then, as SetLineErrors asked.
+    void Damage(std::string& line);
+
+    // Sleeps as long as a UART would need to move the given number of bytes.
+    void Pace(unsigned long long& busyUntil, size_t bytes);
+
+    HANDLE thread;
+    HANDLE pipe;
+    volatile LONG stopping;
+    DWORD baudRate;
+    unsigned long long origin;  // BifrostMetrics::Now() when Start was called.
+
+    Expression expression;  // Reused between requests, like the firmware's buffer.
+    std::string input;  // The trimmed text of the last request.
+    std::vector<KeptReply> keptReplies;  // Cleared for each client, as a board resets when its port is opened.
+    BifrostFirmwareStats stats;  // Cleared for each client too. Compiling is timed with evaluating, and receiving not at all.
+
+    unsigned lineErrors;  // Per thousand lines.
+    unsigned long long noise;  // State of the generator deciding which lines to damage.
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Host-side mirror of the TinyExpr grammar used by the firmware.
+// It accepts exactly what te_compile() accepts on the board (same builtins,
+// same "pi" variable, same precedence) and reports the same error position,
+// so malformed expressions can be rejected without a serial round trip.
+class Expression {
+public:
+    Expression();
+
+    // Compiles the expression into the internal node arena.
+    // Returns false on a syntax error and, if errorPosition is not NULL, stores
+    // the 1-based position te_compile() would have reported (0 on success).
+    bool Compile(const std::string& text, int* errorPosition = NULL);
+
+    // Evaluates the last successfully compiled expression.
+    // Returns NaN if nothing has been compiled.
+    double Evaluate() const;
+
+    // Defines a variable for the following compilations, or changes its
+    // value, like an entry of te_compile's variable array. Host-side only:
+    // the firmware knows nothing but "pi".
+    void SetVariable(const std::string& name, double value = 0.0);
+
+    // Evaluates the last compiled expression for every x[i] bound to the
+    // named variable, into out[i] (out may be x). The tree is run a block of
+    // inputs at a time, each operation over the whole block with the
+    // VectorMath kernels, and constant subtrees are evaluated only once.
+    // Returns false if nothing is compiled or the variable is not defined.
+    bool EvaluateOver(const std::string& variable, const double* x, size_t count, double* out) const;
+
+    // Re-emits the last compiled expression as the shortest equivalent text:
+    // redundant whitespace and parentheses are dropped, numbers are printed in
+    // their shortest form and constant subtrees are folded when that is shorter
+    // and the board, whose double is a float, would get exactly the same value.
+    std::string Minify() const;
+
+    // Checks the syntax of an expression without keeping the result.
+    // Returns 0 if the expression is well formed, otherwise the error position.
+    static int Validate(const std::string& text);
+
+    // Compiles and minifies an expression in one go.
+    // Returns the text unchanged if it does not compile. If bytesSaved is not
+    // NULL it receives how many bytes shorter the minified text is.
+    static std::string Minify(const std::string& text, size_t* bytesSaved = NULL);
+
+private:
+    enum NodeType {
+        NodeConstant,
+        NodeVariable,
+        NodeCall
+    };
+
+    // Every operator and builtin function of the firmware's TinyExpr build.
+    enum Operation {
+        OpAdd, OpSub, OpMul, OpDiv, OpPow, OpMod, OpNegate, OpComma,
+        OpAbs, OpAcos, OpAsin, OpAtan, OpAtan2, OpCeil, OpCos, OpCosh,
+        OpE, OpExp, OpFac, OpFloor, OpLn, OpLog, OpLog10, OpNcr, OpNpr,
+        OpPi, OpPow2, OpSin, OpSinh, OpSqrt, OpTan, OpTanh
+    };
+
+    struct Node {
+        NodeType type;
+        Operation operation;
+        double value;      // NodeConstant
+        int variable;      // NodeVariable: index into variableValues
+        int arguments[2];  // NodeCall: indices into nodes (-1 if unused)
+    };
+
+    enum TokenType {
+        TokenNull,
+        TokenError,
+        TokenEnd,
+        TokenSeparator,
+        TokenOpen,
+        TokenClose,
+        TokenNumber,
+        TokenVariable,
+        TokenInfix,
+        TokenFunction
+    };
+
+    struct Builtin {
+        const char* name;
+        Operation operation;
+        int arity;
+    };
+
+    // Binding strength of emitted text, from the loosest grammar rule to the tightest.
+    enum Level {
+        LevelList,    // a,b
+        LevelExpr,    // a+b
+        LevelTerm,    // a*b
+        LevelFactor,  // a^b
+        LevelPower,   // -a
+        LevelBase     // 1, pi, sin(a), (a)
+    };
+
+    // Text emitted for a subtree, with its constant value when it has one.
+    struct Emitted {
+        std::string text;
+        Level level;
+        bool constant;
+        double value;
+    };
+
+    static const Builtin builtins[];
+    static const int builtinCount;
+
+    static const Builtin* FindBuiltin(const char* name, size_t length);
+    static const Builtin* FindBuiltin(Operation operation);
+    static std::string FormatConstant(double value);
+    static double Apply(Operation operation, double a, double b);
+
+    void NextToken();
+    int AddNode(NodeType type, Operation operation, int first = -1, int second = -1);
+    int ParseList();
+    int ParseExpr();
+    int ParseTerm();
+    int ParseFactor();
+    int ParsePower();
+    int ParseBase();
+    double EvaluateNode(int index) const;
+    void OrderNodes(int index, std::vector<int>& order) const;
+    static void ApplyOver(Operation operation, const double* a, const double* b, double* out, size_t count);
+    Emitted EmitNode(int index) const;
+
+    // Node arena; kept between compilations so its capacity is reused.
+    std::vector<Node> nodes;
+    int root;
+
+    // Variables known to the firmware ("pi"), then any added by SetVariable.
+    std::vector<std::string> variableNames;
+    std::vector<double> variableValues;
+
+    // Tokenizer state, only meaningful while compiling.
+    const char* start;
+    const char* next;
+    TokenType tokenType;
+    double tokenValue;
+    int tokenVariable;
+    Operation tokenOperation;
+    int tokenArity;
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+// What computed a result in the history.
+enum HistorySource {
+    SourceBoard,  // The microcontroller, through the serial link or the broker.
+    SourceHost,   // The host-side Expression engine.
+};
+
+// One calculation, as kept in the history log.
+struct HistoryRecord {
+    unsigned long long time;  // FILETIME (100 ns since 1601, UTC) when it was answered.
+    unsigned int latencyMicros;  // From sending the expression to its result.
+    HistorySource source;
+    std::string expression;  // As typed.
+    std::string result;  // As shown.
+};
+
+// The calculator's history on disk, kept across runs. Records are only ever
+// appended to the log file, and a second file indexes them: one 8-byte
+// offset per record. Opening maps both files instead of reading them, so it
+// takes the same time with millions of records, and Read then pages in just
+// the records asked for. Every record carries a CRC-32, so one that was cut
+// short (the app or the machine stopped while it was written) or left as
+// zeros is told from a whole one: the first such record at the end of the
+// log is dropped on the next Open, with everything after it, and Read refuses
+// one anywhere else. Records the index misses are indexed again. Count, Read,
+// Append and Clear may be called from different threads; Open and Close may
+// not.
+class HistoryLog {
+public:
+    HistoryLog();
+    ~HistoryLog();
+
+    // %LOCALAPPDATA%\BifrostCalculator\history.log, creating the folder.
+    // Empty if %LOCALAPPDATA% isn't set.
+    static std::wstring DefaultPath();
+
+    // Opens the log at path, creating it if needed; the index is the same
+    // path with ".idx" appended. Returns false if either can't be opened.
+    bool Open(const std::wstring& path);
+
+    // Unmaps and closes both files.
+    void Close();
+
+    // Number of records, those appended since Open included.
+    size_t Count() const;
+
+    // Reads a record, position 0 being the oldest. Returns false if there
+    // is no such record or it can't be read.
+    bool Read(size_t position, HistoryRecord& record) const;
+
+    // Appends a record to the log and the index. Returns false if the log
+    // isn't open or the write failed.
+    bool Append(const HistoryRecord& record);
+
+    // Deletes every record. Returns false if the files couldn't be emptied.
+    bool Clear();
+
+private:
+    // Drops the end of the log from its first record that isn't whole and
+    // indexes the records the index misses. Called by Open before anything
+    // is mapped.
+    bool Recover();
+
+    // Maps what the files hold now; later records are read with ReadFile.
+    bool Map();
+    void Unmap();
+
+    // Read and Append, the lock being held.
+    bool ReadRecord(size_t position, HistoryRecord& record) const;
+    bool AppendRecord(const HistoryRecord& record);
+
+    // Where a record starts in the log.
+    unsigned long long Offset(size_t position) const;
+
+    HANDLE log;
+    HANDLE index;
+    HANDLE logMapping;
+    HANDLE indexMapping;
+    const char* logView;  // The log as it was at Open (NULL if it was empty).
+    const unsigned long long* indexView;  // Its offsets.
+    unsigned long long mappedLogSize;
+    size_t mappedCount;  // Records in the views.
+    std::vector<unsigned long long> appended;  // Offsets of the records appended since.
+    unsigned long long logSize;
+    mutable SRWLOCK lock;  // Shared by Count and Read, exclusive for Append and Clear.
+};
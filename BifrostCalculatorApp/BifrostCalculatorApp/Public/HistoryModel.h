@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// The calculator's history of operations, newest first, for a list in
+// virtual mode to draw from. Entries live in a ring buffer: adding one is
+// O(1) however long the history, and once capacity entries are kept the
+// oldest is dropped. Every entry gets an id that stays the same while it
+// is kept, so a result that arrives later can find its line even after
+// newer ones were added.
+class HistoryModel {
+public:
+    static const size_t kDefaultCapacity = 200000;
+
+    struct Entry {
+        unsigned long long id;
+        std::string expression;  // As typed.
+        std::string result;  // Empty while the result is on its way.
+    };
+
+    explicit HistoryModel(size_t capacity = kDefaultCapacity);
+
+    // Adds an operation as the newest entry, without its result yet.
+    // Returns its id.
+    unsigned long long Add(const std::string& expression);
+
+    // Sets the result of an entry. Returns false if it is no longer kept.
+    bool SetResult(unsigned long long id, const std::string& result);
+
+    // An entry by id, or NULL if it is no longer kept.
+    const Entry* Get(unsigned long long id) const;
+
+    // Removes an entry, e.g. one whose result never came. Entries newer
+    // than it move down, so it is cheapest for the newest ones.
+    // Returns false if it is no longer kept.
+    bool Remove(unsigned long long id);
+
+    // Forgets every entry. Ids keep counting up.
+    void Clear();
+
+    // Number of entries kept.
+    size_t Count() const;
+
+    size_t Capacity() const;
+
+    // An entry by row, 0 being the newest. row must be below Count().
+    const Entry& At(size_t row) const;
+
+    // "expression = result", or "expression = ..." while the result is on its way.
+    static std::string Text(const std::string& expression, const std::string& result);
+
+private:
+    // Slot of the index-th oldest entry.
+    size_t Slot(size_t index) const;
+
+    // Index (0 the oldest) of an entry by id, or Count() if it isn't kept.
+    size_t Find(unsigned long long id) const;
+
+    std::vector<Entry> ring;  // Grows up to capacity, then wraps.
+    size_t capacity;
+    size_t oldest;  // Slot of the oldest entry.
+    size_t count;
+    unsigned long long nextId;
+};
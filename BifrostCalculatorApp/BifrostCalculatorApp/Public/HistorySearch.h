@@ -0,0 +1,73 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "HistoryLog.h"
+
+// Substring search over a HistoryLog, ignoring case. Records are numbered by
+// their log positions. Every three-character sequence (trigram) of a record's
+// text lists the records that contain it, so a query only looks at the
+// records holding all of its trigrams, newest first, and stops once it has
+// found enough. Queries shorter than a trigram only look between the first
+// and the last record that have their characters, checking each record's
+// letters against a 64-bit mask before its text. The texts themselves aren't
+// kept: a candidate is checked against the log. A thread of its own indexes
+// the log's records in order and then waits for more, so the window never
+// waits for it; Count tells how far it has got.
+class HistorySearch {
+public:
+    HistorySearch();
+    ~HistorySearch();
+
+    // Starts indexing log, which must stay open until Stop.
+    bool Start(const HistoryLog* log);
+
+    // Stops the thread. The records indexed so far are kept.
+    void Stop();
+
+    // Tells the thread records were appended to the log.
+    void Wake();
+
+    // Number of records indexed.
+    size_t Count() const;
+
+    // Finds the newest records, at most limit of them, whose text contains
+    // query. matches receives their numbers, newest first.
+    // Returns the number of matches.
+    size_t Find(const std::string& query, size_t limit, std::vector<size_t>& matches) const;
+
+    // Whether a record numbered from on or later might contain query: false
+    // means records indexed since a Find can't change its matches.
+    bool MayMatchSince(const std::string& query, size_t from) const;
+
+    // Forgets every record. Only while stopped.
+    void Clear();
+
+private:
+    static DWORD WINAPI ThreadProc(LPVOID parameter);
+    void Run();
+
+    // Indexes a record as the list shows it ("expression = result").
+    // It gets the number Count() had before the call.
+    void Add(const std::string& expression, const std::string& result);
+
+    // Find, the lock being held.
+    size_t FindRecords(const std::string& query, size_t limit, std::vector<size_t>& matches) const;
+
+    // Whether a record's text contains the (lowercased) query.
+    bool Contains(size_t record, const std::string& query) const;
+
+    const HistoryLog* log;
+    HANDLE thread;
+    HANDLE more;  // Set by Wake and Stop.
+    volatile LONG stopping;
+    mutable SRWLOCK lock;  // Guards the index: exclusive for Add and Clear.
+
+    std::unordered_map<unsigned int, std::vector<unsigned int> > postings;  // Trigram to records, oldest first.
+    std::vector<unsigned int> firstSeen;  // Per character and pair of them, 1 + the oldest record that has it (0 if none).
+    std::vector<unsigned int> lastSeen;  // Likewise the newest.
+    std::vector<unsigned long long> masks;  // Per record, a bit for every letter its text has.
+};
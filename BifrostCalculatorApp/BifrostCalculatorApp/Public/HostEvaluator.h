@@ -0,0 +1,79 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#include "Expression.h"
+
+// Outcome of evaluating one line on the host.
+struct HostResult {
+    double value;  // NaN on a syntax error.
+    int errorPosition;  // 0, or the position the firmware would report.
+};
+
+// Evaluates batches of expressions on the host with every core, for jobs
+// whose results don't have to come from the board (e.g. validating a corpus).
+// A batch is cut into chunks spread over the threads; a thread that runs out
+// of chunks steals from the others. Every thread compiles into its own
+// Expression arena, and results[i] always belongs to expressions[i].
+class HostEvaluator {
+public:
+    // threadCount 0 uses one thread per logical processor.
+    // The calling thread takes part too, so threadCount - 1 threads are started.
+    explicit HostEvaluator(unsigned int threadCount = 0);
+    ~HostEvaluator();
+
+    // Number of threads (including the caller) a batch is spread over.
+    unsigned int Threads() const;
+
+    // Evaluates expressions[0..count) into results[0..count), the way the
+    // board would. Blocks until the whole batch is done.
+    // Not reentrant: batches from several threads have to take turns.
+    void Evaluate(const std::string* expressions, size_t count, HostResult* results);
+
+    // Evaluates one received line like ExpressionsHandler.ino does: trimmed,
+    // cut to the firmware's buffer size and compiled with "pi".
+    // scratch holds the prepared text, so it can be reused between calls.
+    static HostResult EvaluateLine(Expression& expression, const char* line, size_t length, std::string& scratch);
+
+    // Formats a result like the firmware's reply, without its "\r\n".
+    // Returns the length written (truncated to size - 1).
+    static size_t FormatReply(const HostResult& result, char* buffer, size_t size);
+
+private:
+    // One thread's share of the chunks. Padded to its own cache line, since
+    // every thread keeps incrementing its own next.
+    struct Range {
+        volatile LONG64 next;
+        LONG64 end;
+        char padding[64 - 2 * sizeof(LONG64)];
+    };
+
+    struct Worker {
+        HostEvaluator* owner;
+        unsigned int index;
+        HANDLE thread;  // NULL for the calling thread's worker.
+        Expression expression;  // This thread's compile arena.
+        std::string input;  // Reused for the prepared text of each line.
+    };
+
+    static DWORD WINAPI ThreadProc(LPVOID parameter);
+    void Run(Worker& worker);
+    void Work(Worker& worker);
+
+    std::vector<Worker*> workers;
+    std::vector<Range> ranges;
+
+    SRWLOCK lock;
+    CONDITION_VARIABLE wake;  // Signalled when a batch starts (or on shutdown).
+    CONDITION_VARIABLE done;  // Signalled when the last thread finishes a batch.
+    unsigned long long generation;  // Incremented for every batch.
+    unsigned int busy;  // Started threads still working on the batch.
+    bool stopping;
+
+    // The batch being evaluated.
+    const std::string* expressions;
+    HostResult* results;
+    size_t count;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <windows.h>
+
+// Reads a text file line by line straight out of a file mapping.
+// Lines are returned as pointer and length into the mapped view, with no
+// copy and no allocation; each one stays valid until the next call to Next.
+// The file is mapped through a sliding window, so files larger than the
+// address space (on 32-bit builds) work too.
+class MappedFileReader {
+public:
+    MappedFileReader();
+    ~MappedFileReader();
+
+    // Opens and maps the file. Returns false if it could not be opened.
+    bool Open(LPCWSTR path);
+
+    // Unmaps and closes the file.
+    void Close();
+
+    // Gets the next line, without its "\n" or "\r\n".
+    // Returns false at the end of the file.
+    bool Next(const char*& text, size_t& length);
+
+    // Size of the file and how far Next has got, in bytes.
+    unsigned long long Size() const;
+    unsigned long long Position() const;
+
+private:
+    // Maps a view that starts at or before offset and covers at least length bytes from it.
+    bool MapWindow(unsigned long long offset, unsigned long long length);
+
+    HANDLE file;
+    HANDLE mapping;
+    const char* view;  // Start of the mapped window (NULL if none).
+    unsigned long long viewOffset;  // File offset of view.
+    size_t viewSize;
+    unsigned long long fileSize;
+    unsigned long long position;  // File offset of the next line.
+};
+
+// Writes a file through a file mapping, so results are copied once, straight
+// into the page cache, instead of going through stdio buffers.
+// The file is grown a window at a time (or to sizeHint up front) and cut to
+// the written length by Close.
+class MappedFileWriter {
+public:
+    MappedFileWriter();
+    ~MappedFileWriter();
+
+    // Creates (or truncates) the file. sizeHint preallocates that many bytes.
+    // Returns false if the file could not be created.
+    bool Create(LPCWSTR path, unsigned long long sizeHint = 0);
+
+    // Appends bytes. Returns false if the file could not be grown.
+    bool Append(const char* data, size_t length);
+
+    // Unmaps the file, trims it to the bytes written and closes it.
+    // Returns false if the file could not be trimmed.
+    bool Close();
+
+    // Number of bytes appended so far.
+    unsigned long long Written() const;
+
+private:
+    // Maps the window that starts at offset, growing the file if needed.
+    bool MapWindow(unsigned long long offset);
+
+    HANDLE file;
+    HANDLE mapping;
+    char* view;  // Start of the mapped window (NULL if none).
+    unsigned long long viewOffset;  // File offset of view.
+    size_t used;  // Bytes written into the current window.
+    unsigned long long reserved;  // Current size of the file on disk.
+};
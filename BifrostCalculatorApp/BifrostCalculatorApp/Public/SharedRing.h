@@ -0,0 +1,98 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+
+// One direction of a shared-memory channel: a single-producer single-consumer
+// ring of fixed-size slots, laid out in memory that both processes map.
+// The producer writes a line straight into the next free slot and publishes
+// it by advancing the tail; the consumer reads it in place and frees it by
+// advancing the head. No locks and no system calls are needed while the
+// ring is neither empty nor full: events are only signalled when the other
+// side has said it is about to sleep.
+class SharedRing {
+public:
+    static const size_t kSlotSize = 256;
+    static const size_t kSlotPayload = kSlotSize - sizeof(LONG);  // Longest line a slot holds.
+    static const LONG kSlotCount = 256;
+
+    SharedRing();
+
+    // Bytes of shared memory one ring needs.
+    static size_t MemorySize();
+
+    // Uses memory (MemorySize() bytes, zeroed by whoever created the mapping)
+    // and the two named events both sides opened for this ring.
+    void Attach(void* memory, HANDLE dataEvent, HANDLE spaceEvent);
+
+    // Producer: copies a line into the next slot (cut to kSlotPayload).
+    // Waits while the ring is full, up to timeoutMs or until cancel is set.
+    bool Push(const char* data, size_t length, DWORD timeoutMs, HANDLE cancel);
+
+    // Consumer: the oldest line, in place, without waiting. It stays valid
+    // until Pop.
+    bool Front(const char*& data, size_t& length);
+    void Pop();
+
+    // Consumer: waits for a line, up to timeoutMs or until cancel is set.
+    bool WaitForData(DWORD timeoutMs, HANDLE cancel);
+
+    // Consumer, for waiting on DataEvent() together with other handles:
+    // Arm returns false if a line is already there (don't wait then);
+    // otherwise the producer signals DataEvent() for the next line. Disarm
+    // after the wait.
+    bool Arm();
+    void Disarm();
+    HANDLE DataEvent() const;
+
+private:
+    // Each index is written by one side only and sits on its own cache line.
+    struct Control {
+        volatile LONG head;  // Next slot to read; written by the consumer.
+        char padding1[64 - sizeof(LONG)];
+        volatile LONG tail;  // Next slot to write; written by the producer.
+        char padding2[64 - sizeof(LONG)];
+        volatile LONG consumerWaiting;
+        volatile LONG producerWaiting;
+        char padding3[64 - 2 * sizeof(LONG)];
+    };
+
+    bool Empty();
+    bool Full();
+
+    Control* control;
+    char* slots;
+    HANDLE dataEvent;  // Signalled by the producer for a waiting consumer.
+    HANDLE spaceEvent;  // Signalled by the consumer for a waiting producer.
+};
+
+// A shared-memory connection between a broker and one client: a mapping that
+// holds a ring of requests (client to broker) and a ring of replies (broker
+// to client), plus the events that wake either side.
+// The client creates it under a name of its choice and sends "#shm <name>"
+// to the broker over the pipe; the broker opens it by that name.
+class SharedChannel {
+public:
+    SharedChannel();
+    ~SharedChannel();
+
+    // Client side: creates the mapping and events under name (in the Local\ namespace).
+    bool Create(const std::wstring& name);
+
+    // Broker side: opens what the client created.
+    bool Open(const std::wstring& name);
+
+    void Close();
+
+    SharedRing& Requests();
+    SharedRing& Replies();
+
+private:
+    bool Attach(bool create, const std::wstring& name);
+
+    HANDLE mapping;
+    void* view;
+    HANDLE events[4];  // Request data, request space, reply data, reply space.
+    SharedRing requests;
+    SharedRing replies;
+};
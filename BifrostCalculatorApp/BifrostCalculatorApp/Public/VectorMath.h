@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+
+// Element-wise math over arrays of doubles, used by Expression::EvaluateOver.
+// Each function runs AVX kernels (4 lanes) when the processor and OS support
+// them, SSE2 kernels (2 lanes) otherwise, and a scalar loop for the tail.
+// sin, cos, exp and the logarithms use the compiler's vector math library
+// (SVML) and can differ from the <cmath> results in the last bit.
+// out may be the same array as an input.
+class VectorMath {
+public:
+    static void Add(const double* a, const double* b, double* out, size_t count);
+    static void Subtract(const double* a, const double* b, double* out, size_t count);
+    static void Multiply(const double* a, const double* b, double* out, size_t count);
+    static void Divide(const double* a, const double* b, double* out, size_t count);
+
+    static void Negate(const double* a, double* out, size_t count);
+    static void Abs(const double* a, double* out, size_t count);
+    static void Sqrt(const double* a, double* out, size_t count);
+    static void Sin(const double* a, double* out, size_t count);
+    static void Cos(const double* a, double* out, size_t count);
+    static void Exp(const double* a, double* out, size_t count);
+    static void Ln(const double* a, double* out, size_t count);
+    static void Log10(const double* a, double* out, size_t count);
+
+    // True if the AVX kernels are used on this machine.
+    static bool HasAvx();
+};
@@ -0,0 +1,580 @@
+//BifrostCli.cpp
+//
+// bifrost_cli: evaluates expressions in bulk, without the form. Reads one
+// expression per line from a file or stdin and writes "expr<TAB>result" lines
+// to a file or stdout, in input order. Progress and throughput go to stderr,
+// and at the end the round trip percentiles.
+//
+// Usage:
+//   bifrost_cli [--port COM4[,COM5...] | --loopback | --host] [--baud 9600] [--depth 8]
+//               [--batch 4] [--threads 0] [--input expressions.txt]
+//               [--output results.txt] [--arq] [--quiet]
+//
+// Requests are pipelined (--depth in flight, --batch per write) so the link
+// never sits idle waiting for a reply. Only the requests in flight are kept
+// in memory, so inputs of any length run in constant memory.
+// --host skips the board and evaluates on every core with HostEvaluator
+// (--threads of them, 0 for one per logical processor), a block of lines
+// at a time; the results are the same the board would send.
+// Files given with --input and --output are memory mapped: lines are read
+// in place and results copied straight into the output mapping.
+// Through bifrost_broker (--port \\.\pipe\bifrost) the job asks for the bulk
+// priority class, so it doesn't hold up the form's requests.
+// Several ports (--port COM4,COM5) spread the lines over one board each with
+// BifrostPool; results still come out in input order, and lines a board
+// doesn't answer because its link failed are sent to the others.
+// --arq uses the reliable protocol (see BifrostArq.h) with boards that speak
+// it, so a link run at a baud rate that drops bytes still gives every result.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <io.h>
+
+#include <windows.h>
+#include "Public/Bifrost.h"
+#include "Public/BifrostArq.h"
+#include "Public/BifrostPipeline.h"
+#include "Public/BifrostPool.h"
+#include "Public/BoardEmulator.h"
+#include "Public/Expression.h"
+#include "Public/HostEvaluator.h"
+#include "Public/MappedFile.h"
+
+namespace {
+
+    // Lines evaluated per HostEvaluator batch with --host.
+    const size_t kHostBlockSize = 16384;
+
+    struct Options {
+        std::wstring port;  // Empty for the loopback emulator.
+        std::vector<std::wstring> pool;  // Every port when more than one is given.
+        bool host;  // Evaluate on the host instead of a board.
+        unsigned long threads;
+        unsigned long baud;
+        unsigned long depth;
+        unsigned long batch;
+        std::string inputPath;  // Empty for stdin.
+        std::string outputPath;  // Empty for stdout.
+        bool reliable;  // --arq
+        bool quiet;
+    };
+
+    /// <summary>
+    /// Reads the command line. Returns false (after printing the usage) on bad input.
+    /// </summary>
+    bool ParseOptions(int argc, char* argv[], Options& options)
+    {
+        options.host = false;
+        options.threads = 0;
+        options.baud = CBR_9600;
+        options.depth = 8;
+        options.batch = 4;
+        options.reliable = false;
+        options.quiet = false;
+
+        for (int i = 1; i < argc; i++) {
+            const char* arg = argv[i];
+            const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+            if (std::strcmp(arg, "--loopback") == 0) {
+                options.port.clear();
+                options.pool.clear();
+                options.host = false;
+                continue;
+            }
+            if (std::strcmp(arg, "--host") == 0) {
+                options.port.clear();
+                options.pool.clear();
+                options.host = true;
+                continue;
+            }
+            if (std::strcmp(arg, "--arq") == 0) {
+                options.reliable = true;
+                continue;
+            }
+            if (std::strcmp(arg, "--quiet") == 0) {
+                options.quiet = true;
+                continue;
+            }
+            if (!value) {
+                std::fprintf(stderr, "Missing value for %s\n", arg);
+                return false;
+            }
+
+            if (std::strcmp(arg, "--port") == 0) {
+                options.pool.clear();
+                for (const char* start = value; ; ) {
+                    const char* end = std::strchr(start, ',');
+                    std::string port(start, end != NULL ? end - start : std::strlen(start));
+                    if (port.compare(0, 4, "\\\\.\\") != 0 && _strnicmp(port.c_str(), "shm:", 4) != 0)
+                        port = "\\\\.\\" + port;
+                    options.pool.push_back(std::wstring(port.begin(), port.end()));
+                    if (end == NULL)
+                        break;
+                    start = end + 1;
+                }
+                options.port = options.pool[0];
+                if (options.pool.size() == 1)
+                    options.pool.clear();
+                options.host = false;
+            }
+            else if (std::strcmp(arg, "--baud") == 0)
+                options.baud = std::strtoul(value, NULL, 10);
+            else if (std::strcmp(arg, "--depth") == 0)
+                options.depth = std::strtoul(value, NULL, 10);
+            else if (std::strcmp(arg, "--batch") == 0)
+                options.batch = std::strtoul(value, NULL, 10);
+            else if (std::strcmp(arg, "--threads") == 0)
+                options.threads = std::strtoul(value, NULL, 10);
+            else if (std::strcmp(arg, "--input") == 0)
+                options.inputPath = value;
+            else if (std::strcmp(arg, "--output") == 0)
+                options.outputPath = value;
+            else {
+                std::fprintf(stderr, "Unknown option %s\n", arg);
+                return false;
+            }
+            i++;
+        }
+
+        return options.depth > 0 && options.batch > 0;
+    }
+
+    /// <summary>
+    /// Converts a command line path to the wide form the Win32 calls take.
+    /// </summary>
+    std::wstring WidePath(const std::string& path)
+    {
+        int length = MultiByteToWideChar(CP_ACP, 0, path.c_str(), -1, NULL, 0);
+        if (length <= 0)
+            return std::wstring();
+        std::wstring wide(length, L'\0');
+        MultiByteToWideChar(CP_ACP, 0, path.c_str(), -1, &wide[0], length);
+        wide.resize(length - 1);
+        return wide;
+    }
+
+    // Lines from a mapped file, or from stdin when no file is given.
+    class LineInput {
+    public:
+        LineInput() : fromFile(false) {}
+
+        bool Open(const std::string& path)
+        {
+            fromFile = !path.empty();
+            return !fromFile || file.Open(WidePath(path).c_str());
+        }
+
+        // Size of the input in bytes (0 for stdin, which can't tell).
+        unsigned long long Size() const
+        {
+            return fromFile ? file.Size() : 0;
+        }
+
+        bool Next(const char*& text, size_t& length)
+        {
+            if (fromFile)
+                return file.Next(text, length);
+
+            if (!std::getline(std::cin, line))
+                return false;
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            text = line.data();
+            length = line.size();
+            return true;
+        }
+
+    private:
+        bool fromFile;
+        MappedFileReader file;
+        std::string line;  // Reused for every line read from stdin.
+    };
+
+    // Results into a mapped file, or to stdout when no file is given.
+    class ResultOutput {
+    public:
+        ResultOutput() : toFile(false), failed(false) {}
+
+        bool Create(const std::string& path, unsigned long long sizeHint)
+        {
+            toFile = !path.empty();
+            failed = false;
+            if (!toFile) {
+                // Fully buffered, and in binary mode so "\n" is not expanded to "\r\n".
+                static char buffer[1 << 16];
+                _setmode(_fileno(stdout), _O_BINARY);
+                std::setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+                return true;
+            }
+            return file.Create(WidePath(path).c_str(), sizeHint);
+        }
+
+        void Write(const char* data, size_t length)
+        {
+            if (toFile)
+                failed = !file.Append(data, length) || failed;
+            else
+                std::fwrite(data, 1, length, stdout);
+        }
+
+        bool Close()
+        {
+            if (toFile)
+                return file.Close() && !failed;
+            return std::fflush(stdout) == 0;
+        }
+
+    private:
+        bool toFile;
+        bool failed;
+        MappedFileWriter file;
+    };
+
+    // Prints "processed, rate" on stderr at most once a second, and adds up
+    // the bytes minifying kept off the wire for the final summary.
+    class Progress {
+    public:
+        explicit Progress(bool quiet) : quiet(quiet)
+        {
+            started = lastReport = BifrostMetrics::Now();
+            completed = 0;
+            errors = 0;
+            bytesSaved = 0;
+        }
+
+        void Minified(size_t saved)
+        {
+            bytesSaved += saved;
+        }
+
+        void Completed(bool error)
+        {
+            completed++;
+            if (error)
+                errors++;
+
+            if (!quiet && BifrostMetrics::MicrosSince(lastReport) >= 1000000) {
+                Report('\r');
+                lastReport = BifrostMetrics::Now();
+            }
+        }
+
+        void Report(char end) const
+        {
+            double seconds = BifrostMetrics::MicrosSince(started) / 1e6;
+            if (seconds <= 0) seconds = 1e-9;
+            std::fprintf(stderr, "%llu evaluated, %llu errors, %.0f expressions/s%c", completed, errors, completed / seconds, end);
+        }
+
+        void ReportMinified() const
+        {
+            std::fprintf(stderr, "%llu bytes saved by minifying\n", bytesSaved);
+        }
+
+    private:
+        bool quiet;
+        unsigned long long started;
+        unsigned long long lastReport;
+        unsigned long long completed;
+        unsigned long long errors;
+        unsigned long long bytesSaved;
+    };
+
+    /// <summary>
+    /// Asks a broker to schedule this connection's requests as bulk work.
+    /// Anything else at the end of a pipe (e.g. a board emulator) answers with
+    /// an error line instead, which is just as well ignored.
+    /// </summary>
+    void RequestBulkPriority(Bifrost& link)
+    {
+        std::string reply;
+        if (link.WriteData("#priority bulk\n"))
+            link.ReadLine(reply);
+    }
+
+    /// <summary>
+    /// Writes one "expr<TAB>result" line and counts it.
+    /// </summary>
+    void WriteResult(ResultOutput& output, Progress& progress, const std::string& expression, const std::string& reply)
+    {
+        output.Write(expression.data(), expression.size());
+        output.Write("\t", 1);
+        output.Write(reply.data(), reply.size());
+        output.Write("\n", 1);
+
+        // Same test the form uses: every error reply contains "nan".
+        progress.Completed(reply.find("nan") != std::string::npos);
+    }
+
+    /// <summary>
+    /// Streams every line of input through the link, writing the results to output.
+    /// </summary>
+    /// <returns>False if the link failed before the input was exhausted.</returns>
+    bool Run(const Options& options, Bifrost& link, LineInput& input, ResultOutput& output, Progress& progress)
+    {
+        // The pipeline never holds more than depth requests, and Submit may
+        // complete the oldest one before queueing the new one, so depth + 1
+        // slots are enough to keep each expression until its reply arrives.
+        std::vector<std::string> inFlight(options.depth + 1);
+
+        BifrostPipeline pipeline(link, options.depth, options.batch);
+        pipeline.SetCompletion([&](unsigned long long id, const std::string& reply) {
+            WriteResult(output, progress, inFlight[id % inFlight.size()], reply);
+        });
+
+        const char* text;
+        size_t length;
+        std::string payload;
+        unsigned long long id = 0;
+        while (input.Next(text, length)) {
+            size_t first = 0;
+            while (first < length && (text[first] == ' ' || text[first] == '\t'))
+                first++;
+            if (first == length)
+                continue;
+
+            // The slot keeps its capacity, so this stops allocating once warm.
+            std::string& slot = inFlight[id % inFlight.size()];
+            slot.assign(text, length);
+            size_t saved = 0;
+            payload = Expression::Minify(slot, &saved);
+            progress.Minified(saved);
+
+            if (!pipeline.Submit(payload, id))
+                return false;
+            id++;
+        }
+
+        return pipeline.Drain();
+    }
+
+    /// <summary>
+    /// Streams every line of input through a pool of boards, writing the results to output in input order.
+    /// </summary>
+    /// <returns>False if every board failed before the input was exhausted.</returns>
+    bool RunOnPool(BifrostPool& pool, LineInput& input, ResultOutput& output, Progress& progress)
+    {
+        // Submit blocks while kWindow lines are undelivered, so as in Run one
+        // more slot than that is enough. Replies arrive on the boards'
+        // threads, but one at a time and never for a slot being refilled.
+        std::vector<std::string> inFlight(BifrostPool::kWindow + 1);
+        pool.SetCompletion([&](unsigned long long id, const std::string& reply) {
+            WriteResult(output, progress, inFlight[id % inFlight.size()], reply);
+        });
+
+        const char* text;
+        size_t length;
+        std::string payload;
+        unsigned long long id = 0;
+        while (input.Next(text, length)) {
+            size_t first = 0;
+            while (first < length && (text[first] == ' ' || text[first] == '\t'))
+                first++;
+            if (first == length)
+                continue;
+
+            std::string& slot = inFlight[id % inFlight.size()];
+            slot.assign(text, length);
+            size_t saved = 0;
+            payload = Expression::Minify(slot, &saved);
+            progress.Minified(saved);
+
+            if (!pool.Submit(payload, id))
+                return false;
+            id++;
+        }
+
+        return pool.Drain();
+    }
+
+    /// <summary>
+    /// Prints the round trip percentiles of the requests sent to the board(s).
+    /// </summary>
+    void ReportLatency()
+    {
+        BifrostPhaseSnapshot latency = Bifrost::Metrics().Snapshot(PhaseResponse);
+        if (latency.count > 0)
+            std::fprintf(stderr, "Round trip p50/p95/p99/max: %llu/%llu/%llu/%llu us over %llu requests\n",
+                latency.p50, latency.p95, latency.p99, latency.max, latency.count);
+    }
+
+    /// <summary>
+    /// Prints how much each board of a pool did.
+    /// </summary>
+    void ReportPool(BifrostPool& pool)
+    {
+        for (size_t i = 0; i < pool.Boards(); i++) {
+            BifrostBoardStats stats = pool.BoardStats(i);
+            std::fprintf(stderr, "%ls: %llu evaluated, %llu us each%s\n", stats.port.c_str(), stats.completed, stats.serviceMicros,
+                stats.alive ? "" : ", failed");
+        }
+        std::fprintf(stderr, "%llu taken over from slower boards, %llu sent again after a board failed\n", pool.Stolen(), pool.Retried());
+    }
+
+    /// <summary>
+    /// Evaluates every line of input on the host, a block at a time, writing the results to output.
+    /// </summary>
+    void RunOnHost(const Options& options, LineInput& input, ResultOutput& output, Progress& progress)
+    {
+        HostEvaluator evaluator(options.threads);
+        if (!options.quiet)
+            std::fprintf(stderr, "Evaluating on %u threads\n", evaluator.Threads());
+
+        // Both blocks keep their size (and every line its capacity) between blocks.
+        std::vector<std::string> lines(kHostBlockSize);
+        std::vector<HostResult> results(kHostBlockSize);
+        char reply[64];
+
+        const char* text;
+        size_t length;
+        bool more = true;
+        while (more) {
+            size_t count = 0;
+            while (count < kHostBlockSize && (more = input.Next(text, length))) {
+                size_t first = 0;
+                while (first < length && (text[first] == ' ' || text[first] == '\t'))
+                    first++;
+                if (first < length)
+                    lines[count++].assign(text, length);
+            }
+
+            evaluator.Evaluate(lines.data(), count, results.data());
+
+            for (size_t i = 0; i < count; i++) {
+                size_t replyLength = HostEvaluator::FormatReply(results[i], reply, sizeof(reply));
+                output.Write(lines[i].data(), lines[i].size());
+                output.Write("\t", 1);
+                output.Write(reply, replyLength);
+                output.Write("\n", 1);
+                progress.Completed(std::strstr(reply, "nan") != NULL);
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        std::fprintf(stderr, "Usage: bifrost_cli [--port COM4[,COM5...] | --loopback | --host] [--baud 9600] [--depth 8] [--batch 4] [--threads 0] [--input file] [--output file] [--arq] [--quiet]\n");
+        return 2;
+    }
+
+    std::ios::sync_with_stdio(false);
+
+    LineInput input;
+    if (!input.Open(options.inputPath)) {
+        std::fprintf(stderr, "Could not read %s\n", options.inputPath.c_str());
+        return 2;
+    }
+
+    // Each result line is the expression plus a tab and a reply of about a
+    // dozen bytes, so twice the input size is a close first reservation.
+    ResultOutput output;
+    if (!output.Create(options.outputPath, 2 * input.Size())) {
+        std::fprintf(stderr, "Could not create %s\n", options.outputPath.c_str());
+        return 2;
+    }
+
+    Progress progress(options.quiet);
+
+    if (options.host) {
+        RunOnHost(options, input, output, progress);
+        if (!output.Close()) {
+            std::fprintf(stderr, "Could not write the results\n");
+            return 1;
+        }
+        if (!options.quiet)
+            progress.Report('\n');
+        return 0;
+    }
+
+    if (!options.pool.empty()) {
+        BifrostPool pool;
+        if (!pool.Open(options.pool, options.baud, options.depth, options.batch, options.reliable)) {
+            std::fprintf(stderr, "Could not open any of the ports\n");
+            return 1;
+        }
+        if (!options.quiet && pool.Boards() < options.pool.size())
+            std::fprintf(stderr, "Running on %u of %u ports\n", (unsigned int)pool.Boards(), (unsigned int)options.pool.size());
+
+        // Once Drain returns no more replies are delivered, so the output
+        // can be closed while the pool (and its statistics) is still open.
+        bool succeeded = RunOnPool(pool, input, output, progress);
+
+        if (!output.Close()) {
+            std::fprintf(stderr, "Could not write the results\n");
+            return 1;
+        }
+        if (!options.quiet) {
+            progress.Report('\n');
+            progress.ReportMinified();
+            ReportLatency();
+            ReportPool(pool);
+        }
+        if (!succeeded) {
+            std::fprintf(stderr, "Every board failed before the input was finished\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    BoardEmulator emulator;
+    std::wstring target = options.port;
+    if (target.empty()) {
+        target = L"\\\\.\\pipe\\bifrost-cli-" + std::to_wstring(GetCurrentProcessId());
+        if (!emulator.Start(target, options.baud)) {
+            std::fprintf(stderr, "Could not start the loopback emulator\n");
+            return 1;
+        }
+    }
+
+    Bifrost link;
+    if (!link.Open(target.c_str(), options.baud)) {
+        std::fprintf(stderr, "Could not open the port\n");
+        return 1;
+    }
+
+    // A pipe or shared memory the user named is the broker's; an empty port is the emulator's pipe.
+    bool brokered = !options.port.empty() &&
+        (_wcsnicmp(target.c_str(), L"\\\\.\\pipe\\", 9) == 0 || _wcsnicmp(target.c_str(), L"shm:", 4) == 0);
+    if (brokered)
+        RequestBulkPriority(link);
+    if (options.reliable && !link.StartReliable() && !options.quiet)
+        std::fprintf(stderr, "The board doesn't speak the reliable protocol, using the plain one\n");
+
+    // The broker paces its own link to the board; straight to a board, the
+    // pipeline keeps within the receive buffer the board reports.
+    std::string identity;
+    if (!brokered && link.Reliable() == NULL)
+        link.Identify(identity);
+
+    bool succeeded = Run(options, link, input, output, progress);
+
+    if (!output.Close()) {
+        std::fprintf(stderr, "Could not write the results\n");
+        return 1;
+    }
+
+    if (!options.quiet) {
+        progress.Report('\n');
+        progress.ReportMinified();
+        ReportLatency();
+        if (link.Reliable() != NULL)
+            std::fprintf(stderr, "%llu requests sent again, %llu duplicate and %llu damaged replies\n",
+                link.Reliable()->Retransmitted(), link.Reliable()->Duplicates(), link.Reliable()->Damaged());
+    }
+    link.Close();
+    if (!succeeded) {
+        std::fprintf(stderr, "The link failed before the input was finished\n");
+        return 1;
+    }
+    return 0;
+}